@@ -1,23 +1,730 @@
-#include <stdio.h>
-#include "lplex.h"
-#define BUFLEN 1024
-int main(int argc, char* argv[]) {
-    void *src = file_source(argv[1]);
-    Token *t;
-    char buf[BUFLEN+1];
-
-    if (src == NULL) {
-        printf("invalid file name\n");
-        return 1;
-    }
-    while (1) {
-        t = next_token(src);
-        print_token(t, buf, BUFLEN);
-        printf("%s\n", buf);
-        if (t->type == TOKEN_EOS)
-            return 0;
-        if (t->type == TOKEN_ERROR)
-            return 2;
-    }
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "lplex.h"
+#include "lpscan.h"
+#include "lpparse.h"
+#include "lpvm.h"
+#include "lpsched.h"
+#define BUFLEN 1024
+
+// the token cache file of a source file: next to it as "xxx.lpt", or in
+// the directory given by $LPCACHE, named by the whole path with '/'
+// replaced by '%'
+static char *cache_path(const char *filepath) {
+    const char *dir = getenv("LPCACHE");
+    char *path;
+    char *p;
+
+    if (dir == NULL || *dir == 0) {
+        path = (char*)malloc(strlen(filepath) + 5);
+        if (path != NULL)
+            sprintf(path, "%s.lpt", filepath);
+        return path;
+    }
+    path = (char*)malloc(strlen(dir) + strlen(filepath) + 6);
+    if (path == NULL)
+        return NULL;
+    sprintf(path, "%s/", dir);
+    p = path + strlen(path);
+    sprintf(p, "%s.lpt", filepath);
+    for (; *p; p++) {
+        if (*p == '/')
+            *p = '%';
+    }
+    return path;
+}
+
+// lex the whole file into a token stream first, then print it. with
+// 'cache', the stream is loaded from the token cache file if it's
+// up to date, otherwise it's saved there.
+static int print_stream(const char *filepath, int nthread, int cache) {
+    void *src = file_source(filepath);
+    TokenStream *ts = NULL;
+    char *path = NULL;
+    Token t;
+    char buf[BUFLEN+1];
+    int k;
+
+    if (src == NULL) {
+        printf("invalid file name\n");
+        return 1;
+    }
+    if (cache) {
+        path = cache_path(filepath);
+        if (path != NULL)
+            ts = load_token_cache(src, path);
+    }
+    if (ts == NULL) {
+        ts = nthread > 1 ? lex_all_parallel(src, nthread) : lex_all(src);
+        if (ts != NULL && path != NULL)
+            save_token_cache(src, ts, path);
+    }
+    free(path);
+    if (ts == NULL) {
+        close_source(src);
+        return 1;
+    }
+    t.bigstr = NULL;
+    for (k = 0; k < ts->count; k++) {
+        stream_token(ts, k, &t);
+        print_token(&t, buf, BUFLEN);
+        printf("%s\n", buf);
+    }
+    k = ts->type[ts->count-1] == TOKEN_ERROR ? 2 : 0;
+    free_token_stream(ts);
+    close_source(src);
+    return k;
+}
+
+//1 ------------------- lex many files in parallel ---------------------
+// lp -j N path...
+// the files(and the .lp files under the directories) are lexed by N
+// worker threads. each worker has a deque of files, biggest first; it
+// takes files from its own deque, and steals from the other end of the
+// others' deques when its own is empty, so a few big files don't keep
+// the other workers idle. the results are printed in the order of the
+// paths, no matter which worker finishes first.
+// lp -p -j N path...
+// the files are parsed instead, the workers adding the identifiers to
+// one shared pool, so a name has the same id in the asts of all files.
+typedef struct {
+    char *path;
+    long size;
+    int status;           // 0: ok, 1: invalid file, 2: lex error, 3: syntax errors
+    int count;            // token count
+    char *error;          // the error token or the first syntax error, printed
+    int done;
+} Job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;           // job index, the owner takes from the bottom,
+    int top;              // thieves take from the top
+    int bottom;
+} Deque;
+
+typedef struct {
+    Job *jobs;
+    int jobcount;
+    int jobsize;
+    Deque *deques;
+    int nworker;
+    lp_sharedpool *names; // identifiers of the asts if the files are parsed
+    pthread_mutex_t lock; // protecting 'done' of the jobs
+    pthread_cond_t cond;
+} Driver;
+
+typedef struct {
+    Driver *d;
+    int id;
+} Worker;
+
+static int add_job(Driver *d, char *path, long size) {
+    if (path == NULL) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    if (d->jobcount == d->jobsize) {
+        int newsize = d->jobsize == 0 ? 64 : d->jobsize * 2;
+        Job *jobs = (Job*)realloc(d->jobs, newsize * sizeof(Job));
+        if (jobs == NULL) {
+            printf("no enough memory\n");
+            free(path);
+            return 0;
+        }
+        d->jobs = jobs;
+        d->jobsize = newsize;
+    }
+    memset(&d->jobs[d->jobcount], 0, sizeof(Job));
+    d->jobs[d->jobcount].path = path;
+    d->jobs[d->jobcount].size = size;
+    d->jobcount++;
+    return 1;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// add the path as a job, or all .lp files under it if it's a directory,
+// in order of their names
+static int add_path(Driver *d, const char *path) {
+    struct stat st;
+    DIR *dir;
+    struct dirent *e;
+    char **names = NULL;
+    int count = 0;
+    int size = 0;
+    int ok = 1;
+    int i;
+
+    if (stat(path, &st) != 0)
+        return add_job(d, strdup(path), 0);
+    if (!S_ISDIR(st.st_mode) || (dir = opendir(path)) == NULL)
+        return add_job(d, strdup(path), st.st_size);
+    while ((e = readdir(dir)) != NULL) {
+        int len = strlen(e->d_name);
+        char *p;
+        if (e->d_name[0] == '.')
+            continue;
+        if (count == size) {
+            char **n = (char**)realloc(names, (size == 0 ? 16 : size * 2) * sizeof(char*));
+            if (n == NULL) {
+                ok = 0;
+                break;
+            }
+            names = n;
+            size = size == 0 ? 16 : size * 2;
+        }
+        p = (char*)malloc(strlen(path) + len + 2);
+        if (p == NULL) {
+            ok = 0;
+            break;
+        }
+        sprintf(p, "%s/%s", path, e->d_name);
+        names[count++] = p;
+    }
+    closedir(dir);
+    if (!ok)
+        printf("no enough memory\n");
+
+    qsort(names, count, sizeof(char*), cmp_name);
+    for (i = 0; i < count; i++) {
+        int len = strlen(names[i]);
+        if (ok && stat(names[i], &st) == 0) {
+            if (S_ISDIR(st.st_mode))
+                ok = add_path(d, names[i]);
+            else if (len > 3 && strcmp(names[i] + len - 3, ".lp") == 0)
+                ok = add_path(d, names[i]);
+        }
+        free(names[i]);
+    }
+    free(names);
+    return ok;
+}
+
+// parse the file of the job into an ast on the shared pool, the ast is
+// dropped, only the first error is kept
+static void parse_job(Job *job, void *src, lp_sharedpool *names) {
+    char buf[BUFLEN+1];
+    lp_ast *ast = parse_module_shared(src, names);
+
+    if (ast == NULL) {
+        job->status = 1;
+        return;
+    }
+    job->count = ast->tokens;
+    if (ast->errorcount > 0) {
+        snprintf(buf, sizeof(buf), "%d:%d: %s", ast->errors[0].row, ast->errors[0].col,
+                 ast->errors[0].msg);
+        job->error = strdup(buf);
+        job->status = 3;
+    }
+    ast_free(ast);
+}
+
+static void run_job(Job *job, lp_sharedpool *names) {
+    void *src;
+    TokenStream *ts;
+    char buf[BUFLEN+1];
+    Token t;
+
+    // file_source would complain on stdout, out of order
+    if (access(job->path, R_OK) != 0) {
+        job->status = 1;
+        return;
+    }
+    src = file_source(job->path);
+    if (src == NULL) {
+        job->status = 1;
+        return;
+    }
+    if (names != NULL) {
+        parse_job(job, src, names);
+        close_source(src);
+        return;
+    }
+    ts = lex_all(src);
+    if (ts == NULL) {
+        job->status = 1;
+        close_source(src);
+        return;
+    }
+    job->count = ts->count;
+    if (ts->type[ts->count-1] == TOKEN_ERROR) {
+        t.bigstr = NULL;
+        stream_token(ts, ts->count-1, &t);
+        print_token(&t, buf, BUFLEN);
+        job->error = strdup(buf);
+        job->status = 2;
+    }
+    free_token_stream(ts);
+    close_source(src);
+}
+
+// take a job from the bottom of the own deque, or steal one from the
+// top of another deque. return -1 if all deques are empty.
+static int take_job(Driver *d, int id) {
+    int i;
+    for (i = 0; i < d->nworker; i++) {
+        Deque *q = &d->deques[(id + i) % d->nworker];
+        int k = -1;
+        pthread_mutex_lock(&q->lock);
+        if (q->top < q->bottom) {
+            if (i == 0)
+                k = q->items[--q->bottom];
+            else
+                k = q->items[q->top++];
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (k >= 0)
+            return k;
+    }
+    return -1;
+}
+
+static void *work(void *arg) {
+    Worker *w = (Worker*)arg;
+    Driver *d = w->d;
+    int k;
+    while ((k = take_job(d, w->id)) >= 0) {
+        run_job(&d->jobs[k], d->names);
+        pthread_mutex_lock(&d->lock);
+        d->jobs[k].done = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+    return NULL;
+}
+
+static Driver *sort_driver;
+static int cmp_size(const void *a, const void *b) {
+    long sa = sort_driver->jobs[*(const int*)a].size;
+    long sb = sort_driver->jobs[*(const int*)b].size;
+    if (sa != sb)
+        return sa < sb ? 1 : -1;
+    return *(const int*)a - *(const int*)b;
+}
+
+static int lex_files(int nworker, char *paths[], int npath, int parse) {
+    Driver d;
+    pthread_t *threads = NULL;
+    Worker *workers = NULL;
+    int *order = NULL;
+    int ndeque = 0;
+    int result = 0;
+    int tokens = 0;
+    int i;
+
+    memset(&d, 0, sizeof(d));
+    for (i = 0; i < npath; i++) {
+        if (!add_path(&d, paths[i])) {
+            result = 1;
+            goto done;
+        }
+    }
+    if (d.jobcount == 0)
+        goto done;
+    if (parse && (d.names = sharedpool_init()) == NULL) {
+        result = 1;
+        goto done;
+    }
+    if (nworker <= 0)
+        nworker = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworker <= 0)
+        nworker = 1;
+    if (nworker > d.jobcount)
+        nworker = d.jobcount;
+
+    order = (int*)malloc(d.jobcount * sizeof(int));
+    threads = (pthread_t*)malloc(nworker * sizeof(pthread_t));
+    workers = (Worker*)malloc(nworker * sizeof(Worker));
+    d.deques = (Deque*)calloc(nworker, sizeof(Deque));
+    if (order == NULL || threads == NULL || workers == NULL || d.deques == NULL) {
+        printf("no enough memory\n");
+        result = 1;
+        goto done;
+    }
+
+    // deal the files biggest first, the biggest ones go to the bottom of
+    // the deques, where the owners take first
+    for (i = 0; i < d.jobcount; i++)
+        order[i] = i;
+    sort_driver = &d;
+    qsort(order, d.jobcount, sizeof(int), cmp_size);
+    d.nworker = nworker;
+    for (ndeque = 0; ndeque < nworker; ndeque++) {
+        Deque *q = &d.deques[ndeque];
+        int n = (d.jobcount - ndeque + nworker - 1) / nworker;
+        int j;
+        q->items = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+        if (q->items == NULL) {
+            printf("no enough memory\n");
+            result = 1;
+            goto done;
+        }
+        pthread_mutex_init(&q->lock, NULL);
+        q->top = 0;
+        q->bottom = n;
+        for (j = 0; j < n; j++)
+            q->items[n-1-j] = order[ndeque + j * nworker];
+    }
+
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    scan_init();
+    for (i = 0; i < nworker; i++) {
+        workers[i].d = &d;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, work, &workers[i]);
+    }
+
+    // print the results in order as soon as they are ready
+    for (i = 0; i < d.jobcount; i++) {
+        Job *job = &d.jobs[i];
+        pthread_mutex_lock(&d.lock);
+        while (!job->done)
+            pthread_cond_wait(&d.cond, &d.lock);
+        pthread_mutex_unlock(&d.lock);
+        if (job->status == 1) {
+            printf("%s: invalid file name\n", job->path);
+            result = 1;
+        } else if (job->status == 2) {
+            printf("%s: %s\n", job->path, job->error != NULL ? job->error : "error");
+            if (result == 0)
+                result = 2;
+        } else if (job->status == 3) {
+            printf("%s:%s\n", job->path, job->error != NULL ? job->error : " syntax error");
+            if (result == 0)
+                result = 2;
+        } else {
+            tokens += job->count;
+        }
+    }
+    if (parse)
+        printf("%d files, %d tokens, %d names\n", d.jobcount, tokens, sharedpool_count(d.names));
+    else
+        printf("%d files, %d tokens\n", d.jobcount, tokens);
+
+    for (i = 0; i < nworker; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+
+done:
+    // the deques before ndeque are set up, the rest are zeroed by calloc
+    for (i = 0; i < ndeque; i++)
+        pthread_mutex_destroy(&d.deques[i].lock);
+    for (i = 0; d.deques != NULL && i < d.nworker; i++)
+        free(d.deques[i].items);
+    for (i = 0; i < d.jobcount; i++) {
+        free(d.jobs[i].path);
+        free(d.jobs[i].error);
+    }
+    free(d.jobs);
+    free(d.deques);
+    sharedpool_destroy(d.names);
+    free(workers);
+    free(threads);
+    free(order);
+    return result;
+}
+
+//1 ------------------- lex streams as they arrive ---------------------
+// lp -s [socket]
+// lex lp code from stdin, and from the connections to the unix socket if
+// it's given, as the code arrives. all inputs are served by one thread
+// waiting on epoll, none of them blocks the others. the tokens of an
+// input are printed as soon as they're decided, after its number(0 for
+// stdin, the connections are 1, 2...).
+#define MAX_EVENTS 64
+
+typedef struct {
+    int fd;
+    int id;
+    void *src;
+} Conn;
+
+static Conn *new_conn(int epfd, int fd, int id) {
+    Conn *c = (Conn*)malloc(sizeof(Conn));
+    struct epoll_event ev;
+
+    if (c == NULL || (c->src = stream_source(NULL)) == NULL) {
+        printf("no enough memory\n");
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->id = id;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        // a regular file can't be waited for, it's always readable
+        while (read_source(c->src, fd) >= 0)
+            ;
+    }
+    return c;
+}
+
+static void close_conn(Conn *c) {
+    // closing the fd removes it from epoll
+    close(c->fd);
+    close_source(c->src);
+    free(c);
+}
+
+// print the tokens decided so far, return 1 if the input is finished
+static int print_conn(Conn *c) {
+    char buf[BUFLEN+1];
+    Token *t;
+    while (1) {
+        t = next_token(c->src);
+        if (t->type == TOKEN_MORE)
+            return 0;
+        print_token(t, buf, BUFLEN);
+        printf("%d: %s\n", c->id, buf);
+        if (t->type == TOKEN_EOS || t->type == TOKEN_ERROR)
+            return 1;
+    }
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("too long socket path %s\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        printf("can't create socket\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+        printf("can't listen on socket %s\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve(const char *sockpath) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    Conn listener;
+    Conn *c;
+    int epfd = epoll_create1(0);
+    int nconn = 0;
+    int lastid = 0;
+    int i, n;
+
+    if (epfd == -1) {
+        printf("can't create epoll\n");
+        return 1;
+    }
+    listener.fd = -1;
+    if (sockpath != NULL) {
+        listener.fd = listen_unix(sockpath);
+        if (listener.fd == -1)
+            return 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listener;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listener.fd, &ev);
+    }
+
+    c = new_conn(epfd, dup(0), 0);
+    if (c != NULL) {
+        if (print_conn(c))
+            close_conn(c);
+        else
+            nconn++;
+    }
+
+    // without the socket, it's done when stdin is finished
+    while (nconn > 0 || listener.fd != -1) {
+        fflush(stdout);
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            printf("epoll error\n");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            int fd;
+            c = (Conn*)events[i].data.ptr;
+            if (c != &listener) {
+                read_source(c->src, c->fd);
+                if (print_conn(c)) {
+                    close_conn(c);
+                    nconn--;
+                }
+                continue;
+            }
+            while ((fd = accept(listener.fd, NULL, NULL)) != -1) {
+                c = new_conn(epfd, fd, ++lastid);
+                if (c != NULL)
+                    nconn++;
+            }
+        }
+    }
+    if (listener.fd != -1) {
+        close(listener.fd);
+        unlink(sockpath);
+    }
+    close(epfd);
+    return 0;
+}
+
+// lp --stats [--json] file
+// lex the file, then print the counters of the lexer
+static int print_stats(const char *filepath, int json) {
+    void *src = file_source(filepath);
+    Token *t;
+    int result;
+
+    if (src == NULL) {
+        printf("invalid file name\n");
+        return 1;
+    }
+    do {
+        t = next_token(src);
+    } while (t->type != TOKEN_EOS && t->type != TOKEN_ERROR);
+    result = t->type == TOKEN_ERROR ? 2 : 0;
+    print_lex_stats(src, json);
+    close_source(src);
+    return result;
+}
+
+// lp -p file
+// parse the file, then print the ast and the syntax errors
+static int print_ast(const char *filepath) {
+    void *src = file_source(filepath);
+    lp_ast *ast;
+    int result;
+
+    if (src == NULL) {
+        printf("invalid file name\n");
+        return 1;
+    }
+    ast = parse_module(src, NULL);
+    close_source(src);
+    if (ast == NULL)
+        return 1;
+    ast_print(ast, ast->root);
+    print_parse_errors(ast, filepath);
+    result = ast->errorcount > 0 ? 2 : 0;
+    ast_free(ast);
+    return result;
+}
+
+// lp -r file, lp -d file
+// compile the file and run it, or print its code
+static int run_file(const char *filepath, int dump) {
+    void *src = file_source(filepath);
+    lp_ast *ast;
+    lp_program *prog;
+    lp_sched *s;
+    long failed;
+    int result = 0;
+
+    if (src == NULL) {
+        printf("invalid file name\n");
+        return 1;
+    }
+    ast = parse_module(src, NULL);
+    close_source(src);
+    if (ast == NULL)
+        return 1;
+    if (ast->errorcount > 0) {
+        print_parse_errors(ast, filepath);
+        ast_free(ast);
+        return 2;
+    }
+    prog = vm_compile(ast);
+    if (prog == NULL) {
+        ast_free(ast);
+        return 1;
+    }
+    if (prog->errorcount > 0) {
+        print_compile_errors(prog, filepath);
+        result = 2;
+    } else if (dump) {
+        vm_print(prog);
+    } else if ((s = sched_new(prog, filepath, 0)) == NULL) {
+        result = 1;
+    } else {
+        // the errors of the lps failed are printed by the scheduler
+        failed = sched_run(s);
+        if (failed < 0)
+            result = 1;
+        else if (failed > 0)
+            result = 3;
+        sched_free(s);
+    }
+    vm_free_program(prog);
+    ast_free(ast);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    void *src;
+    Token *t;
+    char buf[BUFLEN+1];
+
+    if (argc == 3 && strcmp(argv[1], "-a") == 0)
+        return print_stream(argv[2], 1, 0);
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+        return print_stream(argv[2], 1, 1);
+    if (argc == 5 && strcmp(argv[1], "-a") == 0 && strcmp(argv[2], "-j") == 0)
+        return print_stream(argv[4], atoi(argv[3]), 0);
+    if (argc == 3 && strcmp(argv[1], "-p") == 0)
+        return print_ast(argv[2]);
+    if (argc == 3 && strcmp(argv[1], "-r") == 0)
+        return run_file(argv[2], 0);
+    if (argc == 3 && strcmp(argv[1], "-d") == 0)
+        return run_file(argv[2], 1);
+    if (argc == 3 && strcmp(argv[1], "--stats") == 0)
+        return print_stats(argv[2], 0);
+    if (argc == 4 && strcmp(argv[1], "--stats") == 0 && strcmp(argv[2], "--json") == 0)
+        return print_stats(argv[3], 1);
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "-s") == 0)
+        return serve(argc == 3 ? argv[2] : NULL);
+    if (argc >= 4 && strcmp(argv[1], "-j") == 0)
+        return lex_files(atoi(argv[2]), argv + 3, argc - 3, 0);
+    if (argc >= 5 && strcmp(argv[1], "-p") == 0 && strcmp(argv[2], "-j") == 0)
+        return lex_files(atoi(argv[3]), argv + 4, argc - 4, 1);
+
+    src = file_source(argv[1]);
+    if (src == NULL) {
+        printf("invalid file name\n");
+        return 1;
+    }
+    while (1) {
+        t = next_token(src);
+        print_token(t, buf, BUFLEN);
+        printf("%s\n", buf);
+        if (t->type == TOKEN_EOS)
+            return 0;
+        if (t->type == TOKEN_ERROR)
+            return 2;
+    }
+    return 0;
+}
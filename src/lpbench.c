@@ -0,0 +1,313 @@
+/*
+ * lexer and parser throughput harness.
+ *
+ * lpbench [-n repeat] [-b baseline] [-t tolerance] file...
+ *   each file is lexed in these modes:
+ *     file    file_source + next_token
+ *     string  string_source + next_token(sources under 10MB only)
+ *     stream  file_source + lex_all
+ *     parse   file_source + parse_module
+ *   and one line is printed for each:
+ *     name mode bytes tokens MB/s tokens/s allocs/token peak-rss-KB nodes/s
+ *   nodes/s is the count of ast nodes made per second, 0 for lexing.
+ *   lines beginning with '#' are comments. the output can be saved as
+ *   the baseline of a later run.
+ *   -n  times to lex each file in each mode, the fastest one is taken,
+ *       3 by default. a small file is lexed more times, till MIN_TIME
+ *       is spent.
+ *   -b  compare with the baseline file: a mode of a file is a regression
+ *       if it's slower by more than the tolerance, or allocates more
+ *       per token. the exit status is 1 if there's any regression.
+ *   -t  tolerance of the speed in percent, 10 by default
+ *
+ * each measurement runs in its own child process, so the peak RSS is
+ * its own. allocations are counted by wrapping malloc, calloc, realloc
+ * and strdup at link time(see the Makefile).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "lplex.h"
+#include "lpparse.h"
+
+#define STRING_MAX (10*1024*1024) // the same as SRCMAX of the lexer
+#define MAX_CASES 256
+#define MIN_TIME 0.2 // small sources are lexed more times, at least for this long
+
+//1 --------------------- allocation counter -------------------------
+static long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    allocs++;
+    return __real_strdup(s);
+}
+
+//1 --------------------- measurement ---------------------------------
+typedef struct {
+    char name[256];
+    char mode[16];
+    long bytes;
+    long tokens;
+    long nodes;     // ast nodes, parse mode only
+    double seconds; // of the fastest run
+    double mbps;
+    double tokps;
+    double allocs;  // per token
+    long rss;       // KB
+    double nodps;
+} Result;
+
+static const char *modes[] = {"file", "string", "stream", "parse"};
+#define MODE_COUNT 4
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char *read_text(const char *path, long *len) {
+    FILE *f = fopen(path, "rb");
+    char *text;
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = (char*)__real_malloc(*len + 1);
+    if (text != NULL && fread(text, 1, *len, f) != (size_t)*len) {
+        free(text);
+        text = NULL;
+    }
+    fclose(f);
+    if (text != NULL)
+        text[*len] = 0;
+    return text;
+}
+
+// lex the source once, return the token count, -1 on error. the ast
+// nodes made are put in 'nodes' for the parse mode
+static long lex_once(const char *path, int mode, const char *text, long *nodes) {
+    void *src = mode == 1 ? string_source(text) : file_source(path);
+    long count = 0;
+    Token *t;
+
+    if (src == NULL)
+        return -1;
+    if (mode == 3) {
+        lp_ast *ast = parse_module(src, NULL);
+        if (ast == NULL || ast->errorcount > 0) {
+            ast_free(ast);
+            close_source(src);
+            return -1;
+        }
+        count = ast->tokens;
+        *nodes = ast->count - 1;
+        ast_free(ast);
+    } else if (mode == 2) {
+        TokenStream *ts = lex_all(src);
+        if (ts == NULL) {
+            close_source(src);
+            return -1;
+        }
+        count = ts->count;
+        free_token_stream(ts);
+    } else {
+        do {
+            t = next_token(src);
+            count++;
+        } while (t->type != TOKEN_EOS && t->type != TOKEN_ERROR);
+    }
+    close_source(src);
+    return count;
+}
+
+// run in the child process, write the result to 'fd'
+static void measure(const char *path, int mode, int repeat, int fd) {
+    Result r;
+    char *text = NULL;
+    double best = 0;
+    double total = 0;
+    long bytes = 0;
+    long a = 0;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    if (mode == 1) {
+        text = read_text(path, &bytes);
+        if (text == NULL || bytes >= STRING_MAX)
+            exit(2);
+    }
+    for (i = 0; i < repeat || total < MIN_TIME; i++) {
+        double begin = now();
+        long before = allocs;
+        r.tokens = lex_once(path, mode, text, &r.nodes);
+        if (r.tokens < 0)
+            exit(1);
+        begin = now() - begin;
+        total += begin;
+        a = allocs - before;
+        if (i == 0 || begin < best)
+            best = begin;
+    }
+    if (best <= 0)
+        best = 1e-9;
+    r.seconds = best;
+    r.allocs = (double)a / r.tokens;
+    r.tokps = r.tokens / best;
+    r.nodps = r.nodes / best;
+    write(fd, &r, sizeof(r));
+    exit(0);
+}
+
+static int run_case(const char *path, int mode, int repeat, Result *r) {
+    struct rusage usage;
+    struct stat st;
+    int fds[2];
+    int status;
+    pid_t pid;
+
+    if (stat(path, &st) != 0 || pipe(fds) != 0)
+        return 0;
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        measure(path, mode, repeat, fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], r, sizeof(Result)) != sizeof(Result)) {
+        close(fds[0]);
+        if (pid > 0)
+            wait4(pid, &status, 0, &usage);
+        return 0;
+    }
+    close(fds[0]);
+    wait4(pid, &status, 0, &usage);
+
+    r->bytes = st.st_size;
+    r->mbps = st.st_size / 1048576.0 / r->seconds;
+    r->rss = usage.ru_maxrss;
+    snprintf(r->name, sizeof(r->name), "%s", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    snprintf(r->mode, sizeof(r->mode), "%s", modes[mode]);
+    return 1;
+}
+
+//1 --------------------- baseline ------------------------------------
+static int load_baseline(const char *path, Result *base, int max) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    int n = 0;
+    if (f == NULL)
+        return -1;
+    while (n < max && fgets(line, sizeof(line), f) != NULL) {
+        Result *r = &base[n];
+        if (line[0] == '#')
+            continue;
+        // nodes/s is not in the baselines saved before the parse mode
+        r->nodps = 0;
+        if (sscanf(line, "%255s %15s %ld %ld %lf %lf %lf %ld %lf", r->name, r->mode,
+                   &r->bytes, &r->tokens, &r->mbps, &r->tokps, &r->allocs, &r->rss,
+                   &r->nodps) >= 8)
+            n++;
+    }
+    fclose(f);
+    return n;
+}
+
+// return 1 if 'r' regresses from the baseline
+static int compare(Result *r, Result *base, int nbase, double tolerance) {
+    int i;
+    for (i = 0; i < nbase; i++) {
+        Result *b = &base[i];
+        if (strcmp(b->name, r->name) != 0 || strcmp(b->mode, r->mode) != 0)
+            continue;
+        if (r->mbps < b->mbps * (1 - tolerance / 100)) {
+            printf("# REGRESSION %s %s: %.1f MB/s, baseline %.1f MB/s\n",
+                   r->name, r->mode, r->mbps, b->mbps);
+            return 1;
+        }
+        if (r->allocs > b->allocs + 0.001) {
+            printf("# REGRESSION %s %s: %.4f allocs/token, baseline %.4f\n",
+                   r->name, r->mode, r->allocs, b->allocs);
+            return 1;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static Result base[MAX_CASES];
+    const char *baseline = NULL;
+    double tolerance = 10;
+    int repeat = 3;
+    int nbase = 0;
+    int regressions = 0;
+    int i, mode;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            break;
+        }
+    }
+    if (i == argc || repeat <= 0) {
+        fprintf(stderr, "usage: %s [-n repeat] [-b baseline] [-t tolerance] file...\n", argv[0]);
+        return 1;
+    }
+    if (baseline != NULL) {
+        nbase = load_baseline(baseline, base, MAX_CASES);
+        if (nbase < 0)
+            printf("# no baseline %s, nothing to compare\n", baseline);
+    }
+
+    printf("# name mode bytes tokens MB/s tokens/s allocs/token peak-rss-KB nodes/s\n");
+    for (; i < argc; i++) {
+        for (mode = 0; mode < MODE_COUNT; mode++) {
+            Result r;
+            if (!run_case(argv[i], mode, repeat, &r))
+                continue;
+            printf("%s %s %ld %ld %.1f %.0f %.4f %ld %.0f\n", r.name, r.mode, r.bytes,
+                   r.tokens, r.mbps, r.tokps, r.allocs, r.rss, r.nodps);
+            if (nbase > 0)
+                regressions += compare(&r, base, nbase, tolerance);
+        }
+    }
+    if (regressions > 0) {
+        printf("# %d regressions\n", regressions);
+        return 1;
+    }
+    return 0;
+}
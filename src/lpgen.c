@@ -0,0 +1,259 @@
+/*
+ * generate a synthetic lp source for benchmarking the lexer and parser.
+ *
+ * lpgen [-s size] [-r seed] [-m mix]
+ *   -s  size of the source, with suffix K, M or G, 1M by default
+ *   -r  seed of the random numbers, the same seed makes the same source
+ *   -m  weights of the statement kinds, e.g. "id=4,num=1,mstr=0", the
+ *       kinds are:
+ *       id       assignment of plain identifiers
+ *       qid      call with qualified names(a.b.c)
+ *       num      integer, float and hexadecimal numbers
+ *       str      single line strings and regular expressions
+ *       mstr     ''' and """ multi-line strings
+ *       comment  # and #""" comments
+ *       section  section headers(@1, @<...)
+ *       block    fun, if, while, for and case blocks of the statements
+ *                above, for benchmarking the parser
+ *
+ * the source is written to stdout. it's always lexed and parsed to the
+ * end without error, so the whole of it is measured.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {MIX_ID, MIX_QID, MIX_NUM, MIX_STR, MIX_MSTR, MIX_COMMENT, MIX_SECTION, MIX_BLOCK, MIX_COUNT};
+
+static const char *mixnames[MIX_COUNT] = {
+    "id", "qid", "num", "str", "mstr", "comment", "section", "block"
+};
+static int mix[MIX_COUNT] = {6, 3, 4, 3, 1, 2, 1, 2};
+
+static const char *words[] = {
+    "value", "count", "name", "index", "result", "buffer", "node", "left",
+    "right", "total", "item", "key", "data", "offset", "size", "state",
+    "config", "handler", "message", "record", "x", "y", "i", "n"
+};
+#define WORD_COUNT ((int)(sizeof(words) / sizeof(words[0])))
+
+static unsigned long long seed = 88172645463325252ULL;
+
+// xorshift64, the same on every platform
+static unsigned rnd(unsigned n) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (unsigned)(seed % n);
+}
+
+static const char *word() {
+    return words[rnd(WORD_COUNT)];
+}
+
+static void gen_name(char *buf) {
+    if (rnd(3) == 0)
+        sprintf(buf, "%s_%u", word(), rnd(1000));
+    else
+        strcpy(buf, word());
+}
+
+static void gen_text(char *buf, int n) {
+    int i;
+    buf[0] = 0;
+    for (i = 0; i < n; i++) {
+        strcat(buf, word());
+        strcat(buf, " ");
+    }
+}
+
+static int gen_block(FILE *out);
+
+// write one statement, return the bytes written
+static int gen_stmt(FILE *out, int kind) {
+    char a[64], b[64], c[64], text[512];
+    int i;
+    switch (kind) {
+        case MIX_ID:
+            gen_name(a); gen_name(b); gen_name(c);
+            return fprintf(out, "%s = %s + %s * (%s - 1)\n", a, b, c, a);
+        case MIX_QID:
+            gen_name(a);
+            return fprintf(out, "%s = %s.%s.%s(%s.%s, %s)\n",
+                           a, word(), word(), word(), word(), word(), word());
+        case MIX_NUM:
+            gen_name(a);
+            switch (rnd(4)) {
+                case 0:
+                    return fprintf(out, "%s = %u\n", a, rnd(1000000));
+                case 1:
+                    return fprintf(out, "%s = %u.%u\n", a, rnd(100000), rnd(1000));
+                case 2:
+                    return fprintf(out, "%s = %u.%ue%d\n", a, rnd(10), rnd(100000), (int)rnd(40) - 20);
+                default:
+                    return fprintf(out, "%s = 0x%x\n", a, rnd(0x7fffffff));
+            }
+        case MIX_STR:
+            gen_name(a);
+            gen_text(text, 1 + rnd(8));
+            switch (rnd(3)) {
+                case 0:
+                    return fprintf(out, "%s = '%s'\n", a, text);
+                case 1:
+                    return fprintf(out, "%s = \"%s\\t%s\"\n", a, text, word());
+                default:
+                    return fprintf(out, "%s = r'^%s[a-z]+$'\n", a, word());
+            }
+        case MIX_MSTR: {
+            int n = 0;
+            const char *q = rnd(2) ? "'''" : "\"\"\"";
+            gen_name(a);
+            n += fprintf(out, "%s = %s\n", a, q);
+            for (i = 1 + rnd(20); i > 0; i--) {
+                gen_text(text, 1 + rnd(12));
+                n += fprintf(out, "    %s\n", text);
+            }
+            n += fprintf(out, "%s\n", q);
+            return n;
+        }
+        case MIX_COMMENT: {
+            int n = 0;
+            if (rnd(4) != 0) {
+                gen_text(text, 1 + rnd(12));
+                return fprintf(out, "# %s\n", text);
+            }
+            n += fprintf(out, "#\"\"\"\n");
+            for (i = 1 + rnd(10); i > 0; i--) {
+                gen_text(text, 1 + rnd(12));
+                n += fprintf(out, "  %s\n", text);
+            }
+            n += fprintf(out, "\"\"\"\n");
+            return n;
+        }
+        case MIX_SECTION:
+            gen_text(text, 1 + rnd(4));
+            return fprintf(out, "@%c %s\n", "123456789<>="[rnd(12)], text);
+        default:
+            return gen_block(out);
+    }
+}
+
+// a few simple statements, the body of a block
+static int gen_body(FILE *out) {
+    int n = 0;
+    int i;
+    for (i = 1 + rnd(4); i > 0; i--) {
+        n += fprintf(out, "    ");
+        n += gen_stmt(out, rnd(3));
+    }
+    return n;
+}
+
+static int gen_block(FILE *out) {
+    char a[64], b[64];
+    int n = 0;
+    gen_name(a);
+    gen_name(b);
+    switch (rnd(5)) {
+        case 0:
+            n += fprintf(out, "fun %s(%s, %s int)\n", a, b, word());
+            n += gen_body(out);
+            n += fprintf(out, "    return %s\nend\n", b);
+            return n;
+        case 1:
+            n += fprintf(out, "if %s > %s then\n", a, b);
+            n += gen_body(out);
+            n += fprintf(out, "elseif %s == %u then\n", a, rnd(100));
+            n += gen_body(out);
+            n += fprintf(out, "else\n");
+            n += gen_body(out);
+            return n + fprintf(out, "end\n");
+        case 2:
+            n += fprintf(out, "while %s < %s and %s != nil do\n", a, b, word());
+            n += gen_body(out);
+            return n + fprintf(out, "end\n");
+        case 3:
+            n += fprintf(out, "for %s in 1..%u do\n", a, rnd(1000));
+            n += gen_body(out);
+            return n + fprintf(out, "end\n");
+        default:
+            n += fprintf(out, "case %s of\n", a);
+            n += fprintf(out, "%u:\n", rnd(10));
+            n += gen_body(out);
+            n += fprintf(out, "'%s':\n", word());
+            n += gen_body(out);
+            return n + fprintf(out, "end\n");
+    }
+}
+
+static long parse_size(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        default: return n;
+    }
+}
+
+static int parse_mix(char *s) {
+    char *item;
+    for (item = strtok(s, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *eq = strchr(item, '=');
+        int k;
+        if (eq == NULL)
+            return 0;
+        *eq = 0;
+        for (k = 0; k < MIX_COUNT; k++) {
+            if (strcmp(item, mixnames[k]) == 0)
+                break;
+        }
+        if (k == MIX_COUNT)
+            return 0;
+        mix[k] = atoi(eq + 1);
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    long size = 1 << 20;
+    long written = 0;
+    int total = 0;
+    int i, k;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            seed += strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (!parse_mix(argv[++i])) {
+                fprintf(stderr, "invalid mix: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: %s [-s size] [-r seed] [-m kind=weight,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (k = 0; k < MIX_COUNT; k++)
+        total += mix[k] > 0 ? mix[k] : 0;
+    if (total == 0) {
+        fprintf(stderr, "all weights are 0\n");
+        return 1;
+    }
+
+    while (written < size) {
+        int r = rnd(total);
+        for (k = 0; k < MIX_COUNT; k++) {
+            if (mix[k] <= 0)
+                continue;
+            if (r < mix[k])
+                break;
+            r -= mix[k];
+        }
+        written += gen_stmt(stdout, k);
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * generate the reserve word table of the lexer(lpreserve.h).
+ *
+ * the table is a perfect hash: a reserve word is found by its first
+ * char, last char and length only, which are known as soon as an
+ * identifier is scanned, then confirmed by one memcmp.
+ *     slot = ((first * M1) ^ (last * M2)) + length) & (SLOTS-1)
+ * M1 and M2 are searched here so that no two reserve words share a slot.
+ *
+ * to add a reserve word, add it to the list below and define its token
+ * type in lplex.h.
+ */
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    const char *str;
+    const char *type;
+} Word;
+
+static Word words[] = {
+    {"after",    "TOKEN_KW_AFTER"},
+    {"and",      "TOKEN_KW_AND"},
+    {"binary",   "TOKEN_KW_BINARY"},
+    {"bool",     "TOKEN_KW_BOOL"},
+    {"break",    "TOKEN_KW_BREAK"},
+    {"case",     "TOKEN_KW_CASE"},
+    {"catch",    "TOKEN_KW_CATCH"},
+    {"continue", "TOKEN_KW_CONTINUE"},
+    {"do",       "TOKEN_KW_DO"},
+    {"else",     "TOKEN_KW_ELSE"},
+    {"elseif",   "TOKEN_KW_ELSEIF"},
+    {"end",      "TOKEN_KW_END"},
+    {"export",   "TOKEN_KW_EXPORT"},
+    {"false",    "TOKEN_KW_FALSE"},
+    {"finally",  "TOKEN_KW_FINALLY"},
+    {"float",    "TOKEN_KW_FLOAT"},
+    {"for",      "TOKEN_KW_FOR"},
+    {"fun",      "TOKEN_KW_FUN"},
+    {"if",       "TOKEN_KW_IF"},
+    {"import",   "TOKEN_KW_IMPORT"},
+    {"in",       "TOKEN_KW_IN"},
+    {"int",      "TOKEN_KW_INT"},
+    {"local",    "TOKEN_KW_LOCAL"},
+    {"lp",       "TOKEN_KW_LP"},
+    {"nil",      "TOKEN_KW_NIL"},
+    {"of",       "TOKEN_KW_OF"},
+    {"or",       "TOKEN_KW_OR"},
+    {"regex",    "TOKEN_KW_REGEX"},
+    {"return",   "TOKEN_KW_RETURN"},
+    {"string",   "TOKEN_KW_STRING"},
+    {"struct",   "TOKEN_KW_STRUCT"},
+    {"then",     "TOKEN_KW_THEN"},
+    {"true",     "TOKEN_KW_TRUE"},
+    {"try",      "TOKEN_KW_TRY"},
+    {"while",    "TOKEN_KW_WHILE"},
+};
+
+#define WORD_COUNT ((int)(sizeof(words) / sizeof(words[0])))
+#define MAX_SLOTS 1024
+#define MAX_MULTIPLIER 1024
+
+static unsigned slot(const char *str, unsigned m1, unsigned m2, unsigned slots) {
+    unsigned len = strlen(str);
+    unsigned first = (unsigned char)str[0];
+    unsigned last = (unsigned char)str[len-1];
+    return (((first * m1) ^ (last * m2)) + len) & (slots - 1);
+}
+
+// return 1 if every word gets its own slot
+static int try_hash(unsigned m1, unsigned m2, unsigned slots, int *table) {
+    int i;
+    for (i = 0; i < (int)slots; i++)
+        table[i] = -1;
+    for (i = 0; i < WORD_COUNT; i++) {
+        unsigned s = slot(words[i].str, m1, m2, slots);
+        if (table[s] != -1)
+            return 0;
+        table[s] = i;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int table[MAX_SLOTS];
+    unsigned slots;
+    unsigned m1;
+    unsigned m2;
+    int minlen = 1000;
+    int maxlen = 0;
+    int i;
+
+    for (i = 0; i < WORD_COUNT; i++) {
+        int len = strlen(words[i].str);
+        if (len < minlen) minlen = len;
+        if (len > maxlen) maxlen = len;
+    }
+
+    for (slots = 16; slots <= MAX_SLOTS; slots *= 2) {
+        if (slots < (unsigned)WORD_COUNT)
+            continue;
+        for (m1 = 1; m1 < MAX_MULTIPLIER; m1++) {
+            for (m2 = 1; m2 < MAX_MULTIPLIER; m2++) {
+                if (try_hash(m1, m2, slots, table))
+                    goto found;
+            }
+        }
+    }
+    fprintf(stderr, "no perfect hash found for the reserve words\n");
+    return 1;
+
+found:
+    printf("// generated by lpkwgen, do not edit\n");
+    printf("#ifndef LPRESERVE_H\n");
+    printf("#define LPRESERVE_H\n\n");
+    printf("#define RESERVE_SLOTS  %u\n", slots);
+    printf("#define RESERVE_M1     %u\n", m1);
+    printf("#define RESERVE_M2     %u\n", m2);
+    printf("#define RESERVE_MINLEN %d\n", minlen);
+    printf("#define RESERVE_MAXLEN %d\n", maxlen);
+    printf("#define RESERVE_SLOT(first, last, len) \\\n"
+           "    (((((unsigned)(unsigned char)(first) * RESERVE_M1) ^ \\\n"
+           "       ((unsigned)(unsigned char)(last) * RESERVE_M2)) + (unsigned)(len)) & (RESERVE_SLOTS-1))\n\n");
+    printf("static const Reserve reserves[RESERVE_SLOTS] = {\n");
+    for (i = 0; i < (int)slots; i++) {
+        if (table[i] == -1) {
+            printf("    {\"\", 0, TOKEN_IDENTIFIER},\n");
+        } else {
+            Word *w = &words[table[i]];
+            printf("    {\"%s\", %d, %s},\n", w->str, (int)strlen(w->str), w->type);
+        }
+    }
+    printf("};\n\n");
+    printf("#endif //LPRESERVE_H\n");
+    return 0;
+}
@@ -8,6 +8,9 @@
 // for read
 #include <unistd.h>
 
+// for mmap and madvise
+#include <sys/mman.h>
+
 // for malloc and free
 #include <stdlib.h>
 
@@ -17,46 +20,290 @@
 // for assert
 #include <assert.h>
 
-// for strtol and strtod
+// for offsetof
+#include <stddef.h>
+
+// for strtod
 #include <errno.h>
 
+// for LONG_MAX
+#include <limits.h>
+
+// for lex_all_parallel
+#include <pthread.h>
+
 #include "lplex.h"
+#include "lpscan.h"
+#include "lpregex.h"
 
 //1 ---------------------- common definition ---------------------
 #define EOS  -1    // end of source
 #define NCH  0     // no char
-#define BUFLEN 256
+#define BUFLEN 65536
 #define PATHMAX 65535
 #define SRCMAX (10*1024*1024) 
+#define SENTINEL SCAN_PADDING // count of EOS chars padded after the source text
+#define LOOKAHEAD 3 // a token is decided by at most 3 chars after its end
+#define ring_token(src, i) ((src)->ring[(i) & (src)->ringmask])
+#define curr_slot(src) ring_token(src, (src)->head)
+
+//2 -------------------- statistics ------------------------------
+// counters for finding out where the time goes on a source, only built
+// with LPLEX_STATS(make STATS=1). see print_lex_stats.
+#ifdef LPLEX_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+enum {
+    STAT_STRING, STAT_REGEX, STAT_COMMENT, STAT_SECTION,
+    STAT_NUMBER, STAT_ID, STAT_NEWLINE, STAT_ROUTINES
+};
+#define STAT_TYPES (TOKEN_RANGE - TOKEN_ERROR + 1)
+
+typedef struct {
+    long reads;          // read calls loading the source, 0 if it's mapped
+    long mallocs;        // malloc of string arena chunks
+    long reallocs;       // token strings copied to grow in the arena
+    long bigstrs;        // token strings moved from buf to the arena
+    long semis;          // auto semicolons
+    long types[STAT_TYPES];            // token count by type - TOKEN_ERROR
+    long calls[STAT_ROUTINES];         // calls of the consume routines
+    unsigned long long cycles[STAT_ROUTINES];
+} LexStats;
+
+// the token functions don't know the source, they count into the source
+// being lexed by the thread
+static __thread LexStats *curr_stats;
+static __thread long read_calls;
+
+static unsigned long long stats_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
 
-typedef int (*Reader)(void *data, char*buf, int len);
-typedef void (*Closer)(void *data);
+#define STATS_ADD(field) do { if (curr_stats != NULL) curr_stats->field++; } while (0)
+#define STATS_READ() (read_calls++)
+#define TIMED(src, k, call) ({ \
+    unsigned long long t0_ = stats_clock(); \
+    int r_ = (call); \
+    (src)->stats.calls[k]++; \
+    (src)->stats.cycles[k] += stats_clock() - t0_; \
+    r_; })
+#else
+#define STATS_ADD(field)
+#define STATS_READ()
+#define TIMED(src, k, call) (call)
+#endif
+
+#define RING_MIN 4 // lookahead tokens kept in Source itself
+#define ALIGN8(n) (((n) + 7) & ~7L)
+
+// arena of the token strings longer than TOKEN_BUFMAX, see str_alloc
+#define STR_CHUNK_SIZE 65536
+
+typedef struct StrChunk {
+    struct StrChunk *next;
+    long used;
+    long size;
+    char data[];
+} StrChunk;
+
+// a regex literal compiled by the lexer, allocated in the arena
+typedef struct RegexRef {
+    struct RegexRef *next;
+    lp_regex *re;
+} RegexRef;
 
+typedef struct {
+    StrChunk *chunks;    // current one first
+    RegexRef *regexes;   // the regexes of the tokens, freed with the arena, newest first
+} StrArena;
+
+// the whole source text is kept in one contiguous buffer followed by
+// SENTINEL EOS chars, so the scanner never checks for the buffer end:
+// it stops at EOS, and looking ahead is just indexing from 'ptr'.
 typedef struct Source {
     int row;             // current row number
-    int col;             // current column number
     int curr;            // current character
-    int next1;           // next character
-    int next2;           // next to next character
-    int next3;           // next to next to next character
+    const char *ptr;     // next char to scan
+    const char *line;    // beginning of the current row
+    const char *text;    // source text, padded by SENTINEL EOS chars
+    long len;            // source text length
+    long size;           // allocated text length of a stream source
+    int open;            // more text may be fed to the stream source
+    int stream;          // a stream source, the strings of passed tokens are dropped
     char *srcname;       // source (file) name
-    char buf[BUFLEN];    // cache of current source data
-    int len;             // source length in the buffer
-    int ptr;             // pointer to the next char in buf
-    Reader read;
-    Closer close;
-    void *data;
-
-    Token curr_token;
-    Token next_token1;
-    Token next_token2;
-    Token next_token3;
+    char *map;           // mapped region holding text, NULL if text is malloced
+    long maplen;         // length of the mapped region
+    unsigned *lines;     // position of each row, recorded only for lex_all
+    int linecount;
+    int linesize;        // -1 if recording failed
+    StrArena strs;       // long token strings, templates and regexes
+
+    // the current token and the tokens peeked after it, see peek_token
+    Token **ring;
+    unsigned ringmask;   // size of the ring - 1, the size is a power of 2
+    unsigned head;       // index of the current token
+    unsigned tail;       // index after the last token lexed
+    Token *ringinit[RING_MIN];
+    Token tokens[RING_MIN];
+#ifdef LPLEX_STATS
+    LexStats stats;
+#endif
 } Source;
 
+// the column is not counted char by char, it's the distance to the
+// beginning of the row. consuming EOS counts one more column.
+static int column(Source *src) {
+    return (int)(src->ptr - src->line) + (src->curr == EOS);
+}
+
 
 //1 ----------------- token manipulation ------------------------------
-static void clear_token(Token *t, int freebigstr) {
-    char *bigstr = t->bigstr;
+// strings too long for Token.buf are allocated from the string arena of
+// the source instead of malloc: they are never freed one by one, but all
+// together with the source, so the tokens stay valid as long as the
+// source is alive, however they are moved between the token slots. a
+// string growing at the top of the arena just takes more room in place.
+static char *str_alloc(StrArena *a, long n) {
+    StrChunk *c = a->chunks;
+    char *p;
+
+    // aligned for a template as well
+    if (c != NULL)
+        c->used = ALIGN8(c->used);
+    if (c == NULL || c->used + n > c->size) {
+        long size = n > STR_CHUNK_SIZE ? n : STR_CHUNK_SIZE;
+        c = (StrChunk*)malloc(sizeof(StrChunk) + size);
+        STATS_ADD(mallocs);
+        if (c == NULL)
+            return NULL;
+        c->used = 0;
+        c->size = size;
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+    p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+// grow the string 'p' of 'oldn' chars to 'n' chars
+static char *str_grow(StrArena *a, char *p, long oldn, long n) {
+    StrChunk *c = a->chunks;
+    char *newp;
+
+    if (c != NULL && p + oldn == c->data + c->used && c->used - oldn + n <= c->size) {
+        c->used += n - oldn;
+        return p;
+    }
+    newp = str_alloc(a, n);
+    STATS_ADD(reallocs);
+    if (newp != NULL)
+        memcpy(newp, p, oldn);
+    return newp;
+}
+
+// move the strings of 'from' to 'a', 'from' is left empty
+static void str_merge(StrArena *a, StrArena *from) {
+    StrChunk **last = &a->chunks;
+    RegexRef **lastre = &a->regexes;
+    while (*last != NULL)
+        last = &(*last)->next;
+    *last = from->chunks;
+    from->chunks = NULL;
+    while (*lastre != NULL)
+        lastre = &(*lastre)->next;
+    *lastre = from->regexes;
+    from->regexes = NULL;
+}
+
+// drop the strings allocated after 'chunk' was the current chunk with
+// 'used' chars used, and the regexes after 'regexes'
+static void str_rewind(StrArena *a, StrChunk *chunk, long used, RegexRef *regexes) {
+    while (a->regexes != regexes) {
+        regex_free(a->regexes->re);
+        a->regexes = a->regexes->next;
+    }
+    while (a->chunks != chunk) {
+        StrChunk *c = a->chunks;
+        a->chunks = c->next;
+        free(c);
+    }
+    if (chunk != NULL)
+        chunk->used = used;
+}
+
+static int in_chunk(StrChunk *c, const void *p) {
+    return p != NULL && (const char*)p >= c->data && (const char*)p < c->data + c->size;
+}
+
+// the strings, templates and regexes of a stream source are only kept for
+// the tokens not yet passed by next_token(from the current one to the
+// last one peeked), like the text kept by stream_room, so a long stream
+// is lexed in bounded memory. the chunks used by none of them are freed,
+// the current one is rewound instead.
+static void str_drop_passed(Source *src) {
+    StrArena *a = &src->strs;
+    RegexRef **r = &a->regexes;
+    StrChunk **c = &a->chunks;
+    unsigned k;
+
+    while (*r != NULL) {
+        for (k = src->head; k != src->tail; k++) {
+            if (ring_token(src, k)->re == (*r)->re)
+                break;
+        }
+        if (k == src->tail) {
+            regex_free((*r)->re);
+            *r = (*r)->next;
+        } else {
+            r = &(*r)->next;
+        }
+    }
+    while (*c != NULL) {
+        StrChunk *chunk = *c;
+        RegexRef *ref;
+        int used = 0;
+        for (k = src->head; k != src->tail && !used; k++) {
+            Token *t = ring_token(src, k);
+            used = in_chunk(chunk, t->bigstr) || in_chunk(chunk, t->tpl);
+        }
+        for (ref = a->regexes; ref != NULL && !used; ref = ref->next)
+            used = in_chunk(chunk, ref);
+        if (used) {
+            c = &chunk->next;
+        } else if (chunk == a->chunks) {
+            chunk->used = 0;
+            c = &chunk->next;
+        } else {
+            *c = chunk->next;
+            free(chunk);
+        }
+    }
+}
+
+static void free_str_arena(StrArena *a) {
+    RegexRef *r;
+    for (r = a->regexes; r != NULL; r = r->next)
+        regex_free(r->re);
+    a->regexes = NULL;
+    while (a->chunks != NULL) {
+        StrChunk *c = a->chunks;
+        a->chunks = c->next;
+        free(c);
+    }
+}
+
+static void clear_token(Token *t) {
     t->type = TOKEN_NTOKEN;
     t->beginrow = 0;
     t->begincol = 0;
@@ -68,34 +315,38 @@ static void clear_token(Token *t, int freebigstr) {
     t->buflen = TOKEN_BUFMAX;
     t->buf[0] = 0;
     t->bigstr = NULL;
-
-    if (freebigstr && bigstr != NULL)
-        free(bigstr);
+    t->ref = NULL;
+    t->tpl = NULL;
+    t->re = NULL;
 }
 
 static void move_token(Token *src, Token *dest) {
-    clear_token(dest, 1);
+    clear_token(dest);
     memcpy(dest, src, sizeof(Token));
-    clear_token(src, 0);
+    clear_token(src);
 }
 
 static int token_strlen(Token *t) {
     return t->strlen;
 }
 
+// NOTE: a string referenced from the mapped source is not NUL terminated,
+// always use it together with token_strlen()
 static const char *token_str(Token *t) {
+    if (t->ref != NULL)
+        return t->ref;
     if (t->bigstr != NULL)
         return t->bigstr;
     return t->buf;
 }
 
 static void set_token_begin(Source *src, Token *t) {
-    t->begincol = src->col;
+    t->begincol = column(src);
     t->beginrow = src->row;
 }
 
 static void set_token_end(Source *src, Token *t) {
-    t->endcol = src->col;
+    t->endcol = column(src);
     t->endrow = src->row;
 }
 
@@ -103,61 +354,62 @@ static void set_token_type(Token *t, int type) {
     t->type = type;
 }
 
-static int set_token_str(Token *t, const char *str) {
+static int set_token_str(Source *src, Token *t, const char *str) {
     int len = strnlen(str, SRCMAX);
     if (len == SRCMAX) {
         printf("too long string\n");
         return 0;
     }
 
-    if (t->buflen == TOKEN_BUFMAX) {
-        // no bigstr
-        assert(t->bigstr == NULL);
-        if (len <= TOKEN_BUFMAX) {
-            strcpy(t->buf, str);
-            t->strlen = len;
-        } else {
-            char *s = strdup(str);
-            if (s == 0) {
+    t->ref = NULL;
+    if (len <= TOKEN_BUFMAX) {
+        strcpy(t->buf, str);
+        t->bigstr = NULL;
+        t->buflen = TOKEN_BUFMAX;
+    } else {
+        if (len > t->buflen) {
+            char *s = str_alloc(&src->strs, len+1);
+            STATS_ADD(bigstrs);
+            if (s == NULL) {
                 printf("no enough memory\n");
                 return 0;
             }
             t->bigstr = s;
-            t->buf[0] = 0;
             t->buflen = len;
-            t->strlen = len;
-        }
-    } else {
-        // has bigstr
-        assert(t->bigstr != NULL);
-        if (len <= TOKEN_BUFMAX) {
-            strcpy(t->buf, str);
-            t->strlen = len;
-            t->buflen = TOKEN_BUFMAX;
-            free(t->bigstr);
-            t->bigstr = NULL;
-        } else {
-            if (len <= t->buflen) {
-                strcpy(t->bigstr, str);
-                t->strlen = len;
-            } else {
-                char *s = realloc(t->bigstr, len+1);
-                if (s == NULL) {
-                    printf("no enough memory\n");
-                    return 0;
-                }
-                strcpy(s, str);
-                t->bigstr = s;
-                t->buflen = len;
-                t->strlen = len;
-            }
         }
+        strcpy(t->bigstr, str);
+        t->buf[0] = 0;
     }
+    t->strlen = len;
     return 1;
 }
 
-static int append_char_to_token(Token *t, int ch) {
+// make room for 'len' more chars of the token string
+static char *grow_token_str(Source *src, Token *t, int len) {
+    char *newptr;
+    int newlen = t->buflen * 2;
+    while (newlen < t->strlen + len)
+        newlen *= 2;
+    if (t->bigstr == NULL) {
+        newptr = str_alloc(&src->strs, newlen+1);
+        STATS_ADD(bigstrs);
+        if (newptr == NULL)
+            return NULL;
+        memcpy(newptr, t->buf, t->strlen+1);
+        t->buf[0] = 0;
+    } else {
+        newptr = str_grow(&src->strs, t->bigstr, t->buflen+1, newlen+1);
+        if (newptr == NULL)
+            return NULL;
+    }
+    t->buflen = newlen;
+    t->bigstr = newptr;
+    return newptr;
+}
+
+static int append_char_to_token(Source *src, Token *t, int ch) {
     char *ptr = NULL;
+    assert (t->ref == NULL);
     assert (t->strlen <= t->buflen);
     assert ((t->buflen == TOKEN_BUFMAX && t->bigstr == NULL) ||
             (t->buflen > TOKEN_BUFMAX && t->bigstr != NULL));
@@ -168,28 +420,10 @@ static int append_char_to_token(Token *t, int ch) {
         ptr = t->bigstr;
     }
 
-    assert(ptr != NULL);
-
     if (t->strlen == t->buflen) {
-        char *newptr = NULL;
-        if (ptr == t->buf) {
-            newptr = (char*)malloc(TOKEN_BUFMAX*2+1);
-            if (newptr == NULL) {
-                return 0;
-            }
-            strcpy(newptr, ptr);
-            *ptr = (char) 0;
-            t->buflen = TOKEN_BUFMAX*2;
-            t->bigstr = newptr;
-        } else {
-            newptr = realloc(ptr, t->buflen * 2 + 1);
-            if (newptr == NULL) {
-                return 0;
-            }
-            t->buflen *= 2;
-            t->bigstr = newptr;
-        }
-        ptr = newptr;
+        ptr = grow_token_str(src, t, 1);
+        if (ptr == NULL)
+            return 0;
     }
 
     ptr[t->strlen++] = (char)ch;
@@ -198,108 +432,230 @@ static int append_char_to_token(Token *t, int ch) {
     return 1;
 }
 
+static int append_str_to_token(Source *src, Token *t, const char *str, int len) {
+    char *ptr = NULL;
+    assert (t->ref == NULL);
+    assert (t->strlen <= t->buflen);
+    assert ((t->buflen == TOKEN_BUFMAX && t->bigstr == NULL) ||
+            (t->buflen > TOKEN_BUFMAX && t->bigstr != NULL));
+
+    if (t->buflen == TOKEN_BUFMAX) {
+        ptr = t->buf;
+    } else {
+        ptr = t->bigstr;
+    }
+
+    if (t->strlen + len > t->buflen) {
+        ptr = grow_token_str(src, t, len);
+        if (ptr == NULL)
+            return 0;
+    }
+
+    memcpy(ptr + t->strlen, str, len);
+    t->strlen += len;
+    ptr[t->strlen] = (char)0;
+
+    return 1;
+}
+
 //1 --------------------- reserve words manipulation -------------------------
 typedef struct {
     const char *str;
+    int len;
     int type;
 } Reserve;
 
-static Reserve reserves[] = {
-    {"after", TOKEN_KW_AFTER},
-    {"and", TOKEN_KW_AND},
-    {"break", TOKEN_KW_BREAK},
-    {"case", TOKEN_KW_CASE},
-    {"catch", TOKEN_KW_CATCH},
-    {"continue", TOKEN_KW_CONTINUE},
-    {"do", TOKEN_KW_DO},
-    {"else", TOKEN_KW_ELSE},
-    {"elseif", TOKEN_KW_ELSEIF},
-    {"end", TOKEN_KW_END},
-    {"export", TOKEN_KW_EXPORT},
-    {"false", TOKEN_KW_FALSE},
-    {"finally", TOKEN_KW_FINALLY},
-    {"float", TOKEN_KW_FLOAT},
-    {"for", TOKEN_KW_FOR},
-    {"fun", TOKEN_KW_FUN},
-    {"if", TOKEN_KW_IF},
-    {"import", TOKEN_KW_IMPORT},
-    {"in", TOKEN_KW_IN},
-    {"int", TOKEN_KW_INTEGER},
-    {"local", TOKEN_KW_LOCAL},
-    {"lp", TOKEN_KW_LP},
-    {"nil", TOKEN_KW_NIL},
-    {"of", TOKEN_KW_OF},
-    {"or", TOKEN_KW_OR},
-    {"return", TOKEN_KW_RETURN},
-    {"string", TOKEN_KW_STRING},
-    {"then", TOKEN_KW_THEN},
-    {"true", TOKEN_KW_TRUE},
-    {"try", TOKEN_KW_TRY},
-    {"while", TOKEN_KW_WHILE},
-};
+// the perfect hash table 'reserves' is generated by lpkwgen
+#include "lpreserve.h"
 
-static int search_reserve(const char* str) {
-    int begin = 0;
-    int end = sizeof(reserves) / sizeof(reserves[0]) - 1;
-    int m;
-    int res;
-    while (begin <= end) {
-        m = (begin + end) / 2;
-        res = strcmp(reserves[m].str, str);
-        if (res == 0) {
-            return reserves[m].type;
-        } else if (res > 0) {
-            end = m - 1;
-        } else {
-            begin = m + 1;
-        }
-    }
+// classify an identifier(or a name of a qualified identifier) of 'len' chars
+static int search_reserve(const char* str, int len) {
+    const Reserve *r;
+    if (len < RESERVE_MINLEN || len > RESERVE_MAXLEN)
+        return TOKEN_IDENTIFIER;
+
+    r = &reserves[RESERVE_SLOT(str[0], str[len-1], len)];
+    if (r->len == len && memcmp(r->str, str, len) == 0)
+        return r->type;
     return TOKEN_IDENTIFIER;
 }
 
-// check whether the collected identifier is a reserved word
-static int check_reserve(Token *t) {
-    const char *str = token_str(t);
-    int type;
 
-    assert(t->type == TOKEN_IDENTIFIER);
+//1 -------------- program source manipulation --------------
+// the ring starts with the tokens in Source, and only grows for a deeper
+// peek. a token never moves once it's in the ring, only the ring of the
+// pointers is rebuilt.
+static void init_ring(Source *src) {
+    int k;
+    for (k = 0; k < RING_MIN; k++) {
+        src->ringinit[k] = &src->tokens[k];
+        clear_token(&src->tokens[k]);
+    }
+    src->ring = src->ringinit;
+    src->ringmask = RING_MIN - 1;
+    src->head = 0;
+    src->tail = 1; // the current token before the first one is NTOKEN
+}
 
-    if (t->i == 1) {
-        type = search_reserve(str);
-        set_token_type(t, type);
-    } else {
-        int i;
-        const char *ptr = str;
-        for (i=0; i < t->i; i++) {
-            int len = strlen(ptr);
-            type = search_reserve(ptr);
-            if (type != TOKEN_IDENTIFIER) {
-                set_token_type(t, TOKEN_ERROR);
-                set_token_str(t, "reserve word can't be used as identifier");
-                return 0;
-            }
-            ptr += len+1;
+// make the ring hold at least 'n' tokens from the current one
+static int grow_ring(Source *src, unsigned n) {
+    unsigned size = src->ringmask + 1;
+    unsigned newsize = size;
+    unsigned k;
+    Token **ring;
+
+    if (n <= size)
+        return 1;
+    while (newsize < n)
+        newsize *= 2;
+    ring = (Token**)malloc(newsize * sizeof(Token*));
+    if (ring == NULL)
+        return 0;
+    for (k = size; k < newsize; k++) {
+        ring[k] = (Token*)malloc(sizeof(Token));
+        if (ring[k] == NULL) {
+            while (k-- > size)
+                free(ring[k]);
+            free(ring);
+            return 0;
         }
+        clear_token(ring[k]);
     }
+    for (k = 0; k < size; k++)
+        ring[k] = ring_token(src, src->head + k);
+    src->tail -= src->head;
+    src->head = 0;
+    if (src->ring != src->ringinit)
+        free(src->ring);
+    src->ring = ring;
+    src->ringmask = newsize - 1;
     return 1;
 }
 
+static void free_ring(Source *src) {
+    unsigned k;
+    if (src->ring == src->ringinit)
+        return;
+    for (k = 0; k <= src->ringmask; k++) {
+        if (src->ring[k] < src->tokens || src->ring[k] >= src->tokens + RING_MIN)
+            free(src->ring[k]);
+    }
+    free(src->ring);
+    src->ring = src->ringinit;
+}
+
+static Source *new_source(char *srcname, const char *text, long len,
+                          char *map, long maplen) {
+    Source *src = (Source *)malloc(sizeof(Source));
+    if (src == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+
+    src->row = 1;
+    src->curr = NCH;
+    src->ptr = text;
+    src->line = text;
+    src->text = text;
+    src->len = len;
+    src->size = len;
+    src->open = 0;
+    src->stream = 0;
+    src->srcname = srcname;
+    src->map = map;
+    src->maplen = maplen;
+    src->lines = NULL;
+    src->linecount = 0;
+    src->linesize = 0;
+    src->strs.chunks = NULL;
+    src->strs.regexes = NULL;
+    init_ring(src);
+
+#ifdef LPLEX_STATS
+    memset(&src->stats, 0, sizeof(LexStats));
+    src->stats.reads = read_calls;
+    read_calls = 0;
+#endif
+    return src;
+}
 
-//1 -------------- program source manipulation --------------
 //2 --------------- file source -----------------------------
-static int file_reader(void *data, char* buf, int len) {
-    int fd = (int)(long)data;
-    ssize_t size = read(fd, buf, len);
-    return (int)size;
+// map the whole regular file into memory, so the scanner can index the
+// source directly instead of copying it through 'read'. the file is
+// mapped at the beginning of a private anonymous region, which provides
+// writable room for the EOS sentinels even if the file size is a multiple
+// of the page size. return NULL if the file can't be mapped(pipe, tty,
+// empty file...), then the caller should fall back to read_file.
+static char *map_file(int fd, long *len, long *maplen) {
+    struct stat st;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long size;
+    char *region;
+    char *map;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+
+    size = (long)st.st_size;
+    *maplen = (size + SENTINEL + pagesize - 1) / pagesize * pagesize;
+    region = (char*)mmap(NULL, *maplen, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+
+    map = (char*)mmap(region, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        munmap(region, *maplen);
+        return NULL;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    memset(map + size, EOS, SENTINEL);
+    *len = size;
+    return map;
 }
-static void file_closer(void *data) {
-    int fd = (int)(long)data;
-    close(fd);
+
+// read the whole file which can't be mapped into memory
+static char *read_file(int fd, long *len) {
+    long size = 0;
+    long bufsize = BUFLEN;
+    char *text = (char*)malloc(bufsize + SENTINEL);
+    ssize_t n;
+
+    if (text == NULL)
+        return NULL;
+
+    while ((n = read(fd, text + size, bufsize - size)) > 0) {
+        STATS_READ();
+        size += n;
+        if (size == bufsize) {
+            char *newtext = (char*)realloc(text, bufsize * 2 + SENTINEL);
+            if (newtext == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = newtext;
+            bufsize *= 2;
+        }
+    }
+    if (n < 0) {
+        free(text);
+        return NULL;
+    }
+
+    memset(text + size, EOS, SENTINEL);
+    *len = size;
+    return text;
 }
 
 void *file_source(const char *filepath) {
     Source *src;
     char *mypath;
+    char *text;
+    char *map;
+    long len = 0;
+    long maplen = 0;
     int fd;
 
     if (filepath == NULL || strnlen(filepath, PATHMAX) == 0) {
@@ -320,74 +676,42 @@ void *file_source(const char *filepath) {
         printf("can't open source file %s to read\n", filepath);
         return NULL;
     }
-    
-    src = (Source *)malloc(sizeof(Source));
-    if (src == NULL) {
-        free(mypath);
-        close(fd);
-        printf("no enough memory\n");
-        return NULL;
-    }
 
-    src->row = 1;
-    src->col = 0;
-    src->curr = NCH;
-    src->next1 = NCH;
-    src->next2 = NCH;
-    src->next3 = NCH;
-    src->srcname = mypath;
-    mypath = NULL;
-    src->len = 0;
-    src->ptr = 0;
-    src->read = file_reader;
-    src->close = file_closer;
-    src->data = (void*)(long)fd;
-
-    clear_token(&src->curr_token, 0);
-    clear_token(&src->next_token1, 0);
-    clear_token(&src->next_token2, 0);
-    clear_token(&src->next_token3, 0);
-
-    return src;
-}
-
-//2 --------------- string source -----------------------------
-typedef struct {
-    int ptr;
-    int len;
-    const char *str;
-} StringSource;
-
-static int string_reader(void *data, char* buf, int len) {
-    StringSource *ss = (StringSource*)data;
-    int left = ss->len - ss->ptr;
-    int tocpy;
-    if (left <= 0) {
-        tocpy = 0;
-    } else if (left <= len) {
-        tocpy = left;
+    map = map_file(fd, &len, &maplen);
+    if (map != NULL) {
+        text = map;
     } else {
-        tocpy = len;
+        text = read_file(fd, &len);
     }
+    // the mapping(or the buffer) keeps the file content, fd is not needed
+    close(fd);
 
-    if (tocpy > 0) {
-        memcpy(buf, &ss->str[ss->ptr], tocpy);
-        ss->ptr += tocpy;
+    if (text == NULL) {
+        free(mypath);
+        printf("can't read source file %s\n", filepath);
+        return NULL;
     }
 
-    return tocpy;
-}
+    src = new_source(mypath, text, len, map, maplen);
+    if (src == NULL) {
+        free(mypath);
+        if (map != NULL)
+            munmap(map, maplen);
+        else
+            free(text);
+        return NULL;
+    }
 
-static void string_closer(void *data) {
-    free(data);
+    return src;
 }
 
+//2 --------------- string source -----------------------------
 void *string_source(const char *str) {
     Source *src;
-    StringSource *ss;
+    char *text;
     int len;
 
-    if (src == NULL) {
+    if (str == NULL) {
         printf("invalid string\n");
         return NULL;
     }
@@ -398,44 +722,156 @@ void *string_source(const char *str) {
         return NULL;
     }
 
-    src = (Source*)malloc(sizeof(Source));
-    if (src == NULL) {
+    text = (char*)malloc(len + SENTINEL);
+    if (text == NULL) {
         printf("no enough memory\n");
         return NULL;
     }
+    memcpy(text, str, len);
+    memset(text + len, EOS, SENTINEL);
 
-    ss = (StringSource*)malloc(sizeof(StringSource));
-    if (ss == NULL) {
-        free(src);
-        printf("no enough memory\n");
+    src = new_source(NULL, text, len, NULL, 0);
+    if (src == NULL) {
+        free(text);
         return NULL;
     }
-    ss->ptr = 0;
-    ss->len = len;
-    ss->str = str;
 
-    src->row = 1;
-    src->col = 0;
-    src->curr = NCH;
-    src->next1 = NCH;
-    src->next2 = NCH;
-    src->next3 = NCH;
-    src->srcname = "<string>";
-    src->len = 0;
-    src->ptr = 0;
-    src->read = string_reader;
-    src->close = string_closer;
-    src->data = (void*)ss;
-
-    clear_token (&src->curr_token, 0);
-    clear_token (&src->next_token1, 0);
-    clear_token (&src->next_token2, 0);
-    clear_token (&src->next_token3, 0);
+    return src;
+}
 
+//2 --------------- stream source -----------------------------
+// the text of a stream source arrives piece by piece, from a pipe, a
+// socket or a REPL. next_token returns TOKEN_MORE when the text fed so far
+// can't decide the next token(see consume_open), then it can be called
+// again after more text is fed. the text before the current row and the
+// tokens held by the source is dropped when the buffer is full, so a long
+// stream doesn't take more memory than its longest row.
+void *stream_source(const char *name) {
+    Source *src;
+    char *myname = NULL;
+    char *text;
+
+    if (name != NULL && (myname = strdup(name)) == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    text = (char*)malloc(BUFLEN + SENTINEL);
+    if (text == NULL) {
+        printf("no enough memory\n");
+        free(myname);
+        return NULL;
+    }
+    memset(text, EOS, SENTINEL);
 
+    src = new_source(myname, text, 0, NULL, 0);
+    if (src == NULL) {
+        free(myname);
+        free(text);
+        return NULL;
+    }
+    src->size = BUFLEN;
+    src->open = 1;
+    src->stream = 1;
     return src;
 }
 
+#define rebase(p, text, drop) ((p) = (text) + ((p) - src->text) - (drop))
+
+// make room for 'n' more chars in the stream source
+static int stream_room(Source *src, long n) {
+    const char *keep = src->line;
+    char *text = (char*)src->text;
+    long size = src->size;
+    long drop;
+    unsigned k;
+
+    if (src->len + n <= src->size)
+        return 1;
+
+    for (k = src->head; k != src->tail; k++) {
+        Token *t = ring_token(src, k);
+        if (t->ref != NULL && t->ref < keep)
+            keep = t->ref;
+    }
+    drop = keep - src->text;
+    while (src->len - drop + n > size)
+        size *= 2;
+    if (size > src->size) {
+        text = (char*)realloc(text, size + SENTINEL);
+        if (text == NULL)
+            return 0;
+    }
+    memmove(text, text + drop, src->len - drop);
+
+    rebase(src->ptr, text, drop);
+    rebase(src->line, text, drop);
+    for (k = src->head; k != src->tail; k++) {
+        Token *t = ring_token(src, k);
+        if (t->ref != NULL)
+            rebase(t->ref, text, drop);
+    }
+    src->text = text;
+    src->len -= drop;
+    src->size = size;
+    memset(text + src->len, EOS, SENTINEL);
+    return 1;
+}
+
+int feed_source(void *data, const char *str, long len) {
+    Source *src = (Source*)data;
+    assert(src->open);
+    if (!stream_room(src, len)) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    memcpy((char*)src->text + src->len, str, len);
+    src->len += len;
+    memset((char*)src->text + src->len, EOS, SENTINEL);
+    return 1;
+}
+
+long read_source(void *data, int fd) {
+    Source *src = (Source*)data;
+    long total = 0;
+    ssize_t n;
+
+    assert(src->open);
+    while (1) {
+        long room;
+        if (!stream_room(src, BUFLEN)) {
+            printf("no enough memory\n");
+            end_source(src);
+            return -1;
+        }
+        room = src->size - src->len;
+        n = read(fd, (char*)src->text + src->len, room);
+        if (n > 0) {
+            STATS_READ();
+            src->len += n;
+            total += n;
+            memset((char*)src->text + src->len, EOS, SENTINEL);
+            // a short read means nothing more for now, don't block on
+            // a blocking fd
+            if (n < room)
+                return total;
+        } else if (n == 0) {
+            end_source(src);
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return total;
+        } else {
+            end_source(src);
+            return -1;
+        }
+    }
+}
+
+void end_source(void *data) {
+    Source *src = (Source*)data;
+    src->open = 0;
+}
 
 //2 --------------- close source -----------------------------
 void close_source(void *data) {
@@ -445,114 +881,109 @@ void close_source(void *data) {
         src->srcname = NULL;
     }
 
-    if (src->close != NULL) {
-        src->close(src->data);
+    if (src->map != NULL) {
+        munmap(src->map, src->maplen);
+        src->map = NULL;
+    } else {
+        free((char*)src->text);
     }
+    src->text = NULL;
+
+    free(src->lines);
+    src->lines = NULL;
+
+    free_ring(src);
+    free_str_arena(&src->strs);
 
     free(src);
 }
 
 //2 --------------- scan source -----------------------------
-static void refill(Source *src) {
-    int len;
-    src->ptr = 0;
-    len = src->read(src->data, src->buf, BUFLEN);
-    if (len <= 0) {
-        src->len = 0;
-        src->buf[src->len++] = EOS;
-        return;
-    } else {
-        src->len = len;
-    }
-}
-
 static int curr(Source *src) {
-//    if (src->curr == NCH) {
-//        return next(src);
-//    }
     return src->curr;
 }
 
 static int next(Source *src) {
-    // if already at the end, no need to get next
-    if (src->curr == EOS)
-        return EOS;
-
-    if (src->next1 != NCH) {
-        src->curr = src->next1;
-        src->next1 = src->next2;
-        src->next2 = src->next3;
-        src->next3 = NCH;
-    } else {
-        assert(src->next1 == NCH);
-        assert(src->next2 == NCH);
-        assert(src->next3 == NCH);
-        if (src->ptr >= src->len) {
-            refill(src);
-        }
-        assert(src->ptr < src->len);
-        src->curr = src->buf[src->ptr++];
-    }
-    src->col ++;
-    return src->curr;
+    int ch = *src->ptr;
+    // EOS is never passed over
+    if (ch != EOS)
+        src->ptr++;
+    src->curr = ch;
+    return ch;
 }
 
+// a EOS char in the middle of the text(invalid byte 0xff) ends the
+// source as well, so don't look beyond it.
 static int peek1(Source *src) {
-    // if already at the end, no need to try to get next
-    if (src->curr == EOS)
-        return EOS;
-
-    if (src->next1 != NCH) {
-        return src->next1;
-    } else {
-        assert(src->next2 == NCH && src->next3 == NCH);
-        if (src->ptr >= src->len) {
-            refill(src);
-        }
-        assert(src->ptr < src->len);
-        src->next1 = src->buf[src->ptr++];
-        return src->next1;
-    }
+    return src->ptr[0];
 }
 
 static int peek2(Source *src) {
-    // if already at the end, no need to try to get next
-    if (src->curr == EOS || src->next1 == EOS)
+    if (src->ptr[0] == EOS)
         return EOS;
+    return src->ptr[1];
+}
 
-    assert(src->next1 != NCH);
-    if (src->next2 != NCH) {
-        return src->next2;
-    } else {
-        assert(src->next3 == NCH);
-        if (src->ptr >= src->len) {
-            refill(src);
+static int peek3(Source *src) {
+    if (src->ptr[0] == EOS || src->ptr[1] == EOS)
+        return EOS;
+    return src->ptr[2];
+}
+
+// record the beginning of a new row for lex_all
+static void add_line(Source *src, const char *line) {
+    if (src->linecount == src->linesize) {
+        unsigned *lines = (unsigned*)realloc(src->lines, src->linesize * 2 * sizeof(unsigned));
+        if (lines == NULL) {
+            printf("no enough memory\n");
+            free(src->lines);
+            src->lines = NULL;
+            src->linesize = -1;
+            return;
         }
-        assert(src->ptr < src->len);
-        src->next2 = src->buf[src->ptr++];
-        return src->next2;
+        src->lines = lines;
+        src->linesize *= 2;
     }
+    src->lines[src->linecount++] = (unsigned)(line - src->text);
 }
 
-static int peek3(Source *src) {
-    // if already at the end, no need to try to get next
-    if (src->curr == EOS || src->next1 == EOS | src->next2 == EOS)
-        return EOS;
+// start a new row, 'ptr' is the first char of it
+static void new_line(Source *src) {
+    src->row ++;
+    src->line = src->ptr;
+    if (src->lines != NULL)
+        add_line(src, src->line);
+}
 
-    assert(src->next1 != NCH);
-    assert(src->next2 != NCH);
-    if (src->next3 != NCH) {
-        return src->next3;
-    } else {
-        if (src->ptr >= src->len) {
-            refill(src);
+// count the rows of the consumed text [begin, end)
+static void count_lines(Source *src, const char *begin, const char *end) {
+    const char *last;
+    int n;
+
+    if (src->lines != NULL) {
+        // each row needs to be recorded
+        while ((begin = memchr(begin, '\n', end - begin)) != NULL) {
+            src->row ++;
+            src->line = ++begin;
+            add_line(src, src->line);
         }
-        assert(src->ptr < src->len);
-        src->next3 = src->buf[src->ptr++];
-        return src->next3;
+        return;
+    }
+
+    n = scan_lines(begin, end, &last);
+    if (n > 0) {
+        src->row += n;
+        src->line = last + 1;
     }
 }
 
+static void skip_blanks(Source *src) {
+    const char *p = src->ptr;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    src->ptr = p;
+    src->curr = p[-1];
+}
 
 // --------------- consume various tokens  -----------
 // all these verious consume_xxx functions will consume
@@ -573,31 +1004,333 @@ static int peek3(Source *src) {
 #define is_id_first_char(ch) (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || (ch) == '_')
 
 
-static int error_token(Token *t, const char *msg) {
+static int error_token(Source *src, Token *t, const char *msg) {
     t->type = TOKEN_ERROR;
-    set_token_str(t, msg);
+    set_token_str(src, t, msg);
     return 0;
 }
 
-static int consume_newline(Source *src) {
-    int curr = next(src);
-    int n;
-    assert(is_newline_char(curr));
-
-    n = peek1(src);
-
-    if (is_newline_char(n)) {
-        if (curr != n) {
-            next(src);
-        }
+// "..." and """...""" strings interpolate "$name", "${expr}" and
+// "${expr: fmt}", and "$$" is a '$'. such a string is compiled into a
+// template when it's lexed: the literal text with the holes cut out, and
+// a descriptor of each hole with its format, so it's never scanned again
+// when it's rendered. a '$' followed by none of them is just a '$'.
+// parse the format spec "[flags][width][.precision][conversion]" of the
+// hole into the printf formats. return 0 if it's invalid.
+static int parse_hole_fmt(StrHole *h, const char *fmt, int len) {
+    const char *end = fmt + len;
+    char spec[16];
+    char *p = spec;
+    int width = 0;
+    int precision = -1;
+    int conv = 0;
+
+    *p++ = '%';
+    while (fmt < end && strchr("-+0 ", *fmt) != NULL) {
+        if (p - spec > 4)
+            return 0;
+        *p++ = *fmt++;
+    }
+    while (fmt < end && is_dec_char(*fmt) && width <= TEMPLATE_MAXFMT)
+        width = width * 10 + *fmt++ - '0';
+    if (fmt < end && *fmt == '.') {
+        fmt++;
+        precision = 0;
+        while (fmt < end && is_dec_char(*fmt) && precision <= TEMPLATE_MAXFMT)
+            precision = precision * 10 + *fmt++ - '0';
+    }
+    if (width > TEMPLATE_MAXFMT || precision > TEMPLATE_MAXFMT)
+        return 0;
+    if (fmt < end) {
+        if (fmt + 1 != end || strchr("dxXofeEgGs", *fmt) == NULL)
+            return 0;
+        conv = *fmt;
     }
+    if (width > 0)
+        p += sprintf(p, "%d", width);
+    if (precision >= 0)
+        p += sprintf(p, ".%d", precision);
+    *p = 0;
+
+    h->conv = conv;
+    h->width = width;
+    h->precision = precision;
+    h->left = strchr(spec, '-') != NULL;
+    // a number is converted if the conversion is for the other type
+    sprintf(h->ifmt, "%sl%c", spec, conv != 0 && strchr("dxXo", conv) != NULL ? conv : 'd');
+    sprintf(h->ffmt, "%s%c", spec, conv != 0 && strchr("feEgG", conv) != NULL ? conv : 'g');
+    return 1;
+}
 
-    src->row ++;
-    src->col = 0;
+// scan the holes of the string. with 'fill', the template is filled,
+// otherwise only its size is counted into 't'. return NULL if ok, or the
+// error message.
+static const char *scan_template(const char *str, int len, StrTemplate *t, int fill) {
+    const char *end = str + len;
+    const char *p = str;
+    char *lit = fill ? t->text : NULL;
+    char *exprs = fill ? t->text + t->litlen + 1 : NULL;
+    unsigned litlen = 0;
+    unsigned exprlen = 0;
+    int holes = 0;
+
+    while (p < end) {
+        const char *dollar = memchr(p, '$', end - p);
+        const char *b, *e, *colon;
+        StrHole *h;
+        int kind;
+        int depth;
+
+        if (dollar == NULL)
+            dollar = end;
+        if (fill)
+            memcpy(lit + litlen, p, dollar - p);
+        litlen += dollar - p;
+        p = dollar;
+        if (p == end)
+            break;
+
+        if (p + 1 == end || (p[1] != '$' && p[1] != '{' && !is_id_first_char(p[1]))) {
+            // a '$' by itself
+            if (fill)
+                lit[litlen] = '$';
+            litlen++;
+            p++;
+            continue;
+        }
+        if (p[1] == '$') {
+            if (fill)
+                lit[litlen] = '$';
+            litlen++;
+            p += 2;
+            continue;
+        }
+
+        h = fill ? &t->holes[holes] : NULL;
+        colon = NULL;
+        if (p[1] != '{') {
+            // $name
+            kind = HOLE_NAME;
+            b = p + 1;
+            for (e = b; e < end && is_id_char(*e); e++)
+                ;
+            p = e;
+        } else {
+            // ${expr} or ${expr: fmt}, the format follows the last ':'
+            // out of any inner braces
+            kind = HOLE_EXPR;
+            b = p + 2;
+            depth = 1;
+            for (e = b; e < end; e++) {
+                if (*e == '{') {
+                    depth++;
+                } else if (*e == '}' && --depth == 0) {
+                    break;
+                } else if (*e == ':' && depth == 1) {
+                    colon = e;
+                }
+            }
+            if (e == end)
+                return "no close '}' in string";
+            p = e + 1;
+            if (colon != NULL)
+                e = colon;
+            while (b < e && (*b == ' ' || *b == '\t'))
+                b++;
+            while (e > b && (e[-1] == ' ' || e[-1] == '\t'))
+                e--;
+            if (b == e)
+                return "empty ${} in string";
+        }
+
+        if (fill) {
+            h->kind = kind;
+            h->pos = litlen;
+            h->expr = t->litlen + 1 + exprlen;
+            h->exprlen = (unsigned)(e - b);
+            memcpy(exprs + exprlen, b, e - b);
+            exprs[exprlen + (e - b)] = 0;
+            parse_hole_fmt(h, "", 0);
+        }
+        if (colon != NULL) {
+            const char *f = colon + 1;
+            const char *fe = p - 1;
+            StrHole tmp;
+            while (f < fe && (*f == ' ' || *f == '\t'))
+                f++;
+            while (fe > f && (fe[-1] == ' ' || fe[-1] == '\t'))
+                fe--;
+            if (!parse_hole_fmt(fill ? h : &tmp, f, (int)(fe - f)))
+                return "invalid format in string";
+        }
+        exprlen += (unsigned)(e - b) + 1;
+        holes++;
+    }
+
+    if (fill) {
+        lit[litlen] = 0;
+    } else {
+        t->litlen = litlen;
+        t->holecount = holes;
+        t->textlen = litlen + 1 + exprlen;
+    }
+    return NULL;
+}
+
+static long template_size(StrTemplate *t) {
+    return ALIGN8(sizeof(StrTemplate) + t->holecount * sizeof(StrHole)) + t->textlen;
+}
+
+static void init_template(StrTemplate *t, StrTemplate *size) {
+    *t = *size;
+    t->text = (char*)t + ALIGN8(sizeof(StrTemplate) + t->holecount * sizeof(StrHole));
+}
+
+// compile the string of the token into a template in the string arena,
+// if it has any '$'
+static int set_token_template(Source *src, Token *t) {
+    const char *str = token_str(t);
+    int len = token_strlen(t);
+    StrTemplate size;
+    StrTemplate *tpl;
+    const char *err;
+
+    if (memchr(str, '$', len) == NULL)
+        return 1;
+    err = scan_template(str, len, &size, 0);
+    if (err != NULL)
+        return error_token(src, t, err);
+    tpl = (StrTemplate*)str_alloc(&src->strs, template_size(&size));
+    if (tpl == NULL) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    init_template(tpl, &size);
+    scan_template(str, len, tpl, 1);
+    t->tpl = tpl;
+    return 1;
+}
+
+// compile the regex literal, which is then matched without parsing it
+// again. r"..." with holes is not a constant, it's compiled when the
+// holes are filled.
+static int set_token_regex(Source *src, Token *t) {
+    RegexRef *r;
+    const char *err;
+    char msg[64];
+
+    if (t->tpl != NULL)
+        return 1;
+    r = (RegexRef*)str_alloc(&src->strs, sizeof(RegexRef));
+    if (r == NULL) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    r->re = regex_compile(token_str(t), token_strlen(t), &err);
+    if (r->re == NULL) {
+        if (err == NULL)
+            return 0;
+        snprintf(msg, sizeof(msg), "invalid regex: %s", err);
+        return error_token(src, t, msg);
+    }
+    r->next = src->strs.regexes;
+    src->strs.regexes = r;
+    t->re = r->re;
+    return 1;
+}
+
+static int consume_newline(Source *src) {
+    int curr = next(src);
+    int n;
+    assert(is_newline_char(curr));
+
+    n = peek1(src);
+
+    if (is_newline_char(n)) {
+        if (curr != n) {
+            next(src);
+        }
+    }
+
+    new_line(src);
 
     return 0;
 }
 
+// take the string body verbatim from the source text instead of copying
+// it into the token. it's only possible when the body needs no
+// translation: no escape and no '\r'. the position is kept the same as
+// consuming it char by char.
+// return 1 if the string(including the close quote(s)) is consumed,
+//        0 if nothing is consumed, the caller should gather the string.
+static int ref_str(Source *src, Token *dest, int quote, int multiline) {
+    const char *begin = src->ptr;
+    const char *p = begin;
+
+    if (dest == NULL)
+        return 0;
+
+    if (multiline) {
+        while (1) {
+            p = scan_until(p, quote, '\r', quote, quote);
+            if (*p != quote)
+                return 0;
+            if (p[1] == quote && p[2] == quote)
+                break;
+            p++;
+        }
+    } else {
+        p = scan_until(p, quote, '\\', '\n', '\r');
+        if (*p != quote)
+            return 0;
+    }
+
+    dest->ref = begin;
+    dest->strlen = (int)(p - begin);
+    if (multiline)
+        count_lines(src, begin, p);
+    src->ptr = multiline ? p + 3 : p + 1;
+    src->curr = quote;
+    return 1;
+}
+
+// consume a run of ordinary chars in a single line string, till c0, c1,
+// a newline or EOS. the run is gathered if the token is provided.
+static void consume_run(Source *src, Token *dest, int c0, int c1) {
+    const char *begin = src->ptr;
+    const char *end = scan_until(begin, c0, c1, '\n', '\r');
+
+    assert(end > begin);
+    if (dest != NULL)
+        append_str_to_token(src, dest, begin, end - begin);
+    src->ptr = end;
+    src->curr = end[-1];
+}
+
+// consume a run of ordinary chars in a multi-line string or comment, till
+// the quote, '\r' or EOS. the '\n's in the run are counted here instead of
+// by consume_newline(). the run is gathered if the token is provided.
+static void consume_lines(Source *src, Token *dest, int quote) {
+    const char *begin = src->ptr;
+    const char *end = scan_until(begin, quote, '\r', quote, quote);
+
+    assert(end > begin);
+    if (dest != NULL)
+        append_str_to_token(src, dest, begin, end - begin);
+    src->ptr = end;
+    src->curr = end[-1];
+    count_lines(src, begin, end);
+
+    // "\n\r" is one newline as well
+    if (*end == '\r' && end[-1] == '\n') {
+        src->ptr++;
+        src->curr = '\r';
+        src->line = src->ptr;
+        if (src->lines != NULL)
+            src->lines[src->linecount-1] = (unsigned)(src->line - src->text);
+    }
+}
+
 // consume string functions. if the token is provided, the string content
 // will be gathered. the string begin char(s)(' or " or ''' or """) are
 // already consumed.
@@ -611,21 +1344,24 @@ static int consume_str_till_eol(Source *src, Token *dest) {
                 next(src);
                 return 1;
             case '\n': case '\r':
-                consume_newline(src);
+                // the newline after a comment is left to end the line,
+                // so a ';' is added there as if there's no comment
+                if (dest != NULL)
+                    consume_newline(src);
                 return 1;
             case '\\':
                 next(src);
                 if (is_newline_char(peek1(src))) {
-                    consume_newline(src);
+                    (void)TIMED(src, STAT_NEWLINE, consume_newline(src));
                     curr = '\n';
                 }
                 break;
             default:
-                next(src);
-                break;
+                consume_run(src, dest, '\\', '\\');
+                continue;
         }
         if (dest != NULL) {
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         }
     }
     return 0;
@@ -633,12 +1369,16 @@ static int consume_str_till_eol(Source *src, Token *dest) {
 // consume the string started by '
 static int consume_str_till_single(Source *src, Token *dest) {
     int curr;
+
+    if (ref_str(src, dest, '\'', 0))
+        return 1;
+
     while (1) {
         curr = peek1(src);
         switch (curr) {
             case EOS: case '\n': case '\r':
                 if (dest != NULL) {
-                    return error_token(dest, "no close \"'\"");
+                    return error_token(src, dest, "no close \"'\"");
                 } else {
                     return 0;
                 }
@@ -658,11 +1398,11 @@ static int consume_str_till_single(Source *src, Token *dest) {
                 }
                 break;
             default:
-                next(src);
-                break;
+                consume_run(src, dest, '\'', '\\');
+                continue;
         }
         if (dest != NULL) {
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         }
     }
 
@@ -671,12 +1411,16 @@ static int consume_str_till_single(Source *src, Token *dest) {
 // consume the string started by "
 static int consume_str_till_double(Source *src, Token *dest) {
     int curr;
+
+    if (ref_str(src, dest, '"', 0))
+        return 1;
+
     while (1) {
         curr = peek1(src);
         switch (curr) {
             case EOS: case '\n': case '\r':
                 if (dest != NULL) {
-                    return error_token(dest, "no close '\"'");
+                    return error_token(src, dest, "no close '\"'");
                 } else {
                     return 0;
                 }
@@ -701,11 +1445,11 @@ static int consume_str_till_double(Source *src, Token *dest) {
                 }
                 break;
             default:
-                next(src);
-                break;
+                consume_run(src, dest, '"', '\\');
+                continue;
         }
         if (dest != NULL) {
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         }
     }
 
@@ -715,12 +1459,16 @@ static int consume_str_till_double(Source *src, Token *dest) {
 // consume the multi-line string started by '''
 static int consume_str_till_singlem(Source *src, Token *dest) {
     int curr;
+
+    if (ref_str(src, dest, '\'', 1))
+        return 1;
+
     while (1) {
         curr = peek1(src);
         switch (curr) {
             case EOS:
                 if (dest != NULL) {
-                    return error_token(dest, "no close \"'''\"");
+                    return error_token(src, dest, "no close \"'''\"");
                 } else {
                     return 0;
                 }
@@ -736,11 +1484,11 @@ static int consume_str_till_singlem(Source *src, Token *dest) {
                 curr = '\n';
                 break;
             default:
-                next(src);
-                break;
+                consume_lines(src, dest, '\'');
+                continue;
         }
         if (dest != NULL) {
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         }
     }
 
@@ -750,12 +1498,16 @@ static int consume_str_till_singlem(Source *src, Token *dest) {
 // consume the multi-line string started by """
 static int consume_str_till_doublem(Source *src, Token *dest) {
     int curr;
+
+    if (ref_str(src, dest, '"', 1))
+        return 1;
+
     while (1) {
         curr = peek1(src);
         switch (curr) {
             case EOS:
                 if (dest != NULL) {
-                    return error_token(dest, "no close '\"\"\"'");
+                    return error_token(src, dest, "no close '\"\"\"'");
                 } else {
                     return 0;
                 }
@@ -771,11 +1523,11 @@ static int consume_str_till_doublem(Source *src, Token *dest) {
                 curr = '\n';
                 break;
             default:
-                next(src);
-                break;
+                consume_lines(src, dest, '"');
+                continue;
         }
         if (dest != NULL) {
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         }
     }
 
@@ -791,6 +1543,7 @@ static int consume_string(Source *src, Token *dest) {
     set_token_begin(src, dest);
     switch (curr) {
         case '\'':
+            dest->i = STRTYPE_SINGLE;
             if (peek1(src) == '\'' && peek2(src) == '\'') {
                 next(src); next(src);
                 result = consume_str_till_singlem(src, dest);
@@ -801,14 +1554,16 @@ static int consume_string(Source *src, Token *dest) {
             set_token_end(src, dest);
             return result;
         case '"':
+            dest->i = STRTYPE_DOUBLE;
             if (peek1(src) == '"' && peek2(src) == '"') {
                 next(src); next(src);
                 result = consume_str_till_doublem(src, dest);
-                set_token_end(src, dest);
-                return result;
+            } else {
+                result = consume_str_till_double(src, dest);
             }
-            result = consume_str_till_double(src, dest);
             set_token_end(src, dest);
+            if (result == 1)
+                result = set_token_template(src, dest);
             return result;
         default:
             set_token_type(dest, TOKEN_ERROR);
@@ -855,155 +1610,186 @@ static int consume_section(Source *src, Token *dest) {
         default:
             next(src);
             set_token_end(src, dest);
-            return error_token(dest, "invalid section specification");
+            return error_token(src, dest, "invalid section specification");
     }
 
     return 0;
 }
 
-static int str2int(Token *dest, int base) {
-    long l;
-    const char *beginptr = token_str(dest);
-    char *endptr;
-    if (token_strlen(dest) == 0) {
-        return error_token(dest, "malformed number");
-    }
-    errno = 0;
-    l = strtol(beginptr, &endptr, base);
-
-    if ((errno != 0) || *endptr != '\0') {
-        return error_token(dest, "invalid number format");
-    }
-
-    dest->i = l;
-    return 1;
-}
+// numbers are converted while they are scanned, the digits are not
+// gathered into the token. the literal text is referenced from the
+// source instead(token_str), in case it's wanted.
+static const double exact_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MAX_EXACT_POW10 22
+#define MAX_EXACT_INT   (1UL << 53) // integers exactly representable by double
+#define MAX_DIGITS      19          // significant digits kept in an unsigned long
+#define MAX_EXPONENT    100000      // larger exponents are just kept as this
 
-static int str2float(Token *dest) {
+// convert the float literal [begin, end) the slow but correctly rounded way
+static int str2float(Source *src, Token *dest, const char *begin, const char *end) {
     double l;
-    const char *beginptr = token_str(dest);
     char *endptr;
-    if (token_strlen(dest) == 0) {
-        return error_token(dest, "malformed number");
-    }
-    errno = 0;
-    l = strtod(beginptr, &endptr);
 
-    if ((errno != 0) || *endptr != '\0') {
-        return error_token(dest, "invalid number format");
+    errno = 0;
+    l = strtod(begin, &endptr);
+    if ((errno != 0) || endptr != end) {
+        return error_token(src, dest, "invalid number format");
     }
 
     dest->f = l;
     return 1;
 }
 
-static int gather_hex_int(Source *src, Token *dest) {
+// hexadecimal, octal and binary integer, 'shift' bits per digit
+static int gather_int(Source *src, Token *dest, const char *begin, int shift) {
+    unsigned long v = 0;
+    int overflow = 0;
+    int n = 0;
     int curr;
-    while (1) {
-        curr = peek1(src);
-        if (is_hex_char(curr)) {
-            next(src);
-            append_char_to_token(dest, curr);
-        } else if (is_id_char(curr)) {
-            next(src);
-            return error_token(dest, "malformed number");
-        } else {
-            break;
-        }
-    }
-
-    return str2int(dest, 16);
-}
+    int d;
 
-static int gather_bin_int(Source *src, Token *dest) {
-    int curr;
     while (1) {
         curr = peek1(src);
-        if (curr == '0' || curr == '1') {
-            next(src);
-            append_char_to_token(dest, curr);
+        if (shift == 4 && is_hex_char(curr)) {
+            d = curr <= '9' ? curr - '0' : (curr | 0x20) - 'a' + 10;
+        } else if ((shift == 3 && is_oct_char(curr)) ||
+                   (shift == 1 && (curr == '0' || curr == '1'))) {
+            d = curr - '0';
         } else if (is_id_char(curr)) {
             next(src);
-            return error_token(dest, "malformed number");
-        } else {
-            break;
-        }
-    }
-
-    return str2int(dest, 2);
-}
-
-static int gather_oct_int(Source *src, Token *dest) {
-    int curr;
-    while (1) {
-        curr = peek1(src);
-        if (is_oct_char(curr)) {
-            next(src);
-            append_char_to_token(dest, curr);
-        } else if (is_id_char(curr)) {
-            next(src);
-            return error_token(dest, "malformed number");
+            return error_token(src, dest, "malformed number");
         } else {
             break;
         }
+        next(src);
+        if (v > (unsigned long)(LONG_MAX >> shift))
+            overflow = 1;
+        v = (v << shift) | d;
+        n++;
     }
 
-    return str2int(dest, 8);
+    if (n == 0)
+        return error_token(src, dest, "malformed number");
+    if (overflow)
+        return error_token(src, dest, "invalid number format");
+    dest->i = (long)v;
+    dest->ref = begin;
+    dest->strlen = (int)(src->ptr - begin);
+    return 1;
 }
 
-static int gather_dec(Source *src, Token *dest) {
+// decimal integer or float, the first digit('first') is consumed already.
+// a float is computed exactly if its significant digits and power of 10
+// are both exact doubles(the result is rounded only once), otherwise
+// it's left to strtod.
+static int gather_dec(Source *src, Token *dest, const char *begin, int first) {
     int hasptr = 0; // has xiaoshudian
     int hasexp = 0; // has exponent
+    unsigned long w = first; // significant digits
+    int digits = first != 0; // count of significant digits in w
+    int dropped = 0;         // more significant digits than MAX_DIGITS
+    int scale = 0;           // power of 10 of w, by the fraction digits
+    long exp = 0;
+    int expsign = 1;
+    int expdigits = 0;
+    long e;
     int curr;
     
     while (1) {
         curr = peek1(src);
         if (is_dec_char(curr)) {
             next(src);
-            append_char_to_token(dest, curr);
+            if (hasexp) {
+                if (exp < MAX_EXPONENT)
+                    exp = exp * 10 + (curr - '0');
+                expdigits++;
+            } else if (digits < MAX_DIGITS) {
+                w = w * 10 + (curr - '0');
+                if (w != 0)
+                    digits++;
+                if (hasptr)
+                    scale--;
+            } else {
+                dropped = 1;
+            }
         } else if (curr == '.') {
+            if (peek2(src) == '.')
+                break; // 1..n, a range
             next(src);
             if (hasptr || hasexp) {
                 // cannot has more than one pointer
                 // cannot has pointer in exponent
-                return error_token(dest, "malformed number");
+                return error_token(src, dest, "malformed number");
             } else {
                 hasptr = 1;
             }
-            append_char_to_token(dest, curr);
         } else if (curr == 'e' || curr == 'E') {
             next(src);
             if (hasexp) {
                 // cannot have more than one exponent
-                return error_token(dest, "malformed number");
+                return error_token(src, dest, "malformed number");
             }
             hasexp = 1;
-            append_char_to_token(dest, curr);
 
             curr = peek1(src);
-            if (curr == '+' || curr == '-' || is_dec_char(curr)) {
+            if (curr == '+' || curr == '-') {
                 next(src);
-                append_char_to_token(dest, curr);
+                expsign = curr == '-' ? -1 : 1;
+            } else if (is_dec_char(curr)) {
+                next(src);
+                exp = curr - '0';
+                expdigits++;
             } else {
-                return error_token(dest, "malformed number");
+                return error_token(src, dest, "malformed number");
             }
         } else if (is_id_char(curr)) {
             next(src);
-            return error_token(dest, "malformed number");
+            return error_token(src, dest, "malformed number");
         } else {
             break;
         }
     }
 
-    if (hasptr || hasexp) {
-        //float
-        set_token_type(dest, TOKEN_FLOAT);
-        return str2float(dest);
-    } else {
+    dest->ref = begin;
+    dest->strlen = (int)(src->ptr - begin);
+    if (!hasptr && !hasexp) {
         // integer
         set_token_type(dest, TOKEN_INTEGER);
-        return str2int(dest, 10);
+        if (dropped || w > (unsigned long)LONG_MAX)
+            return error_token(src, dest, "invalid number format");
+        dest->i = (long)w;
+        return 1;
+    }
+
+    //float
+    set_token_type(dest, TOKEN_FLOAT);
+    if (hasexp && expdigits == 0)
+        return error_token(src, dest, "invalid number format");
+    if (dropped)
+        return str2float(src, dest, begin, src->ptr);
+
+    e = scale + expsign * exp;
+    if (w == 0) {
+        dest->f = 0.0;
+        return 1;
     }
+    if (e > MAX_EXACT_POW10 && e <= MAX_EXACT_POW10 * 2 &&
+        w * exact_pow10[e - MAX_EXACT_POW10] <= MAX_EXACT_INT) {
+        // move the extra power of 10 into the digits, still exact
+        w = (unsigned long)(w * exact_pow10[e - MAX_EXACT_POW10]);
+        e = MAX_EXACT_POW10;
+    }
+    if (w <= MAX_EXACT_INT && e >= -MAX_EXACT_POW10 && e <= MAX_EXACT_POW10) {
+        if (e < 0)
+            dest->f = (double)w / exact_pow10[-e];
+        else
+            dest->f = (double)w * exact_pow10[e];
+        return 1;
+    }
+    return str2float(src, dest, begin, src->ptr);
 }
 
 static int consume_normal_number(Source *src, Token *dest) {
@@ -1013,8 +1799,7 @@ static int consume_normal_number(Source *src, Token *dest) {
     set_token_type(dest, TOKEN_INTEGER);
     set_token_begin(src, dest);
 
-    append_char_to_token(dest, curr);
-    result = gather_dec(src, dest);
+    result = gather_dec(src, dest, src->ptr - 1, curr - '0');
     set_token_end(src, dest);
     return result;
 }
@@ -1031,34 +1816,35 @@ static int consume_special_number(Source *src, Token *dest) {
     switch (curr) {
         case 'x': case 'X': // only support hexdecimal integer(not hexdecimal float)
             next(src);
-            result = gather_hex_int(src, dest);
+            result = gather_int(src, dest, src->ptr - 2, 4);
             set_token_end(src, dest);
             return result;
         case 'b': case 'B': // only support binary integer(not binary float)
             next(src);
-            result = gather_bin_int(src, dest);
+            result = gather_int(src, dest, src->ptr - 2, 1);
             set_token_end(src, dest);
             return result;
         case '0': case '1': case '2': case '3': case '4':
         case '5': case '6': case '7': // only support octal integer (not octal float)
-            result = gather_oct_int(src, dest);
+            result = gather_int(src, dest, src->ptr - 1, 3);
             set_token_end(src, dest);
             return result;
         case '.':
             // it's normal number(float)
-            append_char_to_token(dest, '0');
-            result = gather_dec(src, dest);
+            result = gather_dec(src, dest, src->ptr - 1, 0);
             set_token_end(src, dest);
             return result;
         default:
             if (is_id_first_char(curr) || curr == '8' || curr == '9') {
                 next(src);
-                set_token_str(dest, "invalid number format");
+                set_token_str(src, dest, "invalid number format");
                 set_token_type(dest, TOKEN_ERROR);
                 set_token_end(src, dest);
                 return 0;
             } else {
                 dest->i = 0;
+                dest->ref = src->ptr - 1;
+                dest->strlen = 1;
                 set_token_end(src, dest);
                 return 1;
             }
@@ -1066,13 +1852,46 @@ static int consume_special_number(Source *src, Token *dest) {
 }
 
 
+// a simple(not qualified) identifier is referenced from the source text
+// directly instead of copying it into the token.
+// return 1 if the identifier is consumed, 0 if the caller should gather it.
+static int ref_id(Source *src, Token *dest) {
+    const char *begin = src->ptr;
+    const char *p;
+
+    if (!is_id_first_char(*begin))
+        return 0;
+
+    for (p = begin + 1; is_id_char(*p); p++)
+        ;
+    if (*p == '.' && is_id_first_char(p[1]))
+        return 0;
+
+    dest->ref = begin;
+    dest->strlen = (int)(p - begin);
+    dest->i = 1;
+    set_token_type(dest, search_reserve(begin, dest->strlen));
+    src->ptr = begin + 1;
+    src->curr = *begin;
+    set_token_begin(src, dest);
+    src->ptr = p;
+    src->curr = p[-1];
+    set_token_end(src, dest);
+    return 1;
+}
+
 static int consume_id(Source *src, Token *dest) {
     int curr;
     int begin = 1;
+    int name = 0;     // offset of the current name in the token string
+    int reserved = 0; // a reserve word is one name of the identifier
 
     set_token_type(dest, TOKEN_IDENTIFIER);
+    if (ref_id(src, dest))
+        return 1;
+
     if (peek1(src) == '.') {
-        append_char_to_token(dest, '.');
+        append_char_to_token(src, dest, '.');
     }
 
     while (1) {
@@ -1081,15 +1900,26 @@ static int consume_id(Source *src, Token *dest) {
 
         if (is_id_char(curr)) {
             next(src);
-            append_char_to_token(dest, curr);
+            append_char_to_token(src, dest, curr);
         } else if (curr == '.' && is_id_first_char(peek2(src))) {
             next(src);
-            append_char_to_token(dest, 0);
+            // the name is classified as soon as it's gathered
+            if (search_reserve(token_str(dest) + name, token_strlen(dest) - name) != TOKEN_IDENTIFIER)
+                reserved = 1;
+            append_char_to_token(src, dest, 0);
+            name = token_strlen(dest);
             dest->i ++;
         } else {
+            int type = search_reserve(token_str(dest) + name, token_strlen(dest) - name);
             dest->i ++;
             set_token_end(src, dest);
-            return check_reserve(dest);
+            if (dest->i == 1) {
+                set_token_type(dest, type);
+                return 1;
+            }
+            if (reserved || type != TOKEN_IDENTIFIER)
+                return error_token(src, dest, "reserve word can't be used as identifier");
+            return 1;
         }
 
         // set begin position
@@ -1112,7 +1942,7 @@ static int consume_default(Source *src, Token *dest) {
         set_token_begin(src, dest);
         set_token_end(src, dest);
         dest->type = TOKEN_ERROR;
-        set_token_str(dest, "invalid character");
+        set_token_str(src, dest, "invalid character");
         return 0;
     }
 }
@@ -1129,17 +1959,18 @@ static int try_add_semi(Source *src, Token *dest, int ttype) {
         case TOKEN_REGEX:
         case TOKEN_KW_END:
         case TOKEN_KW_BREAK:
-        case TOKEN_CONTINUE:
-        case TOKEN_RETURN:
+        case TOKEN_KW_CONTINUE:
+        case TOKEN_KW_RETURN:
         case TOKEN_KW_TRUE:
-        case TOKEN_FALSE:
-        case TOKEN_NIL:
+        case TOKEN_KW_FALSE:
+        case TOKEN_KW_NIL:
         case ')':
         case '}':
         case ']':
             set_token_begin(src, dest);
             set_token_end(src, dest);
             set_token_type(dest, ';');
+            STATS_ADD(semis);
             return 1;
         default:
             return 0;
@@ -1151,14 +1982,14 @@ static int try_add_semi(Source *src, Token *dest, int ttype) {
 // and call the corrisponding consume_xxx function to get the next token.
 // return 1: ok
 //        0: error
-static int consume(Source *src, Token *dest, Token *last) {
+static int consume_token(Source *src, Token *dest, Token *last) {
     int curr;
 
     // get last token type before clear_token, because dest may be the
     // last token.
     int currtype = last->type;
 
-    clear_token(dest, 1);
+    clear_token(dest);
 
     // this loop is used to bypass the comments/whitespaces
     while(1) {
@@ -1174,22 +2005,22 @@ static int consume(Source *src, Token *dest, Token *last) {
                 return 1;
             case '#':
                 set_token_begin(src, dest);
-                if (consume_comment(src) == 0) {
+                if (TIMED(src, STAT_COMMENT, consume_comment(src)) == 0) {
                     set_token_end(src, dest);
                     set_token_type(dest, TOKEN_ERROR);
-                    set_token_str(dest, "unfinished multiline comment"); //<- the only reason
+                    set_token_str(src, dest, "unfinished multiline comment"); //<- the only reason
                     return 0;
                 }
                 break;
             case '@':
-                return consume_section(src, dest);
+                return TIMED(src, STAT_SECTION, consume_section(src, dest));
             case '"': case '\'':
-                return consume_string(src, dest);
+                return TIMED(src, STAT_STRING, consume_string(src, dest));
             case '0':
-                return consume_special_number(src, dest);
+                return TIMED(src, STAT_NUMBER, consume_special_number(src, dest));
             case '1': case '2': case '3': case '4': case '5':
             case '6': case '7': case '8': case '9': 
-                return consume_normal_number(src, dest);
+                return TIMED(src, STAT_NUMBER, consume_normal_number(src, dest));
                 break;
             case '\r': case '\n':
                 if (try_add_semi(src, dest, currtype) == 1) {
@@ -1199,7 +2030,7 @@ static int consume(Source *src, Token *dest, Token *last) {
                 }
                 break;
             case '\t': case ' ':
-                next(src);
+                skip_blanks(src);
                 break;
             case ':': case ';':
             case '+': case '-':
@@ -1288,7 +2119,7 @@ static int consume(Source *src, Token *dest, Token *last) {
                     dest->type = TOKEN_RANGE;
                     return 1;
                 } else if (is_id_first_char(curr)) {
-                    return consume_id(src, dest);
+                    return TIMED(src, STAT_ID, consume_id(src, dest));
                 //} else if (is_dec_char(curr)) {
                 // do not support float number format .123
                 } else {
@@ -1296,7 +2127,7 @@ static int consume(Source *src, Token *dest, Token *last) {
                     set_token_begin(src, dest);
                     set_token_end(src, dest);
                     set_token_type(dest, TOKEN_ERROR);
-                    set_token_str(dest, "invalid '.' usage");
+                    set_token_str(src, dest, "invalid '.' usage");
                     return 0;
                 }
                 break;
@@ -1310,8 +2141,12 @@ static int consume(Source *src, Token *dest, Token *last) {
                     set_token_type(dest, TOKEN_REGEX);
                     dest->i = STRTYPE_DOUBLE;
                     next(src);
-                    result = consume_str_till_double(src, dest);
+                    result = TIMED(src, STAT_REGEX, consume_str_till_double(src, dest));
                     set_token_end(src, dest);
+                    if (result == 1)
+                        result = set_token_template(src, dest);
+                    if (result == 1)
+                        result = set_token_regex(src, dest);
                     return result;
                 } else if (curr == '\'') {
                     // regular expression r'xxx'
@@ -1320,106 +2155,1161 @@ static int consume(Source *src, Token *dest, Token *last) {
                     set_token_type(dest, TOKEN_REGEX);
                     dest->i = STRTYPE_SINGLE;
                     next(src);
-                    result = consume_str_till_single(src, dest);
+                    result = TIMED(src, STAT_REGEX, consume_str_till_single(src, dest));
                     set_token_end(src, dest);
+                    if (result == 1)
+                        result = set_token_regex(src, dest);
                     return result;
                 } else {
                     // normal identifier
-                    return consume_id(src, dest);
+                    return TIMED(src, STAT_ID, consume_id(src, dest));
                 }
                 break;
             }
             default:
-                return consume_default(src, dest);
+                return TIMED(src, STAT_ID, consume_default(src, dest));
         }
     }
 }
 
+// consume a token of an open stream source. a token is taken only if
+// LOOKAHEAD chars after it are fed already, otherwise the source is rolled
+// back to where the blanks and comments before the token begin, and
+// TOKEN_MORE is returned instead. the lexer state between tokens is just
+// the position and the last token(which is kept in the ring), so nothing
+// else is saved, but the string of the token is dropped from the arena.
+static int consume_open(Source *src, Token *dest, Token *last) {
+    const char *ptr = src->ptr;
+    const char *line = src->line;
+    int curr = src->curr;
+    int row = src->row;
+    StrChunk *chunk = src->strs.chunks;
+    long used = chunk != NULL ? chunk->used : 0;
+    RegexRef *regexes = src->strs.regexes;
+    int result;
+
+    assert(dest != last);
+    result = consume_token(src, dest, last);
+    if (src->text + src->len - src->ptr >= LOOKAHEAD)
+        return result;
+
+    clear_token(dest);
+    str_rewind(&src->strs, chunk, used, regexes);
+    set_token_type(dest, TOKEN_MORE);
+    src->ptr = ptr;
+    src->line = line;
+    src->curr = curr;
+    src->row = row;
+    set_token_begin(src, dest);
+    set_token_end(src, dest);
+    return 1;
+}
+
+static int consume(Source *src, Token *dest, Token *last) {
+    int result;
+#ifdef LPLEX_STATS
+    curr_stats = &src->stats;
+#endif
+    if (src->open)
+        result = consume_open(src, dest, last);
+    else
+        result = consume_token(src, dest, last);
+#ifdef LPLEX_STATS
+    src->stats.types[dest->type - TOKEN_ERROR]++;
+    curr_stats = NULL;
+#endif
+    return result;
+}
+
 Token *curr_token(void *data) {
     Source *src;
     src = (Source*)data;
-    return &src->curr_token;
+    return curr_slot(src);
+}
+
+// the k-th token after the current one, lexed into the ring if it's not
+// yet. the tokens from the current one to it stay where they are till
+// they're passed by next_token.
+Token *peek_token(void *data, int k) {
+    Source *src = (Source*)data;
+    unsigned i;
+
+    assert(k >= 0);
+    if (!grow_ring(src, k + 1)) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    for (i = src->head; i != src->head + k; i++) {
+        Token *t = ring_token(src, i);
+        // if already at the end or error occurred, no need to retry
+        if (t->type == TOKEN_EOS || t->type == TOKEN_ERROR)
+            return t;
+        if (i + 1 == src->tail) {
+            Token *dest = ring_token(src, i + 1);
+            consume(src, dest, t);
+            // it's lexed again after more text is fed
+            if (dest->type == TOKEN_MORE)
+                return dest;
+            src->tail++;
+        }
+    }
+    return ring_token(src, i);
 }
 
 Token *next_token(void *data) {
-    Source *src;
-    src = (Source*)data;
+    Source *src = (Source*)data;
+    Token *t = curr_slot(src);
+
+    if (t->type == TOKEN_EOS || t->type == TOKEN_ERROR)
+        return t;
+    t = peek_token(src, 1);
+    if (t->type != TOKEN_MORE) {
+        Token *passed = curr_slot(src);
+        src->head++;
+        // only what the passed token used may be unused now
+        if (src->stream && (passed->bigstr != NULL || passed->tpl != NULL || passed->re != NULL))
+            str_drop_passed(src);
+    }
+    return t;
+}
 
-    // if already at the end or error occurred, no need to retry
-    if (src->curr_token.type == TOKEN_EOS || src->curr_token.type == TOKEN_ERROR)
-        return &src->curr_token;
+Token *peek_token1(void *data) {
+    return peek_token(data, 1);
+}
+
+Token *peek_token2(void *data) {
+    return peek_token(data, 2);
+}
+
+Token *peek_token3(void *data) {
+    return peek_token(data, 3);
+}
+
+//1 ------------------------- token stream ---------------------------------
+static int grow_token_stream(TokenStream *ts, int size) {
+    short *type;
+    unsigned short *aux;
+    unsigned *begin;
+    unsigned *end;
+    TokenValue *value;
+
+    // keep the arrays already grown, they're freed with the stream
+    type = (short*)realloc(ts->type, size * sizeof(short));
+    if (type == NULL)
+        return 0;
+    ts->type = type;
+    aux = (unsigned short*)realloc(ts->aux, size * sizeof(unsigned short));
+    if (aux == NULL)
+        return 0;
+    ts->aux = aux;
+    begin = (unsigned*)realloc(ts->begin, size * sizeof(unsigned));
+    if (begin == NULL)
+        return 0;
+    ts->begin = begin;
+    end = (unsigned*)realloc(ts->end, size * sizeof(unsigned));
+    if (end == NULL)
+        return 0;
+    ts->end = end;
+    value = (TokenValue*)realloc(ts->value, size * sizeof(TokenValue));
+    if (value == NULL)
+        return 0;
+    ts->value = value;
+
+    ts->size = size;
+    return 1;
+}
 
-    if (src->next_token1.type != TOKEN_NTOKEN) {
-        move_token(&src->next_token1, &src->curr_token);
-        move_token(&src->next_token2, &src->next_token1);
-        move_token(&src->next_token3, &src->next_token2);
-        return &src->curr_token;
+// copy the token string into the text arena
+static int arena_add(TokenStream *ts, const char *str, unsigned len, unsigned *off) {
+    if (ts->arenalen + len > ts->arenasize) {
+        unsigned newsize = ts->arenasize * 2;
+        char *arena;
+        while (newsize < ts->arenalen + len)
+            newsize *= 2;
+        if (newsize >= TOKEN_ARENA)
+            return 0;
+        arena = (char*)realloc(ts->arena, newsize);
+        if (arena == NULL)
+            return 0;
+        ts->arena = arena;
+        ts->arenasize = newsize;
     }
+    *off = ts->arenalen | TOKEN_ARENA;
+    memcpy(ts->arena + ts->arenalen, str, len);
+    ts->arenalen += len;
+    return 1;
+}
 
-    consume(src, &src->curr_token, &src->curr_token);
-    return &src->curr_token;
+// position of row/column in the source text
+static unsigned row_pos(Source *src, int row, int col) {
+    if (row <= 0)
+        return 0;
+    return src->lines[row-1] + col;
 }
 
-Token *peek_token1(void *data) {
-    Source *src;
-    src = (Source*)data;
+// whether the token has a string in the stream
+static int is_str_token(int type) {
+    switch (type) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_SECTION:
+        case TOKEN_STRING:
+        case TOKEN_REGEX:
+        case TOKEN_ERROR:
+            return 1;
+        default:
+            return 0;
+    }
+}
 
-    // if already at the end or error occurred, no need to retry
-    if (src->curr_token.type == TOKEN_EOS || src->curr_token.type == TOKEN_ERROR)
-        return &src->curr_token;
+// append the token just consumed to the stream
+static int add_stream_token(TokenStream *ts, Source *src, Token *t) {
+    int k = ts->count;
+    if (k == ts->size && !grow_token_stream(ts, ts->size * 2))
+        return 0;
 
-    if (src->next_token1.type != TOKEN_NTOKEN) {
-        return &src->next_token1;
+    ts->type[k] = (short)t->type;
+    ts->aux[k] = 0;
+    ts->begin[k] = row_pos(src, t->beginrow, t->begincol);
+    ts->end[k] = row_pos(src, t->endrow, t->endcol);
+    switch (t->type) {
+        case TOKEN_INTEGER:
+            ts->value[k].i = t->i;
+            break;
+        case TOKEN_FLOAT:
+            ts->value[k].f = t->f;
+            break;
+        case TOKEN_IDENTIFIER:
+        case TOKEN_SECTION:
+        case TOKEN_STRING:
+        case TOKEN_REGEX:
+        case TOKEN_ERROR:
+            ts->aux[k] = (unsigned short)t->i;
+            if (t->ref != NULL) {
+                ts->value[k].s.off = (unsigned)(t->ref - src->text);
+            } else {
+                if (!arena_add(ts, token_str(t), token_strlen(t), &ts->value[k].s.off))
+                    return 0;
+            }
+            ts->value[k].s.len = token_strlen(t);
+            break;
+        default:
+            ts->value[k].i = 0;
+            break;
     }
+    ts->count++;
+    return 1;
+}
 
-    consume(src, &src->next_token1, &src->curr_token);
-    return &src->next_token1;
+// create an empty stream for about 'size' bytes of the source, and start
+// recording the rows of the source, the first one begins at 'start'
+static TokenStream *new_token_stream(Source *src, unsigned start, long size) {
+    TokenStream *ts = (TokenStream*)calloc(1, sizeof(TokenStream));
+    src->linesize = 1024;
+    src->lines = (unsigned*)malloc(src->linesize * sizeof(unsigned));
+    if (ts == NULL || src->lines == NULL)
+        goto nomem;
+    src->lines[0] = start;
+    src->linecount = 1;
+
+    ts->text = src->text;
+    ts->arenasize = 4096;
+    ts->arena = (char*)malloc(ts->arenasize);
+    if (ts->arena == NULL || !grow_token_stream(ts, size / 8 + 64))
+        goto nomem;
+    return ts;
+
+nomem:
+    free(src->lines);
+    src->lines = NULL;
+    free_token_stream(ts);
+    return NULL;
 }
 
-Token *peek_token2(void *data) {
-    Source *src;
-    src = (Source*)data;
+TokenStream *lex_all(void *data) {
+    Source *src = (Source*)data;
+    Token *t = curr_slot(src);
+    TokenStream *ts;
+
+    assert(t->type == TOKEN_NTOKEN);
+    if (src->open) {
+        printf("can't lex an open stream source all at once\n");
+        return NULL;
+    }
+    if (src->len >= TOKEN_ARENA) {
+        printf("too long source\n");
+        return NULL;
+    }
+
+    ts = new_token_stream(src, 0, src->len);
+    if (ts == NULL)
+        goto nomem;
 
-    // if already at the end or error occurred, no need to retry
-    if (src->curr_token.type == TOKEN_EOS || src->curr_token.type == TOKEN_ERROR)
-        return &src->curr_token;
-    if (src->next_token1.type == TOKEN_EOS || src->next_token1.type == TOKEN_ERROR)
-        return &src->next_token1;
+    while (1) {
+        consume(src, t, t);
+        if (src->linesize < 0 || !add_stream_token(ts, src, t))
+            goto nomem;
+        if (t->type == TOKEN_EOS || t->type == TOKEN_ERROR)
+            break;
+    }
+
+    // the source is left at its end, as if all tokens were fetched
+    ts->lines = src->lines;
+    ts->linecount = src->linecount;
+    src->lines = NULL;
+    return ts;
+
+nomem:
+    printf("no enough memory\n");
+    free(src->lines);
+    src->lines = NULL;
+    free_token_stream(ts);
+    return NULL;
+}
+
+//2 ------------------- parallel lexing -------------------------------
+// a big source is split at section header lines('@' at the beginning
+// of a line), and the chunks are lexed on several threads, each one as
+// if it began the source. that's right as long as the split point is
+// not in a multi-line string or comment: a section header token doesn't
+// depend on the tokens before it. so a chunk is lexed till a token
+// beginning at or after its end, and if that token doesn't begin exactly
+// at the next split point, the next chunk is wrong. then the chunk is
+// continued over the next chunk, till it meets a later split point
+// exactly. positions in the streams are offsets in the whole text, so
+// the right chunks are just concatenated.
+#define PAR_MIN_CHUNK (1024*1024) // don't split a source into smaller chunks
+#define PAR_NOEND     0xffffffffu
 
-    assert(src->next_token1.type != TOKEN_NTOKEN);
-    if (src->next_token2.type != TOKEN_NTOKEN) {
-        return &src->next_token2;
+typedef struct {
+    Source src;      // a copy of the source, beginning at the chunk
+    TokenStream *ts;
+    unsigned end;    // the chunk ends before the first token beginning here or after
+    unsigned stop;   // the beginning of the token in src.curr_token, not added yet
+    int done;        // TOKEN_EOS or TOKEN_ERROR is met
+    int result;      // 0 if no enough memory
+} Chunk;
+
+// find the first section header line at or after 'from', 0 if not found
+static unsigned find_section_line(Source *src, unsigned from) {
+    const char *text = src->text;
+    const char *p = text + from;
+    const char *end = text + src->len;
+
+    while (p < end && (p = memchr(p, '@', end - p)) != NULL) {
+        if (p > text && is_newline_char(p[-1])) {
+            switch (p[1]) {
+                case '=': case '>': case '<':
+                case '1': case '2': case '3': case '4': case '5':
+                case '6': case '7': case '8': case '9':
+                    return (unsigned)(p - text);
+            }
+        }
+        p++;
     }
+    return 0;
+}
+
+// lex the chunk till its end, or continue it if it's stopped already
+static int lex_chunk(Chunk *c) {
+    Source *src = &c->src;
+    Token *t = curr_slot(src);
+    int pending = t->type != TOKEN_NTOKEN;
 
-    assert(src->next_token3.type == TOKEN_NTOKEN);
+    while (1) {
+        if (!pending) {
+            consume(src, t, t);
+            if (src->linesize < 0)
+                return 0;
+            c->stop = row_pos(src, t->beginrow, t->begincol);
+        }
+        pending = 0;
+        if (c->stop >= c->end)
+            return 1;
+        if (!add_stream_token(c->ts, src, t))
+            return 0;
+        if (t->type == TOKEN_EOS || t->type == TOKEN_ERROR) {
+            c->done = 1;
+            return 1;
+        }
+    }
+}
 
-    consume(src, &src->next_token2, &src->next_token1);
-    return &src->next_token2;
+static void *lex_chunk_thread(void *arg) {
+    Chunk *c = (Chunk*)arg;
+    c->result = lex_chunk(c);
+    return NULL;
 }
 
-Token *peek_token3(void *data) {
-    Source *src;
-    src = (Source*)data;
+// append the tokens of 'from' to 'ts', and the rows of 'src' to 'dest'
+static int append_chunk(TokenStream *ts, Source *dest, TokenStream *from, Source *src) {
+    int k;
+    if (ts->count + from->count > ts->size &&
+        !grow_token_stream(ts, ts->count + from->count))
+        return 0;
+    if (from->arenalen > 0) {
+        unsigned base;
+        if (!arena_add(ts, from->arena, from->arenalen, &base))
+            return 0;
+        base &= ~TOKEN_ARENA;
+        for (k = 0; k < from->count; k++) {
+            if (is_str_token(from->type[k]) && (from->value[k].s.off & TOKEN_ARENA))
+                from->value[k].s.off += base;
+        }
+    }
+    memcpy(ts->type + ts->count, from->type, from->count * sizeof(short));
+    memcpy(ts->aux + ts->count, from->aux, from->count * sizeof(unsigned short));
+    memcpy(ts->begin + ts->count, from->begin, from->count * sizeof(unsigned));
+    memcpy(ts->end + ts->count, from->end, from->count * sizeof(unsigned));
+    memcpy(ts->value + ts->count, from->value, from->count * sizeof(TokenValue));
+    ts->count += from->count;
+
+    for (k = 0; k < src->linecount; k++) {
+        add_line(dest, src->text + src->lines[k]);
+        if (dest->linesize < 0)
+            return 0;
+    }
+    return 1;
+}
+
+TokenStream *lex_all_parallel(void *data, int nthread) {
+    Source *src = (Source*)data;
+    TokenStream *ts = NULL;
+    Chunk *chunks;
+    pthread_t *threads;
+    unsigned *starts;
+    int n = 1;
+    int i, j;
+    int ok = 1;
+
+    assert(curr_slot(src)->type == TOKEN_NTOKEN);
+    if (nthread > src->len / PAR_MIN_CHUNK)
+        nthread = src->len / PAR_MIN_CHUNK;
+    if (nthread <= 1 || src->open || src->len >= TOKEN_ARENA)
+        return lex_all(src);
+
+    chunks = (Chunk*)calloc(nthread, sizeof(Chunk));
+    threads = (pthread_t*)malloc(nthread * sizeof(pthread_t));
+    starts = (unsigned*)malloc(nthread * sizeof(unsigned));
+    if (chunks == NULL || threads == NULL || starts == NULL) {
+        printf("no enough memory\n");
+        free(chunks);
+        free(threads);
+        free(starts);
+        return NULL;
+    }
+
+    // split at the first section header line after each 1/nthread
+    starts[0] = 0;
+    for (i = 1; i < nthread; i++) {
+        unsigned from = (unsigned)(src->len / nthread * i);
+        unsigned p;
+        if (from <= starts[n-1])
+            from = starts[n-1] + 1;
+        p = find_section_line(src, from);
+        if (p == 0)
+            break;
+        starts[n++] = p;
+    }
+
+    for (i = 0; i < n; i++) {
+        Chunk *c = &chunks[i];
+        unsigned end = i + 1 < n ? starts[i+1] : (unsigned)src->len;
+        c->src = *src;
+        c->src.ptr = c->src.line = src->text + starts[i];
+        c->src.row = 1;
+        c->src.curr = NCH;
+        c->src.strs.chunks = NULL;
+        c->src.strs.regexes = NULL;
+        init_ring(&c->src);
+        c->ts = new_token_stream(&c->src, starts[i], end - starts[i]);
+        c->end = i + 1 < n ? starts[i+1] : PAR_NOEND;
+        if (c->ts == NULL)
+            ok = 0;
+    }
+
+    scan_init();
+    for (i = 1; ok && i < n; i++) {
+        if (pthread_create(&threads[i], NULL, lex_chunk_thread, &chunks[i]) != 0) {
+            // lex the rest chunks here
+            for (j = i; j < n; j++)
+                lex_chunk_thread(&chunks[j]);
+            break;
+        }
+    }
+    if (ok)
+        lex_chunk_thread(&chunks[0]);
+    for (j = 1; ok && j < i; j++)
+        pthread_join(threads[j], NULL);
+    for (i = 0; ok && i < n; i++)
+        ok = chunks[i].result;
+    if (!ok)
+        goto nomem;
+
+    // stitch the right chunks, chunk 0 collects all the tokens
+    ts = chunks[0].ts;
+    i = 0;
+    while (1) {
+        Chunk *c = &chunks[i];
+        while (!c->done) {
+            for (j = i + 1; j < n && starts[j] < c->stop; j++)
+                ;
+            if (j < n && starts[j] == c->stop)
+                break;
+            // the split point is in a multi-line string or comment,
+            // continue the chunk till the next split point
+            c->end = j < n ? starts[j] : PAR_NOEND;
+            if (!lex_chunk(c))
+                goto nomem;
+        }
+        if (!c->done) {
+            // drop the rows after the end of the chunk
+            while (c->src.linecount > 0 && c->src.lines[c->src.linecount-1] >= c->stop)
+                c->src.linecount--;
+        }
+        if (i > 0 && !append_chunk(ts, &chunks[0].src, c->ts, &c->src))
+            goto nomem;
+        if (c->done)
+            break;
+        i = j;
+    }
+
+    // the source is left at its end, as if all tokens were fetched
+    ts->lines = chunks[0].src.lines;
+    ts->linecount = chunks[0].src.linecount;
+    chunks[0].src.lines = NULL;
+    move_token(curr_slot(&chunks[i].src), curr_slot(src));
+    src->ptr = src->text + src->len;
+    src->curr = EOS;
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            free_token_stream(chunks[i].ts);
+        free(chunks[i].src.lines);
+        str_merge(&src->strs, &chunks[i].src.strs);
+    }
+    free(chunks);
+    free(threads);
+    free(starts);
+    return ts;
+
+nomem:
+    printf("no enough memory\n");
+    for (i = 0; i < n; i++) {
+        free_token_stream(chunks[i].ts);
+        free(chunks[i].src.lines);
+        str_merge(&src->strs, &chunks[i].src.strs);
+    }
+    free(chunks);
+    free(threads);
+    free(starts);
+    return NULL;
+}
+
+void free_token_stream(TokenStream *ts) {
+    if (ts == NULL)
+        return;
+    if (ts->map != NULL) {
+        // the arrays are in the cache file mapping
+        munmap(ts->map, ts->maplen);
+        free(ts);
+        return;
+    }
+    free(ts->type);
+    free(ts->aux);
+    free(ts->begin);
+    free(ts->end);
+    free(ts->value);
+    free(ts->arena);
+    free(ts->lines);
+    free(ts);
+}
+
+// convert a position to row and column: the row is the last one beginning
+// at or before the position.
+static void stream_pos(TokenStream *ts, unsigned pos, int *row, int *col) {
+    int begin = 0;
+    int end = ts->linecount - 1;
+    while (begin < end) {
+        int m = (begin + end + 1) / 2;
+        if (ts->lines[m] <= pos) {
+            begin = m;
+        } else {
+            end = m - 1;
+        }
+    }
+    *row = begin + 1;
+    *col = (int)(pos - ts->lines[begin]);
+}
+
+void token_pos(TokenStream *ts, int k, int *beginrow, int *begincol, int *endrow, int *endcol) {
+    assert(k >= 0 && k < ts->count);
+    stream_pos(ts, ts->begin[k], beginrow, begincol);
+    stream_pos(ts, ts->end[k], endrow, endcol);
+}
+
+const char *token_text(TokenStream *ts, int k, int *len) {
+    unsigned off;
+    assert(k >= 0 && k < ts->count);
+    switch (ts->type[k]) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_SECTION:
+        case TOKEN_STRING:
+        case TOKEN_REGEX:
+        case TOKEN_ERROR:
+            break;
+        default:
+            *len = 0;
+            return "";
+    }
+    off = ts->value[k].s.off;
+    *len = (int)ts->value[k].s.len;
+    if (off & TOKEN_ARENA)
+        return ts->arena + (off & ~TOKEN_ARENA);
+    return ts->text + off;
+}
 
-    // if already at the end or error occurred, no need to retry
-    if (src->curr_token.type == TOKEN_EOS || src->curr_token.type == TOKEN_ERROR)
-        return &src->curr_token;
-    if (src->next_token1.type == TOKEN_EOS || src->next_token1.type == TOKEN_ERROR)
-        return &src->next_token1;
-    if (src->next_token2.type == TOKEN_EOS || src->next_token2.type == TOKEN_ERROR)
-        return &src->next_token2;
+void stream_token(TokenStream *ts, int k, Token *t) {
+    int len;
+    clear_token(t);
+    t->type = ts->type[k];
+    token_pos(ts, k, &t->beginrow, &t->begincol, &t->endrow, &t->endcol);
+    switch (t->type) {
+        case TOKEN_INTEGER:
+            t->i = ts->value[k].i;
+            break;
+        case TOKEN_FLOAT:
+            t->f = ts->value[k].f;
+            break;
+        default:
+            t->i = ts->aux[k];
+            t->ref = token_text(ts, k, &len);
+            t->strlen = len;
+            break;
+    }
+}
+
+//2 ------------------- token cache ---------------------------------
+// a token stream can be saved into a cache file, and loaded back by
+// mapping the file: the token arrays are used in place, so loading
+// takes no allocation per token. the file is tied to the source text by
+// its hash and length, and to the lexer by TOKEN_CACHE_VERSION, which
+// must be increased whenever the tokens or the format change.
+// the file layout: header, value, begin, end, lines, type, aux, arena,
+// each part aligned to 8 bytes.
+#define TOKEN_CACHE_MAGIC   "LPT\032"
+#define TOKEN_CACHE_VERSION 2
+#define CACHE_ALIGN(n) (((n) + 7) & ~7L)
 
-    assert(src->next_token1.type != TOKEN_NTOKEN);
-    assert(src->next_token2.type != TOKEN_NTOKEN);
-    if (src->next_token3.type != TOKEN_NTOKEN) {
-        return &src->next_token3;
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned char sizes[4];   // sizeof short, int, long, TokenValue, for the byte layout
+    unsigned order;           // 0x01020304 written natively, for the byte order
+    unsigned long long hash;  // hash of the source text
+    long long srclen;
+    int count;
+    int linecount;
+    unsigned arenalen;
+    unsigned reserved;
+} CacheHeader;
+
+// hash 8 bytes a time, it only needs to tell a changed source
+static unsigned long long hash_text(const char *text, long len) {
+    unsigned long long h = 14695981039346656037ULL ^ (unsigned long long)len;
+    unsigned long long w;
+    long i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, text + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+        h ^= h >> 29;
     }
+    for (; i < len; i++)
+        h = (h ^ (unsigned char)text[i]) * 1099511628211ULL;
+    return h ^ (h >> 32);
+}
 
-    consume(src, &src->next_token3, &src->next_token2);
-    return &src->next_token3;
+static void init_cache_header(CacheHeader *h, Source *src, TokenStream *ts) {
+    memset(h, 0, sizeof(CacheHeader));
+    memcpy(h->magic, TOKEN_CACHE_MAGIC, 4);
+    h->version = TOKEN_CACHE_VERSION;
+    h->sizes[0] = sizeof(short);
+    h->sizes[1] = sizeof(int);
+    h->sizes[2] = sizeof(long);
+    h->sizes[3] = sizeof(TokenValue);
+    h->order = 0x01020304;
+    h->hash = hash_text(src->text, src->len);
+    h->srclen = src->len;
+    if (ts != NULL) {
+        h->count = ts->count;
+        h->linecount = ts->linecount;
+        h->arenalen = ts->arenalen;
+    }
+}
+
+// size of the cache file, and the offset of each part
+static long cache_layout(CacheHeader *h, long off[7]) {
+    long n = CACHE_ALIGN(sizeof(CacheHeader));
+    off[0] = n; n = CACHE_ALIGN(n + (long)h->count * sizeof(TokenValue));
+    off[1] = n; n = CACHE_ALIGN(n + (long)h->count * sizeof(unsigned));
+    off[2] = n; n = CACHE_ALIGN(n + (long)h->count * sizeof(unsigned));
+    off[3] = n; n = CACHE_ALIGN(n + (long)h->linecount * sizeof(unsigned));
+    off[4] = n; n = CACHE_ALIGN(n + (long)h->count * sizeof(short));
+    off[5] = n; n = CACHE_ALIGN(n + (long)h->count * sizeof(unsigned short));
+    off[6] = n; n = CACHE_ALIGN(n + h->arenalen);
+    return n;
+}
+
+static int write_all(int fd, const void *data, long len) {
+    static const char zeros[8];
+    long pad = CACHE_ALIGN(len) - len;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0)
+            return 0;
+        data = (const char*)data + n;
+        len -= n;
+    }
+    return pad == 0 || write(fd, zeros, pad) == pad;
+}
+
+int save_token_cache(void *data, TokenStream *ts, const char *path) {
+    Source *src = (Source*)data;
+    CacheHeader h;
+    char *tmp;
+    int fd;
+    int ok;
+
+    assert(ts->text == src->text);
+    init_cache_header(&h, src, ts);
+
+    // write another file and rename it, so a reader never sees half a file
+    tmp = (char*)malloc(strlen(path) + 16);
+    if (tmp == NULL) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(tmp);
+        return 0;
+    }
+    ok = write_all(fd, &h, sizeof(h)) &&
+         write_all(fd, ts->value, (long)ts->count * sizeof(TokenValue)) &&
+         write_all(fd, ts->begin, (long)ts->count * sizeof(unsigned)) &&
+         write_all(fd, ts->end, (long)ts->count * sizeof(unsigned)) &&
+         write_all(fd, ts->lines, (long)ts->linecount * sizeof(unsigned)) &&
+         write_all(fd, ts->type, (long)ts->count * sizeof(short)) &&
+         write_all(fd, ts->aux, (long)ts->count * sizeof(unsigned short)) &&
+         write_all(fd, ts->arena, ts->arenalen);
+    if (close(fd) != 0)
+        ok = 0;
+    if (ok)
+        ok = rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+TokenStream *load_token_cache(void *data, const char *path) {
+    Source *src = (Source*)data;
+    CacheHeader want;
+    CacheHeader *h;
+    TokenStream *ts;
+    struct stat st;
+    long off[7];
+    char *map;
+    Token *t;
+    int fd;
+
+    assert(curr_slot(src)->type == TOKEN_NTOKEN);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < (long)sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    // the file must be of this lexer, for this very source text
+    h = (CacheHeader*)map;
+    init_cache_header(&want, src, NULL);
+    if (memcmp(h, &want, offsetof(CacheHeader, count)) != 0 ||
+        h->count <= 0 || h->linecount <= 0 ||
+        cache_layout(h, off) != st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    ts = (TokenStream*)calloc(1, sizeof(TokenStream));
+    if (ts == NULL) {
+        printf("no enough memory\n");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    ts->count = h->count;
+    ts->size = h->count;
+    ts->value = (TokenValue*)(map + off[0]);
+    ts->begin = (unsigned*)(map + off[1]);
+    ts->end = (unsigned*)(map + off[2]);
+    ts->lines = (unsigned*)(map + off[3]);
+    ts->linecount = h->linecount;
+    ts->type = (short*)(map + off[4]);
+    ts->aux = (unsigned short*)(map + off[5]);
+    ts->arena = map + off[6];
+    ts->arenalen = h->arenalen;
+    ts->arenasize = h->arenalen;
+    ts->text = src->text;
+    ts->map = map;
+    ts->maplen = st.st_size;
+
+    // the source is left at its end, as if all tokens were fetched. the
+    // last token owns its string, the stream may be freed first.
+    t = curr_slot(src);
+    stream_token(ts, ts->count - 1, t);
+    if (t->ref != NULL) {
+        const char *str = t->ref;
+        int len = t->strlen;
+        t->ref = NULL;
+        t->strlen = 0;
+        append_str_to_token(src, t, str, len);
+    }
+    src->ptr = src->text + src->len;
+    src->curr = EOS;
+    return ts;
+}
+
+// copy the arrays of a stream loaded from a cache file into memory, so
+// they can be changed
+static int own_token_stream(TokenStream *ts) {
+    TokenStream copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.arenasize = ts->arenalen > 4096 ? ts->arenalen : 4096;
+    copy.arena = (char*)malloc(copy.arenasize);
+    copy.lines = (unsigned*)malloc(ts->linecount * sizeof(unsigned));
+    if (copy.arena == NULL || copy.lines == NULL || !grow_token_stream(&copy, ts->count)) {
+        free(copy.type);
+        free(copy.aux);
+        free(copy.begin);
+        free(copy.end);
+        free(copy.value);
+        free(copy.arena);
+        free(copy.lines);
+        return 0;
+    }
+    memcpy(copy.type, ts->type, ts->count * sizeof(short));
+    memcpy(copy.aux, ts->aux, ts->count * sizeof(unsigned short));
+    memcpy(copy.begin, ts->begin, ts->count * sizeof(unsigned));
+    memcpy(copy.end, ts->end, ts->count * sizeof(unsigned));
+    memcpy(copy.value, ts->value, ts->count * sizeof(TokenValue));
+    memcpy(copy.arena, ts->arena, ts->arenalen);
+    memcpy(copy.lines, ts->lines, ts->linecount * sizeof(unsigned));
+    munmap(ts->map, ts->maplen);
+
+    ts->type = copy.type;
+    ts->aux = copy.aux;
+    ts->begin = copy.begin;
+    ts->end = copy.end;
+    ts->value = copy.value;
+    ts->size = copy.size;
+    ts->arena = copy.arena;
+    ts->arenasize = copy.arenasize;
+    ts->lines = copy.lines;
+    ts->map = NULL;
+    ts->maplen = 0;
+    return 1;
+}
+
+//2 ------------------- incremental lexing ----------------------------
+// after an edit, the tokens are re-lexed from the last token which can't
+// be affected by the edit, till a token after the edit which ends at the
+// same place of the text as an old one, with the same type. the lexer
+// state between tokens is just the position and the last token
+// type(for try_add_semi), and a multi-line string or comment is never
+// open between tokens, so the rest tokens are the same as the old ones,
+// only moved.
+
+// find the last token(not the last one of the stream) ending LOOKAHEAD
+// chars or more before 'pos', -1 if not found
+static int last_token_before(TokenStream *ts, unsigned pos) {
+    int begin = 0;
+    int end = ts->count - 2;
+    if (end < 0 || ts->end[0] + LOOKAHEAD > pos)
+        return -1;
+    while (begin < end) {
+        int m = (begin + end + 1) / 2;
+        if (ts->end[m] + LOOKAHEAD <= pos) {
+            begin = m;
+        } else {
+            end = m - 1;
+        }
+    }
+    return begin;
+}
+
+int relex_stream(void *data, TokenStream *ts, unsigned begin, unsigned end,
+                 const char *str, unsigned len) {
+    Source *src = (Source*)data;
+    Source ls;
+    Token t;
+    TokenStream *tmp = NULL;
+    long delta = (long)len - (long)(end - begin);
+    long newlen = src->len + delta;
+    char *text = NULL;
+    const char *oldtext;
+    int j = last_token_before(ts, begin);
+    int m = j + 1;
+    int resync = 0;
+    int tail, tailrows, count, row, col, k;
+    unsigned restart = j >= 0 ? ts->end[j] : 0;
+    unsigned stop = 0;
+    unsigned base;
+
+    assert(begin <= end && end <= src->len);
+    assert(ts->text == src->text);
+    if (newlen >= TOKEN_ARENA) {
+        printf("too long source\n");
+        return -1;
+    }
+    if (ts->map != NULL && !own_token_stream(ts)) {
+        printf("no enough memory\n");
+        return -1;
+    }
+
+    text = (char*)malloc(newlen + SENTINEL);
+    tmp = (TokenStream*)calloc(1, sizeof(TokenStream));
+    ls = *src;
+    stream_pos(ts, restart, &row, &col);
+    ls.linesize = row * 2 > 1024 ? row * 2 : 1024;
+    ls.lines = (unsigned*)malloc(ls.linesize * sizeof(unsigned));
+    clear_token(&t);
+    if (text == NULL || tmp == NULL || ls.lines == NULL || !grow_token_stream(tmp, 64))
+        goto nomem;
+    tmp->arenasize = 4096;
+    tmp->arena = (char*)malloc(tmp->arenasize);
+    if (tmp->arena == NULL)
+        goto nomem;
+
+    memcpy(text, src->text, begin);
+    memcpy(text + begin, str, len);
+    memcpy(text + begin + len, src->text + end, src->len - end);
+    memset(text + newlen, EOS, SENTINEL);
+
+    // continue lexing after the last unaffected token, the rows till there
+    // are kept
+    memcpy(ls.lines, ts->lines, row * sizeof(unsigned));
+    ls.linecount = row;
+    ls.row = row;
+    ls.text = text;
+    ls.len = newlen;
+    ls.line = text + ts->lines[row-1];
+    ls.ptr = text + restart;
+    ls.curr = restart > 0 ? text[restart-1] : NCH;
+    tmp->text = text;
+    t.type = j >= 0 ? ts->type[j] : TOKEN_NTOKEN;
+
+    while (1) {
+        long olde;
+        consume(&ls, &t, &t);
+        if (ls.linesize < 0 || !add_stream_token(tmp, &ls, &t))
+            goto nomem;
+        if (t.type == TOKEN_EOS || t.type == TOKEN_ERROR)
+            break;
+        if (tmp->end[tmp->count-1] < begin + len)
+            continue;
+
+        // the text from here on is the same as the old text from 'olde'
+        olde = (long)tmp->end[tmp->count-1] - delta;
+        while (m < ts->count && ts->end[m] < olde)
+            m++;
+        if (m < ts->count && ts->end[m] == olde && ts->type[m] == t.type) {
+            resync = 1;
+            stop = (unsigned)olde;
+            break;
+        }
+    }
+
+    // tokens [j+1, m] are replaced by the new ones, the rest are moved
+    tail = resync ? ts->count - m - 1 : 0;
+    count = j + 1 + tmp->count + tail;
+    tailrows = 0;
+    if (resync) {
+        stream_pos(ts, stop, &row, &col);
+        tailrows = ts->linecount - row;
+    }
+    if (ls.linecount + tailrows > ls.linesize) {
+        unsigned *lines = (unsigned*)realloc(ls.lines, (ls.linecount + tailrows) * sizeof(unsigned));
+        if (lines == NULL)
+            goto nomem;
+        ls.lines = lines;
+    }
+    if (count > ts->size && !grow_token_stream(ts, count))
+        goto nomem;
+    if (!arena_add(ts, tmp->arena, tmp->arenalen, &base))
+        goto nomem;
+    base &= ~TOKEN_ARENA;
+
+    // no failure from here on
+    for (k = 0; k < tailrows; k++)
+        ls.lines[ls.linecount++] = ts->lines[row + k] + delta;
+
+    k = m + 1;
+    memmove(ts->type + j + 1 + tmp->count, ts->type + k, tail * sizeof(short));
+    memmove(ts->aux + j + 1 + tmp->count, ts->aux + k, tail * sizeof(unsigned short));
+    memmove(ts->begin + j + 1 + tmp->count, ts->begin + k, tail * sizeof(unsigned));
+    memmove(ts->end + j + 1 + tmp->count, ts->end + k, tail * sizeof(unsigned));
+    memmove(ts->value + j + 1 + tmp->count, ts->value + k, tail * sizeof(TokenValue));
+    for (k = j + 1 + tmp->count; k < count; k++) {
+        ts->begin[k] += delta;
+        ts->end[k] += delta;
+        if (is_str_token(ts->type[k]) && !(ts->value[k].s.off & TOKEN_ARENA))
+            ts->value[k].s.off += delta;
+    }
+
+    for (k = 0; k < tmp->count; k++) {
+        if (is_str_token(tmp->type[k]) && (tmp->value[k].s.off & TOKEN_ARENA))
+            tmp->value[k].s.off += base;
+    }
+    memcpy(ts->type + j + 1, tmp->type, tmp->count * sizeof(short));
+    memcpy(ts->aux + j + 1, tmp->aux, tmp->count * sizeof(unsigned short));
+    memcpy(ts->begin + j + 1, tmp->begin, tmp->count * sizeof(unsigned));
+    memcpy(ts->end + j + 1, tmp->end, tmp->count * sizeof(unsigned));
+    memcpy(ts->value + j + 1, tmp->value, tmp->count * sizeof(TokenValue));
+    ts->count = count;
+
+    free(ts->lines);
+    ts->lines = ls.lines;
+    ts->linecount = ls.linecount;
+    ts->text = text;
+    // the strings of the tokens lexed above are kept by the source
+    src->strs = ls.strs;
+
+    // the source takes the new text, and is left at its end
+    oldtext = src->text;
+    if (src->map != NULL)
+        munmap(src->map, src->maplen);
+    else
+        free((char*)src->text);
+    src->map = NULL;
+    src->maplen = 0;
+    src->text = text;
+    src->len = newlen;
+    src->ptr = text + newlen;
+    src->curr = EOS;
+    src->row = ts->linecount;
+    src->line = text + ts->lines[ts->linecount-1];
+    if (!resync) {
+        move_token(&t, curr_slot(src));
+    } else if (curr_slot(src)->ref != NULL) {
+        // the last token is moved as well
+        curr_slot(src)->ref = text + (curr_slot(src)->ref - oldtext) + delta;
+    }
+    clear_token(&t);
+    free_token_stream(tmp);
+    return j + 1;
+
+nomem:
+    printf("no enough memory\n");
+    clear_token(&t);
+    src->strs = ls.strs;
+    free(ls.lines);
+    free(text);
+    free_token_stream(tmp);
+    return -1;
+}
+
+//1 ------------------------- string template ---------------------------------
+StrTemplate *compile_template(const char *str, int len) {
+    StrTemplate size;
+    StrTemplate *tpl;
+    const char *err = scan_template(str, len, &size, 0);
+
+    if (err != NULL) {
+        printf("%s\n", err);
+        return NULL;
+    }
+    tpl = (StrTemplate*)malloc(template_size(&size));
+    if (tpl == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    init_template(tpl, &size);
+    scan_template(str, len, tpl, 1);
+    return tpl;
+}
+
+// length of the value rendered by the hole, the value is written to
+// 'out' if it's given
+static int render_hole(const StrHole *h, const HoleValue *v, char *out) {
+    int isint = h->conv != 0 && strchr("dxXo", h->conv) != NULL;
+    int isfloat = h->conv != 0 && strchr("feEgG", h->conv) != NULL;
+    int len, pad;
+
+    switch (v->type) {
+        case TOKEN_INTEGER:
+            if (isfloat)
+                return out ? sprintf(out, h->ffmt, (double)v->v.i) : snprintf(NULL, 0, h->ffmt, (double)v->v.i);
+            return out ? sprintf(out, h->ifmt, v->v.i) : snprintf(NULL, 0, h->ifmt, v->v.i);
+        case TOKEN_FLOAT:
+            if (isint)
+                return out ? sprintf(out, h->ifmt, (long)v->v.f) : snprintf(NULL, 0, h->ifmt, (long)v->v.f);
+            return out ? sprintf(out, h->ffmt, v->v.f) : snprintf(NULL, 0, h->ffmt, v->v.f);
+        default:
+            // a string is cut by the precision, and padded to the width
+            len = v->v.s.len;
+            if (h->precision >= 0 && len > h->precision)
+                len = h->precision;
+            pad = h->width > len ? h->width - len : 0;
+            if (out != NULL) {
+                memset(out + (h->left ? len : 0), ' ', pad);
+                memcpy(out + (h->left ? 0 : pad), v->v.s.str, len);
+            }
+            return len + pad;
+    }
+}
+
+char *render_template(const StrTemplate *t, const HoleValue *values, int *len) {
+    char *buf, *p;
+    long total = t->litlen;
+    unsigned pos = 0;
+    int k;
+
+    for (k = 0; k < t->holecount; k++)
+        total += render_hole(&t->holes[k], &values[k], NULL);
+    // sprintf ends each number by NUL, so one more char
+    buf = (char*)malloc(total + 1);
+    if (buf == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    p = buf;
+    for (k = 0; k < t->holecount; k++) {
+        const StrHole *h = &t->holes[k];
+        memcpy(p, t->text + pos, h->pos - pos);
+        p += h->pos - pos;
+        pos = h->pos;
+        p += render_hole(h, &values[k], p);
+    }
+    memcpy(p, t->text + pos, t->litlen - pos);
+    p += t->litlen - pos;
+    *p = 0;
+    if (len != NULL)
+        *len = (int)(p - buf);
+    return buf;
 }
 
 //1 ------------------------- print token ---------------------------------
+// the token string may be referenced from the mapped source without
+// the ending NUL, so it's appended by its length
+static void cat_token_str(char *buf, Token *t) {
+    int n = strlen(buf);
+    memcpy(buf + n, token_str(t), token_strlen(t));
+    buf[n + token_strlen(t)] = 0;
+}
 static void pt(Token *t, char *buf, const char *msg) {
     sprintf(buf, "%3d,%3d - %3d,%3d: %s", t->beginrow, t->begincol, t->endrow, t->endcol, msg);
 }
@@ -1438,19 +3328,19 @@ static void ptf(Token *t, char *buf, const char *msg) {
 static void pts(Token *t, char *buf, int len, const char *msg) {
     sprintf(buf, "%3d,%3d - %3d,%3d: %s ", t->beginrow, t->begincol, t->endrow, t->endcol, msg);
     if (token_strlen(t) + strlen(buf) < len)
-        strcat(buf, token_str(t));
+        cat_token_str(buf, t);
     else strcat(buf, "...");
 }
 static void ptcs(Token *t, char *buf, int len, const char *msg) {
     sprintf(buf, "%3d,%3d - %3d,%3d: %s %c ", t->beginrow, t->begincol, t->endrow, t->endcol, msg, (int)t->i);
     if (token_strlen(t) + strlen(buf) < len)
-        strcat(buf, token_str(t));
+        cat_token_str(buf, t);
     else strcat(buf, "...");
 }
 static void ptis(Token *t, char *buf, int len, const char *msg) {
     sprintf(buf, "%3d,%3d - %3d,%3d: %s %ld ", t->beginrow, t->begincol, t->endrow, t->endcol, msg, t->i);
     if (token_strlen(t) + strlen(buf) < len)
-        strcat(buf, token_str(t));
+        cat_token_str(buf, t);
     else strcat(buf, "...");
 }
 static void ptss(Token *t, char *buf, int len, const char *msg) {
@@ -1458,10 +3348,12 @@ static void ptss(Token *t, char *buf, int len, const char *msg) {
     char *out = buf + n;
     if (n + token_strlen(t) < len) {
         const char *ptr = token_str(t);
+        const char *end = ptr + token_strlen(t);
         int i;
         for (i=0; i<t->i; i++) {
-            int l = strlen(ptr);
-            sprintf(out, "%s:", ptr);
+            const char *sep = memchr(ptr, 0, end - ptr);
+            int l = sep != NULL ? sep - ptr : end - ptr;
+            sprintf(out, "%.*s:", l, ptr);
             out += l+1;
             ptr += l+1; 
         }
@@ -1472,7 +3364,7 @@ static void ptss(Token *t, char *buf, int len, const char *msg) {
 static void ptfs(Token *t, char *buf, int len, const char *msg) {
     sprintf(buf, "%3d,%3d - %3d,%3d: %s %lf ", t->beginrow, t->begincol, t->endrow, t->endcol, msg, t->f);
     if (token_strlen(t) + strlen(buf) < len)
-        strcat(buf, token_str(t));
+        cat_token_str(buf, t);
     else strcat(buf, "...");
 }
 
@@ -1499,6 +3391,9 @@ void print_token(Token *t, char *buf, int len) {
         case TOKEN_EOS:
             pt(t, buf, "EOS");
             break;
+        case TOKEN_MORE:
+            pt(t, buf, "need-more");
+            break;
         case TOKEN_SECTION:
             ptcs(t, buf, len, "section");
             break;
@@ -1523,22 +3418,22 @@ void print_token(Token *t, char *buf, int len) {
         case TOKEN_KW_THEN:
             pt(t, buf, "then");
             break;
-        case TOKEN_ELSE:
+        case TOKEN_KW_ELSE:
             pt(t, buf, "else");
             break;
-        case TOKEN_ELSEIF:
+        case TOKEN_KW_ELSEIF:
             pt(t, buf, "elseif");
             break;
         case TOKEN_KW_END:
             pt(t, buf, "end");
             break;
-        case TOKEN_FOR:
+        case TOKEN_KW_FOR:
             pt(t, buf, "for");
             break;
-        case TOKEN_IN:
+        case TOKEN_KW_IN:
             pt(t, buf, "in");
             break;
-        case TOKEN_DO:
+        case TOKEN_KW_DO:
             pt(t, buf, "do");
             break;
         case TOKEN_KW_WHILE:
@@ -1547,57 +3442,81 @@ void print_token(Token *t, char *buf, int len) {
         case TOKEN_KW_BREAK:
             pt(t, buf, "break");
             break;
-        case TOKEN_CONTINUE:
+        case TOKEN_KW_CONTINUE:
             pt(t, buf, "continue");
             break;
-        case TOKEN_RETURN:
+        case TOKEN_KW_RETURN:
             pt(t, buf, "return");
             break;
-        case TOKEN_AND:
+        case TOKEN_KW_AND:
             pt(t, buf, "and");
             break;
-        case TOKEN_OR:
+        case TOKEN_KW_OR:
             pt(t, buf, "or");
             break;
-        case TOKEN_CASE:
+        case TOKEN_KW_CASE:
             pt(t, buf, "case");
             break;
-        case TOKEN_OF:
+        case TOKEN_KW_OF:
             pt(t, buf, "of");
             break;
-        case TOKEN_LP:
+        case TOKEN_KW_LP:
             pt(t, buf, "lp");
             break;
-        case TOKEN_FUN:
+        case TOKEN_KW_FUN:
             pt(t, buf, "fun");
             break;
         case TOKEN_KW_TRUE:
             pt(t, buf, "true");
             break;
-        case TOKEN_FALSE:
+        case TOKEN_KW_FALSE:
             pt(t, buf, "false");
             break;
         case TOKEN_KW_TRY:
             pt(t, buf, "try");
             break;
-        case TOKEN_CATCH:
+        case TOKEN_KW_CATCH:
             pt(t, buf, "catch");
             break;
-        case TOKEN_AFTER:
+        case TOKEN_KW_AFTER:
             pt(t, buf, "after");
             break;
-        case TOKEN_FINALLY:
+        case TOKEN_KW_FINALLY:
             pt(t, buf, "finally");
             break;
-        case TOKEN_EXPORT:
+        case TOKEN_KW_EXPORT:
             pt(t, buf, "export");
             break;
-        case TOKEN_IMPORT:
+        case TOKEN_KW_IMPORT:
             pt(t, buf, "import");
             break;
-        case TOKEN_LOCAL:
+        case TOKEN_KW_LOCAL:
             pt(t, buf, "local");
             break;
+        case TOKEN_KW_NIL:
+            pt(t, buf, "nil");
+            break;
+        case TOKEN_KW_INT:
+            pt(t, buf, "int");
+            break;
+        case TOKEN_KW_FLOAT:
+            pt(t, buf, "float");
+            break;
+        case TOKEN_KW_STRING:
+            pt(t, buf, "string");
+            break;
+        case TOKEN_KW_REGEX:
+            pt(t, buf, "regex");
+            break;
+        case TOKEN_KW_BOOL:
+            pt(t, buf, "bool");
+            break;
+        case TOKEN_KW_STRUCT:
+            pt(t, buf, "struct");
+            break;
+        case TOKEN_KW_BINARY:
+            pt(t, buf, "binary");
+            break;
         case TOKEN_EXPONENT:
             pt(t, buf, "**");
             break;
@@ -1620,3 +3539,338 @@ void print_token(Token *t, char *buf, int len) {
             ptu(t, buf);
     }
 }
+
+//1 ------------------------- statistics ---------------------------------
+#ifdef LPLEX_STATS
+static const char *stat_routines[STAT_ROUTINES] = {
+    "string", "regex", "comment", "section", "number", "identifier", "newline"
+};
+
+static const char *type_name(int type, char *buf) {
+    int i;
+    switch (type) {
+        case TOKEN_ERROR:      return "error";
+        case TOKEN_NTOKEN:     return "none";
+        case TOKEN_EOS:        return "eos";
+        case TOKEN_SECTION:    return "section";
+        case TOKEN_IDENTIFIER: return "identifier";
+        case TOKEN_INTEGER:    return "integer";
+        case TOKEN_FLOAT:      return "float";
+        case TOKEN_STRING:     return "string";
+        case TOKEN_REGEX:      return "regex";
+        case TOKEN_EXPONENT:   return "**";
+        case TOKEN_EQ:         return "==";
+        case TOKEN_NEQ:        return "!=";
+        case TOKEN_GE:         return ">=";
+        case TOKEN_LE:         return "<=";
+        case TOKEN_RANGE:      return "..";
+    }
+    for (i = 0; i < RESERVE_SLOTS; i++) {
+        if (reserves[i].len > 0 && reserves[i].type == type)
+            return reserves[i].str;
+    }
+    sprintf(buf, "%c", type);
+    return buf;
+}
+#endif
+
+void print_lex_stats(void *data, int json) {
+#ifdef LPLEX_STATS
+    Source *src = (Source*)data;
+    LexStats *s = &src->stats;
+    long bytes = src->text != NULL ? (long)(src->ptr - src->text) : 0;
+    char buf[8];
+    const char *sep = "";
+    int k;
+
+    if (json) {
+        printf("{\"bytes\": %ld, \"reads\": %ld, \"mallocs\": %ld, \"reallocs\": %ld, "
+               "\"bigstrs\": %ld, \"semicolons\": %ld,\n \"tokens\": {",
+               bytes, s->reads, s->mallocs, s->reallocs, s->bigstrs, s->semis);
+        for (k = 0; k < STAT_TYPES; k++) {
+            if (s->types[k] == 0)
+                continue;
+            printf("%s\"%s\": %ld", sep, type_name(k + TOKEN_ERROR, buf), s->types[k]);
+            sep = ", ";
+        }
+        printf("},\n \"routines\": {");
+        for (k = 0; k < STAT_ROUTINES; k++) {
+            printf("%s\"%s\": {\"calls\": %ld, \"cycles\": %llu}", k > 0 ? ", " : "",
+                   stat_routines[k], s->calls[k], s->cycles[k]);
+        }
+        printf("}}\n");
+        return;
+    }
+
+    printf("bytes       %ld\n", bytes);
+    printf("reads       %ld\n", s->reads);
+    printf("mallocs     %ld\n", s->mallocs);
+    printf("reallocs    %ld\n", s->reallocs);
+    printf("bigstrs     %ld\n", s->bigstrs);
+    printf("semicolons  %ld\n", s->semis);
+    printf("tokens:\n");
+    for (k = 0; k < STAT_TYPES; k++) {
+        if (s->types[k] != 0)
+            printf("  %-12s %ld\n", type_name(k + TOKEN_ERROR, buf), s->types[k]);
+    }
+    printf("routines:          calls          cycles  cycles/call\n");
+    for (k = 0; k < STAT_ROUTINES; k++) {
+        printf("  %-12s %10ld %15llu %12.1f\n", stat_routines[k], s->calls[k], s->cycles[k],
+               s->calls[k] > 0 ? (double)s->cycles[k] / s->calls[k] : 0.0);
+    }
+#else
+    (void)data;
+    (void)json;
+    printf("lexer statistics are not built in, rebuild with LPLEX_STATS(make STATS=1)\n");
+#endif
+}
+
+//1 ------------------------- test --------------------------------------------
+#ifdef LPLEX_TEST
+// random edits re-lexed by relex_stream, each one compared token for
+// token with the text after the edit lexed from scratch by lex_all
+
+static const char *base =
+    "@1 intro section\n"
+    "# a comment \"with quotes\" and 'more'\n"
+    "x = 1 + 2.5e3 * y\n"
+    "s = \"hello $name and ${a + b} done\"\n"
+    "t = 'single' .. '''three\nlines'''\n"
+    "#\"\"\"\nmulti-line comment\n\"\"\"\n"
+    "m = \"\"\"\nmulti-line $s\nstring\n\"\"\"\n"
+    "r = r'^ab+c$'\n"
+    "fun f(a, b) return a ** b end\n"
+    "@= another section\n"
+    "for i in 1..10 do puts i end\n"
+    "case x of .a: 1 end\n"
+    "@2 sub # not a comment\n"
+    "z = [1, 2, 3] != 0x1f\n";
+
+// inserted by the edits: quotes, comment and section marks, and pieces
+// of tokens
+static const char *pieces[] = {
+    "", "\"", "'", "\"\"\"", "'''", "#", "#\"\"\"", "\n", "@1 sec\n", "@", " ",
+    "x", "12", ".", "..", "=", "$", "${", "}", "r'", "\\", "e5", "end", "\t", "ab cd"
+};
+
+static unsigned seed = 1;
+
+static unsigned rnd(unsigned n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static void check_stream(TokenStream *ts, const char *text, int len) {
+    void *src = string_source(text);
+    TokenStream *expect = lex_all(src);
+    int k, l1, l2;
+    const char *s1, *s2;
+    assert(expect != NULL);
+    assert(memcmp(ts->text, text, len) == 0);
+    if (ts->count != expect->count) {
+        printf("%d tokens, not %d, after the edit of:\n%s\n", ts->count, expect->count, text);
+        assert(0);
+    }
+    for (k = 0; k < ts->count; k++) {
+        assert(ts->type[k] == expect->type[k] && ts->aux[k] == expect->aux[k]);
+        assert(ts->begin[k] == expect->begin[k] && ts->end[k] == expect->end[k]);
+        if (ts->type[k] == TOKEN_INTEGER)
+            assert(ts->value[k].i == expect->value[k].i);
+        else if (ts->type[k] == TOKEN_FLOAT)
+            assert(memcmp(&ts->value[k].f, &expect->value[k].f, sizeof(double)) == 0);
+        s1 = token_text(ts, k, &l1);
+        s2 = token_text(expect, k, &l2);
+        assert(l1 == l2 && memcmp(s1, s2, l1) == 0);
+    }
+    assert(ts->linecount == expect->linecount);
+    assert(memcmp(ts->lines, expect->lines, ts->linecount * sizeof(unsigned)) == 0);
+    free_token_stream(expect);
+    close_source(src);
+}
+
+// a place for an edit: anywhere, inside a string, after a '#', inside a
+// section header, inside an identifier or number(split), or at a blank
+// between two tokens(join)
+static unsigned edit_pos(TokenStream *ts, const char *text, int len, int kind, unsigned *end) {
+    unsigned pos = rnd(len + 1);
+    int k = rnd(ts->count);
+    int i;
+    *end = pos;
+    switch (kind) {
+        case 0:
+            *end = pos + rnd(8);
+            break;
+        case 1: case 3: case 4:
+            for (i = 0; i < ts->count; i++, k = (k + 1) % ts->count) {
+                int t = ts->type[k];
+                if ((kind == 1 && t == TOKEN_STRING) || (kind == 3 && t == TOKEN_SECTION) ||
+                    (kind == 4 && (t == TOKEN_IDENTIFIER || t == TOKEN_INTEGER || t == TOKEN_FLOAT))) {
+                    if (ts->end[k] - ts->begin[k] >= 2)
+                        return ts->begin[k] + 1 + rnd(ts->end[k] - ts->begin[k] - 1);
+                }
+            }
+            break;
+        case 2:
+            for (i = 0; i < len; i++, pos = (pos + 1) % len) {
+                if (text[pos] == '#')
+                    return pos + 1 + rnd(4);
+            }
+            break;
+        case 5:
+            for (i = 0; i < len; i++, pos = (pos + 1) % len) {
+                if (pos > 0 && text[pos] == ' ' && text[pos-1] != ' ' && text[pos+1] != ' ') {
+                    *end = pos + 1;
+                    return pos;
+                }
+            }
+            break;
+    }
+    return pos;
+}
+
+static void test_relex(unsigned s, int rounds) {
+    int size = 4096;
+    char *text = (char*)malloc(size);
+    void *src = NULL;
+    TokenStream *ts = NULL;
+    int len = 0, r, k;
+    seed = s;
+    for (r = 0; r < rounds; r++) {
+        const char *piece;
+        unsigned begin, end;
+        int kind, plen;
+        // back to the base text now and then, as the edits mess it up
+        if (r % 40 == 0) {
+            if (ts != NULL) {
+                free_token_stream(ts);
+                close_source(src);
+            }
+            len = strlen(base);
+            memcpy(text, base, len + 1);
+            src = string_source(text);
+            ts = lex_all(src);
+            assert(ts != NULL);
+        }
+        kind = rnd(6);
+        piece = kind == 4 ? " " : kind == 5 ? "" : pieces[rnd(sizeof(pieces) / sizeof(pieces[0]))];
+        plen = strlen(piece);
+        begin = edit_pos(ts, text, len, kind, &end);
+        if (begin > (unsigned)len)
+            begin = len;
+        if (end < begin)
+            end = begin;
+        if (end > (unsigned)len)
+            end = len;
+        if (len + plen + 1 > size)
+            continue;
+        k = relex_stream(src, ts, begin, end, piece, plen);
+        assert(k >= 0);
+        memmove(text + begin + plen, text + end, len - end + 1);
+        memcpy(text + begin, piece, plen);
+        len += plen - (int)(end - begin);
+        check_stream(ts, text, len);
+    }
+    free_token_stream(ts);
+    close_source(src);
+    free(text);
+}
+
+// a stream of long escaped strings, regexes and long templates fed in
+// random pieces: their strings are dropped as the tokens are passed, so
+// the arena stays within a few chunks however long the stream is
+static void check_arena(Source *src, long *maxsize, int *maxregex) {
+    StrChunk *c;
+    RegexRef *r;
+    long size = 0;
+    int regexes = 0;
+    for (c = src->strs.chunks; c != NULL; c = c->next)
+        size += c->size;
+    for (r = src->strs.regexes; r != NULL; r = r->next)
+        regexes++;
+    if (size > *maxsize)
+        *maxsize = size;
+    if (regexes > *maxregex)
+        *maxregex = regexes;
+}
+
+static void test_stream_arena(int units) {
+    char text[4096];
+    Source *src = (Source*)stream_source("stream");
+    long maxsize = 0;
+    int maxregex = 0;
+    int len = 0, pos = 0, fed = 0, strs = 0, tpls = 0, res = 0, k;
+    Token *t;
+
+    len += sprintf(text + len, "s = \"a");
+    for (k = 0; k < 300; k++)
+        len += sprintf(text + len, "\\n\\t");
+    len += sprintf(text + len, "z\"\nr = r'^a+b\\d*$'\nt = \"v $x and ${a + b} ");
+    for (k = 0; k < 600; k++)
+        text[len++] = 'q';
+    len += sprintf(text + len, "\"\n");
+    assert(src != NULL);
+    seed = 7;
+    while (1) {
+        // feed a random piece, the text repeated 'units' times
+        if (fed < units) {
+            int n = 1 + rnd(700);
+            while (n > 0 && fed < units) {
+                int m = n < len - pos ? n : len - pos;
+                k = feed_source(src, text + pos, m);
+                assert(k);
+                pos += m;
+                n -= m;
+                if (pos == len) {
+                    pos = 0;
+                    fed++;
+                }
+            }
+            if (fed == units)
+                end_source(src);
+        }
+        // and peek deeper now and then, the peeked strings must survive
+        if (rnd(4) == 0)
+            peek_token(src, 1 + rnd(6));
+        while ((t = next_token(src))->type != TOKEN_MORE) {
+            check_arena(src, &maxsize, &maxregex);
+            if (t->type == TOKEN_EOS)
+                break;
+            assert(t->type != TOKEN_ERROR);
+            if (t->type == TOKEN_STRING) {
+                // the template is referenced from the text, only the
+                // escaped string is copied into the arena
+                assert(t->strlen > TOKEN_BUFMAX);
+                if (t->tpl != NULL) {
+                    assert(t->tpl->holecount == 2);
+                    tpls++;
+                } else {
+                    assert(t->bigstr != NULL && t->bigstr[0] == 'a' && t->bigstr[1] == '\n' &&
+                           t->bigstr[t->strlen-1] == 'z' && t->strlen == 602);
+                    strs++;
+                }
+            } else if (t->type == TOKEN_REGEX) {
+                assert(t->re != NULL);
+                res++;
+            }
+        }
+        if (t->type == TOKEN_EOS)
+            break;
+    }
+    assert(strs == units && tpls == units && res == units);
+    if (maxsize > 4 * STR_CHUNK_SIZE || maxregex > 8) {
+        printf("%ld bytes of arena, %d regexes kept for a stream\n", maxsize, maxregex);
+        assert(0);
+    }
+    close_source(src);
+}
+
+int main(int argc, char *argv[]) {
+    int k;
+    for (k = 1; k <= 10; k++)
+        test_relex(k, 4000);
+    printf("40000 edits ok\n");
+    test_stream_arena(2000);
+    printf("stream arena ok\n");
+    return 0;
+}
+#endif //LPLEX_TEST
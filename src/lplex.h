@@ -4,6 +4,7 @@
 #define TOKEN_ERROR      -2 // error
 #define TOKEN_NTOKEN     -1 // not a token
 #define TOKEN_EOS        500
+#define TOKEN_MORE       501 // need more input of a stream source
 #define TOKEN_SECTION    502 //#1~#9, #<, #>, #=
 #define TOKEN_IDENTIFIER 504
 #define TOKEN_BOOL       505
@@ -44,6 +45,8 @@
 #define TOKEN_KW_STRING     540 //string
 #define TOKEN_KW_REGEX      541 //regex
 #define TOKEN_KW_BOOL       542 //bool
+#define TOKEN_KW_STRUCT     543 //struct
+#define TOKEN_KW_BINARY     544 //binary
 
 #define TOKEN_EXPONENT   628 //**
 #define TOKEN_EQ         629 //==
@@ -55,6 +58,47 @@
 #define STRTYPE_SINGLE  1 // string quoted by '
 #define STRTYPE_DOUBLE  2 // string quoted by "
 
+// string template: a "..." or """...""" string with "$name", "${expr}"
+// or "${expr: fmt}" holes in it, fmt is "[-+0 ][width][.precision][conv]"
+// where conv is one of d x X o f e E g G s. "$$" is a '$'.
+#define HOLE_NAME 1
+#define HOLE_EXPR 2
+#define TEMPLATE_MAXFMT 999 // max width/precision of a format
+
+typedef struct StrHole {
+    int kind;              // HOLE_NAME or HOLE_EXPR
+    unsigned pos;          // where the value goes in the literal text
+    unsigned expr;         // the name or expression, offset in the text, NUL terminated
+    unsigned exprlen;
+    int conv;              // conversion of the format, 0 if not given
+    int width;             // 0 if not given
+    int precision;         // -1 if not given
+    int left;              // aligned to the left
+    char ifmt[20];         // printf format for an integer value
+    char ffmt[20];         // printf format for a float value
+} StrHole;
+
+typedef struct StrTemplate {
+    unsigned litlen;       // length of the literal text, the holes cut out
+    unsigned textlen;      // length of the text
+    int holecount;
+    char *text;            // the literal text, then the names/expressions
+    StrHole holes[];
+} StrTemplate;
+
+// value of a hole for rendering
+typedef struct HoleValue {
+    int type;              // TOKEN_INTEGER, TOKEN_FLOAT or TOKEN_STRING
+    union {
+        long i;
+        double f;
+        struct {
+            const char *str;
+            int len;
+        } s;
+    } v;
+} HoleValue;
+
 #define TOKEN_BUFMAX     512
 typedef struct Token {
     int type;
@@ -67,18 +111,110 @@ typedef struct Token {
     int  strlen; // actual string length
     int  buflen; // actual buffer length
     char buf[TOKEN_BUFMAX+1];
-    char *bigstr;
+    char *bigstr;    // string too long for buf, kept by the source till it is closed,
+                     // or till the token is passed on a stream source
+    const char *ref; // string taken verbatim from the source text, not NUL terminated,
+                     // or the literal text of a number
+    StrTemplate *tpl; // template of a "..." string with '$' in it, kept like bigstr
+    struct lp_regex *re; // compiled regex of a constant regex literal, kept like bigstr
 } Token;
 
 
 void *file_source(const char *filepath);
 void *string_source(const char *str);
 void close_source(void *src);
+// stream source: the text is fed as it arrives, next_token returns
+// TOKEN_MORE(not a token, nothing is consumed) when the next token needs
+// more text, then it can be called again after feed_source/read_source.
+// end_source tells there's no more text, then the source ends like others.
+void *stream_source(const char *name);
+// append 'len' chars to the stream source, return 0 if no enough memory
+int feed_source(void *src, const char *str, long len);
+// read what's available from 'fd'(non-blocking usually) into the stream
+// source. return the count of chars read, 0 if nothing is available now,
+// -1 at the end of the input or on an error, then the source is ended.
+long read_source(void *src, int fd);
+void end_source(void *src);
 Token *curr_token(void *src);
+// the k-th token after the current one(0 is the current one), for any k.
+// the tokens peeked are not copied when next_token passes them, so the
+// Token pointers stay valid till the tokens are passed. NULL if no enough
+// memory for a deeper peek than ever.
+Token *peek_token(void *src, int k);
 Token *peek_token1(void *src);
 Token *peek_token2(void *src);
 Token *peek_token3(void *src);
 Token *next_token(void *src);
 void print_token(Token *t, char *buf, int len);
+// print the counters of the lexer on the source as text or JSON, they're
+// only counted if the lexer is built with LPLEX_STATS
+void print_lex_stats(void *src, int json);
+
+// compile a string into a template, for a string of a token stream. the
+// tokens of a source have it in Token.tpl already. free it by free().
+// NULL if the holes are malformed or no enough memory.
+StrTemplate *compile_template(const char *str, int len);
+// render the template with the values of its holes, in one allocation
+// of the exact size. free the result by free(), its length is in 'len'.
+char *render_template(const StrTemplate *t, const HoleValue *values, int *len);
+
+// compact token stream: the whole source lexed into flat arrays in one
+// pass, the k-th token is described by the k-th item of each array.
+// positions are offsets in the source text(see token_pos), token strings
+// are spans of the source text or of the stream's own text arena(see
+// token_text). the stream refers to the source text, so the source
+// must be closed after the stream is freed.
+typedef union TokenValue {
+    long i;               // integer value
+    double f;             // float value
+    struct {
+        unsigned off;     // TOKEN_ARENA is set if it's in the text arena
+        unsigned len;
+    } s;                  // string of identifier/section/string/regex/error
+} TokenValue;
+
+#define TOKEN_ARENA 0x80000000u
+
+typedef struct TokenStream {
+    int count;            // token count, the last one is TOKEN_EOS or TOKEN_ERROR
+    int size;             // allocated size of each token array
+    short *type;          // token type
+    unsigned short *aux;  // section char, string/regex type or name count of an identifier
+    unsigned *begin;      // begin position
+    unsigned *end;        // end position
+    TokenValue *value;
+    const char *text;     // source text
+    char *arena;          // texts which can't be referenced from the source
+    unsigned arenalen;
+    unsigned arenasize;
+    unsigned *lines;      // position of the beginning of each row
+    int linecount;
+    char *map;            // mapped cache file holding the arrays, NULL if they're malloced
+    long maplen;
+} TokenStream;
+
+// lex the whole source, it must be called before any next_token/peek_token
+TokenStream *lex_all(void *src);
+// the same as lex_all, but a big source is split at section header lines
+// and lexed on at most 'nthread' threads
+TokenStream *lex_all_parallel(void *src, int nthread);
+void free_token_stream(TokenStream *ts);
+// replace [begin, end) of the source text by 'str' of 'len' chars, and
+// re-lex only the tokens affected by the edit. the source must be lexed
+// into the stream already. return the index of the first re-lexed token,
+// -1 if there's no enough memory(then nothing is changed).
+int relex_stream(void *src, TokenStream *ts, unsigned begin, unsigned end,
+                 const char *str, unsigned len);
+void token_pos(TokenStream *ts, int k, int *beginrow, int *begincol, int *endrow, int *endcol);
+const char *token_text(TokenStream *ts, int k, int *len);
+// expand the k-th token, the token string is referenced instead of copied
+void stream_token(TokenStream *ts, int k, Token *t);
+
+// save the stream of the source into a token cache file, return 1 if ok
+int save_token_cache(void *src, TokenStream *ts, const char *path);
+// load the stream of the source from a token cache file by mapping it,
+// instead of lex_all. return NULL if the file is missing, or it's not
+// made from the same source text by the same lexer version.
+TokenStream *load_token_cache(void *src, const char *path);
 
 #endif // __LPLEX_H__
@@ -1,6 +1,1465 @@
-#include <stdio.h>
-
-#include "lplex.h"
-#include "lpparse.h"
-
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lplex.h"
+#include "lpparse.h"
+
+#define INIT_NODES 1024
+#define INIT_EXTRA 1024
+#define INIT_STACK 256
+#define INIT_TEXT  4096
+
+//1 --------------------- arena --------------------------------------
+// make room for 'n' more items of 'size' bytes in the array, 0 if no
+// enough memory
+static int reserve(lp_ast *ast, void **array, unsigned *size, unsigned count,
+                   unsigned n, unsigned itemsize) {
+    unsigned newsize;
+    void *p;
+    if (count + n <= *size && count + n >= count)
+        return 1;
+    if (ast->nomem)
+        return 0;
+    newsize = *size;
+    while (newsize < count + n) {
+        if (newsize > 0x7fffffffu / itemsize) {
+            newsize = 0;
+            break;
+        }
+        newsize *= 2;
+    }
+    p = newsize == 0 ? NULL : realloc(*array, (size_t)newsize * itemsize);
+    if (p == NULL) {
+        printf("no enough memory\n");
+        ast->nomem = 1;
+        return 0;
+    }
+    *array = p;
+    *size = newsize;
+    return 1;
+}
+
+static lp_ast *new_ast(lp_strpool *names, lp_sharedpool *shared) {
+    lp_ast *ast = (lp_ast*)calloc(1, sizeof(lp_ast));
+    if (ast == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    ast->nodes = (ast_node*)malloc(INIT_NODES * sizeof(ast_node));
+    ast->extra = (unsigned*)malloc(INIT_EXTRA * sizeof(unsigned));
+    ast->stack = (unsigned*)malloc(INIT_STACK * sizeof(unsigned));
+    ast->text = (char*)malloc(INIT_TEXT);
+    ast->names = names;
+    ast->shared = shared;
+    if (names == NULL && shared == NULL) {
+        ast->names = strpool_init();
+        ast->ownnames = 1;
+    }
+    if (ast->nodes == NULL || ast->extra == NULL || ast->stack == NULL ||
+        ast->text == NULL || (ast->names == NULL && ast->shared == NULL)) {
+        ast_free(ast);
+        printf("no enough memory\n");
+        return NULL;
+    }
+    ast->size = INIT_NODES;
+    ast->extrasize = INIT_EXTRA;
+    ast->stacksize = INIT_STACK;
+    ast->textsize = INIT_TEXT;
+
+    // index 0 of nodes, extra and names is nothing
+    memset(&ast->nodes[0], 0, sizeof(ast_node));
+    ast->count = 1;
+    ast->extra[0] = 0;
+    ast->extracount = 1;
+    ast->text[0] = 0;
+    ast->textcount = 1;
+    if (shared == NULL && strpool_addn(ast->names, "", 0) != 0) {
+        // a shared pool must have "" as its first string
+        ast_free(ast);
+        return NULL;
+    }
+    return ast;
+}
+
+lp_ast *ast_new(lp_strpool *names) {
+    return new_ast(names, NULL);
+}
+
+lp_ast *ast_new_shared(lp_sharedpool *names) {
+    return new_ast(NULL, names);
+}
+
+void ast_free(lp_ast *ast) {
+    if (ast == NULL)
+        return;
+    if (ast->ownnames)
+        strpool_destroy(ast->names);
+    free(ast->nodes);
+    free(ast->extra);
+    free(ast->stack);
+    free(ast->text);
+    free(ast);
+}
+
+unsigned ast_add(lp_ast *ast, int kind, unsigned row, unsigned a, unsigned b) {
+    ast_node *n;
+    if (!reserve(ast, (void**)&ast->nodes, &ast->size, ast->count, 1, sizeof(ast_node)))
+        return 0;
+    n = &ast->nodes[ast->count];
+    n->kind = (unsigned char)kind;
+    n->flags = 0;
+    n->aux = 0;
+    n->row = row;
+    n->a = a;
+    n->b = b;
+    return ast->count++;
+}
+
+unsigned ast_extra(lp_ast *ast, const unsigned *items, int n) {
+    unsigned at = ast->extracount;
+    if (!reserve(ast, (void**)&ast->extra, &ast->extrasize, at, n, sizeof(unsigned)))
+        return 0;
+    memcpy(&ast->extra[at], items, n * sizeof(unsigned));
+    ast->extracount += n;
+    return at;
+}
+
+unsigned ast_mark(lp_ast *ast) {
+    return ast->top;
+}
+
+void ast_push(lp_ast *ast, unsigned node) {
+    if (!reserve(ast, (void**)&ast->stack, &ast->stacksize, ast->top, 1, sizeof(unsigned)))
+        return;
+    ast->stack[ast->top++] = node;
+}
+
+unsigned ast_list(lp_ast *ast, unsigned mark) {
+    unsigned n = ast->top - mark;
+    unsigned at = ast->extracount;
+    ast->top = mark;
+    if (n == 0)
+        return 0;
+    if (!reserve(ast, (void**)&ast->extra, &ast->extrasize, at, n + 1, sizeof(unsigned)))
+        return 0;
+    ast->extra[at] = n;
+    memcpy(&ast->extra[at + 1], &ast->stack[mark], n * sizeof(unsigned));
+    ast->extracount += n + 1;
+    return at;
+}
+
+unsigned ast_text(lp_ast *ast, const char *str, int len) {
+    unsigned at = ast->textcount;
+    if (!reserve(ast, (void**)&ast->text, &ast->textsize, at, len + 1, 1))
+        return 0;
+    memcpy(&ast->text[at], str, len);
+    ast->text[at + len] = 0;
+    ast->textcount += len + 1;
+    return at;
+}
+
+unsigned ast_name(lp_ast *ast, const char *str, int len) {
+    int id = ast->shared != NULL ? sharedpool_addn(ast->shared, str, len)
+                                 : strpool_addn(ast->names, str, len);
+    if (id == NOT_SP_ID) {
+        ast->nomem = 1;
+        return 0;
+    }
+    return id;
+}
+
+unsigned ast_int(lp_ast *ast, unsigned row, long i) {
+    unsigned long long u = (unsigned long long)i;
+    return ast_add(ast, AST_INT, row, (unsigned)u, (unsigned)(u >> 32));
+}
+
+unsigned ast_float(lp_ast *ast, unsigned row, double f) {
+    unsigned long long u;
+    memcpy(&u, &f, sizeof(u));
+    return ast_add(ast, AST_FLOAT, row, (unsigned)u, (unsigned)(u >> 32));
+}
+
+long ast_intval(lp_ast *ast, unsigned node) {
+    ast_node *n = &ast->nodes[node];
+    return (long)((unsigned long long)n->b << 32 | n->a);
+}
+
+double ast_floatval(lp_ast *ast, unsigned node) {
+    ast_node *n = &ast->nodes[node];
+    unsigned long long u = (unsigned long long)n->b << 32 | n->a;
+    double f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+//1 --------------------- print --------------------------------------
+static const char *kindnames[AST_KINDS] = {
+    "", "module", "section", "struct", "binary", "binfield", "fun", "var",
+    "type", "import", "if", "branch", "while", "for", "in", "case", "arm",
+    "assign", "return", "break", "continue", "expr", "lp", "int", "float",
+    "bool", "nil", "string", "regex", "name", "unary", "binop", "field",
+    "call", "new", "namedarg", "tuple", "typed", "do", "list", "comp",
+    "atom", "error"
+};
+
+// operands of each kind: a, b, then the ones in extra if a or b is 'X'.
+// N node, L list, S name, T text, X extra, - nothing
+static const char *layouts[AST_KINDS] = {
+    "--",                          // 0
+    "L-",     "X-NNL", "SL",  "SL", "SN",  // module section struct binary binfield
+    "X-SLNNL", "SXNN", "S-",  "SS",         // fun var type import
+    "L-",     "LL",  "LL",  "LL",  "SN",   // if branch while for in
+    "NL",     "XLNN", "LL", "L-",  "--",   // case arm assign return break
+    "--",     "N-",  "L-",  "--",  "--",   // continue expr lp int float
+    "--",     "--",  "T-",  "T-",  "S-",   // bool nil string regex name
+    "N-",     "NN",  "NS",  "NL",  "NL",   // unary binop field call new
+    "SN",     "L-",  "NN",  "L-",  "L-",   // namedarg tuple typed do list
+    "NL",     "S-",  "--"                  // comp atom error
+};
+
+static const char *typenames[] = {
+    "int", "float", "string", "regex", "bool", "struct", "binary"
+};
+
+static void print_op(int op) {
+    switch (op) {
+        case TOKEN_EXPONENT: printf("**"); break;
+        case TOKEN_EQ:       printf("=="); break;
+        case TOKEN_NEQ:      printf("!="); break;
+        case TOKEN_GE:       printf(">="); break;
+        case TOKEN_LE:       printf("<="); break;
+        case TOKEN_RANGE:    printf(".."); break;
+        case TOKEN_KW_AND:   printf("and"); break;
+        case TOKEN_KW_OR:    printf("or"); break;
+        default:             printf("%c", op); break;
+    }
+}
+
+static void print_node(lp_ast *ast, unsigned node);
+
+static void print_operand(lp_ast *ast, char how, unsigned v) {
+    unsigned i;
+    switch (how) {
+        case 'N':
+            printf(" ");
+            print_node(ast, v);
+            break;
+        case 'L':
+            printf(" [");
+            for (i = 0; i < ast_count(ast, v); i++) {
+                if (i > 0)
+                    printf(" ");
+                print_node(ast, ast_items(ast, v)[i]);
+            }
+            printf("]");
+            break;
+        case 'S':
+            printf(" %s", v == 0 ? "_" : ast_namestr(ast, v));
+            break;
+        case 'T':
+            printf(" \"%s\"", ast_str(ast, v));
+            break;
+    }
+}
+
+static void print_node(lp_ast *ast, unsigned node) {
+    ast_node *n;
+    const char *layout;
+    int i;
+    if (node == 0) {
+        printf("_");
+        return;
+    }
+    n = ast_at(ast, node);
+    layout = layouts[n->kind];
+    printf("(%s", kindnames[n->kind]);
+    if (n->flags & AST_EXPORT)
+        printf(" export");
+    if (n->flags & AST_LOCAL)
+        printf(" local");
+    if (n->flags & AST_BIG)
+        printf(" >");
+    if (n->flags & AST_LITTLE)
+        printf(" <");
+    switch (n->kind) {
+        case AST_SECTION:
+            printf(" @%c", n->aux);
+            break;
+        case AST_BINFIELD:
+            if (n->flags & AST_UTF8)
+                printf(" utf8");
+            else if (n->flags & AST_UTF16)
+                printf(" utf16");
+            else if (n->flags & AST_UTF32)
+                printf(" utf32");
+            else if (n->aux > 0)
+                printf(" %d", n->aux);
+            break;
+        case AST_TYPENAME:
+            if (n->aux >= TOKEN_KW_INT && n->aux <= TOKEN_KW_BINARY) {
+                printf(" %s", typenames[n->aux - TOKEN_KW_INT]);
+                layout = "--";
+            }
+            break;
+        case AST_INT:
+            printf(" %ld", ast_intval(ast, node));
+            break;
+        case AST_FLOAT:
+            printf(" %g", ast_floatval(ast, node));
+            break;
+        case AST_BOOL:
+            printf(" %s", n->aux ? "true" : "false");
+            break;
+        case AST_UNARY:
+        case AST_BINOP:
+            printf(" ");
+            print_op(n->aux);
+            break;
+    }
+    for (i = 0; i < 2; i++) {
+        unsigned v = i == 0 ? n->a : n->b;
+        if (layout[i] == 'X') {
+            const char *more = layout + 2;
+            unsigned *ops = &ast->extra[v];
+            for (; *more; more++)
+                print_operand(ast, *more, *ops++);
+        } else {
+            print_operand(ast, layout[i], v);
+        }
+    }
+    printf(")");
+}
+
+void ast_print(lp_ast *ast, unsigned node) {
+    print_node(ast, node);
+    printf("\n");
+}
+
+static void walk_operand(lp_ast *ast, char how, unsigned v, void (*fn)(void *arg, unsigned n), void *arg) {
+    unsigned i;
+    if (how == 'N' && v != 0) {
+        ast_walk(ast, v, fn, arg);
+    } else if (how == 'L') {
+        for (i = 0; i < ast_count(ast, v); i++)
+            ast_walk(ast, ast_items(ast, v)[i], fn, arg);
+    }
+}
+
+void ast_walk(lp_ast *ast, unsigned node, void (*fn)(void *arg, unsigned n), void *arg) {
+    ast_node *n = ast_at(ast, node);
+    const char *layout = layouts[n->kind];
+    int i;
+    fn(arg, node);
+    for (i = 0; i < 2; i++) {
+        unsigned v = i == 0 ? n->a : n->b;
+        if (layout[i] == 'X') {
+            const char *more = layout + 2;
+            unsigned *ops = &ast->extra[v];
+            for (; *more; more++)
+                walk_operand(ast, *more, *ops++, fn, arg);
+        } else {
+            walk_operand(ast, layout[i], v, fn, arg);
+        }
+    }
+}
+
+//1 --------------------- parser -------------------------------------
+typedef struct {
+    void *src;
+    lp_ast *ast;
+    Token *t;        // the current token, valid till the next one is taken
+    int type;        // its type, TOKEN_EOS after a lexical error
+    int last;        // type of the token before it
+    int depth;       // blocks opened by a keyword and not closed by 'end' yet
+    int nest;        // nesting of the blocks and expressions being parsed
+    int panic;       // a syntax error is found, the statement is abandoned
+} Parser;
+
+// string of the token, a qualified name has '\0' between the names
+static const char *tok_text(Token *t, int *len) {
+    *len = t->strlen;
+    if (t->ref != NULL)
+        return t->ref;
+    return t->bigstr != NULL ? t->bigstr : t->buf;
+}
+
+static void report(Parser *p, const char *msg);
+
+static void advance(Parser *p) {
+    char buf[PARSE_MSGMAX];
+    int len;
+    p->last = p->type;
+    p->t = next_token(p->src);
+    p->type = p->t->type;
+    p->ast->tokens++;
+    if (p->type == TOKEN_ERROR || p->type == TOKEN_MORE) {
+        if (p->type == TOKEN_ERROR) {
+            const char *s = tok_text(p->t, &len);
+            snprintf(buf, sizeof(buf), "%.*s", len, s);
+        } else {
+            snprintf(buf, sizeof(buf), "unfinished source");
+        }
+        p->panic = 0;
+        report(p, buf);
+        p->type = TOKEN_EOS;
+    }
+}
+
+static int peek_type(Parser *p, int k) {
+    Token *t = peek_token(p->src, k);
+    return t == NULL ? TOKEN_EOS : t->type;
+}
+
+// the token as told in a message
+static void describe(Token *t, int type, char *buf, int len) {
+    char tmp[TOKEN_BUFMAX+64];
+    const char *s;
+    switch (type) {
+        case TOKEN_EOS:        snprintf(buf, len, "end of source"); return;
+        case TOKEN_IDENTIFIER: snprintf(buf, len, "identifier"); return;
+        case TOKEN_INTEGER:    snprintf(buf, len, "integer"); return;
+        case TOKEN_FLOAT:      snprintf(buf, len, "float"); return;
+        case TOKEN_STRING:     snprintf(buf, len, "string"); return;
+        case TOKEN_REGEX:      snprintf(buf, len, "regex"); return;
+        case TOKEN_SECTION:    snprintf(buf, len, "section header"); return;
+        case ';':              snprintf(buf, len, "end of line"); return;
+    }
+    print_token(t, tmp, sizeof(tmp));
+    s = strstr(tmp, ": ");
+    // room for the quotes and the NUL
+    snprintf(buf, len, "'%.*s'", len > 3 ? len - 3 : 0, s != NULL ? s + 2 : tmp);
+}
+
+// only the first error of a statement is reported, the others follow it
+static void report(Parser *p, const char *msg) {
+    ast_error *e;
+    if (p->panic)
+        return;
+    p->panic = 1;
+    if (p->ast->errorcount++ >= PARSE_MAX_ERRORS)
+        return;
+    e = &p->ast->errors[p->ast->errorcount - 1];
+    e->row = p->t->beginrow;
+    e->col = p->t->begincol;
+    snprintf(e->msg, PARSE_MSGMAX, "%s", msg);
+}
+
+static void syntax_error(Parser *p, const char *what) {
+    char got[64];
+    char msg[PARSE_MSGMAX];
+    describe(p->t, p->type, got, sizeof(got));
+    snprintf(msg, sizeof(msg), "expect %s, got %s", what, got);
+    report(p, msg);
+}
+
+static int accept(Parser *p, int type) {
+    if (p->type != type)
+        return 0;
+    advance(p);
+    return 1;
+}
+
+static int expect(Parser *p, int type, const char *what) {
+    if (accept(p, type))
+        return 1;
+    syntax_error(p, what);
+    return 0;
+}
+
+// 'end' of a block opened by a keyword
+static void expect_end(Parser *p) {
+    if (expect(p, TOKEN_KW_END, "'end'"))
+        p->depth--;
+}
+
+static void skip_semis(Parser *p) {
+    while (p->type == ';')
+        advance(p);
+}
+
+static int enter(Parser *p) {
+    if (++p->nest <= PARSE_MAX_NEST)
+        return 1;
+    report(p, "too deeply nested");
+    return 0;
+}
+
+// id of the identifier, a qualified name is taken as one name "a.b.c".
+// with 'dotted', the leading '.' of an atom or field is dropped
+static unsigned token_name(Parser *p, int dotted) {
+    Token *t = p->t;
+    int len, i;
+    const char *s = tok_text(t, &len);
+    if (t->ref == NULL) {
+        // the buffer is the source's, but the token is passed right after
+        char *w = (char*)s;
+        for (i = 0; i < len; i++) {
+            if (w[i] == 0)
+                w[i] = '.';
+        }
+    }
+    while (dotted && len > 0 && *s == '.') {
+        s++;
+        len--;
+    }
+    return ast_name(p->ast, s, len);
+}
+
+static int token_is(Token *t, const char *word) {
+    int len;
+    const char *s = tok_text(t, &len);
+    return t->type == TOKEN_IDENTIFIER && len == (int)strlen(word) && memcmp(s, word, len) == 0;
+}
+
+// a builtin type, or an identifier whose last name is capitalized
+static int is_type(Token *t) {
+    int len, i;
+    const char *s;
+    if (t->type >= TOKEN_KW_INT && t->type <= TOKEN_KW_BOOL)
+        return 1;
+    if (t->type != TOKEN_IDENTIFIER)
+        return 0;
+    s = tok_text(t, &len);
+    for (i = len - 1; i > 0 && s[i - 1] != 0 && s[i - 1] != '.'; i--)
+        ;
+    return len > 0 && s[i] >= 'A' && s[i] <= 'Z';
+}
+
+// tokens beginning an argument of a call without parentheses("puts x"),
+// the ones which can't continue an expression instead
+static int begins_arg(int type) {
+    switch (type) {
+        case TOKEN_IDENTIFIER:
+        case TOKEN_INTEGER:
+        case TOKEN_FLOAT:
+        case TOKEN_STRING:
+        case TOKEN_REGEX:
+        case TOKEN_KW_TRUE:
+        case TOKEN_KW_FALSE:
+        case TOKEN_KW_NIL:
+        case TOKEN_KW_FUN:
+        case TOKEN_KW_LP:
+        case '[':
+        case '!':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int ends_block(int type) {
+    switch (type) {
+        case TOKEN_KW_END:
+        case TOKEN_KW_ELSE:
+        case TOKEN_KW_ELSEIF:
+        case TOKEN_EOS:
+        case TOKEN_SECTION:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static unsigned parse_expr(Parser *p, int power);
+static unsigned parse_block(Parser *p, int top, unsigned *pattern);
+
+static unsigned parse_type(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned n;
+    if (p->type >= TOKEN_KW_INT && p->type <= TOKEN_KW_BINARY) {
+        n = ast_add(p->ast, AST_TYPENAME, row, 0, 0);
+        if (n != 0)
+            ast_at(p->ast, n)->aux = p->type;
+        advance(p);
+        return n;
+    }
+    if (p->type != TOKEN_IDENTIFIER) {
+        syntax_error(p, "a type");
+        return 0;
+    }
+    n = ast_add(p->ast, AST_TYPENAME, row, token_name(p, 0), 0);
+    advance(p);
+    return n;
+}
+
+static unsigned parse_name(Parser *p) {
+    unsigned id;
+    if (p->type != TOKEN_IDENTIFIER) {
+        syntax_error(p, "a name");
+        return 0;
+    }
+    id = token_name(p, 0);
+    advance(p);
+    return id;
+}
+
+// name [type] [= value], a parameter, a member of a struct or a vardef
+static unsigned parse_vardef(Parser *p, int flags, int needvalue) {
+    unsigned row = p->t->beginrow;
+    unsigned name = parse_name(p);
+    unsigned ops[2] = {0, 0};
+    unsigned n;
+    if (is_type(p->t))
+        ops[0] = parse_type(p);
+    if (needvalue ? expect(p, '=', "'='") : accept(p, '='))
+        ops[1] = parse_expr(p, 1);
+    n = ast_add(p->ast, AST_VARDEF, row, name, ast_extra(p->ast, ops, 2));
+    if (n != 0)
+        ast_at(p->ast, n)->flags = flags;
+    return n;
+}
+
+#define ITEM_PLAIN  0 // expression
+#define ITEM_ARG    1 // expression or name = expression
+#define ITEM_MEMBER 2 // an argument with a type after it
+#define ITEM_PARAM  3 // name [type] [= expression]
+
+static unsigned parse_item(Parser *p, int how) {
+    unsigned row = p->t->beginrow;
+    unsigned n;
+    if (how == ITEM_PARAM)
+        return parse_vardef(p, 0, 0);
+    if (how != ITEM_PLAIN && p->type == TOKEN_IDENTIFIER && peek_type(p, 1) == '=') {
+        unsigned name = token_name(p, 0);
+        advance(p);
+        advance(p);
+        n = ast_add(p->ast, AST_NAMEDARG, row, name, parse_expr(p, 1));
+    } else {
+        n = parse_expr(p, 1);
+    }
+    if (how == ITEM_MEMBER && (p->type == TOKEN_IDENTIFIER ||
+        (p->type >= TOKEN_KW_INT && p->type <= TOKEN_KW_BINARY)))
+        n = ast_add(p->ast, AST_TYPED, row, n, parse_type(p));
+    return n;
+}
+
+// items separated by ',' till 'close', which is taken too
+static unsigned parse_items(Parser *p, int close, int how) {
+    unsigned mark = ast_mark(p->ast);
+    skip_semis(p);
+    while (p->type != close && !p->panic) {
+        ast_push(p->ast, parse_item(p, how));
+        skip_semis(p);
+        if (!accept(p, ','))
+            break;
+        skip_semis(p);
+    }
+    if (!p->panic)
+        expect(p, close, close == ')' ? "')'" : close == '}' ? "'}'" : "']'");
+    return ast_list(p->ast, mark);
+}
+
+// name in expression, assignment, or condition
+static unsigned parse_clause(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned mark, first;
+    if (p->type == TOKEN_IDENTIFIER && peek_type(p, 1) == TOKEN_KW_IN) {
+        unsigned name = token_name(p, 0);
+        advance(p);
+        advance(p);
+        mark = ast_mark(p->ast);
+        first = parse_expr(p, 1);
+        if (p->type != ',') {
+            ast_list(p->ast, mark);
+            return ast_add(p->ast, AST_IN, row, name, first);
+        }
+        ast_push(p->ast, first);
+        while (accept(p, ','))
+            ast_push(p->ast, parse_expr(p, 1));
+        first = ast_add(p->ast, AST_LIST, row, ast_list(p->ast, mark), 0);
+        return ast_add(p->ast, AST_IN, row, name, first);
+    }
+    mark = ast_mark(p->ast);
+    first = parse_expr(p, 1);
+    if (p->type != ',' && p->type != '=') {
+        ast_list(p->ast, mark);
+        return first;
+    }
+    ast_push(p->ast, first);
+    while (accept(p, ','))
+        ast_push(p->ast, parse_expr(p, 1));
+    first = ast_list(p->ast, mark);
+    expect(p, '=', "'='");
+    mark = ast_mark(p->ast);
+    ast_push(p->ast, parse_expr(p, 1));
+    while (accept(p, ','))
+        ast_push(p->ast, parse_expr(p, 1));
+    return ast_add(p->ast, AST_ASSIGN, row, first, ast_list(p->ast, mark));
+}
+
+// clauses separated by ';' till 'stop', which is taken too
+static unsigned parse_clauses(Parser *p, int stop, const char *what) {
+    unsigned mark = ast_mark(p->ast);
+    skip_semis(p);
+    while (!p->panic) {
+        ast_push(p->ast, parse_clause(p));
+        if (!accept(p, ';'))
+            break;
+        skip_semis(p);
+        if (p->type == stop)
+            break;
+    }
+    expect(p, stop, what);
+    return ast_list(p->ast, mark);
+}
+
+// [item for clauses], the '[' and the item are taken
+static unsigned parse_comp(Parser *p, unsigned row, unsigned item) {
+    unsigned mark = ast_mark(p->ast);
+    advance(p);
+    while (!p->panic) {
+        ast_push(p->ast, parse_clause(p));
+        if (!accept(p, ';') || p->type == ']')
+            break;
+    }
+    skip_semis(p);
+    expect(p, ']', "']'");
+    return ast_add(p->ast, AST_COMP, row, item, ast_list(p->ast, mark));
+}
+
+// fun(params) [type] [of type] statements end, the 'fun' and the name are taken
+static unsigned parse_fun(Parser *p, unsigned row, unsigned name, int flags) {
+    unsigned ops[5];
+    unsigned n;
+    ops[0] = name;
+    ops[1] = 0;
+    ops[2] = 0;
+    ops[3] = 0;
+    ops[4] = 0;
+    if (expect(p, '(', "'('"))
+        ops[1] = parse_items(p, ')', ITEM_PARAM);
+    if (!p->panic && is_type(p->t))
+        ops[2] = parse_type(p);
+    if (!p->panic && accept(p, TOKEN_KW_OF))
+        ops[3] = parse_type(p);
+    if (!p->panic) {
+        ops[4] = parse_block(p, 0, NULL);
+        expect_end(p);
+    }
+    n = ast_add(p->ast, AST_FUNDEF, row, ast_extra(p->ast, ops, 5), 0);
+    if (n != 0)
+        ast_at(p->ast, n)->flags = flags;
+    return n;
+}
+
+static unsigned parse_primary(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned n = 0;
+    int len;
+    const char *s;
+    switch (p->type) {
+        case TOKEN_INTEGER:
+            n = ast_int(p->ast, row, p->t->i);
+            break;
+        case TOKEN_FLOAT:
+            n = ast_float(p->ast, row, p->t->f);
+            break;
+        case TOKEN_KW_TRUE:
+        case TOKEN_KW_FALSE:
+            n = ast_add(p->ast, AST_BOOL, row, 0, 0);
+            if (n != 0)
+                ast_at(p->ast, n)->aux = p->type == TOKEN_KW_TRUE;
+            break;
+        case TOKEN_KW_NIL:
+            n = ast_add(p->ast, AST_NIL, row, 0, 0);
+            break;
+        case TOKEN_STRING:
+        case TOKEN_REGEX:
+            s = tok_text(p->t, &len);
+            n = ast_add(p->ast, p->type == TOKEN_STRING ? AST_STRING : AST_REGEX, row,
+                        ast_text(p->ast, s, len), len);
+            if (n != 0 && p->type == TOKEN_STRING && p->t->tpl != NULL)
+                ast_at(p->ast, n)->flags = AST_TEMPLATE;
+            if (n != 0 && p->type == TOKEN_REGEX)
+                ast_at(p->ast, n)->aux = (unsigned short)p->t->i;
+            break;
+        case TOKEN_IDENTIFIER:
+            s = tok_text(p->t, &len);
+            if (s[0] == '.')
+                n = ast_add(p->ast, AST_ATOM, row, token_name(p, 1), 0);
+            else
+                n = ast_add(p->ast, AST_NAME, row, token_name(p, 0), 0);
+            break;
+        case '(':
+            advance(p);
+            skip_semis(p);
+            n = parse_expr(p, 1);
+            skip_semis(p);
+            expect(p, ')', "')'");
+            return n;
+        case '{':
+            advance(p);
+            return ast_add(p->ast, AST_TUPLE, row, parse_items(p, '}', ITEM_MEMBER), 0);
+        case '[': {
+            unsigned mark = ast_mark(p->ast);
+            advance(p);
+            skip_semis(p);
+            if (p->type != ']') {
+                n = parse_expr(p, 1);
+                if (p->type == TOKEN_KW_FOR) {
+                    ast_list(p->ast, mark);
+                    return parse_comp(p, row, n);
+                }
+                ast_push(p->ast, n);
+                skip_semis(p);
+                while (accept(p, ',')) {
+                    skip_semis(p);
+                    if (p->type == ']')
+                        break;
+                    ast_push(p->ast, parse_expr(p, 1));
+                    skip_semis(p);
+                }
+            }
+            expect(p, ']', "']'");
+            return ast_add(p->ast, AST_LIST, row, ast_list(p->ast, mark), 0);
+        }
+        case TOKEN_KW_FUN:
+            advance(p);
+            p->depth++;
+            return parse_fun(p, row, 0, 0);
+        case TOKEN_KW_LP:
+            advance(p);
+            p->depth++;
+            n = parse_block(p, 0, NULL);
+            expect_end(p);
+            return ast_add(p->ast, AST_LP, row, n, 0);
+        default:
+            syntax_error(p, "an expression");
+            return 0;
+    }
+    advance(p);
+    return n;
+}
+
+// calls, news and field accesses after the primary expression
+static unsigned parse_postfix(Parser *p) {
+    unsigned n = parse_primary(p);
+    while (!p->panic) {
+        unsigned row = p->t->beginrow;
+        int len;
+        if (accept(p, '(')) {
+            n = ast_add(p->ast, AST_CALL, row, n, parse_items(p, ')', ITEM_ARG));
+        } else if (accept(p, '{')) {
+            n = ast_add(p->ast, AST_NEW, row, n, parse_items(p, '}', ITEM_ARG));
+        } else if (p->type == TOKEN_IDENTIFIER && tok_text(p->t, &len)[0] == '.') {
+            n = ast_add(p->ast, AST_FIELD, row, n, token_name(p, 1));
+            advance(p);
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+// binding power of a binary operator, 0 if the token is not one
+static int infix_power(int type) {
+    switch (type) {
+        case TOKEN_KW_OR:
+            return 1;
+        case TOKEN_KW_AND:
+            return 2;
+        case TOKEN_EQ: case TOKEN_NEQ: case '<': case '>': case TOKEN_LE: case TOKEN_GE:
+            return 3;
+        case TOKEN_RANGE:
+            return 4;
+        case '+': case '-':
+            return 5;
+        case '*': case '/': case '%':
+            return 6;
+        case TOKEN_EXPONENT:
+            return 8;
+        default:
+            return 0;
+    }
+}
+#define PREFIX_POWER 7
+
+// an expression of the operators binding at least as tight as 'power'
+static unsigned parse_expr(Parser *p, int power) {
+    unsigned row = p->t->beginrow;
+    unsigned left;
+    int op, pw;
+    if (!enter(p))
+        return 0;
+    if (p->type == '-' || p->type == '!') {
+        op = p->type;
+        advance(p);
+        left = ast_add(p->ast, AST_UNARY, row, parse_expr(p, PREFIX_POWER), 0);
+        if (left != 0)
+            ast_at(p->ast, left)->aux = op;
+    } else {
+        left = parse_postfix(p);
+    }
+    while (!p->panic) {
+        unsigned n;
+        op = p->type;
+        pw = infix_power(op);
+        if (pw == 0 || pw < power)
+            break;
+        row = p->t->beginrow;
+        advance(p);
+        // ** is right associative
+        n = parse_expr(p, op == TOKEN_EXPONENT ? pw : pw + 1);
+        left = ast_add(p->ast, AST_BINOP, row, left, n);
+        if (left != 0)
+            ast_at(p->ast, left)->aux = op;
+    }
+    p->nest--;
+    return left;
+}
+
+// [export|local] struct Name { members }, and binary
+static unsigned parse_typedef(Parser *p, int flags) {
+    unsigned row = p->t->beginrow;
+    int kind = p->type == TOKEN_KW_STRUCT ? AST_STRUCTDEF : AST_BINARYDEF;
+    unsigned mark, name, n;
+    advance(p);
+    name = parse_name(p);
+    expect(p, '{', "'{'");
+    mark = ast_mark(p->ast);
+    skip_semis(p);
+    while (p->type != '}' && !p->panic) {
+        unsigned r = p->t->beginrow;
+        if (is_type(p->t)) {
+            ast_push(p->ast, parse_type(p));
+        } else if (kind == AST_STRUCTDEF) {
+            ast_push(p->ast, parse_vardef(p, 0, 0));
+        } else {
+            int fflags = 0, bits = 0;
+            unsigned fname = parse_name(p);
+            if (accept(p, ':')) {
+                if (accept(p, '>'))
+                    fflags = AST_BIG;
+                else if (accept(p, '<'))
+                    fflags = AST_LITTLE;
+                if (p->type == TOKEN_INTEGER && p->t->i > 0 && p->t->i <= 0xffff) {
+                    bits = (int)p->t->i;
+                    advance(p);
+                } else if (token_is(p->t, "utf8")) {
+                    fflags |= AST_UTF8;
+                    advance(p);
+                } else if (token_is(p->t, "utf16")) {
+                    fflags |= AST_UTF16;
+                    advance(p);
+                } else if (token_is(p->t, "utf32")) {
+                    fflags |= AST_UTF32;
+                    advance(p);
+                } else {
+                    syntax_error(p, "count of bits or utf8/utf16/utf32");
+                }
+            }
+            n = ast_add(p->ast, AST_BINFIELD, r, fname, accept(p, '=') ? parse_expr(p, 1) : 0);
+            if (n != 0) {
+                ast_at(p->ast, n)->flags = fflags;
+                ast_at(p->ast, n)->aux = bits;
+            }
+            ast_push(p->ast, n);
+        }
+        skip_semis(p);
+        if (!accept(p, ','))
+            break;
+        skip_semis(p);
+    }
+    if (!p->panic)
+        expect(p, '}', "'}'");
+    n = ast_add(p->ast, kind, row, name, ast_list(p->ast, mark));
+    if (n != 0)
+        ast_at(p->ast, n)->flags = flags;
+    return n;
+}
+
+// if clauses then statements {elseif clauses then statements} [else statements] end
+static unsigned parse_if(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned mark = ast_mark(p->ast);
+    unsigned clauses, body;
+    advance(p);
+    p->depth++;
+    while (!p->panic) {
+        unsigned r = p->t->beginrow;
+        clauses = parse_clauses(p, TOKEN_KW_THEN, "'then'");
+        if (p->panic)
+            break;
+        body = parse_block(p, 0, NULL);
+        ast_push(p->ast, ast_add(p->ast, AST_BRANCH, r, clauses, body));
+        if (accept(p, TOKEN_KW_ELSEIF))
+            continue;
+        if (p->type == TOKEN_KW_ELSE) {
+            r = p->t->beginrow;
+            advance(p);
+            body = parse_block(p, 0, NULL);
+            ast_push(p->ast, ast_add(p->ast, AST_BRANCH, r, 0, body));
+        }
+        expect_end(p);
+        break;
+    }
+    return ast_add(p->ast, AST_IF, row, ast_list(p->ast, mark), 0);
+}
+
+// while/for clauses do statements end
+static unsigned parse_loop(Parser *p) {
+    unsigned row = p->t->beginrow;
+    int kind = p->type == TOKEN_KW_WHILE ? AST_WHILE : AST_FOR;
+    unsigned clauses, body = 0;
+    advance(p);
+    p->depth++;
+    clauses = parse_clauses(p, TOKEN_KW_DO, "'do'");
+    if (!p->panic) {
+        body = parse_block(p, 0, NULL);
+        expect_end(p);
+    }
+    return ast_add(p->ast, kind, row, clauses, body);
+}
+
+// case subject of pattern [when guard]: statements ... end
+static unsigned parse_case(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned subject, mark, pattern = 0;
+    advance(p);
+    p->depth++;
+    subject = parse_expr(p, 1);
+    expect(p, TOKEN_KW_OF, "'of'");
+    mark = ast_mark(p->ast);
+    skip_semis(p);
+    if (!p->panic && p->type != TOKEN_KW_END)
+        pattern = parse_expr(p, 1);
+    while (pattern != 0 && !p->panic) {
+        unsigned ops[2];
+        unsigned r = ast_at(p->ast, pattern)->row;
+        ops[0] = pattern;
+        ops[1] = 0;
+        if (token_is(p->t, "when")) {
+            advance(p);
+            ops[1] = parse_expr(p, 1);
+        }
+        if (!expect(p, ':', "':'"))
+            break;
+        // the body ends at the next pattern, which parse_block takes
+        pattern = 0;
+        ast_push(p->ast, ast_add(p->ast, AST_ARM, r, ast_extra(p->ast, ops, 2),
+                                 parse_block(p, 0, &pattern)));
+    }
+    if (!p->panic)
+        expect_end(p);
+    return ast_add(p->ast, AST_CASE, row, subject, ast_list(p->ast, mark));
+}
+
+// import a.b.c [as name]
+static unsigned parse_import(Parser *p) {
+    unsigned row = p->t->beginrow;
+    unsigned name, alias = 0;
+    advance(p);
+    name = parse_name(p);
+    if (!p->panic && token_is(p->t, "as")) {
+        advance(p);
+        alias = parse_name(p);
+    }
+    return ast_add(p->ast, AST_IMPORT, row, name, alias);
+}
+
+// assignment, vardef with a type, or expression. in the arms of a case,
+// an expression followed by ':' or "when" is the pattern of the next arm,
+// it's put in 'pattern' instead
+static unsigned parse_simple(Parser *p, int flags, unsigned *pattern) {
+    unsigned row = p->t->beginrow;
+    unsigned mark, first;
+
+    if (p->type == TOKEN_IDENTIFIER && (flags != 0 ||
+        (is_type(peek_token(p->src, 1)) && peek_type(p, 2) == '=')))
+        return parse_vardef(p, flags, 1);
+
+    first = parse_expr(p, 1);
+    if (p->panic)
+        return 0;
+    if (pattern != NULL && (p->type == ':' || token_is(p->t, "when"))) {
+        *pattern = first;
+        return 0;
+    }
+    if (p->type == ',' || p->type == '=') {
+        mark = ast_mark(p->ast);
+        ast_push(p->ast, first);
+        while (accept(p, ','))
+            ast_push(p->ast, parse_expr(p, 1));
+        first = ast_list(p->ast, mark);
+        expect(p, '=', "'='");
+        mark = ast_mark(p->ast);
+        ast_push(p->ast, parse_expr(p, 1));
+        while (accept(p, ','))
+            ast_push(p->ast, parse_expr(p, 1));
+        return ast_add(p->ast, AST_ASSIGN, row, first, ast_list(p->ast, mark));
+    }
+    if (begins_arg(p->type) && ast_at(p->ast, first)->kind == AST_NAME) {
+        // call without parentheses: puts x, y
+        mark = ast_mark(p->ast);
+        ast_push(p->ast, parse_expr(p, 1));
+        while (accept(p, ','))
+            ast_push(p->ast, parse_expr(p, 1));
+        first = ast_add(p->ast, AST_CALL, row, first, ast_list(p->ast, mark));
+    }
+    return ast_add(p->ast, AST_EXPR, row, first, 0);
+}
+
+static unsigned parse_statement(Parser *p, unsigned *pattern) {
+    unsigned row = p->t->beginrow;
+    unsigned mark, n;
+    int flags = 0;
+
+    if (p->type == TOKEN_KW_EXPORT || p->type == TOKEN_KW_LOCAL) {
+        flags = p->type == TOKEN_KW_EXPORT ? AST_EXPORT : AST_LOCAL;
+        advance(p);
+        if (p->type != TOKEN_KW_STRUCT && p->type != TOKEN_KW_BINARY &&
+            p->type != TOKEN_KW_FUN && p->type != TOKEN_IDENTIFIER) {
+            syntax_error(p, "a definition");
+            return 0;
+        }
+    }
+    switch (p->type) {
+        case TOKEN_KW_STRUCT:
+        case TOKEN_KW_BINARY:
+            return parse_typedef(p, flags);
+        case TOKEN_KW_FUN:
+            if (peek_type(p, 1) != TOKEN_IDENTIFIER)
+                break;
+            advance(p);
+            p->depth++;
+            n = parse_name(p);
+            return parse_fun(p, row, n, flags);
+        case TOKEN_KW_IF:
+            return parse_if(p);
+        case TOKEN_KW_WHILE:
+        case TOKEN_KW_FOR:
+            return parse_loop(p);
+        case TOKEN_KW_CASE:
+            return parse_case(p);
+        case TOKEN_KW_DO:
+            advance(p);
+            p->depth++;
+            n = parse_block(p, 0, NULL);
+            expect_end(p);
+            return ast_add(p->ast, AST_DO, row, n, 0);
+        case TOKEN_KW_IMPORT:
+            return parse_import(p);
+        case TOKEN_KW_BREAK:
+        case TOKEN_KW_CONTINUE:
+            n = ast_add(p->ast, p->type == TOKEN_KW_BREAK ? AST_BREAK : AST_CONTINUE, row, 0, 0);
+            advance(p);
+            return n;
+        case TOKEN_KW_RETURN:
+            advance(p);
+            mark = ast_mark(p->ast);
+            if (p->type != ';' && !ends_block(p->type)) {
+                ast_push(p->ast, parse_expr(p, 1));
+                while (accept(p, ','))
+                    ast_push(p->ast, parse_expr(p, 1));
+            }
+            return ast_add(p->ast, AST_RETURN, row, ast_list(p->ast, mark), 0);
+    }
+    return parse_simple(p, flags, pattern);
+}
+
+// skip the rest of a statement with an error: till the ';' ending it, or
+// the 'end'/'else'/'elseif' of the block it's in, whose depth is 'level'.
+// the blocks opened on the way are skipped as a whole.
+static void synchronize(Parser *p, int level) {
+    while (p->type != TOKEN_EOS && p->type != TOKEN_SECTION) {
+        int stop = 0;
+        switch (p->type) {
+            case ';':
+                if (p->depth <= level) {
+                    advance(p);
+                    stop = 1;
+                }
+                break;
+            case TOKEN_KW_END:
+                if (p->depth <= level)
+                    stop = 1;
+                else
+                    p->depth--;
+                break;
+            case TOKEN_KW_ELSE:
+            case TOKEN_KW_ELSEIF:
+                stop = p->depth <= level;
+                break;
+            case TOKEN_KW_IF:
+            case TOKEN_KW_WHILE:
+            case TOKEN_KW_FOR:
+            case TOKEN_KW_CASE:
+            case TOKEN_KW_FUN:
+            case TOKEN_KW_LP:
+                p->depth++;
+                break;
+            case TOKEN_KW_DO:
+                // "do" of while/for doesn't open a block of its own
+                if (p->last == ';' || p->last == TOKEN_KW_THEN ||
+                    p->last == TOKEN_KW_ELSE || p->last == TOKEN_KW_DO)
+                    p->depth++;
+                break;
+        }
+        if (stop)
+            break;
+        advance(p);
+    }
+    p->depth = level;
+    p->panic = 0;
+}
+
+// statements till the end of the block, which is not taken. the top
+// level block of a section ends at the next section only
+static unsigned parse_block(Parser *p, int top, unsigned *pattern) {
+    unsigned mark = ast_mark(p->ast);
+    int level = p->depth;
+    if (!enter(p))
+        return 0;
+    while (1) {
+        unsigned top_before = p->ast->top;
+        unsigned row, n;
+        skip_semis(p);
+        if (p->type == TOKEN_EOS || p->type == TOKEN_SECTION)
+            break;
+        if (!top && ends_block(p->type))
+            break;
+        row = p->t->beginrow;
+        n = parse_statement(p, pattern);
+        if (!p->panic && pattern != NULL && *pattern != 0)
+            break;
+        if (!p->panic && p->type != ';' && !ends_block(p->type))
+            syntax_error(p, "end of line or ';'");
+        if (p->panic) {
+            p->ast->top = top_before;
+            n = ast_add(p->ast, AST_ERROR, row, 0, 0);
+            synchronize(p, level);
+            // a stray 'end' at the top level
+            if (top && ends_block(p->type) && p->type != TOKEN_EOS && p->type != TOKEN_SECTION)
+                advance(p);
+        }
+        ast_push(p->ast, n);
+    }
+    p->nest--;
+    return ast_list(p->ast, mark);
+}
+
+// [doc] statements, the header is taken
+static unsigned parse_section(Parser *p, unsigned row, int level, unsigned title) {
+    unsigned ops[3];
+    unsigned n;
+    ops[0] = title;
+    ops[1] = 0;
+    skip_semis(p);
+    if (p->type == TOKEN_STRING) {
+        int t = peek_type(p, 1);
+        if (t == ';' || t == TOKEN_EOS || t == TOKEN_SECTION) {
+            ops[1] = parse_primary(p);
+        }
+    }
+    ops[2] = parse_block(p, 1, NULL);
+    n = ast_add(p->ast, AST_SECTION, row, ast_extra(p->ast, ops, 3), 0);
+    if (n != 0)
+        ast_at(p->ast, n)->aux = level;
+    return n;
+}
+
+static lp_ast *parse(void *src, lp_ast *ast) {
+    Parser parser;
+    Parser *p = &parser;
+    unsigned mark;
+
+    if (ast == NULL)
+        return NULL;
+    memset(p, 0, sizeof(Parser));
+    p->src = src;
+    p->ast = ast;
+    advance(p);
+
+    mark = ast_mark(p->ast);
+    ast_push(p->ast, parse_section(p, 1, '0', 0));
+    while (p->type == TOKEN_SECTION) {
+        unsigned row = p->t->beginrow;
+        int level = (int)p->t->i;
+        int len;
+        const char *s = tok_text(p->t, &len);
+        unsigned title;
+        // the title is the rest of the header line, without the blanks around
+        while (len > 0 && (*s == ' ' || *s == '\t')) {
+            s++;
+            len--;
+        }
+        while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' || s[len - 1] == '\r'))
+            len--;
+        title = ast_add(p->ast, AST_STRING, row, ast_text(p->ast, s, len), len);
+        advance(p);
+        ast_push(p->ast, parse_section(p, row, level, title));
+    }
+    p->ast->root = ast_add(p->ast, AST_MODULE, 1, ast_list(p->ast, mark), 0);
+    if (p->ast->nomem) {
+        ast_free(p->ast);
+        return NULL;
+    }
+    return p->ast;
+}
+
+lp_ast *parse_module(void *src, lp_strpool *names) {
+    return parse(src, ast_new(names));
+}
+
+lp_ast *parse_module_shared(void *src, lp_sharedpool *names) {
+    return parse(src, ast_new_shared(names));
+}
+
+void print_parse_errors(lp_ast *ast, const char *name) {
+    int i;
+    for (i = 0; i < ast->errorcount && i < PARSE_MAX_ERRORS; i++)
+        printf("%s:%d:%d: %s\n", name, ast->errors[i].row, ast->errors[i].col, ast->errors[i].msg);
+    if (ast->errorcount > PARSE_MAX_ERRORS)
+        printf("%s: %d more errors\n", name, ast->errorcount - PARSE_MAX_ERRORS);
+}
+
+//1 --------------------- test ---------------------------------------
+#ifdef AST_TEST
+#include <assert.h>
+#include <pthread.h>
+
+static unsigned name_node(lp_ast *ast, const char *name) {
+    return ast_add(ast, AST_NAME, 1, ast_name(ast, name, strlen(name)), 0);
+}
+
+static unsigned binop(lp_ast *ast, int op, unsigned l, unsigned r) {
+    unsigned n = ast_add(ast, AST_BINOP, 1, l, r);
+    ast_at(ast, n)->aux = op;
+    return n;
+}
+
+// fun add(a int, b) int: return a + b * 2 end
+static unsigned test_fun(lp_ast *ast) {
+    unsigned ops[5], mark, inner, n, type;
+    unsigned vops[2];
+
+    mark = ast_mark(ast);
+    type = ast_add(ast, AST_TYPENAME, 1, 0, 0);
+    ast_at(ast, type)->aux = TOKEN_KW_INT;
+    vops[0] = type;
+    vops[1] = 0;
+    ast_push(ast, ast_add(ast, AST_VARDEF, 1, ast_name(ast, "a", 1), ast_extra(ast, vops, 2)));
+    vops[0] = 0;
+    ast_push(ast, ast_add(ast, AST_VARDEF, 1, ast_name(ast, "b", 1), ast_extra(ast, vops, 2)));
+    ops[0] = ast_name(ast, "add", 3);
+    ops[1] = ast_list(ast, mark);
+    ops[2] = ast_add(ast, AST_TYPENAME, 1, ast_name(ast, "Int", 3), 0);
+    ops[3] = 0;
+
+    mark = ast_mark(ast);
+    inner = ast_mark(ast);
+    ast_push(ast, binop(ast, '+', name_node(ast, "a"),
+                        binop(ast, '*', name_node(ast, "b"), ast_int(ast, 1, 2))));
+    n = ast_add(ast, AST_RETURN, 1, ast_list(ast, inner), 0);
+    ast_push(ast, n);
+    ops[4] = ast_list(ast, mark);
+    n = ast_add(ast, AST_FUNDEF, 1, ast_extra(ast, ops, 5), 0);
+    ast_at(ast, n)->flags = AST_EXPORT;
+    return n;
+}
+
+// many nested lists of many statements, to check the lists are kept apart
+static void test_big(int count) {
+    lp_ast *ast = ast_new(NULL);
+    unsigned outer = ast_mark(ast);
+    unsigned list, i, j;
+    for (i = 0; i < (unsigned)count; i++) {
+        unsigned inner = ast_mark(ast);
+        for (j = 0; j <= i % 7; j++)
+            ast_push(ast, ast_int(ast, i, (long)i * 100 + j));
+        ast_push(ast, ast_add(ast, AST_LP, i, ast_list(ast, inner), 0));
+    }
+    list = ast_list(ast, outer);
+    assert(!ast->nomem);
+    assert(ast->top == 0);
+    assert(ast_count(ast, list) == (unsigned)count);
+    for (i = 0; i < (unsigned)count; i++) {
+        ast_node *lp = ast_at(ast, ast_items(ast, list)[i]);
+        assert(lp->kind == AST_LP && lp->row == i);
+        assert(ast_count(ast, lp->a) == i % 7 + 1);
+        for (j = 0; j <= i % 7; j++)
+            assert(ast_intval(ast, ast_items(ast, lp->a)[j]) == (long)i * 100 + j);
+    }
+    printf("%u nodes, %u extra, %lu bytes of nodes\n", ast->count, ast->extracount,
+           (unsigned long)ast->count * sizeof(ast_node));
+    ast_free(ast);
+}
+
+// parser threads sharing one pool: a name has the same id in all asts
+#define TEST_THREADS 4
+#define TEST_MODULES 200
+
+static lp_sharedpool *test_names;
+static unsigned test_ids[TEST_THREADS][TEST_MODULES];
+
+static void *test_parser(void *arg) {
+    int t = (int)(long)arg;
+    char text[128];
+    int i;
+    for (i = 0; i < TEST_MODULES; i++) {
+        void *src;
+        lp_ast *ast;
+        int n = (i * 7 + t * 13) % TEST_MODULES;
+        sprintf(text, "x%d = total + %d\nputs(x%d, total)\n", n, n, n);
+        src = string_source(text);
+        ast = parse_module_shared(src, test_names);
+        close_source(src);
+        assert(ast != NULL && ast->errorcount == 0 && ast->names == NULL);
+        sprintf(text, "x%d", n);
+        test_ids[t][n] = ast_name(ast, text, strlen(text));
+        assert(strcmp(ast_namestr(ast, test_ids[t][n]), text) == 0);
+        assert(ast_name(ast, "total", 5) == ast_name(ast, "total", 5));
+        ast_free(ast);
+    }
+    return NULL;
+}
+
+static void test_shared() {
+    pthread_t threads[TEST_THREADS];
+    unsigned total;
+    int i, t;
+
+    test_names = sharedpool_init();
+    for (t = 0; t < TEST_THREADS; t++)
+        pthread_create(&threads[t], NULL, test_parser, (void*)(long)t);
+    for (t = 0; t < TEST_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    for (i = 0; i < TEST_MODULES; i++) {
+        for (t = 1; t < TEST_THREADS; t++)
+            assert(test_ids[t][i] == test_ids[0][i]);
+    }
+    // x0..x199, total and puts
+    assert(sharedpool_count(test_names) == TEST_MODULES + 2);
+    total = sharedpool_addn(test_names, "total", 5);
+    assert(strcmp(sharedpool_get(test_names, total), "total") == 0);
+    sharedpool_destroy(test_names);
+    printf("%d modules parsed on a shared pool\n", TEST_THREADS * TEST_MODULES);
+}
+
+int main(int argc, char *argv[]) {
+    lp_ast *ast = ast_new(NULL);
+    unsigned ops[3], mark, sec;
+
+    assert(sizeof(ast_node) == 16);
+    mark = ast_mark(ast);
+    ast_push(ast, test_fun(ast));
+    ast_push(ast, ast_add(ast, AST_IMPORT, 2, ast_name(ast, "lp.io", 5), ast_name(ast, "io", 2)));
+    ops[0] = ast_add(ast, AST_STRING, 1, ast_text(ast, "intro", 5), 5);
+    ops[1] = 0;
+    ops[2] = ast_list(ast, mark);
+    sec = ast_add(ast, AST_SECTION, 1, ast_extra(ast, ops, 3), 0);
+    ast_at(ast, sec)->aux = '1';
+    mark = ast_mark(ast);
+    ast_push(ast, sec);
+    ast->root = ast_add(ast, AST_MODULE, 1, ast_list(ast, mark), 0);
+    assert(ast_intval(ast, ast_int(ast, 1, -5000000000L)) == -5000000000L);
+    assert(ast_floatval(ast, ast_float(ast, 1, 1.5e300)) == 1.5e300);
+    ast_print(ast, ast->root);
+    ast_free(ast);
+
+    test_big(argc > 1 ? atoi(argv[1]) : 100000);
+    test_shared();
+    return 0;
+}
+#endif //AST_TEST
@@ -1,121 +1,247 @@
-#ifndef LPPARSE_H
-#define LPPARSE_H
-typedef struct {
-    int count;
-    char 
-} lp_qualified_name;
-// lp_type
-typedef struct lpt_struct_ {
-
-} lpt_struct;
-
-typedef struct lpt_function_ {
-
-} lpt_function;
-
-typedef struct lpt_closure_ {
-
-} lpt_closure;
-
-// lp_value
-#define LPV_BOOLEAN
-#define LPV_INTEGER
-#define LPV_FLOAT
-#define LPV_STRING
-#define LPV_REGEX
-#define LPV_FUNCTION
-#define LPV_LP
-#define LPV_OBJECT
-#define LPV_BINARY
-
-struct lpv_function_;
-struct lpv_lp_;
-struct lpv_object_;
-struct lpv_binary_;
-
-typedef struct {
-    int type;
-    union {
-        long i;
-        double f;
-        char *s;
-        struct lpv_function_ *fn;
-        struct lpv_lp_       *lp;
-        struct lpv_object_   *o;
-        struct lpv_binary_   *b;
-    } u;
-} lp_value;
-
-typedef struct lpv_object_ {
-    lpt_struct *type;
-    int item_count;
-    lp_value items[];
-} lpv_object;
-
-typedef struct lpv_binary_ {
-    lpt_binary *type;
-    int byte_count;
-    unsigned char bytes[];
-} lpv_binary;
-
-typedef struct lpv_function_ {
-    lpt_struct *owner;
-    lpt_any    *result;
-    int arg_count;
-    
-} lpv_function;
-
-// ast definition
-// statement definition
-#define STATEMENT_TYPEDEF 0
-#define STATEMENT_FUNDEF 1
-#define STATEMENT_VARDEF 2
-#define STATEMENT_IF     3
-#define STATEMENT_WHILE 4
-#define STATEMENT_CASE 5
-#define STATEMENT_FOR 6
-#define STATEMENT_IMPORT 7
-#define STATEMENT_COMMON_MEMBERS \
-    int type
-
-
-typedef union {
-    int b;
-    long i;
-    double f;
-    char *s;
-} ast_value;
-
-typedef struct {
-    char *name;
-    ast_type *type;
-    ast_value def;
-} ast_vardef;
-
-typedef struct {
-} ast_struct_item;
-
-typedef struct {
-    STATEMENT_COMMON_MEMBERS;
-    int is_export;
-    int is_local;
-    char *name;
-    int item_count;
-    ast_struct_item *items[1];
-} ast_structdef;
-
-typedef struct {
-    STATEMENT_COMMON_MEMBERS;
-} ast_statement;
-typedef struct {
-    char *title;
-    int level;
-    char *doc;
-    int statement_count;
-    ast_statement *statements[1];
-} ast_section;
-typedef struct {
-    int section_count;
-    ast_section sections[1];
-} ast_module;
-#endif //LPPARSE_H
+#ifndef LPPARSE_H
+#define LPPARSE_H
+#include "strpool.h"
+
+/*
+ * ast of a module.
+ * 1. all nodes of a module live in one array of the lp_ast, and refer to
+ *    each other by their 32-bit index in it, so the array can grow by
+ *    realloc, and the whole tree is freed by ast_free in one call. index
+ *    0 is no node.
+ * 2. a node is 16 bytes: kind, flags, aux, row and two operands a and b.
+ *    a node needing more operands keeps them in the extra array, a is
+ *    where they begin there.
+ * 3. a child list is a contiguous range of the extra array: the count,
+ *    then the indexes of the children. it's referred to by where it
+ *    begins, list 0 is the empty list. the children are collected on a
+ *    scratch stack while they're parsed(see ast_mark/ast_push/ast_list),
+ *    so nested lists don't interleave.
+ * 4. identifiers are ids of the string pool of the ast, id 0 is "", for
+ *    no name. a qualified name(a.b.C) is one id. the text of strings,
+ *    regexes and docs is kept in the text array of the ast.
+ * 5. children are added before their parents, so a pass not caring about
+ *    the order of the tree can walk the node array from 1 up.
+ *
+ * operands of each kind, "extra[...]" are the operands kept at a:
+ *   MODULE     a: list of sections
+ *   SECTION    aux: the level char('0'-'9', '<', '>', '='),
+ *              a: extra[title(STRING), doc(STRING), list of statements]
+ *   STRUCTDEF  flags: AST_EXPORT/AST_LOCAL, a: name, b: list of members,
+ *   BINARYDEF  each one a VARDEF/BINFIELD or a TYPENAME
+ *   BINFIELD   flags: AST_BIG/AST_LITTLE/AST_UTF8/AST_UTF16/AST_UTF32,
+ *              aux: count of bits, a: name, b: default value
+ *   FUNDEF     flags: AST_EXPORT/AST_LOCAL, a: extra[name,
+ *              list of parameters(VARDEF), result type, "of" type,
+ *              list of statements]
+ *   VARDEF     flags: AST_EXPORT/AST_LOCAL, a: name, b: extra[type, value]
+ *   TYPENAME   aux: the TOKEN_KW_xxx of a builtin type, else a: name
+ *   IMPORT     a: name, b: alias
+ *   IF         a: list of BRANCHes, the last one has no clause for else
+ *   BRANCH     a: list of clauses, b: list of statements
+ *   WHILE      a: list of clauses, b: list of statements
+ *   FOR        a: list of clauses, b: list of statements
+ *   DO         a: list of statements
+ *              a clause is an IN, an ASSIGN or a condition
+ *   IN         a: name, b: expression iterated
+ *   CASE       a: subject, b: list of ARMs
+ *   ARM        a: extra[pattern, guard], b: list of statements
+ *   ASSIGN     a: list of targets, b: list of values
+ *   RETURN     a: list of values
+ *   BREAK, CONTINUE
+ *   EXPR       a: expression as a statement
+ *   LP         a: list of statements
+ *   INT        a, b: low and high 32 bits, see ast_int
+ *   FLOAT      a, b: low and high 32 bits of the double, see ast_float
+ *   BOOL       aux: 0 or 1
+ *   NIL
+ *   STRING     flags: AST_TEMPLATE if it has holes(compile_template on
+ *              the text makes it), a: text, b: length
+ *   REGEX      aux: STRTYPE_xxx, a: text, b: length
+ *   NAME       a: name
+ *   UNARY      aux: operator, a: operand
+ *   BINOP      aux: operator(the char or TOKEN_xxx), a: left, b: right
+ *   FIELD      a: expression, b: name
+ *   CALL       a: function, b: list of arguments
+ *   NEW        a: type or variable, b: list of arguments
+ *   NAMEDARG   a: name, b: value
+ *   TUPLE      a: list of members
+ *   TYPED      a: expression, b: type
+ *   LIST       a: list of items
+ *   COMP       a: item, b: list of clauses, for [item for clauses]
+ *   ATOM       a: name without the leading '.'
+ *   ERROR      a statement with a syntax error, skipped
+ */
+#define AST_MODULE    1
+#define AST_SECTION   2
+#define AST_STRUCTDEF 3
+#define AST_BINARYDEF 4
+#define AST_BINFIELD  5
+#define AST_FUNDEF    6
+#define AST_VARDEF    7
+#define AST_TYPENAME  8
+#define AST_IMPORT    9
+#define AST_IF        10
+#define AST_BRANCH    11
+#define AST_WHILE     12
+#define AST_FOR       13
+#define AST_IN        14
+#define AST_CASE      15
+#define AST_ARM       16
+#define AST_ASSIGN    17
+#define AST_RETURN    18
+#define AST_BREAK     19
+#define AST_CONTINUE  20
+#define AST_EXPR      21
+#define AST_LP        22
+#define AST_INT       23
+#define AST_FLOAT     24
+#define AST_BOOL      25
+#define AST_NIL       26
+#define AST_STRING    27
+#define AST_REGEX     28
+#define AST_NAME      29
+#define AST_UNARY     30
+#define AST_BINOP     31
+#define AST_FIELD     32
+#define AST_CALL      33
+#define AST_NEW       34
+#define AST_NAMEDARG  35
+#define AST_TUPLE     36
+#define AST_TYPED     37
+#define AST_DO        38
+#define AST_LIST      39
+#define AST_COMP      40
+#define AST_ATOM      41
+#define AST_ERROR     42
+#define AST_KINDS     43
+
+// flags
+#define AST_EXPORT   0x01
+#define AST_LOCAL    0x02
+#define AST_TEMPLATE 0x04
+#define AST_BIG      0x08
+#define AST_LITTLE   0x10
+#define AST_UTF8     0x20
+#define AST_UTF16    0x40
+#define AST_UTF32    0x80
+
+typedef struct {
+    unsigned char kind;
+    unsigned char flags;
+    unsigned short aux;
+    unsigned row;        // row of the source where the node begins
+    unsigned a;
+    unsigned b;
+} ast_node;
+
+#define PARSE_MAX_ERRORS 32   // errors kept in the ast, the others are counted only
+#define PARSE_MAX_NEST   1000 // nesting of blocks and expressions
+#define PARSE_MSGMAX     128
+
+typedef struct {
+    int row;
+    int col;
+    char msg[PARSE_MSGMAX];
+} ast_error;
+
+typedef struct {
+    ast_node *nodes;     // nodes[0] is not used
+    unsigned count;
+    unsigned size;
+    unsigned *extra;     // operands and child lists, extra[0] is the empty list
+    unsigned extracount;
+    unsigned extrasize;
+    unsigned *stack;     // children of the lists being built
+    unsigned top;
+    unsigned stacksize;
+    char *text;          // text of strings, regexes and docs, each one NUL ended
+    unsigned textcount;
+    unsigned textsize;
+    lp_strpool *names;   // identifiers, NULL if 'shared' is used
+    lp_sharedpool *shared; // identifiers shared with the asts of other threads
+    int ownnames;        // the pool is freed with the ast
+    int nomem;           // an allocation failed, the tree is incomplete
+    unsigned root;       // the MODULE node
+    unsigned tokens;     // tokens parsed
+    int errorcount;      // syntax errors, the first PARSE_MAX_ERRORS are in 'errors'
+    ast_error errors[PARSE_MAX_ERRORS];
+} lp_ast;
+
+// create an ast, whose identifiers are added to 'names'. a pool of its
+// own is created if 'names' is NULL. NULL if no enough memory
+lp_ast *ast_new(lp_strpool *names);
+// the same as ast_new, but the identifiers are added to a shared pool,
+// so the asts parsed by several threads have the same ids for a name
+lp_ast *ast_new_shared(lp_sharedpool *names);
+
+// free the ast and all its nodes, and the pool if it's its own
+void ast_free(lp_ast *ast);
+
+// add a node, return its index. the functions adding things return 0 if
+// there's no enough memory, and ast->nomem is set, so the caller can go
+// on and check it once at the end
+unsigned ast_add(lp_ast *ast, int kind, unsigned row, unsigned a, unsigned b);
+
+// keep 'n' operands in the extra array, return where they begin
+unsigned ast_extra(lp_ast *ast, const unsigned *items, int n);
+
+// building a child list: take the mark before parsing the children, push
+// each child, then ast_list moves the children pushed since the mark
+// into a list, and returns it
+unsigned ast_mark(lp_ast *ast);
+void ast_push(lp_ast *ast, unsigned node);
+unsigned ast_list(lp_ast *ast, unsigned mark);
+
+// keep a text of 'len' chars, return its offset in ast->text
+unsigned ast_text(lp_ast *ast, const char *str, int len);
+
+// id of an identifier
+unsigned ast_name(lp_ast *ast, const char *str, int len);
+
+unsigned ast_int(lp_ast *ast, unsigned row, long i);
+unsigned ast_float(lp_ast *ast, unsigned row, double f);
+long ast_intval(lp_ast *ast, unsigned node);
+double ast_floatval(lp_ast *ast, unsigned node);
+
+#define ast_at(ast, n)          (&(ast)->nodes[n])
+#define ast_ops(ast, n)         (&(ast)->extra[(ast)->nodes[n].a])
+#define ast_count(ast, list)    ((ast)->extra[list])
+#define ast_items(ast, list)    (&(ast)->extra[(list) + 1])
+#define ast_str(ast, off)       (&(ast)->text[off])
+#define ast_namestr(ast, id)    ((ast)->shared != NULL ? sharedpool_get((ast)->shared, (id)) \
+                                                   : strpool_get((ast)->names, (id)))
+
+// print the tree under the node as an s-expression, for test
+void ast_print(lp_ast *ast, unsigned node);
+
+// call fn on the node and each node under it, a parent before its children
+void ast_walk(lp_ast *ast, unsigned node, void (*fn)(void *arg, unsigned n), void *arg);
+
+/*
+ * parser: recursive descent on the tokens of next_token, with the
+ * expressions parsed by precedence climbing(Pratt). every token is looked
+ * at a constant number of times, nothing is parsed twice.
+ * 1. the ';' the lexer puts at the ends of lines end the statements, and
+ *    are skipped inside brackets.
+ * 2. on a syntax error the statement is replaced by an ERROR node, and
+ *    the tokens are skipped till the ';' or 'end' ending it, keeping count
+ *    of the blocks opened and closed on the way, so the parse goes on with
+ *    the next statement of the same block.
+ * 3. a lexical error ends the parse, it's the last error.
+ *
+ * operators, from the lowest precedence: or, and, == != < > <= >=, ..,
+ * + -, * / %, the prefix - and !, ** (right associative), then the
+ * postfix call(...), new{...} and field access .name.
+ */
+
+// parse the whole source(not an open stream source) into an ast, see
+// ast_new for 'names'. the ast is returned even if there are syntax
+// errors, see ast->errorcount. NULL if no enough memory
+lp_ast *parse_module(void *src, lp_strpool *names);
+// the same as parse_module, for a parser thread sharing 'names' with others
+lp_ast *parse_module_shared(void *src, lp_sharedpool *names);
+
+// print the syntax errors of the ast
+void print_parse_errors(lp_ast *ast, const char *name);
+
+#endif //LPPARSE_H
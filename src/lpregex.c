@@ -0,0 +1,1776 @@
+#include "lpregex.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+//1 ----------------- program ---------------------------------------
+enum {
+    OP_CHAR,    // x: the char
+    OP_ANY,     // any char but '\n'
+    OP_CLASS,   // x: index of the class
+    OP_BOL,     // ^
+    OP_EOL,     // $
+    OP_WORDB,   // \b
+    OP_NWORDB,  // \B
+    OP_BACKREF, // x: the group
+    OP_SAVE,    // x: slot of the groups, 2*group for the beginning, 2*group+1 for the end
+    OP_SPLIT,   // go on at pc+x, then at pc+y if that fails
+    OP_JMP,     // go on at pc+x
+    OP_MATCH,   // x: the arm of a regex set, 0 in a regex
+};
+
+#define LOOP_INDEX  0x7f // index+1 of the loop in Inst.loop, 0 if not a loop
+#define LOOP_BODY_Y 0x80 // the body of the loop is at pc+y(a lazy loop)
+#define MAX_LOOPS   LOOP_INDEX
+
+// the jumps are relative, so a piece of program can be moved or copied
+// as it is while compiling
+typedef struct {
+    unsigned char op;
+    unsigned char loop;  // of the SPLIT of a loop, see LOOP_INDEX
+    short x;
+    short y;
+} Inst;
+
+typedef struct {
+    unsigned char bits[32];
+} CharClass;
+
+#define in_class(c, ch) ((c)->bits[(ch) >> 3] & (1 << ((ch) & 7)))
+#define add_class_char(c, ch) ((c)->bits[(ch) >> 3] |= (unsigned char)(1 << ((ch) & 7)))
+
+//1 ----------------- lazy DFA --------------------------------------
+#define DS_MATCH    1 // MATCH is in the state
+#define DS_ENDMATCH 2 // matches if the subject ends here($)
+#define DS_DEAD     4 // no match can follow
+
+typedef struct {
+    int off;       // of the pcs in the pool, sorted
+    int n;
+    unsigned hash;
+    int flags;
+    int arm;       // the first arm matched in the state, with DS_MATCH
+    int endarm;    // the first arm matched at the end, with DS_ENDMATCH
+    int live;      // the first arm that can match after the state, INT_MAX if none
+} DState;
+
+struct lp_regex {
+    Inst *prog;
+    int ninst;
+    int instsize;
+    CharClass *classes;
+    int nclass;
+    int classsize;
+    int ngroup;
+    int nloop;
+    int backtrack;        // the DFA can't match it, for \b or back references
+    int anchored;         // a match can only begin at 0
+    unsigned char lit[REGEX_MAX_LIT]; // a literal every match contains
+    int litlen;           // 0 if none is known
+    unsigned short *armof; // arm of each pc of a combined regex set, NULL in a regex
+
+    // chars the program can't tell apart share a column of the table
+    unsigned char *bytemap;     // column of each char
+    unsigned char *colbyte;     // a char of each column
+    int ncol;
+
+    // the lazy DFA, built on the first match
+    DState *states;
+    int nstate;
+    short *table;         // nstate*ncol next states, -1 if not built yet
+    int *slots;           // hash table of the states, -1 if empty
+    int *pool;            // the pcs of the states
+    int poolused;
+    int poolsize;
+    int start;            // the state at the beginning, -1 if not built yet
+    int maxstate;         // states cached, a power of 2
+    int flushes;
+
+    // scratch, allocated on the first match
+    int *set;             // pcs of a state being built
+    int *stack;           // of the closure
+    unsigned *seen;       // generation of each pc visited by the closure
+    unsigned gen;
+    int *groups;          // of regex_match
+    int *loops;           // where each loop was entered last, for backtracking
+    struct Choice *choices;
+    int choicesize;
+};
+
+#define SLOT_COUNT(re) ((re)->maxstate * 2)
+
+//1 ----------------- compile ---------------------------------------
+#define PARSE_INSTS   64 // a program this small is built without malloc
+#define PARSE_CLASSES 4
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    lp_regex *re;
+    const char *err;
+    int depth;            // of the groups
+    int alt;              // '|' out of any group
+    int runlen;           // plain chars just parsed out of any group
+    unsigned char run[REGEX_MAX_LIT];
+    Inst insts[PARSE_INSTS];
+    CharClass classes[PARSE_CLASSES];
+} Parser;
+
+static int is_word(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static int is_digit(int c) {
+    return c >= '0' && c <= '9';
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int fail(Parser *ps, const char *err) {
+    if (ps->err == NULL)
+        ps->err = err;
+    return 0;
+}
+
+// make room for 'n' more instructions
+static int reserve(Parser *ps, int n) {
+    lp_regex *re = ps->re;
+    if (re->ninst + n > REGEX_MAX_INSTS)
+        return fail(ps, "regex too big");
+    if (re->ninst + n > re->instsize) {
+        int size = re->instsize * 2;
+        Inst *prog;
+        while (size < re->ninst + n)
+            size *= 2;
+        if (re->prog == ps->insts) {
+            prog = (Inst*)malloc(size * sizeof(Inst));
+            if (prog != NULL)
+                memcpy(prog, ps->insts, re->ninst * sizeof(Inst));
+        } else {
+            prog = (Inst*)realloc(re->prog, size * sizeof(Inst));
+        }
+        if (prog == NULL)
+            return fail(ps, "");
+        re->prog = prog;
+        re->instsize = size;
+    }
+    return 1;
+}
+
+static int emit(Parser *ps, int op, int x, int y) {
+    Inst *in;
+    if (!reserve(ps, 1))
+        return -1;
+    in = &ps->re->prog[ps->re->ninst];
+    in->op = (unsigned char)op;
+    in->loop = 0;
+    in->x = (short)x;
+    in->y = (short)y;
+    return ps->re->ninst++;
+}
+
+// insert an instruction at 'at', moving the ones after it
+static int insert(Parser *ps, int at, int op, int x, int y) {
+    lp_regex *re = ps->re;
+    if (!reserve(ps, 1))
+        return 0;
+    memmove(re->prog + at + 1, re->prog + at, (re->ninst - at) * sizeof(Inst));
+    re->ninst++;
+    re->prog[at].op = (unsigned char)op;
+    re->prog[at].loop = 0;
+    re->prog[at].x = (short)x;
+    re->prog[at].y = (short)y;
+    return 1;
+}
+
+static int new_loop(Parser *ps, int bodyy) {
+    if (ps->re->nloop >= MAX_LOOPS)
+        return 0; // not guarded, REGEX_MAX_STEPS stops an empty loop
+    return ++ps->re->nloop | (bodyy ? LOOP_BODY_Y : 0);
+}
+
+static int add_class(Parser *ps, CharClass *c) {
+    lp_regex *re = ps->re;
+    if (re->nclass == re->classsize) {
+        int size = re->classsize * 2;
+        CharClass *classes;
+        if (re->classes == ps->classes) {
+            classes = (CharClass*)malloc(size * sizeof(CharClass));
+            if (classes != NULL)
+                memcpy(classes, ps->classes, re->nclass * sizeof(CharClass));
+        } else {
+            classes = (CharClass*)realloc(re->classes, size * sizeof(CharClass));
+        }
+        if (classes == NULL)
+            return fail(ps, "");
+        re->classes = classes;
+        re->classsize = size;
+    }
+    re->classes[re->nclass] = *c;
+    return emit(ps, OP_CLASS, re->nclass++, 0) >= 0;
+}
+
+// the class of \d \w \s, or of \D \W \S if 'neg'
+static int named_class(int c, CharClass *cls) {
+    int neg = c == 'D' || c == 'W' || c == 'S';
+    int ch, i;
+    memset(cls, 0, sizeof(CharClass));
+    for (ch = 0; ch < 256; ch++) {
+        int in;
+        switch (c) {
+            case 'd': case 'D': in = is_digit(ch); break;
+            case 'w': case 'W': in = is_word(ch); break;
+            case 's': case 'S': in = ch == ' ' || (ch >= '\t' && ch <= '\r'); break;
+            default: return 0;
+        }
+        if (in)
+            add_class_char(cls, ch);
+    }
+    if (neg) {
+        for (i = 0; i < 32; i++)
+            cls->bits[i] = (unsigned char)~cls->bits[i];
+    }
+    return 1;
+}
+
+// the char of a simple escape after '\', -1 if it's not one
+static int escape_char(Parser *ps, int c) {
+    int h1, h2;
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return 0;
+        case 'x':
+            if (ps->end - ps->p < 2 || (h1 = hex_value(ps->p[0])) < 0 || (h2 = hex_value(ps->p[1])) < 0)
+                return fail(ps, "invalid \\x escape") - 1;
+            ps->p += 2;
+            return h1 * 16 + h2;
+        default:
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c))
+                return -1;
+            return c;
+    }
+}
+
+static int parse_class(Parser *ps) {
+    CharClass cls;
+    int neg = 0;
+    int first = 1;
+    int i;
+
+    memset(&cls, 0, sizeof(cls));
+    if (ps->p < ps->end && *ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    for (;;) {
+        int lo, hi, c;
+        if (ps->p == ps->end)
+            return fail(ps, "missing ']'");
+        c = *ps->p++;
+        if (c == ']' && !first)
+            break;
+        first = 0;
+        if (c == '\\') {
+            CharClass named;
+            if (ps->p == ps->end)
+                return fail(ps, "missing ']'");
+            c = *ps->p++;
+            if (named_class(c, &named)) {
+                for (i = 0; i < 32; i++)
+                    cls.bits[i] |= named.bits[i];
+                continue;
+            }
+            if (c == 'b') {
+                c = '\b';
+            } else if ((c = escape_char(ps, c)) < 0) {
+                return fail(ps, "invalid escape in []");
+            }
+        }
+        lo = hi = c;
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            hi = *ps->p++;
+            if (hi == '\\') {
+                if (ps->p == ps->end)
+                    return fail(ps, "missing ']'");
+                if ((hi = escape_char(ps, *ps->p++)) < 0)
+                    return fail(ps, "invalid range in []");
+            }
+            if (hi < lo)
+                return fail(ps, "invalid range in []");
+        }
+        for (c = lo; c <= hi; c++)
+            add_class_char(&cls, c);
+    }
+    if (neg) {
+        for (i = 0; i < 32; i++)
+            cls.bits[i] = (unsigned char)~cls.bits[i];
+    }
+    return add_class(ps, &cls);
+}
+
+static int parse_alt(Parser *ps);
+
+static int parse_atom(Parser *ps) {
+    lp_regex *re = ps->re;
+    int c = *ps->p++;
+    int g;
+    CharClass cls;
+
+    switch (c) {
+        case '(':
+            if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+                g = -1;
+            } else {
+                if (re->ngroup == REGEX_MAX_GROUPS)
+                    return fail(ps, "too many groups");
+                g = re->ngroup++;
+                if (emit(ps, OP_SAVE, 2*g, 0) < 0)
+                    return 0;
+            }
+            ps->depth++;
+            if (!parse_alt(ps))
+                return 0;
+            ps->depth--;
+            if (ps->p == ps->end || *ps->p != ')')
+                return fail(ps, "missing ')'");
+            ps->p++;
+            return g < 0 || emit(ps, OP_SAVE, 2*g+1, 0) >= 0;
+        case '[':
+            return parse_class(ps);
+        case '.':
+            return emit(ps, OP_ANY, 0, 0) >= 0;
+        case '^':
+            return emit(ps, OP_BOL, 0, 0) >= 0;
+        case '$':
+            return emit(ps, OP_EOL, 0, 0) >= 0;
+        case '*': case '+': case '?':
+            return fail(ps, "nothing to repeat");
+        case '\\':
+            if (ps->p == ps->end)
+                return fail(ps, "trailing '\\'");
+            c = *ps->p++;
+            if (named_class(c, &cls))
+                return add_class(ps, &cls);
+            if (c == 'b' || c == 'B') {
+                re->backtrack = 1;
+                return emit(ps, c == 'b' ? OP_WORDB : OP_NWORDB, 0, 0) >= 0;
+            }
+            if (c >= '1' && c <= '9') {
+                if (c - '0' >= re->ngroup)
+                    return fail(ps, "invalid back reference");
+                re->backtrack = 1;
+                return emit(ps, OP_BACKREF, c - '0', 0) >= 0;
+            }
+            if ((c = escape_char(ps, c)) < 0)
+                return fail(ps, "invalid escape");
+            return emit(ps, OP_CHAR, c, 0) >= 0;
+        default:
+            return emit(ps, OP_CHAR, c, 0) >= 0;
+    }
+}
+
+// parse {n}, {n,} or {n,m} after '{', m is -1 if not limited. return 0
+// if it's not a counted repeat, then '{' is just a char
+static int parse_count(Parser *ps, int *n, int *m) {
+    const unsigned char *p = ps->p + 1;
+    int k;
+    if (p == ps->end || !is_digit(*p))
+        return 0;
+    for (k = 0; p < ps->end && is_digit(*p); p++)
+        k = k > REGEX_MAX_REPEAT ? k : k * 10 + (*p - '0');
+    *n = *m = k;
+    if (p < ps->end && *p == ',') {
+        p++;
+        *m = -1;
+        if (p < ps->end && is_digit(*p)) {
+            for (k = 0; p < ps->end && is_digit(*p); p++)
+                k = k > REGEX_MAX_REPEAT ? k : k * 10 + (*p - '0');
+            *m = k;
+        }
+    }
+    if (p == ps->end || *p != '}')
+        return 0;
+    ps->p = p + 1;
+    return 1;
+}
+
+// the program of [at, ninst) repeated by '*'
+static int star(Parser *ps, int at, int lazy) {
+    int len = ps->re->ninst - at;
+    int loop = new_loop(ps, lazy);
+    if (!insert(ps, at, OP_SPLIT, lazy ? len + 2 : 1, lazy ? 1 : len + 2))
+        return 0;
+    ps->re->prog[at].loop = (unsigned char)loop;
+    return emit(ps, OP_JMP, -(len + 1), 0) >= 0;
+}
+
+static int plus(Parser *ps, int at, int lazy) {
+    int len = ps->re->ninst - at;
+    int pc = emit(ps, OP_SPLIT, lazy ? 1 : -len, lazy ? -len : 1);
+    if (pc < 0)
+        return 0;
+    ps->re->prog[pc].loop = (unsigned char)new_loop(ps, lazy);
+    return 1;
+}
+
+static int optional(Parser *ps, int at, int lazy) {
+    int len = ps->re->ninst - at;
+    return insert(ps, at, OP_SPLIT, lazy ? len + 1 : 1, lazy ? 1 : len + 1);
+}
+
+// append a copy of the piece, its loops are new ones
+static int append_copy(Parser *ps, Inst *piece, int len) {
+    lp_regex *re = ps->re;
+    int i;
+    if (!reserve(ps, len))
+        return 0;
+    memcpy(re->prog + re->ninst, piece, len * sizeof(Inst));
+    for (i = re->ninst; i < re->ninst + len; i++) {
+        if (re->prog[i].loop != 0)
+            re->prog[i].loop = (unsigned char)new_loop(ps, re->prog[i].loop & LOOP_BODY_Y);
+    }
+    re->ninst += len;
+    return 1;
+}
+
+// the program of [at, ninst) repeated n to m times
+static int repeat(Parser *ps, int at, int n, int m, int lazy) {
+    lp_regex *re = ps->re;
+    int len = re->ninst - at;
+    int copies = (m < 0 ? n + 1 : m);
+    Inst *piece;
+    int i, ok = 1;
+
+    if (m >= 0 && m < n)
+        return fail(ps, "invalid repeat count");
+    if (n > REGEX_MAX_REPEAT || m > REGEX_MAX_REPEAT)
+        return fail(ps, "repeat count too big");
+    if ((long)copies * (len + 2) + at > REGEX_MAX_INSTS)
+        return fail(ps, "regex too big");
+    piece = (Inst*)malloc(len * sizeof(Inst) + 1);
+    if (piece == NULL)
+        return fail(ps, "");
+    memcpy(piece, re->prog + at, len * sizeof(Inst));
+    re->ninst = at;
+    for (i = 0; ok && i < n; i++)
+        ok = append_copy(ps, piece, len);
+    if (ok && m < 0) {
+        int begin = re->ninst;
+        ok = append_copy(ps, piece, len) && star(ps, begin, lazy);
+    }
+    for (i = n; ok && i < m; i++) {
+        int begin = re->ninst;
+        ok = append_copy(ps, piece, len) && optional(ps, begin, lazy);
+    }
+    free(piece);
+    return ok;
+}
+
+// the literal every match contains is the longest run of plain chars
+// out of any group, unless there's a '|' out of any group. a run is
+// ended by an atom which is quantified or is not a char, but not by an
+// assertion.
+static void end_run(Parser *ps) {
+    if (ps->runlen > ps->re->litlen) {
+        memcpy(ps->re->lit, ps->run, ps->runlen);
+        ps->re->litlen = ps->runlen;
+    }
+    ps->runlen = 0;
+}
+
+static void add_run(Parser *ps, int at, int quantified) {
+    lp_regex *re = ps->re;
+    if (ps->depth > 0)
+        return;
+    if (!quantified && re->ninst == at + 1) {
+        switch (re->prog[at].op) {
+            case OP_CHAR:
+                // a longer run still contains the chars kept
+                if (ps->runlen < REGEX_MAX_LIT)
+                    ps->run[ps->runlen++] = (unsigned char)re->prog[at].x;
+                return;
+            case OP_BOL: case OP_EOL: case OP_WORDB: case OP_NWORDB:
+                return;
+        }
+    }
+    end_run(ps);
+}
+
+static int parse_repeat(Parser *ps) {
+    int at = ps->re->ninst;
+    int n = 0, m = -1, c, lazy;
+
+    if (!parse_atom(ps))
+        return 0;
+    c = ps->p < ps->end ? *ps->p : 0;
+    if (c == '{' && parse_count(ps, &n, &m)) {
+        add_run(ps, at, 1);
+    } else if (c == '*' || c == '+' || c == '?') {
+        add_run(ps, at, 1);
+        ps->p++;
+    } else {
+        add_run(ps, at, 0);
+        return 1;
+    }
+    lazy = ps->p < ps->end && *ps->p == '?';
+    if (lazy)
+        ps->p++;
+    switch (c) {
+        case '*': c = star(ps, at, lazy); break;
+        case '+': c = plus(ps, at, lazy); break;
+        case '?': c = optional(ps, at, lazy); break;
+        default:  c = repeat(ps, at, n, m, lazy); break;
+    }
+    if (c && ps->p < ps->end && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?'))
+        return fail(ps, "nested quantifier");
+    return c;
+}
+
+static int parse_alt(Parser *ps) {
+    lp_regex *re = ps->re;
+    int at = re->ninst;
+    int jmp;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        if (!parse_repeat(ps))
+            return 0;
+    }
+    if (ps->p == ps->end || *ps->p != '|')
+        return 1;
+    if (ps->depth == 0)
+        ps->alt = 1;
+    ps->p++;
+    if (!insert(ps, at, OP_SPLIT, 1, 0) || (jmp = emit(ps, OP_JMP, 0, 0)) < 0)
+        return 0;
+    if (!parse_alt(ps))
+        return 0;
+    re->prog[at].y = (short)(jmp + 1 - at);
+    re->prog[jmp].x = (short)(re->ninst - jmp);
+    return 1;
+}
+
+static int closure(lp_regex *re, int pc, int bol, int eol, int *set, int n);
+
+// the program is built in the parser, then the regex is allocated in
+// one block with it
+lp_regex *regex_compile(const char *pattern, int len, const char **err) {
+    Parser ps;
+    lp_regex tmp;
+    lp_regex *re = NULL;
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.prog = ps.insts;
+    tmp.instsize = PARSE_INSTS;
+    tmp.classes = ps.classes;
+    tmp.classsize = PARSE_CLASSES;
+    tmp.ngroup = 1;
+    tmp.start = -1;
+    tmp.maxstate = REGEX_CACHE_STATES;
+    ps.p = (const unsigned char*)pattern;
+    ps.end = ps.p + len;
+    ps.re = &tmp;
+    ps.err = NULL;
+    ps.depth = 0;
+    ps.alt = 0;
+    ps.runlen = 0;
+
+    emit(&ps, OP_SAVE, 0, 0);
+    if (parse_alt(&ps) && ps.p < ps.end)
+        fail(&ps, "unmatched ')'");
+    emit(&ps, OP_SAVE, 1, 0);
+    emit(&ps, OP_MATCH, 0, 0);
+    end_run(&ps);
+    if (ps.alt)
+        tmp.litlen = 0;
+
+    *err = NULL;
+    if (ps.err == NULL) {
+        re = (lp_regex*)malloc(sizeof(lp_regex) + tmp.ninst * sizeof(Inst) + tmp.nclass * sizeof(CharClass));
+        if (re == NULL) {
+            ps.err = "";
+        } else {
+            *re = tmp;
+            re->prog = (Inst*)(re + 1);
+            re->instsize = tmp.ninst;
+            re->classes = (CharClass*)(re->prog + tmp.ninst);
+            re->classsize = tmp.nclass;
+            memcpy(re->prog, tmp.prog, tmp.ninst * sizeof(Inst));
+            memcpy(re->classes, tmp.classes, tmp.nclass * sizeof(CharClass));
+        }
+    }
+    if (tmp.prog != ps.insts)
+        free(tmp.prog);
+    if (tmp.classes != ps.classes)
+        free(tmp.classes);
+    if (ps.err != NULL) {
+        if (ps.err[0] == 0)
+            printf("no enough memory\n");
+        else
+            *err = ps.err;
+    }
+    return re;
+}
+
+// allocate the scratch arrays in one block
+static int prepare(lp_regex *re) {
+    re->seen = (unsigned*)calloc(re->ninst * 5 + 1 + re->ngroup * 2 + re->nloop + 1, sizeof(int));
+    if (re->seen == NULL)
+        return 0;
+    re->set = (int*)(re->seen + re->ninst);
+    re->stack = re->set + re->ninst * 2;
+    re->groups = re->stack + re->ninst * 2 + 1;
+    re->loops = re->groups + re->ngroup * 2;
+    // nothing can begin after the beginning, e.g. "^abc"
+    re->gen++;
+    re->anchored = closure(re, 0, 0, 0, re->set, 0) == 0;
+    return 1;
+}
+
+static void free_dfa(lp_regex *re) {
+    free(re->bytemap);
+    free(re->states);
+    free(re->table);
+    free(re->slots);
+    free(re->pool);
+    re->bytemap = NULL;
+    re->states = NULL;
+    re->table = NULL;
+    re->slots = NULL;
+    re->pool = NULL;
+    re->nstate = 0;
+    re->start = -1;
+}
+
+void regex_free(lp_regex *re) {
+    if (re == NULL)
+        return;
+    free_dfa(re);
+    free(re->seen);
+    free(re->choices);
+    free(re);
+}
+
+int regex_groups(lp_regex *re) {
+    return re->ngroup;
+}
+
+//1 ----------------- lazy DFA --------------------------------------
+// add the instructions reached from 'pc' without consuming a char to
+// the set of 'n' pcs, return the new count. what the DFA keeps of them is
+// the ones consuming a char, MATCH, and EOL unless 'eol'(it's decided at
+// the end). the other assertions are kept as well, but only for telling
+// whether the set is empty.
+static int closure(lp_regex *re, int pc, int bol, int eol, int *set, int n) {
+    int top = 0;
+    re->stack[top++] = pc;
+    while (top > 0) {
+        Inst *in;
+        pc = re->stack[--top];
+        if (re->seen[pc] == re->gen)
+            continue;
+        re->seen[pc] = re->gen;
+        in = &re->prog[pc];
+        switch (in->op) {
+            case OP_SPLIT:
+                re->stack[top++] = pc + in->y;
+                re->stack[top++] = pc + in->x;
+                break;
+            case OP_JMP:
+                re->stack[top++] = pc + in->x;
+                break;
+            case OP_SAVE:
+                re->stack[top++] = pc + 1;
+                break;
+            case OP_BOL:
+                if (bol)
+                    re->stack[top++] = pc + 1;
+                break;
+            case OP_EOL:
+                if (eol)
+                    re->stack[top++] = pc + 1;
+                else
+                    set[n++] = pc;
+                break;
+            default:
+                set[n++] = pc;
+                break;
+        }
+    }
+    return n;
+}
+
+static int compare_int(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+static unsigned hash_set(const int *set, int n) {
+    unsigned h = 2166136261u;
+    int i;
+    for (i = 0; i < n; i++) {
+        h ^= (unsigned)set[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// chars are in the same column if no instruction tells them apart
+static void build_bytemap(lp_regex *re) {
+    unsigned char brk[257];
+    int pc, c, col, i, k;
+
+    memset(brk, 0, sizeof(brk));
+    for (pc = 0; pc < re->ninst; pc++) {
+        Inst *in = &re->prog[pc];
+        if (in->op == OP_CHAR) {
+            brk[in->x] = brk[in->x + 1] = 1;
+        } else if (in->op == OP_ANY) {
+            brk['\n'] = brk['\n' + 1] = 1;
+        }
+    }
+    // a class breaks where a bit differs from the one before it, 8
+    // bits at a time
+    for (k = 0; k < re->nclass; k++) {
+        const unsigned char *bits = re->classes[k].bits;
+        int carry = 0;
+        for (i = 0; i < 32; i++) {
+            int edges = (bits[i] ^ (bits[i] << 1) ^ carry) & 0xff;
+            carry = bits[i] >> 7;
+            for (c = i * 8; edges != 0; c++, edges >>= 1) {
+                if (edges & 1)
+                    brk[c] = 1;
+            }
+        }
+    }
+    col = 0;
+    re->colbyte[0] = 0;
+    for (c = 0; c < 256; c++) {
+        if (c > 0 && brk[c])
+            re->colbyte[++col] = (unsigned char)c;
+        re->bytemap[c] = (unsigned char)col;
+    }
+    re->ncol = col + 1;
+}
+
+static int new_dfa(lp_regex *re) {
+    re->bytemap = (unsigned char*)malloc(512);
+    if (re->bytemap == NULL)
+        return 0;
+    re->colbyte = re->bytemap + 256;
+    build_bytemap(re);
+    re->states = (DState*)malloc(re->maxstate * sizeof(DState));
+    re->table = (short*)malloc(re->maxstate * re->ncol * sizeof(short));
+    re->slots = (int*)malloc(SLOT_COUNT(re) * sizeof(int));
+    re->poolsize = re->ninst * 4;
+    re->pool = (int*)malloc(re->poolsize * sizeof(int));
+    if (re->states == NULL || re->table == NULL || re->slots == NULL || re->pool == NULL) {
+        free_dfa(re);
+        return 0;
+    }
+    memset(re->slots, -1, SLOT_COUNT(re) * sizeof(int));
+    re->poolused = 0;
+    return 1;
+}
+
+// drop all the states
+static void flush_dfa(lp_regex *re) {
+    memset(re->slots, -1, SLOT_COUNT(re) * sizeof(int));
+    re->nstate = 0;
+    re->poolused = 0;
+    re->start = -1;
+    re->flushes++;
+}
+
+// the state of the set of 'n' pcs, built if it's not cached. -1 if no
+// enough memory
+static int dfa_state(lp_regex *re, int *set, int n) {
+    unsigned h;
+    unsigned s;
+    DState *ds;
+    int i, k;
+
+    qsort(set, n, sizeof(int), compare_int);
+    h = hash_set(set, n);
+    for (s = h & (SLOT_COUNT(re)-1); re->slots[s] != -1; s = (s + 1) & (SLOT_COUNT(re)-1)) {
+        ds = &re->states[re->slots[s]];
+        if (ds->hash == h && ds->n == n && memcmp(re->pool + ds->off, set, n * sizeof(int)) == 0)
+            return re->slots[s];
+    }
+
+    if (re->nstate == re->maxstate) {
+        flush_dfa(re);
+        for (s = h & (SLOT_COUNT(re)-1); re->slots[s] != -1; s = (s + 1) & (SLOT_COUNT(re)-1))
+            ;
+    }
+    if (re->poolused + n > re->poolsize) {
+        int size = re->poolsize * 2 + n;
+        int *pool = (int*)realloc(re->pool, size * sizeof(int));
+        if (pool == NULL)
+            return -1;
+        re->pool = pool;
+        re->poolsize = size;
+    }
+
+    k = re->nstate++;
+    ds = &re->states[k];
+    ds->off = re->poolused;
+    ds->n = n;
+    ds->hash = h;
+    ds->flags = 0;
+    memcpy(re->pool + ds->off, set, n * sizeof(int));
+    re->poolused += n;
+    re->slots[s] = k;
+    memset(re->table + k * re->ncol, -1, re->ncol * sizeof(short));
+
+    ds->arm = INT_MAX;
+    ds->endarm = INT_MAX;
+    ds->live = INT_MAX;
+    for (i = 0; i < n; i++) {
+        Inst *in = &re->prog[set[i]];
+        int arm = re->armof != NULL ? re->armof[set[i]] : 0;
+        if (in->op == OP_MATCH) {
+            ds->flags |= DS_MATCH;
+            if (in->x < ds->arm)
+                ds->arm = in->x;
+            continue;
+        }
+        if (arm < ds->live)
+            ds->live = arm;
+        if (in->op == OP_EOL && arm < ds->endarm) {
+            int j, m;
+            re->gen++;
+            m = closure(re, set[i] + 1, 0, 1, re->set + re->ninst, 0);
+            for (j = 0; j < m; j++) {
+                Inst *e = &re->prog[re->set[re->ninst + j]];
+                if (e->op == OP_MATCH && e->x < ds->endarm) {
+                    ds->flags |= DS_ENDMATCH;
+                    ds->endarm = e->x;
+                }
+            }
+        }
+    }
+    if (ds->live == INT_MAX)
+        ds->flags |= DS_DEAD;
+    return k;
+}
+
+// the state after the state 'k' consumes a char of column 'col'
+static int dfa_next(lp_regex *re, int k, int col) {
+    DState *ds = &re->states[k];
+    int c = re->colbyte[col];
+    int flushes = re->flushes;
+    int n = 0;
+    int i, next;
+
+    re->gen++;
+    for (i = 0; i < ds->n; i++) {
+        int pc = re->pool[ds->off + i];
+        Inst *in = &re->prog[pc];
+        int ok;
+        switch (in->op) {
+            case OP_CHAR:  ok = in->x == c; break;
+            case OP_ANY:   ok = c != '\n'; break;
+            case OP_CLASS: ok = in_class(&re->classes[in->x], c); break;
+            default:       ok = 0; break;
+        }
+        if (ok)
+            n = closure(re, pc + 1, 0, 0, re->set, n);
+    }
+    // a match may begin after any char
+    if (!re->anchored)
+        n = closure(re, 0, 0, 0, re->set, n);
+
+    next = dfa_state(re, re->set, n);
+    // the state 'k' is gone if the cache is just flushed
+    if (next >= 0 && re->flushes == flushes)
+        re->table[k * re->ncol + col] = (short)next;
+    return next;
+}
+
+// the first arm matching the subject, -1 if none, -2 if no enough
+// memory. it stops as soon as no arm before the one matched is alive.
+static int dfa_scan(lp_regex *re, const unsigned char *s, int len) {
+    const unsigned char *end = s + len;
+    int best = INT_MAX;
+    DState *ds;
+    int k;
+
+    if (re->states == NULL && !new_dfa(re))
+        return -2;
+    if (re->start == -1) {
+        re->gen++;
+        k = dfa_state(re, re->set, closure(re, 0, 1, 0, re->set, 0));
+        if (k < 0)
+            return -2;
+        re->start = k;
+    }
+    k = re->start;
+    for (; s < end; s++) {
+        int col = re->bytemap[*s];
+        int next;
+        ds = &re->states[k];
+        if (ds->flags & (DS_MATCH|DS_DEAD)) {
+            if ((ds->flags & DS_MATCH) && ds->arm < best)
+                best = ds->arm;
+            if (best <= ds->live)
+                return best == INT_MAX ? -1 : best;
+        }
+        next = re->table[k * re->ncol + col];
+        if (next < 0 && (next = dfa_next(re, k, col)) < 0)
+            return -2;
+        k = next;
+    }
+    ds = &re->states[k];
+    if ((ds->flags & DS_MATCH) && ds->arm < best)
+        best = ds->arm;
+    if ((ds->flags & DS_ENDMATCH) && ds->endarm < best)
+        best = ds->endarm;
+    return best == INT_MAX ? -1 : best;
+}
+
+//1 ----------------- backtracking ----------------------------------
+#define BT_BRANCH 0 // go on at pc, sp
+#define BT_GROUP  1 // restore groups[pc] to sp
+#define BT_LOOP   2 // restore loops[pc] to sp
+
+typedef struct Choice {
+    int kind;
+    int pc;
+    int sp;
+} Choice;
+
+static int push_choice(lp_regex *re, int *top, int kind, int pc, int sp) {
+    if (*top == re->choicesize) {
+        int size = re->choicesize == 0 ? 64 : re->choicesize * 2;
+        Choice *choices = (Choice*)realloc(re->choices, size * sizeof(Choice));
+        if (choices == NULL)
+            return 0;
+        re->choices = choices;
+        re->choicesize = size;
+    }
+    re->choices[*top].kind = kind;
+    re->choices[*top].pc = pc;
+    re->choices[*top].sp = sp;
+    (*top)++;
+    return 1;
+}
+
+// match at 'start', the first alternative wins. the groups are left in
+// 'groups'. 1 if matched, 0 if not, -1 if gives up or no enough memory
+static int backtrack(lp_regex *re, const unsigned char *s, int len, int start, int *groups) {
+    int *loops = re->loops;
+    int pc = 0;
+    int sp = start;
+    int top = 0;
+    long steps = 0;
+    int i;
+
+    for (i = 0; i < 2 * re->ngroup; i++)
+        groups[i] = -1;
+    for (i = 0; i <= re->nloop; i++)
+        loops[i] = -1;
+
+    for (;;) {
+        Inst *in = &re->prog[pc];
+        if (++steps > REGEX_MAX_STEPS)
+            return -1;
+        switch (in->op) {
+            case OP_CHAR:
+                if (sp < len && s[sp] == in->x) {
+                    pc++;
+                    sp++;
+                    continue;
+                }
+                break;
+            case OP_ANY:
+                if (sp < len && s[sp] != '\n') {
+                    pc++;
+                    sp++;
+                    continue;
+                }
+                break;
+            case OP_CLASS:
+                if (sp < len && in_class(&re->classes[in->x], s[sp])) {
+                    pc++;
+                    sp++;
+                    continue;
+                }
+                break;
+            case OP_BOL:
+                if (sp == 0) {
+                    pc++;
+                    continue;
+                }
+                break;
+            case OP_EOL:
+                if (sp == len) {
+                    pc++;
+                    continue;
+                }
+                break;
+            case OP_WORDB:
+            case OP_NWORDB: {
+                int b = (sp > 0 && is_word(s[sp-1])) != (sp < len && is_word(s[sp]));
+                if (b == (in->op == OP_WORDB)) {
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OP_BACKREF: {
+                int b = groups[2*in->x];
+                int e = groups[2*in->x+1];
+                if (b >= 0 && e >= b && sp + (e - b) <= len && memcmp(s + b, s + sp, e - b) == 0) {
+                    sp += e - b;
+                    pc++;
+                    continue;
+                }
+                break;
+            }
+            case OP_SAVE:
+                if (!push_choice(re, &top, BT_GROUP, in->x, groups[in->x]))
+                    return -1;
+                groups[in->x] = sp;
+                pc++;
+                continue;
+            case OP_JMP:
+                pc += in->x;
+                continue;
+            case OP_SPLIT:
+                if (in->loop != 0) {
+                    int k = in->loop & LOOP_INDEX;
+                    // the body matched nothing last time, don't loop again
+                    if (loops[k] == sp) {
+                        pc += (in->loop & LOOP_BODY_Y) ? in->x : in->y;
+                        continue;
+                    }
+                    if (!push_choice(re, &top, BT_LOOP, k, loops[k]))
+                        return -1;
+                    loops[k] = sp;
+                }
+                if (!push_choice(re, &top, BT_BRANCH, pc + in->y, sp))
+                    return -1;
+                pc += in->x;
+                continue;
+            case OP_MATCH:
+                return 1;
+        }
+
+        // failed, go back to the last choice
+        for (;;) {
+            Choice *c;
+            if (top == 0)
+                return 0;
+            c = &re->choices[--top];
+            if (c->kind == BT_BRANCH) {
+                pc = c->pc;
+                sp = c->sp;
+                break;
+            }
+            if (c->kind == BT_GROUP)
+                groups[c->pc] = c->sp;
+            else
+                loops[c->pc] = c->sp;
+        }
+    }
+}
+
+static int search(lp_regex *re, const unsigned char *s, int len, int *groups) {
+    int start;
+    for (start = 0; start <= len; start++) {
+        int r = backtrack(re, s, len, start, groups);
+        if (r != 0 || re->anchored)
+            return r;
+    }
+    return 0;
+}
+
+int regex_match(lp_regex *re, const char *s, int len) {
+    if (re->seen == NULL && !prepare(re))
+        return -1;
+    if (!re->backtrack) {
+        int r = dfa_scan(re, (const unsigned char*)s, len);
+        if (r != -2)
+            return r == 0;
+    }
+    return search(re, (const unsigned char*)s, len, re->groups);
+}
+
+int regex_exec(lp_regex *re, const char *s, int len, int *groups) {
+    if (re->seen == NULL && !prepare(re))
+        return -1;
+    if (!re->backtrack && dfa_scan(re, (const unsigned char*)s, len) == -1)
+        return 0;
+    return search(re, (const unsigned char*)s, len, groups);
+}
+
+//1 ----------------- regex set -------------------------------------
+struct lp_regexset {
+    int narm;
+    lp_regex **arms;        // kept by the caller
+    lp_regex *dfa;          // the arms the DFA can match in one program, NULL if none
+    int thrash;             // matches flushing the cache of 'dfa'
+
+    // Aho-Corasick automaton of the literals of the arms
+    int litarms;            // arms with a literal
+    int acstates;
+    int accol;
+    unsigned char acmap[256]; // column of each char, 0 for the chars of no literal
+    int *acnext;            // acstates*accol next states, the failures folded in
+    int *acout;             // the first arm whose literal ends at the state, -1 if none
+    int *aclink;            // the next state on the failure chain with an arm, -1 if none
+    int *armnext;           // the next arm with the same literal, -1 if none
+    unsigned char *cand;    // arms which may match the subject
+    unsigned char *nolit;   // arms without a literal, which may match any subject
+    int nolitdfa;           // of them the DFA can match
+    int btarms;             // arms the DFA can't match
+};
+
+// the arms the DFA can match in one program, in one block like a regex:
+// arm i is tried by a SPLIT before its program, and its MATCH is i
+static lp_regex *combine(lp_regex **arms, int n) {
+    lp_regex *re;
+    int ninst = 0;
+    int nclass = 0;
+    int last = -1;
+    int i, pc, cls;
+
+    for (i = 0; i < n; i++) {
+        if (!arms[i]->backtrack) {
+            ninst += arms[i]->ninst + 1;
+            nclass += arms[i]->nclass;
+            last = i;
+        }
+    }
+    if (last < 0)
+        return NULL;
+    ninst--; // no SPLIT before the last arm
+    re = (lp_regex*)malloc(sizeof(lp_regex) + ninst * sizeof(Inst) +
+                           nclass * sizeof(CharClass) + ninst * sizeof(unsigned short));
+    if (re == NULL)
+        return NULL;
+    memset(re, 0, sizeof(lp_regex));
+    re->prog = (Inst*)(re + 1);
+    re->classes = (CharClass*)(re->prog + ninst);
+    re->armof = (unsigned short*)(re->classes + nclass);
+    re->ninst = re->instsize = ninst;
+    re->nclass = re->classsize = nclass;
+    re->ngroup = 1;
+    re->start = -1;
+    // the arms together have more states than one regex
+    re->maxstate = REGEX_CACHE_STATES;
+    for (i = REGEXSET_ARMS_STATES; i < n && re->maxstate < REGEXSET_MAX_STATES; i *= 2)
+        re->maxstate *= 2;
+
+    pc = 0;
+    cls = 0;
+    for (i = 0; i < n; i++) {
+        lp_regex *arm = arms[i];
+        int k;
+        if (arm->backtrack)
+            continue;
+        if (i != last) {
+            re->prog[pc].op = OP_SPLIT;
+            re->prog[pc].loop = 0;
+            re->prog[pc].x = 1;
+            re->prog[pc].y = (short)(arm->ninst + 1);
+            re->armof[pc++] = (unsigned short)i;
+        }
+        for (k = 0; k < arm->ninst; k++, pc++) {
+            Inst *in = &re->prog[pc];
+            *in = arm->prog[k];
+            in->loop = 0;
+            if (in->op == OP_CLASS)
+                in->x = (short)(in->x + cls);
+            else if (in->op == OP_MATCH)
+                in->x = (short)i;
+            re->armof[pc] = (unsigned short)i;
+        }
+        memcpy(re->classes + cls, arm->classes, arm->nclass * sizeof(CharClass));
+        cls += arm->nclass;
+    }
+    return re;
+}
+
+// build the automaton of the literals: a trie of them, whose missing
+// transitions are then filled in breadth first by the ones of the
+// failure states
+static int build_ac(lp_regexset *set) {
+    int size = 1;
+    int *queue;
+    int i, c, head, tail;
+
+    set->accol = 1;
+    memset(set->acmap, 0, sizeof(set->acmap));
+    for (i = 0; i < set->narm; i++) {
+        lp_regex *arm = set->arms[i];
+        for (c = 0; c < arm->litlen; c++) {
+            if (set->acmap[arm->lit[c]] == 0)
+                set->acmap[arm->lit[c]] = (unsigned char)set->accol++;
+        }
+        size += arm->litlen;
+    }
+    set->acnext = (int*)malloc(size * set->accol * sizeof(int));
+    set->acout = (int*)malloc(size * sizeof(int));
+    set->aclink = (int*)malloc(size * sizeof(int));
+    queue = (int*)malloc(size * sizeof(int));
+    if (set->acnext == NULL || set->acout == NULL || set->aclink == NULL || queue == NULL) {
+        free(queue);
+        return 0;
+    }
+    memset(set->acnext, -1, size * set->accol * sizeof(int));
+    memset(set->acout, -1, size * sizeof(int));
+    set->acstates = 1;
+
+    // the trie, arms with the same literal are chained at its end
+    for (i = set->narm - 1; i >= 0; i--) {
+        lp_regex *arm = set->arms[i];
+        int st = 0;
+        if (arm->litlen == 0)
+            continue;
+        for (c = 0; c < arm->litlen; c++) {
+            int *next = &set->acnext[st * set->accol + set->acmap[arm->lit[c]]];
+            if (*next < 0)
+                *next = set->acstates++;
+            st = *next;
+        }
+        set->armnext[i] = set->acout[st];
+        set->acout[st] = i;
+    }
+
+    // the failure of a state is reused as the link while building
+    head = tail = 0;
+    for (c = 0; c < set->accol; c++) {
+        int *next = &set->acnext[c];
+        if (*next < 0) {
+            *next = 0;
+        } else {
+            set->aclink[*next] = 0;
+            queue[tail++] = *next;
+        }
+    }
+    while (head < tail) {
+        int st = queue[head++];
+        int fail = set->aclink[st];
+        for (c = 0; c < set->accol; c++) {
+            int *next = &set->acnext[st * set->accol + c];
+            if (*next < 0) {
+                *next = set->acnext[fail * set->accol + c];
+            } else {
+                set->aclink[*next] = set->acnext[fail * set->accol + c];
+                queue[tail++] = *next;
+            }
+        }
+    }
+    // the link of a state is the nearest failure with an arm, in the
+    // order of the queue the failures are done before
+    set->aclink[0] = -1;
+    for (i = 0; i < tail; i++) {
+        int st = queue[i];
+        int fail = set->aclink[st];
+        set->aclink[st] = set->acout[fail] >= 0 ? fail : set->aclink[fail];
+    }
+    free(queue);
+    return 1;
+}
+
+lp_regexset *regexset_new(lp_regex **arms, int n) {
+    lp_regexset *set = (lp_regexset*)calloc(1, sizeof(lp_regexset));
+    int i;
+
+    if (set == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    set->narm = n;
+    set->arms = (lp_regex**)malloc(n * sizeof(lp_regex*) + 1);
+    set->armnext = (int*)malloc(n * sizeof(int) + 1);
+    set->cand = (unsigned char*)malloc(2 * n + 1);
+    if (set->arms == NULL || set->armnext == NULL || set->cand == NULL)
+        goto nomem;
+    set->nolit = set->cand + n;
+    memcpy(set->arms, arms, n * sizeof(lp_regex*));
+    for (i = 0; i < n; i++) {
+        set->nolit[i] = arms[i]->litlen == 0;
+        if (arms[i]->litlen > 0)
+            set->litarms++;
+        else if (!arms[i]->backtrack)
+            set->nolitdfa++;
+        set->btarms += arms[i]->backtrack;
+    }
+    if (set->litarms > 0 && !build_ac(set))
+        goto nomem;
+    set->dfa = combine(arms, n);
+    if (set->dfa != NULL && !prepare(set->dfa))
+        goto nomem;
+    return set;
+
+nomem:
+    printf("no enough memory\n");
+    regexset_free(set);
+    return NULL;
+}
+
+void regexset_free(lp_regexset *set) {
+    if (set == NULL)
+        return;
+    regex_free(set->dfa);
+    free(set->arms);
+    free(set->acnext);
+    free(set->acout);
+    free(set->aclink);
+    free(set->armnext);
+    free(set->cand);
+    free(set);
+}
+
+// mark the arms which may match the subject, return the count of the
+// ones the DFA can match
+static int candidates(lp_regexset *set, const unsigned char *s, int len) {
+    const unsigned char *end = s + len;
+    int found = 0;
+    int count = set->nolitdfa;
+    int st = 0;
+
+    memcpy(set->cand, set->nolit, set->narm);
+    for (; s < end && found < set->litarms; s++) {
+        int o;
+        st = set->acnext[st * set->accol + set->acmap[*s]];
+        for (o = set->acout[st] >= 0 ? st : set->aclink[st]; o >= 0; o = set->aclink[o]) {
+            int a;
+            for (a = set->acout[o]; a >= 0; a = set->armnext[a]) {
+                if (!set->cand[a]) {
+                    set->cand[a] = 1;
+                    found++;
+                    count += !set->arms[a]->backtrack;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+int regexset_match(lp_regexset *set, const char *s, int len) {
+    const unsigned char *u = (const unsigned char*)s;
+    int best = -2;
+    int count = candidates(set, u, len);
+    int i;
+
+    if (count == 0) {
+        best = -1;
+    } else if (count > 1 && set->thrash < REGEXSET_MAX_THRASH) {
+        int flushes = set->dfa->flushes;
+        best = dfa_scan(set->dfa, u, len);
+        if (set->dfa->flushes != flushes)
+            set->thrash++;
+    }
+    if (best == -2) {
+        // one by one
+        best = -1;
+        for (i = 0; i < set->narm && best < 0; i++) {
+            if (set->cand[i] && !set->arms[i]->backtrack && regex_match(set->arms[i], s, len) == 1)
+                best = i;
+        }
+    }
+    for (i = 0; set->btarms > 0 && i < (best < 0 ? set->narm : best); i++) {
+        if (set->cand[i] && set->arms[i]->backtrack && regex_match(set->arms[i], s, len) == 1)
+            return i;
+    }
+    return best;
+}
+
+int regexset_exec(lp_regexset *set, const char *s, int len, int *groups) {
+    int arm = regexset_match(set, s, len);
+    if (arm >= 0 && regex_exec(set->arms[arm], s, len, groups) != 1)
+        return -1;
+    return arm;
+}
+
+//1 ----------------- test ------------------------------------------
+void regex_print(lp_regex *re) {
+    static const char *names[] = {
+        "char", "any", "class", "bol", "eol", "wordb", "nwordb",
+        "backref", "save", "split", "jmp", "match"
+    };
+    int pc;
+    for (pc = 0; pc < re->ninst; pc++) {
+        Inst *in = &re->prog[pc];
+        printf("%4d %-7s", pc, names[in->op]);
+        switch (in->op) {
+            case OP_CHAR:
+                printf(" '%c'", in->x);
+                break;
+            case OP_CLASS: case OP_BACKREF: case OP_SAVE:
+                printf(" %d", in->x);
+                break;
+            case OP_SPLIT:
+                printf(" %d, %d", pc + in->x, pc + in->y);
+                if (in->loop != 0)
+                    printf(" loop %d%s", in->loop & LOOP_INDEX, (in->loop & LOOP_BODY_Y) ? " lazy" : "");
+                break;
+            case OP_JMP:
+                printf(" %d", pc + in->x);
+                break;
+        }
+        printf("\n");
+    }
+    printf("groups %d, loops %d, columns %d, states %d, flushes %d%s%s\n",
+           re->ngroup, re->nloop, re->ncol, re->nstate, re->flushes,
+           re->anchored ? ", anchored" : "", re->backtrack ? ", backtracking" : "");
+}
+
+#ifdef REGEX_TEST
+#include <time.h>
+
+static void check(const char *pattern, const char *s, int expect, const char *g1) {
+    const char *err;
+    int groups[2*REGEX_MAX_GROUPS];
+    lp_regex *re = regex_compile(pattern, strlen(pattern), &err);
+    int r;
+
+    if (re == NULL) {
+        assert(expect == -2);
+        printf("%-24s invalid: %s\n", pattern, err);
+        return;
+    }
+    r = regex_match(re, s, strlen(s));
+    assert(r == expect);
+    r = regex_exec(re, s, strlen(s), groups);
+    assert(r == expect);
+    if (r == 1 && g1 != NULL) {
+        assert(groups[2] >= 0 && (int)strlen(g1) == groups[3] - groups[2]);
+        assert(memcmp(s + groups[2], g1, groups[3] - groups[2]) == 0);
+    }
+    regex_free(re);
+}
+
+static lp_regex *compile_all(const char **pats, int n, lp_regex **arms) {
+    const char *err;
+    int i;
+    for (i = 0; i < n; i++) {
+        arms[i] = regex_compile(pats[i], strlen(pats[i]), &err);
+        assert(arms[i] != NULL);
+    }
+    return arms[0];
+}
+
+static void free_all(lp_regex **arms, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        regex_free(arms[i]);
+}
+
+// the first arm matching, trying them one by one
+static int first_arm(lp_regex **arms, int n, const char *s, int len) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (regex_match(arms[i], s, len) == 1)
+            return i;
+    }
+    return -1;
+}
+
+// the set finds the same arm as trying them one by one, and the groups of
+// that arm
+static void check_set(lp_regexset *set, lp_regex **arms, int n, const char *s, int len) {
+    int groups[2*REGEX_MAX_GROUPS], expect[2*REGEX_MAX_GROUPS];
+    int arm = first_arm(arms, n, s, len);
+    if (regexset_match(set, s, len) != arm) {
+        printf("'%.*s' => arm %d, not %d\n", len, s, regexset_match(set, s, len), arm);
+        assert(0);
+    }
+    assert(regexset_exec(set, s, len, groups) == arm);
+    if (arm >= 0) {
+        assert(regex_exec(arms[arm], s, len, expect) == 1);
+        assert(memcmp(groups, expect, 2 * regex_groups(arms[arm]) * sizeof(int)) == 0);
+    }
+}
+
+static void check_arm(const char **pats, int n, const char *s, int expect) {
+    lp_regex *arms[16];
+    lp_regexset *set;
+    compile_all(pats, n, arms);
+    set = regexset_new(arms, n);
+    assert(regexset_match(set, s, strlen(s)) == expect);
+    check_set(set, arms, n, s, strlen(s));
+    regexset_free(set);
+    free_all(arms, n);
+}
+
+static void test_set(void) {
+    // the first arm wins when several match, whichever ends first
+    const char *prio[] = {"e.*r \\d", "error", "^err"};
+    const char *prio2[] = {"^err", "error", "e.*r \\d"};
+    // no literal: a '|' out of a group, classes only
+    const char *nolit[] = {"ab|cd", "[0-9]{3}", "zz", "(x|y)+$"};
+    // back references and \b are tried one by one, before and after the
+    // arm the DFA finds
+    const char *bt[] = {"(\\w+) \\1", "hello", "\\bcat\\b", "c"};
+    const char *pool[] = {
+        "abc", "^ab", "b+c$", "a.c", "(a|b)c", "[^a]+$", "\\d+", "c{2,}", "(\\w)\\1",
+        "\\bab", "a*", "^$", "x", "(ab|cd)e", "ca?b", "[bc]{3}", "e|1", "(d)(e)?\\2"
+    };
+    const char *chars = "abcde 1x";
+    char flush[8][16];
+    const char *fpats[8];
+    lp_regex *arms[16];
+    lp_regexset *set;
+    char line[64];
+    unsigned seed = 7;
+    int i, j, k, n, len;
+
+    check_arm(prio, 3, "error 42", 0);
+    check_arm(prio, 3, "xerror", 1);
+    check_arm(prio, 3, "err", 2);
+    check_arm(prio2, 3, "error 42", 0);
+    check_arm(prio2, 3, "an error 4", 1);
+
+    compile_all(nolit, 4, arms);
+    assert(arms[0]->litlen == 0 && arms[1]->litlen == 0 && arms[2]->litlen == 2 && arms[3]->litlen == 0);
+    free_all(arms, 4);
+    check_arm(nolit, 4, "xcdx", 0);
+    check_arm(nolit, 4, "a 123", 1);
+    check_arm(nolit, 4, "zz 12", 2);
+    check_arm(nolit, 4, "xyx", 3);
+    check_arm(nolit, 4, "none", -1);
+
+    check_arm(bt, 4, "say hello hello", 0);
+    check_arm(bt, 4, "hello cat", 1);
+    check_arm(bt, 4, "a cat.", 2);
+    check_arm(bt, 4, "cats", 3);
+    check_arm(bt, 4, "dog", -1);
+
+    // random sets of arms against trying them one by one
+    for (k = 0; k < 20000; k++) {
+        seed = seed * 1103515245 + 12345;
+        n = 1 + (seed >> 16) % 8;
+        for (i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;
+            fpats[i] = pool[(seed >> 16) % (sizeof(pool) / sizeof(pool[0]))];
+        }
+        compile_all(fpats, n, arms);
+        set = regexset_new(arms, n);
+        for (i = 0; i < 4; i++) {
+            seed = seed * 1103515245 + 12345;
+            len = (seed >> 16) % 13;
+            for (j = 0; j < len; j++) {
+                seed = seed * 1103515245 + 12345;
+                line[j] = chars[(seed >> 16) % 8];
+            }
+            check_set(set, arms, n, line, len);
+        }
+        regexset_free(set);
+        free_all(arms, n);
+    }
+
+    // the combined DFA has too many states for its cache: it's flushed,
+    // then given up for the arms one by one, the answers are the same
+    for (i = 0; i < 8; i++) {
+        snprintf(flush[i], sizeof(flush[i]), "%c[a-h]{8}$", 'a' + i);
+        fpats[i] = flush[i];
+    }
+    compile_all(fpats, 8, arms);
+    set = regexset_new(arms, 8);
+    for (k = 0; k < 2000; k++) {
+        for (n = 0; n < 40; n++) {
+            seed = seed * 1103515245 + 12345;
+            line[n] = 'a' + (seed >> 16) % 8;
+        }
+        check_set(set, arms, 8, line, n);
+    }
+    assert(set->dfa->flushes > 0 && set->thrash == REGEXSET_MAX_THRASH);
+    regexset_free(set);
+    free_all(arms, 8);
+}
+
+// "re -b": a routing case of BENCH_ARMS arms over BENCH_LINES synthetic
+// log lines, matched by a regex set and by trying the arms one by one
+#define BENCH_ARMS  120
+#define BENCH_LINES 200000
+#define BENCH_LINE  112
+
+static double seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void bench(void) {
+    char pats[BENCH_ARMS][64];
+    const char *ps[BENCH_ARMS];
+    lp_regex *arms[BENCH_ARMS];
+    lp_regexset *set;
+    char *lines = (char*)malloc(BENCH_LINES * BENCH_LINE);
+    int *lens = (int*)malloc(BENCH_LINES * sizeof(int));
+    int *found = (int*)malloc(BENCH_LINES * sizeof(int));
+    unsigned seed = 1;
+    int i, n = 0, matched = 0;
+    double t0, tset, tone;
+
+    assert(lines != NULL && lens != NULL && found != NULL);
+    for (i = 0; i < 40; i++)
+        snprintf(pats[n++], 64, "svc%02d\\[\\d+\\]: error code \\d+", i);
+    for (i = 0; i < 40; i++)
+        snprintf(pats[n++], 64, "user%02d logged (in|out)$", i);
+    for (i = 0; i < 20; i++)
+        snprintf(pats[n++], 64, "^\\d{4}-\\d\\d-\\d\\dT[\\d:]+ db%02d slow query", i);
+    for (i = 0; i < 10; i++)
+        snprintf(pats[n++], 64, "timeout after \\d+ms on shard%d$", i);
+    for (i = 0; i < 8; i++)
+        snprintf(pats[n++], 64, "GET /api/v%d/\\w+ 5\\d\\d$", i);
+    snprintf(pats[n++], 64, "^[0-9a-f]{8} panic");
+    snprintf(pats[n++], 64, "\\bkilled process \\d+\\b");
+    assert(n == BENCH_ARMS);
+    for (i = 0; i < n; i++)
+        ps[i] = pats[i];
+    compile_all(ps, n, arms);
+    set = regexset_new(arms, n);
+
+    // a third of the services, users... are out of the arms, so some
+    // lines match none
+    for (i = 0; i < BENCH_LINES; i++) {
+        char *l = lines + i * BENCH_LINE;
+        unsigned r[4];
+        int k;
+        for (k = 0; k < 4; k++) {
+            seed = seed * 1103515245 + 12345;
+            r[k] = seed >> 8;
+        }
+        switch (r[0] % 6) {
+            case 0:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u host%u svc%02u[%u]: error code %u",
+                                   r[1] % 60, r[2] % 60, r[3] % 64, r[1] % 60, r[2] % 30000, r[3] % 1000);
+                break;
+            case 1:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u host%u sshd[%u]: user%02u logged %s",
+                                   r[1] % 60, r[2] % 60, r[3] % 64, r[2] % 30000, r[1] % 60, r[3] & 1 ? "in" : "out");
+                break;
+            case 2:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u db%02u slow query took %ums",
+                                   r[1] % 60, r[2] % 60, r[1] % 30, r[3] % 5000);
+                break;
+            case 3:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u host%u proxy: timeout after %ums on shard%u",
+                                   r[1] % 60, r[2] % 60, r[3] % 64, r[2] % 5000, r[1] % 15);
+                break;
+            case 4:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u host%u nginx: GET /api/v%u/items %u",
+                                   r[1] % 60, r[2] % 60, r[3] % 64, r[1] % 12, 200 + r[2] % 400);
+                break;
+            default:
+                lens[i] = snprintf(l, BENCH_LINE, "2024-05-01T12:%02u:%02u host%u kernel: %s %u",
+                                   r[1] % 60, r[2] % 60, r[3] % 64,
+                                   r[1] % 8 == 0 ? "killed process" : "nothing to see here, process", r[2]);
+                break;
+        }
+    }
+
+    t0 = seconds();
+    for (i = 0; i < BENCH_LINES; i++)
+        found[i] = regexset_match(set, lines + i * BENCH_LINE, lens[i]);
+    tset = seconds() - t0;
+    t0 = seconds();
+    for (i = 0; i < BENCH_LINES; i++) {
+        int arm = first_arm(arms, n, lines + i * BENCH_LINE, lens[i]);
+        assert(arm == found[i]);
+        matched += arm >= 0;
+    }
+    tone = seconds() - t0;
+    printf("%d arms, %d lines, %d matched: set %.0f ns/line(%d DFA states, %d flushes), one by one %.0f ns/line\n",
+           n, BENCH_LINES, matched, tset * 1e9 / BENCH_LINES, set->dfa->nstate, set->dfa->flushes,
+           tone * 1e9 / BENCH_LINES);
+    regexset_free(set);
+    free_all(arms, n);
+    free(lines);
+    free(lens);
+    free(found);
+}
+
+int main(int argc, char *argv[]) {
+    const char *err;
+    char line[64];
+    unsigned seed = 1;
+    lp_regex *re;
+    int i, n;
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        bench();
+        return 0;
+    }
+    check("abc", "xxabcxx", 1, NULL);
+    check("^abc", "xxabc", 0, NULL);
+    check("^abc$", "abc", 1, NULL);
+    check("abc$", "abcd", 0, NULL);
+    check("^$", "", 1, NULL);
+    check("a.c", "a\nc", 0, NULL);
+    check("^(a|ab)(c|bcd)(d*)$", "abcd", 1, "a");
+    check("^(\\d+)-(\\w+)$", "2024-log_x", 1, "2024");
+    check("[^a-c]+", "abc", 0, NULL);
+    check("x[a-c\\d]{2,3}y", "xa1by", 1, NULL);
+    check("x[a-c\\d]{2,3}y", "xa1bcy", 0, NULL);
+    check("(a*)*b", "aaab", 1, "");
+    check("(a|b)*?c", "abc", 1, "b");
+    check("(a+?)", "aaa", 1, "a");
+    check("(\\w+) \\1", "hello hello", 1, "hello");
+    check("\\bfoo\\b", "a foo.", 1, NULL);
+    check("\\bfoo\\b", "afoo", 0, NULL);
+    check("^/abc/def/.*$/", "/abc/def/x/", 0, NULL);
+    check("(?:ab){2}", "xabab", 1, NULL);
+    check("a{,2}", "a{,2}", 1, NULL);
+    check("\\x41+", "zAAz", 1, NULL);
+    check("(ab", "", -2, NULL);
+    check("ab)", "", -2, NULL);
+    check("*a", "", -2, NULL);
+    check("[z-a]", "", -2, NULL);
+    check("a**", "", -2, NULL);
+    check("\\2(a)", "", -2, NULL);
+
+    // more states than the cache holds, the cache is flushed and built
+    // again, the answers are the same
+    re = regex_compile("x[a-z]{8}$", 10, &err);
+    for (i = 0; i < 2000; i++) {
+        for (n = 0; n < 40; n++) {
+            seed = seed * 1103515245 + 12345;
+            line[n] = (seed >> 16) & 1 ? 'x' : 'a';
+        }
+        assert(regex_match(re, line, n) == (line[n-9] == 'x'));
+    }
+    assert(re->flushes > 0);
+    regex_print(re);
+    regex_free(re);
+
+    // the arms of a case, the first one matching wins
+    {
+        const char *pats[] = {"^good *", "m(or)n*ing", "(\\w+) \\1", ".*$"};
+        lp_regex *arms[4];
+        lp_regexset *set;
+        int groups[2*REGEX_MAX_GROUPS];
+        for (i = 0; i < 4; i++)
+            arms[i] = regex_compile(pats[i], strlen(pats[i]), &err);
+        set = regexset_new(arms, 4);
+        assert(regexset_match(set, "good morning", 12) == 0);
+        assert(regexset_exec(set, "a mornnning", 11, groups) == 1);
+        assert(groups[0] == 2 && groups[2] == 3 && groups[3] == 5);
+        assert(regexset_match(set, "bye bye", 7) == 2);
+        assert(regexset_match(set, "", 0) == 3);
+        regexset_free(set);
+        for (i = 0; i < 4; i++)
+            regex_free(arms[i]);
+    }
+    test_set();
+    printf("regex ok\n");
+    return 0;
+}
+#endif //REGEX_TEST
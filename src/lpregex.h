@@ -0,0 +1,100 @@
+#ifndef LPREGEX_H
+#define LPREGEX_H
+
+/*
+ * regular expressions of lp.
+ * 1. a pattern is compiled once into a small program. a constant regex
+ *    literal is compiled by the lexer as soon as it is scanned, and the
+ *    same compiled regex serves every match after.
+ * 2. matching runs a lazy DFA: its states are built from the program as
+ *    the subjects need them, and kept in a cache of REGEX_CACHE_STATES
+ *    states with a transition table of 16-bit entries, one column for
+ *    each class of chars the pattern can't tell apart. once the states
+ *    are built, a match costs one table lookup per char. the cache is
+ *    flushed and built again when it's full, so the memory is bounded.
+ * 3. the DFA tells whether there's a match, not where the groups are.
+ *    the groups, and back references and \b which the DFA can't do, are
+ *    left to a backtracking matcher. for the groups it runs only after
+ *    the DFA tells there is a match.
+ *
+ * syntax: . [...] [^...] ^ $ | (...) (?:...), the quantifiers * + ? {n}
+ * {n,} {n,m} and their lazy forms *? +? ?? {n,m}?, the escapes \d \D \w
+ * \W \s \S \b \B \1-\9 \n \t \r \f \v \0 \xhh, and \ before any other
+ * char is that char. ^ and $ are the beginning and end of the subject.
+ * chars are bytes.
+ *
+ * a regex(and a regex set) keeps its cache and scratch memory in itself,
+ * so it's used by one thread at a time.
+ */
+#define REGEX_MAX_GROUPS   16      // including group 0, the whole match
+#define REGEX_MAX_INSTS    8192    // size of the compiled program
+#define REGEX_MAX_REPEAT   1000    // max n and m of {n,m}
+#define REGEX_CACHE_STATES 256     // DFA states cached by a regex
+#define REGEX_MAX_STEPS    1000000 // steps of a backtracking match before giving up
+
+typedef struct lp_regex lp_regex;
+
+// compile the pattern of 'len' chars, return NULL if it's invalid(the
+// reason is put in 'err') or no enough memory('err' is NULL)
+lp_regex *regex_compile(const char *pattern, int len, const char **err);
+
+void regex_free(lp_regex *re);
+
+// count of the groups, including group 0
+int regex_groups(lp_regex *re);
+
+// return 1 if the regex matches somewhere in the subject, 0 if not, -1 if
+// the backtracking matcher gives up(after REGEX_MAX_STEPS steps) or no
+// enough memory
+int regex_match(lp_regex *re, const char *s, int len);
+
+// find the leftmost match, with the groups put in 'groups': the beginning
+// and end of group i are groups[2*i] and groups[2*i+1], -1 if the group is
+// not matched. 'groups' has 2*regex_groups(re) items. the return value is
+// the same as regex_match
+int regex_exec(lp_regex *re, const char *s, int len, int *groups);
+
+// for test: print the program and the DFA cache
+void regex_print(lp_regex *re);
+
+/*
+ * regex set: the regexes of the arms of a case statement, matched
+ * together for the first arm matching the subject.
+ * 1. each regex knows a literal every match of it contains: the longest
+ *    run of plain chars out of any group, if it has no '|' out of any
+ *    group. the literals of all arms are searched at once by an
+ *    Aho-Corasick automaton, and an arm whose literal is not in the
+ *    subject is not tried.
+ * 2. the arms the DFA can match are combined into one program, whose
+ *    lazy DFA finds the first arm in one pass over the subject, and stops
+ *    as soon as no arm before the ones matched can still match.
+ * 3. the arms with back references or \b are tried one by one, only if
+ *    no arm before them matched.
+ * 4. the combined DFA caches REGEX_CACHE_STATES states for the first
+ *    REGEXSET_ARMS_STATES arms, twice as many for twice as many arms, up
+ *    to REGEXSET_MAX_STATES. if it still keeps flushing its cache(too
+ *    many states for the arms), the arms are tried one by one instead.
+ * 5. the groups are found only for the arm matched.
+ */
+#define REGEX_MAX_LIT       16 // length of the literal kept by a regex
+#define REGEXSET_MAX_THRASH 8  // matches flushing the combined DFA before it's given up
+#define REGEXSET_ARMS_STATES 16   // arms for REGEX_CACHE_STATES states of the combined DFA
+#define REGEXSET_MAX_STATES  8192 // states cached by the combined DFA
+
+typedef struct lp_regexset lp_regexset;
+
+// the set of the 'n' arms, which are kept by the caller till the set is
+// freed. NULL if no enough memory
+lp_regexset *regexset_new(lp_regex **arms, int n);
+
+void regexset_free(lp_regexset *set);
+
+// the first arm matching the subject, -1 if none. an arm whose
+// backtracking gives up is taken as not matching
+int regexset_match(lp_regexset *set, const char *s, int len);
+
+// the same as regexset_match, with the groups of the arm matched put in
+// 'groups', see regex_exec
+int regexset_exec(lp_regexset *set, const char *s, int len, int *groups);
+
+#endif //LPREGEX_H
@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "lpscan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define EOS -1 // end of source, the same as the lexer
+
+//1 ------------------------ scalar kernels ---------------------------
+static const char *scan_until_scalar(const char *p, int c0, int c1, int c2, int c3) {
+    while (1) {
+        int ch = *p;
+        if (ch == c0 || ch == c1 || ch == c2 || ch == c3 || ch == EOS)
+            return p;
+        p++;
+    }
+}
+
+static int scan_lines_scalar(const char *begin, const char *end, const char **last) {
+    int n = 0;
+    while ((begin = memchr(begin, '\n', end - begin)) != NULL) {
+        *last = begin++;
+        n++;
+    }
+    return n;
+}
+
+#ifdef SCAN_X86
+//1 ------------------------ sse2 kernels -----------------------------
+__attribute__((target("sse2")))
+static const char *scan_until_sse2(const char *p, int c0, int c1, int c2, int c3) {
+    __m128i v0 = _mm_set1_epi8((char)c0);
+    __m128i v1 = _mm_set1_epi8((char)c1);
+    __m128i v2 = _mm_set1_epi8((char)c2);
+    __m128i v3 = _mm_set1_epi8((char)c3);
+    __m128i ve = _mm_set1_epi8((char)EOS);
+    while (1) {
+        __m128i d = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(d, v0), _mm_cmpeq_epi8(d, v1)),
+                                 _mm_or_si128(_mm_cmpeq_epi8(d, v2), _mm_cmpeq_epi8(d, v3)));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(m, _mm_cmpeq_epi8(d, ve)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+}
+
+__attribute__((target("sse2")))
+static int scan_lines_sse2(const char *begin, const char *end, const char **last) {
+    __m128i vn = _mm_set1_epi8('\n');
+    const char *p;
+    int n = 0;
+    for (p = begin; p < end; p += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(d, vn));
+        if (end - p < 16)
+            mask &= (1u << (end - p)) - 1;
+        if (mask != 0) {
+            n += __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
+        }
+    }
+    return n;
+}
+
+//1 ------------------------ avx2 kernels -----------------------------
+__attribute__((target("avx2")))
+static const char *scan_until_avx2(const char *p, int c0, int c1, int c2, int c3) {
+    __m256i v0 = _mm256_set1_epi8((char)c0);
+    __m256i v1 = _mm256_set1_epi8((char)c1);
+    __m256i v2 = _mm256_set1_epi8((char)c2);
+    __m256i v3 = _mm256_set1_epi8((char)c3);
+    __m256i ve = _mm256_set1_epi8((char)EOS);
+    while (1) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(d, v0), _mm256_cmpeq_epi8(d, v1)),
+                                    _mm256_or_si256(_mm256_cmpeq_epi8(d, v2), _mm256_cmpeq_epi8(d, v3)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(m, _mm256_cmpeq_epi8(d, ve)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+}
+
+__attribute__((target("avx2")))
+static int scan_lines_avx2(const char *begin, const char *end, const char **last) {
+    __m256i vn = _mm256_set1_epi8('\n');
+    const char *p;
+    int n = 0;
+    for (p = begin; p < end; p += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(d, vn));
+        if (end - p < 32)
+            mask &= (1u << (end - p)) - 1;
+        if (mask != 0) {
+            n += __builtin_popcount(mask);
+            *last = p + 31 - __builtin_clz(mask);
+        }
+    }
+    return n;
+}
+#endif // SCAN_X86
+
+//1 ------------------------ dispatch ---------------------------------
+// the kernels are chosen at the first call of either function
+static const char *scan_until_init(const char *p, int c0, int c1, int c2, int c3) {
+    scan_init();
+    return scan_until(p, c0, c1, c2, c3);
+}
+
+static int scan_lines_init(const char *begin, const char *end, const char **last) {
+    scan_init();
+    return scan_lines(begin, end, last);
+}
+
+const char *(*scan_until)(const char *p, int c0, int c1, int c2, int c3) = scan_until_init;
+int (*scan_lines)(const char *begin, const char *end, const char **last) = scan_lines_init;
+
+void scan_init(void) {
+    scan_until = scan_until_scalar;
+    scan_lines = scan_lines_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_until = scan_until_avx2;
+        scan_lines = scan_lines_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_until = scan_until_sse2;
+        scan_lines = scan_lines_sse2;
+    }
+#endif
+}
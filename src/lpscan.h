@@ -0,0 +1,26 @@
+#ifndef LPSCAN_H
+#define LPSCAN_H
+
+/*
+ * bulk scanning kernels used by the lexer.
+ * 1. the scanned text must be terminated by the EOS char(-1), and at
+ *    least SCAN_PADDING bytes must be readable from the terminator on,
+ *    because the kernels load 16/32 bytes at a time.
+ * 2. the SSE2/AVX2 kernels are chosen at the first call according to
+ *    the running cpu, the scalar ones are used on other platforms.
+ */
+#define SCAN_PADDING 32
+
+// return the first position from 'p' holding one of c0, c1, c2, c3 or EOS.
+// pass a char more than once if less than 4 chars are interesting.
+extern const char *(*scan_until)(const char *p, int c0, int c1, int c2, int c3);
+
+// count the '\n' chars in [begin, end). if there's any, *last is set to
+// the position of the last one.
+extern int (*scan_lines)(const char *begin, const char *end, const char **last);
+
+// choose the kernels now instead of at the first call. call it before
+// lexing on several threads.
+void scan_init(void);
+
+#endif //LPSCAN_H
@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "lpsched.h"
+
+#define INIT_DEQUE 256     // lps, a power of 2
+#define SPINS      2       // rounds of stealing before a worker sleeps
+#define CACHELINE  64
+
+#define load(p, order)     __atomic_load_n(p, __ATOMIC_##order)
+#define store(p, v, order) __atomic_store_n(p, v, __ATOMIC_##order)
+
+//1 --------------------- deque --------------------------------------
+/*
+ * the Chase-Lev deque, in the memory orders of Le, Pop, Cohen and Zappa
+ * Nardelli(Correct and Efficient Work-Stealing for Weak Memory Models).
+ * only the owner pushes, and grows the ring when it's full. the old rings
+ * are kept till the deque is freed, as a thief may be reading one still.
+ * all take from the top, the owner too, so there's no take at the bottom.
+ */
+typedef struct Ring {
+    long size;             // a power of 2
+    struct Ring *older;
+    lp_vm *items[];
+} Ring;
+
+typedef struct {
+    long top;              // moved by the CAS of any worker
+    char pad[CACHELINE - sizeof(long)];
+    long bottom;           // moved by the owner only
+    Ring *ring;
+} Deque;
+
+static Ring *ring_new(long size, Ring *older) {
+    Ring *r = (Ring*)malloc(sizeof(Ring) + size * sizeof(lp_vm*));
+    if (r == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    r->size = size;
+    r->older = older;
+    return r;
+}
+
+static int deque_init(Deque *q) {
+    q->top = 0;
+    q->bottom = 0;
+    q->ring = ring_new(INIT_DEQUE, NULL);
+    return q->ring != NULL;
+}
+
+// the lps left in the deque are freed with it
+static void deque_free(Deque *q) {
+    Ring *r = q->ring, *older;
+    long k;
+    if (r == NULL)
+        return;
+    for (k = q->top; k < q->bottom; k++)
+        vm_free(r->items[k & (r->size - 1)]);
+    for (; r != NULL; r = older) {
+        older = r->older;
+        free(r);
+    }
+}
+
+// push the lp at the bottom, by the owner. 0 if no enough memory
+static int push(Deque *q, lp_vm *vm) {
+    long b = load(&q->bottom, RELAXED);
+    long t = load(&q->top, ACQUIRE);
+    Ring *r = load(&q->ring, RELAXED);
+    if (b - t > r->size - 1) {
+        Ring *bigger = ring_new(r->size * 2, r);
+        long k;
+        if (bigger == NULL)
+            return 0;
+        for (k = t; k < b; k++)
+            store(&bigger->items[k & (bigger->size - 1)],
+                  load(&r->items[k & (r->size - 1)], RELAXED), RELAXED);
+        store(&q->ring, bigger, RELEASE);
+        r = bigger;
+    }
+    store(&r->items[b & (r->size - 1)], vm, RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    store(&q->bottom, b + 1, RELAXED);
+    return 1;
+}
+
+// take the lp at the top, by any worker. NULL if the deque is empty
+static lp_vm *steal(Deque *q) {
+    for (;;) {
+        long t = load(&q->top, ACQUIRE);
+        long b;
+        Ring *r;
+        lp_vm *vm;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        b = load(&q->bottom, ACQUIRE);
+        if (t >= b)
+            return NULL;
+        r = load(&q->ring, ACQUIRE);
+        vm = load(&r->items[t & (r->size - 1)], RELAXED);
+        // another worker took it first, the next one is tried
+        if (__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return vm;
+    }
+}
+
+//1 --------------------- workers ------------------------------------
+struct sched_worker_ {
+    Deque q;
+    lp_sched *s;
+    int index;
+    pthread_t thread;
+    int started;
+    unsigned seed;         // of the random victims
+    long seq;              // lps spawned, for their ids
+    lp_vm **free;          // states of the lps ended, for reuse
+    int freecount;
+    long spawned;
+    long failed;
+    long preempted;
+    long stolen;
+} __attribute__((aligned(CACHELINE)));
+
+static long spawn(lp_vm *vm, int fun, lp_value *args);
+
+static lp_vm *new_lp(sched_worker *w) {
+    lp_vm *vm = w->freecount > 0 ? w->free[--w->freecount] : vm_new(w->s->prog);
+    if (vm != NULL)
+        vm->spawn = spawn;
+    return vm;
+}
+
+// the lp can't begin or has ended. its heap values are freed at once, as
+// the lps it spawned have copies of what they read, and its state is kept
+// for reuse
+static void drop_lp(sched_worker *w, lp_vm *vm) {
+    if (w->freecount < SCHED_KEEP) {
+        vm_clear(vm);
+        w->free[w->freecount++] = vm;
+    } else {
+        vm_free(vm);
+    }
+}
+
+// a worker sleeping is woken for the lp pushed, unless a worker spinning
+// will find it. the fence orders the push before the loads, as the
+// workers going to sleep change the counts before they look at the deques
+static void wake(lp_sched *s) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (load(&s->spinning, RELAXED) == 0 && load(&s->idle, RELAXED) > 0) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// the spawn of the vms run by the scheduler: the new lp goes to the deque
+// of the worker running the spawner
+static long spawn(lp_vm *vm, int fun, lp_value *args) {
+    sched_worker *w = (sched_worker*)vm->owner;
+    lp_vm *lp = new_lp(w);
+    long id = w->seq * w->s->nworkers + w->index;
+    if (lp == NULL)
+        return -1;
+    // once pushed, it may be run and ended by another worker at once
+    lp->id = id;
+    if (vm_start(lp, fun, args) != VM_OK || !push(&w->q, lp)) {
+        drop_lp(w, lp);
+        return -1;
+    }
+    w->seq++;
+    w->spawned++;
+    wake(w->s);
+    return id;
+}
+
+// an lp of another worker, trying them all from a random one
+static lp_vm *steal_other(sched_worker *w) {
+    lp_sched *s = w->s;
+    lp_vm *vm;
+    int k, v;
+    w->seed = w->seed * 1103515245 + 12345;
+    v = (w->seed >> 16) % s->nworkers;
+    for (k = 0; k < s->nworkers; k++, v = (v + 1) % s->nworkers) {
+        if (v != w->index && (vm = steal(&s->workers[v].q)) != NULL) {
+            w->stolen++;
+            return vm;
+        }
+    }
+    return NULL;
+}
+
+// the next lp to run: the oldest of the own deque, or one stolen. when
+// there's none, the worker looks again a few times, then sleeps till an
+// lp is spawned, and looks again. the last worker going to sleep with no
+// lp anywhere ends the run. NULL when it's over
+static lp_vm *next_lp(sched_worker *w) {
+    lp_sched *s = w->s;
+    lp_vm *vm;
+    int round, done;
+    if ((vm = steal(&w->q)) != NULL)
+        return vm;
+    for (;;) {
+        __atomic_add_fetch(&s->spinning, 1, __ATOMIC_SEQ_CST);
+        for (round = 0; round < SPINS && vm == NULL; round++) {
+            if ((vm = steal_other(w)) == NULL && (vm = steal(&w->q)) == NULL)
+                sched_yield();
+        }
+        // the last one spinning wakes another, as there may be more lps
+        if (__atomic_sub_fetch(&s->spinning, 1, __ATOMIC_SEQ_CST) == 0 && vm != NULL)
+            wake(s);
+        if (vm != NULL)
+            return vm;
+
+        pthread_mutex_lock(&s->lock);
+        __atomic_add_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+        if ((vm = steal(&w->q)) == NULL && (vm = steal_other(w)) == NULL && !s->done) {
+            if (s->idle == s->nworkers) {
+                s->done = 1;
+                pthread_cond_broadcast(&s->wake);
+            } else {
+                pthread_cond_wait(&s->wake, &s->lock);
+            }
+        }
+        __atomic_sub_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+        done = s->done;
+        pthread_mutex_unlock(&s->lock);
+        if (vm != NULL || done)
+            return vm;
+    }
+}
+
+static void end_lp(sched_worker *w, lp_vm *vm, int r) {
+    lp_sched *s = w->s;
+    if (r == VM_ERROR) {
+        w->failed++;
+        fflush(stdout);
+        if (vm->id == 0)
+            fprintf(stderr, "%s:%d: %s\n", s->name, vm->errorrow, vm->error);
+        else
+            fprintf(stderr, "%s:%d: %s, in lp %ld\n", s->name, vm->errorrow, vm->error, vm->id);
+    } else if (vm->id == 0) {
+        // kept with the values of the result
+        s->result = vm->result;
+        s->main = vm;
+        return;
+    }
+    drop_lp(w, vm);
+}
+
+static void *work(void *arg) {
+    sched_worker *w = (sched_worker*)arg;
+    lp_vm *vm;
+    int r;
+    while ((vm = next_lp(w)) != NULL) {
+        vm->owner = w;
+        r = vm_resume(vm, SCHED_SLICE);
+        // back to wait for its turn, or on at once if there's no memory
+        // to push it
+        while (r == VM_YIELD && !push(&w->q, vm))
+            r = vm_resume(vm, SCHED_SLICE);
+        if (r == VM_YIELD)
+            w->preempted++;
+        else
+            end_lp(w, vm, r);
+    }
+    return NULL;
+}
+
+//1 --------------------- scheduler ----------------------------------
+lp_sched *sched_new(lp_program *prog, const char *name, int nworkers) {
+    lp_sched *s = (lp_sched*)calloc(1, sizeof(lp_sched));
+    void *p = NULL;
+    int i;
+    if (nworkers <= 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0)
+        nworkers = 1;
+    if (s == NULL || posix_memalign(&p, CACHELINE, nworkers * sizeof(sched_worker)) != 0) {
+        printf("no enough memory\n");
+        free(s);
+        return NULL;
+    }
+    memset(p, 0, nworkers * sizeof(sched_worker));
+    s->prog = prog;
+    s->name = name;
+    s->workers = (sched_worker*)p;
+    s->nworkers = nworkers;
+    s->result = LPV_NILV;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    for (i = 0; i < nworkers; i++) {
+        sched_worker *w = &s->workers[i];
+        w->s = s;
+        w->index = i;
+        w->seed = i * 2654435761u + 1;
+        w->free = (lp_vm**)malloc(SCHED_KEEP * sizeof(lp_vm*));
+        if (w->free == NULL || !deque_init(&w->q)) {
+            if (w->free == NULL)
+                printf("no enough memory\n");
+            s->nworkers = i + 1;
+            sched_free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+void sched_free(lp_sched *s) {
+    int i, k;
+    if (s == NULL)
+        return;
+    for (i = 0; i < s->nworkers; i++) {
+        sched_worker *w = &s->workers[i];
+        deque_free(&w->q);
+        for (k = 0; k < w->freecount; k++)
+            vm_free(w->free[k]);
+        free(w->free);
+    }
+    vm_free(s->main);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    free(s->workers);
+    free(s);
+}
+
+long sched_run(lp_sched *s) {
+    sched_worker *w = &s->workers[0];
+    lp_vm *vm = new_lp(w);
+    int i;
+    if (vm == NULL)
+        return -1;
+    vm->id = w->seq++ * s->nworkers;
+    if (vm_start(vm, 0, NULL) != VM_OK || !push(&w->q, vm)) {
+        vm_free(vm);
+        return -1;
+    }
+    // worker 0 is the thread of the caller. a worker not started is idle
+    // for good, its deque stays empty
+    for (i = 1; i < s->nworkers; i++) {
+        if (pthread_create(&s->workers[i].thread, NULL, work, &s->workers[i]) == 0) {
+            s->workers[i].started = 1;
+        } else {
+            pthread_mutex_lock(&s->lock);
+            __atomic_add_fetch(&s->idle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    work(w);
+    for (i = 1; i < s->nworkers; i++) {
+        if (s->workers[i].started)
+            pthread_join(s->workers[i].thread, NULL);
+    }
+    for (i = 0; i < s->nworkers; i++) {
+        w = &s->workers[i];
+        s->spawned += w->spawned;
+        s->failed += w->failed;
+        s->preempted += w->preempted;
+        s->stolen += w->stolen;
+    }
+    return s->failed;
+}
+
+//1 --------------------- test ---------------------------------------
+#ifdef SCHED_TEST
+#include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
+
+typedef struct {
+    const char *src;
+    long result;           // of lp 0
+    long spawned;
+    long failed;
+} Case;
+
+static Case cases[] = {
+    {"return 6 * 7", 42, 0, 0},
+    {"for i in 1..100000 do lp x = i * 2 end end\nreturn 1", 1, 100000, 0},
+    {"fun f(n)\nif n > 0 then\nlp f(n - 1) end\nlp f(n - 1) end\nend\nend\nf(12)\nreturn 2", 2, 8190, 0},
+    {"lp return 1 + nil end\nfor i in 1..10 do lp end end\nreturn 3", 3, 11, 1},
+    {"struct P { x }\np = P{5}\nfor i in 1..1000 do lp return p.x + i end end\nreturn p.x", 5, 1000, 0},
+    // the loops are preempted, lp 0 too
+    {"lp s = 0\nfor i in 1..1000000 do s = s + i end end\ns = 0\nfor i in 1..1000000 do s = s + 1 end\nreturn s",
+     1000000, 1, 0},
+    // the strings made by the lps ended are freed
+    {"for i in 1..100000 do lp s = \"item number $i padded to the heap\" end end\nreturn 5", 5, 100000, 0},
+    // the lps read their copies of the values, after their spawner ended
+    {"struct Q { s, n }\nfun g(i)\ns = \"item number $i\"\nq = Q{s, 1 << 50}\n"
+     "for k in 1..10 do lp if q.s != \"item number $i\" or q.n != 1 << 50 then return 1 + nil end end end\nend\n"
+     "for i in 1..1000 do lp g(i) end end\nreturn 6", 6, 11000, 0},
+    // the lps on all workers match the regex arms of one case
+    {"fun f(s, i)\ncase s of\nr'^item \\d*7$': return i % 10 == 7\nr'^item': return i % 10 != 7\n_: return false\nend\nend\n"
+     "for i in 1..10000 do lp if !f(\"item $i\", i) then return 1 + nil end end end\nreturn 7", 7, 10000, 0},
+    {NULL, 0, 0, 0}
+};
+
+// heap values held by the states of the lps ended
+static long held(lp_sched *s) {
+    long count = 0;
+    int i, k;
+    for (i = 0; i < s->nworkers; i++) {
+        for (k = 0; k < s->workers[i].freecount; k++)
+            count += s->workers[i].free[k]->heapcount;
+    }
+    return count;
+}
+
+static void run_case(Case *t, int nworkers) {
+    void *src = string_source(t->src);
+    lp_ast *ast = parse_module(src, NULL);
+    lp_program *prog = vm_compile(ast);
+    lp_sched *s;
+    long failed;
+    assert(prog != NULL && prog->errorcount == 0);
+    s = sched_new(prog, "test", nworkers);
+    assert(s != NULL);
+    failed = sched_run(s);
+    assert(failed == t->failed);
+    if (!lpv_isint(s->result) || lpv_intof(s->result) != t->result || s->spawned != t->spawned) {
+        printf("%s\n=> %s %ld, %ld spawned, on %d workers\n", t->src,
+               lpv_isint(s->result) ? "" : "not an integer", lpv_isint(s->result) ? lpv_intof(s->result) : 0,
+               s->spawned, nworkers);
+        assert(0);
+    }
+    if (strstr(t->src, "1000000") != NULL)
+        assert(s->preempted >= 1000000 / SCHED_SLICE);
+    // lp 0 keeps only what it made, the others nothing
+    assert(held(s) == 0 && s->main != NULL && s->main->heapcount <= 2);
+    sched_free(s);
+    vm_free_program(prog);
+    ast_free(ast);
+    close_source(src);
+}
+
+static long maxrss(void) {
+    struct rusage u;
+    getrusage(RUSAGE_SELF, &u);
+    return u.ru_maxrss;    // in KB
+}
+
+// a million lps making a string each take no more memory than a few
+// thousand alive at once, as the values of each are freed when it ends
+static void test_memory(void) {
+    void *src = string_source("for i in 1..1000000 do lp s = \"item number $i padded to the heap\" end end");
+    lp_ast *ast = parse_module(src, NULL);
+    lp_program *prog = vm_compile(ast);
+    lp_sched *s = sched_new(prog, "memory", 4);
+    long before = maxrss();
+    long failed = sched_run(s);
+    assert(failed == 0 && s->spawned == 1000000);
+    printf("%ld KB more for 1000000 lps\n", maxrss() - before);
+    assert(maxrss() - before < 32 * 1024);
+    sched_free(s);
+    vm_free_program(prog);
+    ast_free(ast);
+    close_source(src);
+}
+
+// many short lps, a tree of lps, and a few long ones
+static const char *benches[][2] = {
+    {"spawn", "for i in 1..1000000 do lp x = i end end"},
+    {"tree", "fun f(n)\nif n > 0 then\nlp f(n - 1) end\nlp f(n - 1) end\nend\nend\nf(19)"},
+    {"busy", "for i in 1..64 do\nlp s = 0\nfor j in 1..2000000 do s = s + j end end\nend"},
+    {NULL, NULL}
+};
+
+static void bench(int nworkers) {
+    int k;
+    for (k = 0; benches[k][0] != NULL; k++) {
+        void *src = string_source(benches[k][1]);
+        lp_ast *ast = parse_module(src, NULL);
+        lp_program *prog = vm_compile(ast);
+        lp_sched *s = sched_new(prog, benches[k][0], nworkers);
+        struct timespec t0, t1;
+        double secs;
+        long failed;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        failed = sched_run(s);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(failed == 0);
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%-6s %7.3fs %8ld lps %10.0f lps/s %8ld stolen %8ld preempted, %d workers\n",
+               benches[k][0], secs, s->spawned + 1, (s->spawned + 1) / secs,
+               s->stolen, s->preempted, s->nworkers);
+        sched_free(s);
+        vm_free_program(prog);
+        ast_free(ast);
+        close_source(src);
+    }
+}
+
+// "sched -b [workers]" runs the benches, one worker per core by default
+int main(int argc, char *argv[]) {
+    int nworkers[] = {1, 2, 4, 16};
+    int k, j;
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        bench(argc > 2 ? atoi(argv[2]) : 0);
+        return 0;
+    }
+    test_memory();
+    for (j = 0; j < (int)(sizeof(nworkers) / sizeof(nworkers[0])); j++) {
+        for (k = 0; cases[k].src != NULL; k++)
+            run_case(&cases[k], nworkers[j]);
+    }
+    printf("%d cases ok\n", k);
+    return 0;
+}
+#endif //SCHED_TEST
@@ -0,0 +1,64 @@
+#ifndef LPSCHED_H
+#define LPSCHED_H
+#include <pthread.h>
+#include "lpvm.h"
+
+/*
+ * scheduler of the lps(lightweight processes) of a program: M:N, all the
+ * lps are run by one worker thread per core.
+ * 1. each worker has a lock-free deque of the lps ready to run(Chase-Lev:
+ *    the owner pushes at the bottom with no atomic read-modify-write, the
+ *    lps are taken from the top by a CAS). a worker takes the oldest lp of
+ *    its own deque, and when it's empty steals the oldest one of another
+ *    worker, trying them all from a random one on.
+ * 2. an lp runs for a slice of SCHED_SLICE reductions(calls and jumps
+ *    backward, see vm_resume), then it's preempted and pushed back to the
+ *    bottom of the deque of its worker. so the lps of a deque take turns,
+ *    and a loop never holds a worker.
+ * 3. an lp spawned is pushed to the deque of the worker running its
+ *    spawner, and a worker sleeping is woken for it unless one is looking
+ *    for lps already. a worker finding none anywhere looks again a few
+ *    times, then sleeps. the run is over when all workers are idle, with
+ *    all deques empty.
+ * 4. an lp owns the heap values it reads: the values it's spawned with
+ *    are copied into its heap(see vm_start), so they are all freed when it
+ *    ends, though there's no garbage collector yet. its state is kept by
+ *    its worker for the lps it spawns next.
+ * 5. an lp failing is reported on stderr and ends, the others go on.
+ */
+
+#define SCHED_SLICE 2000   // reductions of a turn of an lp
+#define SCHED_KEEP  64     // states of lps ended kept by a worker
+
+typedef struct sched_worker_ sched_worker;
+
+typedef struct {
+    lp_program *prog;
+    const char *name;      // of the source, for the errors
+    sched_worker *workers;
+    int nworkers;
+    int spinning;          // workers looking for lps to steal
+    int idle;              // workers sleeping, or going to
+    int done;              // the run is over
+    pthread_mutex_t lock;  // of idle and done
+    pthread_cond_t wake;
+    lp_value result;       // of lp 0, the top-level code
+    lp_vm *main;           // state of lp 0 ended, holding the result
+    // counts of the run, summed from the workers when it's over
+    long spawned;
+    long failed;
+    long preempted;
+    long stolen;
+} lp_sched;
+
+// a scheduler of 'nworkers' workers for the program, one per core if it's
+// 0. NULL if no enough memory
+lp_sched *sched_new(lp_program *prog, const char *name, int nworkers);
+void sched_free(lp_sched *s);
+
+// run the top-level code of the program as lp 0, and all the lps spawned,
+// till they have all ended. the count of the lps failed, -1 if the run
+// can't begin(no enough memory). a scheduler runs once
+long sched_run(lp_sched *s);
+
+#endif //LPSCHED_H
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpvalue.h"
+
+//1 --------------------- integer ------------------------------------
+lp_value lpv_int(long i) {
+    lpv_bigint *b;
+    if (lpv_fits(i))
+        return lpv_small(i);
+    b = (lpv_bigint*)malloc(sizeof(lpv_bigint));
+    if (b == NULL) {
+        printf("no enough memory\n");
+        return LPV_NILV;
+    }
+    b->kind = LPV_INTEGER;
+    b->i = i;
+    return lpv_ref(LPV_TAG_HEAP, b);
+}
+
+int lpv_isint(lp_value v) {
+    return lpv_issmall(v) ||
+           (lpv_is(v, LPV_TAG_HEAP) && ((lpv_heap*)lpv_ptr(v))->kind == LPV_INTEGER);
+}
+
+long lpv_intof(lp_value v) {
+    if (lpv_issmall(v))
+        return lpv_smallof(v);
+    return ((lpv_bigint*)lpv_ptr(v))->i;
+}
+
+//1 --------------------- string -------------------------------------
+lp_value lpv_str(const char *str, int len) {
+    lpv_string *s;
+    if (len <= LPV_SSTRMAX) {
+        lp_value v = lpv_box(LPV_TAG_SSTR, (lp_value)len << 40);
+        int i;
+        for (i = 0; i < len; i++)
+            v |= (lp_value)(unsigned char)str[i] << (8 * i);
+        return v;
+    }
+    s = (lpv_string*)malloc(sizeof(lpv_string) + len + 1);
+    if (s == NULL) {
+        printf("no enough memory\n");
+        return LPV_NILV;
+    }
+    s->kind = LPV_STRING;
+    s->len = len;
+    memcpy(s->chars, str, len);
+    s->chars[len] = 0;
+    return lpv_ref(LPV_TAG_STRING, s);
+}
+
+const char *lpv_strof(lp_value v, char *buf, int *len) {
+    lpv_string *s;
+    if (lpv_issstr(v)) {
+        int i;
+        *len = lpv_sstrlen(v);
+        for (i = 0; i < *len; i++)
+            buf[i] = (char)(v >> (8 * i));
+        buf[*len] = 0;
+        return buf;
+    }
+    s = (lpv_string*)lpv_ptr(v);
+    *len = s->len;
+    return s->chars;
+}
+
+//1 --------------------- object -------------------------------------
+lp_value lpv_object_new(lpt_struct *type, int count) {
+    lpv_object *o = (lpv_object*)malloc(sizeof(lpv_object) + count * sizeof(lp_value));
+    int i;
+    if (o == NULL) {
+        printf("no enough memory\n");
+        return LPV_NILV;
+    }
+    o->kind = LPV_OBJECT;
+    o->type = type;
+    o->item_count = count;
+    for (i = 0; i < count; i++)
+        o->items[i] = LPV_NILV;
+    return lpv_ref(LPV_TAG_OBJECT, o);
+}
+
+void lpv_free(lp_value v) {
+    if (!lpv_isfloat(v) && lpv_isptr(v))
+        free(lpv_ptr(v));
+}
+
+//1 --------------------- generic ------------------------------------
+int lpv_type(lp_value v) {
+    if (lpv_isfloat(v))
+        return LPV_FLOAT;
+    switch (lpv_tagof(v)) {
+        case LPV_TAG_SPECIAL:  return v == LPV_NILV ? LPV_NIL : lpv_islp(v) ? LPV_LP : LPV_BOOLEAN;
+        case LPV_TAG_INT:      return LPV_INTEGER;
+        case LPV_TAG_ATOM:     return LPV_ATOM;
+        case LPV_TAG_SSTR:     return LPV_STRING;
+        case LPV_TAG_STRING:   return LPV_STRING;
+        case LPV_TAG_OBJECT:   return LPV_OBJECT;
+        case LPV_TAG_FUNCTION: return LPV_FUNCTION;
+        default:               return ((lpv_heap*)lpv_ptr(v))->kind;
+    }
+}
+
+int lpv_equal(lp_value a, lp_value b) {
+    int ta, tb;
+    if (a == b)
+        return !(a == LPV_NAN); // NaN is not equal to itself
+    ta = lpv_type(a);
+    tb = lpv_type(b);
+    if ((ta == LPV_INTEGER || ta == LPV_FLOAT) && (tb == LPV_INTEGER || tb == LPV_FLOAT)) {
+        if (ta == LPV_INTEGER && tb == LPV_INTEGER)
+            return lpv_intof(a) == lpv_intof(b);
+        return (ta == LPV_FLOAT ? lpv_floatof(a) : (double)lpv_intof(a)) ==
+               (tb == LPV_FLOAT ? lpv_floatof(b) : (double)lpv_intof(b));
+    }
+    if (lpv_isheapstr(a) && lpv_isheapstr(b)) {
+        lpv_string *sa = (lpv_string*)lpv_ptr(a);
+        lpv_string *sb = (lpv_string*)lpv_ptr(b);
+        return sa->len == sb->len && memcmp(sa->chars, sb->chars, sa->len) == 0;
+    }
+    return 0;
+}
+
+void lpv_print(lp_value v, lp_strpool *names) {
+    char buf[LPV_SSTRMAX+1];
+    const char *s;
+    int len;
+    switch (lpv_type(v)) {
+        case LPV_NIL:
+            printf("nil");
+            break;
+        case LPV_BOOLEAN:
+            printf(v == LPV_TRUEV ? "true" : "false");
+            break;
+        case LPV_INTEGER:
+            printf("%ld", lpv_intof(v));
+            break;
+        case LPV_FLOAT:
+            printf("%.17g", lpv_floatof(v));
+            break;
+        case LPV_ATOM:
+            s = names != NULL ? strpool_get(names, lpv_atomof(v)) : NULL;
+            if (s != NULL)
+                printf(".%s", s);
+            else
+                printf(".#%d", lpv_atomof(v));
+            break;
+        case LPV_STRING:
+            s = lpv_strof(v, buf, &len);
+            printf("'%.*s'", len, s);
+            break;
+        case LPV_LP:
+            printf("<lp %ld>", lpv_lpidof(v));
+            break;
+        case LPV_OBJECT: {
+            lpv_object *o = lpv_objectof(v);
+            int i;
+            printf("{");
+            for (i = 0; i < o->item_count; i++) {
+                if (i > 0)
+                    printf(", ");
+                lpv_print(o->items[i], names);
+            }
+            printf("}");
+            break;
+        }
+        default:
+            printf("<%d %p>", lpv_type(v), lpv_ptr(v));
+            break;
+    }
+}
+
+//1 --------------------- test ---------------------------------------
+#ifdef VALUE_TEST
+#include <assert.h>
+#include <math.h>
+
+static void test_int() {
+    long samples[] = {0, 1, -1, 42, LPV_INTMAX, LPV_INTMIN, LPV_INTMAX + 1,
+                      LPV_INTMIN - 1, 0x7fffffffffffffffL, -0x7fffffffffffffffL - 1};
+    int i;
+    for (i = 0; i < (int)(sizeof(samples) / sizeof(samples[0])); i++) {
+        lp_value v = lpv_int(samples[i]);
+        assert(lpv_isint(v));
+        assert(lpv_type(v) == LPV_INTEGER);
+        assert(lpv_intof(v) == samples[i]);
+        assert(lpv_issmall(v) == lpv_fits(samples[i]));
+        assert(!lpv_isfloat(v));
+        lpv_free(v);
+    }
+}
+
+static void test_float() {
+    double samples[] = {0.0, -0.0, 1.5, -1e300, 1e-310, HUGE_VAL, -HUGE_VAL, NAN, -NAN};
+    int i;
+    for (i = 0; i < (int)(sizeof(samples) / sizeof(samples[0])); i++) {
+        lp_value v = lpv_float(samples[i]);
+        double f = lpv_floatof(v);
+        assert(lpv_isfloat(v));
+        assert(lpv_type(v) == LPV_FLOAT);
+        if (samples[i] != samples[i])
+            assert(f != f && v == LPV_NAN && !lpv_equal(v, v));
+        else
+            assert(memcmp(&f, &samples[i], sizeof(f)) == 0);
+    }
+    assert(lpv_equal(lpv_float(2.0), lpv_int(2)));
+    assert(!lpv_equal(lpv_float(2.5), lpv_int(2)));
+}
+
+static void test_str() {
+    const char *samples[] = {"", "a", "abcde", "abcdef", "hello world, a long string"};
+    char buf[LPV_SSTRMAX+1];
+    int i, j;
+    for (i = 0; i < (int)(sizeof(samples) / sizeof(samples[0])); i++) {
+        int len;
+        lp_value v = lpv_str(samples[i], strlen(samples[i]));
+        lp_value w = lpv_str(samples[i], strlen(samples[i]));
+        const char *s = lpv_strof(v, buf, &len);
+        assert(lpv_isstr(v) && lpv_type(v) == LPV_STRING);
+        assert(lpv_issstr(v) == (strlen(samples[i]) <= LPV_SSTRMAX));
+        assert(len == (int)strlen(samples[i]) && strcmp(s, samples[i]) == 0);
+        assert(lpv_equal(v, w));
+        for (j = 0; j < i; j++) {
+            lp_value u = lpv_str(samples[j], strlen(samples[j]));
+            assert(!lpv_equal(u, v));
+            lpv_free(u);
+        }
+        lpv_free(v);
+        lpv_free(w);
+    }
+    // bytes with the high bit and NUL in an immediate
+    {
+        int len;
+        lp_value v = lpv_str("\xff\0\x80", 3);
+        const char *s = lpv_strof(v, buf, &len);
+        assert(len == 3 && memcmp(s, "\xff\0\x80", 3) == 0);
+    }
+}
+
+static void test_other(lp_strpool *names) {
+    lp_value o = lpv_object_new(NULL, 4);
+    lpv_object *obj = lpv_objectof(o);
+    lp_value a = lpv_atom(strpool_add(names, "ok"));
+    assert(lpv_isobject(o) && lpv_type(o) == LPV_OBJECT);
+    assert(lpv_isnil(obj->items[3]));
+    obj->items[0] = lpv_int(-7);
+    obj->items[1] = lpv_float(0.25);
+    obj->items[2] = a;
+    obj->items[3] = lpv_str("nested", 6);
+    assert(lpv_isatom(a) && lpv_type(a) == LPV_ATOM);
+    assert(lpv_type(LPV_NILV) == LPV_NIL && lpv_type(LPV_TRUEV) == LPV_BOOLEAN);
+    assert(lpv_islp(lpv_lpid(0)) && lpv_type(lpv_lpid(12345)) == LPV_LP);
+    assert(lpv_lpidof(lpv_lpid(12345)) == 12345 && lpv_istrue(lpv_lpid(0)));
+    assert(!lpv_islp(LPV_NILV) && !lpv_islp(LPV_FALSEV) && !lpv_islp(LPV_TRUEV));
+    assert(!lpv_istrue(LPV_NILV) && !lpv_istrue(LPV_FALSEV));
+    assert(lpv_istrue(lpv_int(0)) && lpv_istrue(LPV_TRUEV));
+    assert(lpv_equal(o, o));
+    lpv_print(o, names);
+    printf("\n");
+    lpv_free(obj->items[3]);
+    lpv_free(o);
+}
+
+int main(int argc, char *argv[]) {
+    lp_strpool *names = strpool_init();
+    assert(sizeof(lp_value) == 8);
+    test_int();
+    test_float();
+    test_str();
+    test_other(names);
+    strpool_destroy(names);
+    printf("ok\n");
+    return 0;
+}
+#endif //VALUE_TEST
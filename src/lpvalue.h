@@ -0,0 +1,214 @@
+#ifndef LPVALUE_H
+#define LPVALUE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "strpool.h"
+
+// lp_type
+typedef struct lpt_struct_ {
+    unsigned name;                // string pool id
+    int field_count;
+    unsigned *fields;             // names of the fields
+} lpt_struct;
+
+typedef struct lpt_function_ {
+
+} lpt_function;
+
+typedef struct lpt_closure_ {
+
+} lpt_closure;
+
+typedef struct lpt_binary_ {
+
+} lpt_binary;
+
+typedef struct lpt_any_ {
+
+} lpt_any;
+
+/*
+ * lp_value: 8 bytes, NaN-boxed.
+ * 1. a float is the double itself. a NaN is always kept as the quiet NaN
+ *    LPV_NAN, so the other NaNs are free to hold the other values.
+ * 2. the other values have the 13 highest bits all set, which is a NaN
+ *    with the sign bit no float has, a tag in the next 3 bits, and 48 bits
+ *    of payload:
+ *      0 special  nil, false, true, and the ids of lps(bit 47 set)
+ *      1 int      signed 48-bit integer
+ *      2 atom     string pool id of the name of .abc
+ *      3 sstr     string of at most LPV_SSTRMAX bytes, the bytes in bits
+ *                 0-39, the length in bits 40-42
+ *      4 string   pointer to an lpv_string
+ *      5 object   pointer to an lpv_object
+ *      6 function pointer to an lpv_function
+ *      7 heap     pointer to another heap value, its kind is in the
+ *                 header: binary, regex, or an integer out of the
+ *                 48-bit range
+ *    user space pointers are 48 bits on x86-64 and aarch64.
+ * 3. a value of a type is made only one way: an integer in the 48-bit
+ *    range is always the immediate one, a string of at most LPV_SSTRMAX
+ *    bytes is always an sstr. so two immediates are equal iff their bits
+ *    are, and an immediate never equals a heap value.
+ * 4. the checks of types are comparisons of the bits, see the macros.
+ */
+typedef uint64_t lp_value;
+
+// types of values, and kinds of heap values
+#define LPV_NIL      0
+#define LPV_BOOLEAN  1
+#define LPV_INTEGER  2
+#define LPV_FLOAT    3
+#define LPV_ATOM     4
+#define LPV_STRING   5
+#define LPV_OBJECT   6
+#define LPV_FUNCTION 7
+#define LPV_LP       8
+#define LPV_BINARY   9
+#define LPV_REGEX    10
+
+#define LPV_TAG_SPECIAL  0
+#define LPV_TAG_INT      1
+#define LPV_TAG_ATOM     2
+#define LPV_TAG_SSTR     3
+#define LPV_TAG_STRING   4
+#define LPV_TAG_OBJECT   5
+#define LPV_TAG_FUNCTION 6
+#define LPV_TAG_HEAP     7
+
+#define LPV_BOXED   0xfff8000000000000ULL
+#define LPV_PAYLOAD 0x0000ffffffffffffULL
+#define LPV_NAN     0x7ff8000000000000ULL
+
+#define lpv_box(tag, payload) (LPV_BOXED | (lp_value)(tag) << 48 | ((lp_value)(payload) & LPV_PAYLOAD))
+#define lpv_tagof(v)          ((int)((v) >> 48) & 7) // of a value not a float
+#define lpv_is(v, tag)        (((v) >> 48) == (0xfff8 | (tag)))
+
+#define LPV_NILV   lpv_box(LPV_TAG_SPECIAL, 0)
+#define LPV_FALSEV lpv_box(LPV_TAG_SPECIAL, 1)
+#define LPV_TRUEV  lpv_box(LPV_TAG_SPECIAL, 2)
+
+#define lpv_isfloat(v)  ((v) < LPV_BOXED)
+#define lpv_isnil(v)    ((v) == LPV_NILV)
+#define lpv_isbool(v)   ((v) == LPV_TRUEV || (v) == LPV_FALSEV)
+#define lpv_istrue(v)   ((v) != LPV_NILV && (v) != LPV_FALSEV) // anything but nil and false
+#define lpv_bool(b)     ((b) ? LPV_TRUEV : LPV_FALSEV)
+
+// integers: the 48-bit ones are immediate, the others are boxed in the
+// heap by lpv_int. lpv_issmall tells an immediate one
+#define LPV_INTMIN (-(1LL << 47))
+#define LPV_INTMAX ((1LL << 47) - 1)
+#define lpv_fits(i)       ((long long)(i) >= LPV_INTMIN && (long long)(i) <= LPV_INTMAX)
+#define lpv_issmall(v)    lpv_is(v, LPV_TAG_INT)
+#define lpv_small(i)      lpv_box(LPV_TAG_INT, (i))
+#define lpv_smallof(v)    ((long)((int64_t)((v) << 16) >> 16))
+
+// the id of an lp, as made by "lp ... end"
+#define LPV_LPBIT         (1ULL << 47)
+#define lpv_islp(v)       (((v) & ~(LPV_PAYLOAD >> 1)) == lpv_box(LPV_TAG_SPECIAL, LPV_LPBIT))
+#define lpv_lpid(id)      lpv_box(LPV_TAG_SPECIAL, LPV_LPBIT | (lp_value)(id))
+#define lpv_lpidof(v)     ((long)((v) & (LPV_PAYLOAD >> 1)))
+
+#define lpv_isatom(v)     lpv_is(v, LPV_TAG_ATOM)
+#define lpv_atom(id)      lpv_box(LPV_TAG_ATOM, (id))
+#define lpv_atomof(v)     ((int)((v) & LPV_PAYLOAD))
+
+#define LPV_SSTRMAX 5
+#define lpv_issstr(v)     lpv_is(v, LPV_TAG_SSTR)
+#define lpv_sstrlen(v)    ((int)((v) >> 40) & 7)
+
+// heap values
+#define lpv_isptr(v)      ((v) >= lpv_box(LPV_TAG_STRING, 0))
+#define lpv_ptr(v)        ((void*)(uintptr_t)((v) & LPV_PAYLOAD))
+#define lpv_ref(tag, p)   lpv_box(tag, (uintptr_t)(p))
+#define lpv_isheapstr(v)  lpv_is(v, LPV_TAG_STRING)
+#define lpv_isstr(v)      (lpv_issstr(v) || lpv_isheapstr(v))
+#define lpv_isobject(v)   lpv_is(v, LPV_TAG_OBJECT)
+#define lpv_isfunction(v) lpv_is(v, LPV_TAG_FUNCTION)
+
+static inline lp_value lpv_float(double f) {
+    lp_value v;
+    if (f != f)
+        return LPV_NAN;
+    memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+static inline double lpv_floatof(lp_value v) {
+    double f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+// the header of the heap values
+#define LPV_COMMON unsigned char kind // LPV_xxx
+
+typedef struct {
+    LPV_COMMON;
+} lpv_heap;
+
+typedef struct {
+    LPV_COMMON;
+    long i;
+} lpv_bigint;
+
+typedef struct lpv_string_ {
+    LPV_COMMON;
+    int len;
+    char chars[];    // NUL ended
+} lpv_string;
+
+typedef struct lpv_object_ {
+    LPV_COMMON;
+    lpt_struct *type;
+    int item_count;
+    lp_value items[];
+} lpv_object;
+
+typedef struct lpv_binary_ {
+    LPV_COMMON;
+    lpt_binary *type;
+    int byte_count;
+    unsigned char bytes[];
+} lpv_binary;
+
+typedef struct lpv_function_ {
+    LPV_COMMON;
+    lpt_struct *owner;
+    lpt_any    *result;
+    int arg_count;
+
+} lpv_function;
+
+// the constructors of heap values return LPV_NILV if no enough memory
+
+// an integer, immediate if it fits in 48 bits
+lp_value lpv_int(long i);
+long lpv_intof(lp_value v);
+int lpv_isint(lp_value v);
+
+// a string of 'len' bytes, immediate if it's short enough
+lp_value lpv_str(const char *str, int len);
+// the bytes of a string. an immediate one is put in 'buf' of at least
+// LPV_SSTRMAX+1 bytes, the result is NUL ended either way
+const char *lpv_strof(lp_value v, char *buf, int *len);
+
+// an object of 'count' items, all nil
+lp_value lpv_object_new(lpt_struct *type, int count);
+#define lpv_objectof(v) ((lpv_object*)lpv_ptr(v))
+
+// free a heap value(not the values it refers to), nothing for immediates
+void lpv_free(lp_value v);
+
+// LPV_xxx type of the value
+int lpv_type(lp_value v);
+
+// equality of the values: numbers by value(1 == 1.0), strings by bytes,
+// others by identity
+int lpv_equal(lp_value a, lp_value b);
+
+// print the value, the names of atoms are in 'names'
+void lpv_print(lp_value v, lp_strpool *names);
+
+#endif //LPVALUE_H
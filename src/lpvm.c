@@ -0,0 +1,2743 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <limits.h>
+
+#include "lpvm.h"
+#include "lpregex.h"
+
+#define INIT_CODE   64
+#define INIT_STACK  64      // small, there may be many lps
+#define INIT_FRAMES 8
+#define VM_MAX_STACK (1 << 24) // values of the stack
+
+#define NO_JUMP -1
+#define NO_REG  -1
+
+#define VM_OPNAME(name) #name,
+static const char *opnames[] = { VM_OPS(VM_OPNAME) };
+
+//1 --------------------- program ------------------------------------
+// make room for one more item of 'itemsize' bytes in the array, 0 if no
+// enough memory
+static int grow(void **array, int *size, int count, int itemsize) {
+    int newsize;
+    void *p;
+    if (count < *size)
+        return 1;
+    newsize = *size == 0 ? INIT_CODE : *size * 2;
+    p = realloc(*array, (size_t)newsize * itemsize);
+    if (p == NULL) {
+        printf("no enough memory\n");
+        return 0;
+    }
+    *array = p;
+    *size = newsize;
+    return 1;
+}
+
+static lp_proto *proto_new(unsigned name, int nparams) {
+    lp_proto *f = (lp_proto*)calloc(1, sizeof(lp_proto));
+    if (f == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    f->name = name;
+    f->nparams = nparams;
+    f->nregs = nparams;
+    return f;
+}
+
+struct vm_matcher_ {
+    lp_regex **arms;
+    lp_regexset *set;
+    vm_matcher *next;      // in the free list of the match
+};
+
+static void matcher_free(vm_matcher *mt, int count) {
+    int i;
+    regexset_free(mt->set);
+    for (i = 0; i < count; i++)
+        regex_free(mt->arms[i]);
+    free(mt->arms);
+    free(mt);
+}
+
+static void match_free(vm_match *m) {
+    vm_matcher *mt, *next;
+    int i;
+    for (mt = m->free; mt != NULL; mt = next) {
+        next = mt->next;
+        matcher_free(mt, m->count);
+    }
+    for (i = 0; i < m->count; i++)
+        free(m->patterns[i]);
+    free(m->patterns);
+    free(m->lens);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+static void proto_free(lp_proto *f) {
+    int i;
+    if (f == NULL)
+        return;
+    for (i = 0; i < f->kcount; i++)
+        lpv_free(f->k[i]);
+    for (i = 0; i < f->tplcount; i++)
+        free(f->tpls[i]);
+    for (i = 0; i < f->matchcount; i++)
+        match_free(f->matches[i]);
+    free(f->code);
+    free(f->rows);
+    free(f->k);
+    free(f->fields);
+    free(f->tpls);
+    free(f->matches);
+    free(f);
+}
+
+void vm_free_program(lp_program *prog) {
+    int i;
+    if (prog == NULL)
+        return;
+    for (i = 0; i < prog->funcount; i++)
+        proto_free(prog->funs[i]);
+    for (i = 0; i < prog->typecount; i++) {
+        free(prog->types[i]->fields);
+        free(prog->types[i]);
+    }
+    free(prog->funs);
+    free(prog->types);
+    free(prog);
+}
+
+void print_compile_errors(lp_program *prog, const char *name) {
+    int i;
+    for (i = 0; i < prog->errorcount && i < PARSE_MAX_ERRORS; i++)
+        printf("%s:%d: %s\n", name, prog->errors[i].row, prog->errors[i].msg);
+    if (prog->errorcount > PARSE_MAX_ERRORS)
+        printf("%s: %d more errors\n", name, prog->errorcount - PARSE_MAX_ERRORS);
+}
+
+//1 --------------------- compiler -----------------------------------
+/*
+ * one pass over the ast of each function, emitting the code as it goes.
+ * 1. the locals take the registers from 0 up in order of their
+ *    definitions, the temporaries of an expression are taken above them
+ *    and given back when it's done, so the registers are a stack.
+ * 2. an expression is compiled into the register given, a local read
+ *    as an operand is used in its own register without a move.
+ * 3. a condition is compiled into jumps, not a value: the jumps still to
+ *    be patched are chained by their Bx, see jump_to/patch.
+ * 4. assigning a name defines a local, unless the name is visible
+ *    already. the names assigned by the clauses of if/while/for are the
+ *    construct's own, and their values are given back to the locals of
+ *    the same names outside when it's done.
+ */
+typedef struct {
+    unsigned name;
+    int reg;
+} Local;
+
+typedef struct Loop {
+    struct Loop *outer;
+    int breaks;            // jumps to the end
+    int conts;             // jumps to the next round
+} Loop;
+
+typedef struct {
+    lp_program *prog;
+    lp_ast *ast;
+    lp_proto *f;
+    Local locals[VM_MAX_REGS];
+    int nlocals;
+    int freereg;           // first register not taken
+    Loop *loop;            // innermost loop
+    unsigned row;          // row of the statement, for the instructions emitted
+    int toolong;           // the function is too long, reported already
+    int nomem;
+    int *kslots;           // hash of the constants, index in f->k, -1 if empty
+    int kslotsize;
+    int funsize;           // of prog->funs
+    unsigned *fundefs;     // FUNDEF of each function, 0 for the top-level code
+    unsigned *structdefs;  // STRUCTDEF of each type
+    unsigned id_any;       // "_"
+    unsigned id_puts;
+    unsigned id_print;
+    unsigned id_lp;        // name of the functions of lp blocks
+} Compiler;
+
+static void compile_error(Compiler *c, unsigned row, const char *fmt, ...) {
+    lp_program *prog = c->prog;
+    va_list ap;
+    if (prog->errorcount < PARSE_MAX_ERRORS) {
+        ast_error *e = &prog->errors[prog->errorcount];
+        e->row = row;
+        e->col = 0;
+        va_start(ap, fmt);
+        vsnprintf(e->msg, PARSE_MSGMAX, fmt, ap);
+        va_end(ap);
+    }
+    prog->errorcount++;
+}
+
+#define namestr(c, id) ast_namestr((c)->ast, (id))
+
+//2 -------------------- emitting ------------------------------------
+static int emit(Compiler *c, unsigned inst) {
+    lp_proto *f = c->f;
+    int size = f->codesize;
+    if (f->codecount >= VM_MAX_CODE) {
+        if (!c->toolong)
+            compile_error(c, c->row, "function too long");
+        c->toolong = 1;
+        return -1;
+    }
+    if (!grow((void**)&f->code, &f->codesize, f->codecount, sizeof(unsigned))) {
+        c->nomem = 1;
+        return -1;
+    }
+    if (f->codesize != size) {
+        unsigned *rows = (unsigned*)realloc(f->rows, f->codesize * sizeof(unsigned));
+        if (rows == NULL) {
+            printf("no enough memory\n");
+            f->codesize = size;
+            c->nomem = 1;
+            return -1;
+        }
+        f->rows = rows;
+    }
+    f->code[f->codecount] = inst;
+    f->rows[f->codecount] = c->row;
+    return f->codecount++;
+}
+
+#define emit_abc(c, op, a, b, cc) emit(c, vm_abc(OP_##op, a, b, cc))
+#define emit_abx(c, op, a, bx)    emit(c, vm_abx(OP_##op, a, bx))
+#define here(c)                   ((c)->f->codecount)
+
+static int alloc_reg(Compiler *c) {
+    if (c->freereg >= VM_MAX_REGS) {
+        compile_error(c, c->row, "too many locals and temporaries");
+        return VM_MAX_REGS - 1;
+    }
+    if (c->freereg >= c->f->nregs)
+        c->f->nregs = c->freereg + 1;
+    return c->freereg++;
+}
+
+static int find_local(Compiler *c, unsigned name) {
+    int i;
+    for (i = c->nlocals - 1; i >= 0; i--) {
+        if (c->locals[i].name == name)
+            return c->locals[i].reg;
+    }
+    return NO_REG;
+}
+
+static void add_local(Compiler *c, unsigned name, int reg) {
+    if (c->nlocals >= VM_MAX_REGS) {
+        compile_error(c, c->row, "too many locals");
+        return;
+    }
+    c->locals[c->nlocals].name = name;
+    c->locals[c->nlocals].reg = reg;
+    c->nlocals++;
+}
+
+static unsigned khash(lp_value v) {
+    unsigned h = 2166136261u;
+    if (lpv_isheapstr(v)) {
+        lpv_string *s = (lpv_string*)lpv_ptr(v);
+        int i;
+        for (i = 0; i < s->len; i++)
+            h = (h ^ (unsigned char)s->chars[i]) * 16777619u;
+        return h;
+    }
+    return (unsigned)(v ^ (v >> 29) ^ (v >> 47)) * 2654435761u;
+}
+
+static int same_k(lp_value a, lp_value b) {
+    return a == b || (lpv_isheapstr(a) && lpv_isheapstr(b) && lpv_equal(a, b));
+}
+
+// index of the constant, the same values are kept once. the value is
+// taken by the proto, or freed if it's there already
+static int add_k(Compiler *c, lp_value v) {
+    lp_proto *f = c->f;
+    unsigned mask;
+    int i;
+    if (f->kcount * 2 >= c->kslotsize) {
+        int size = c->kslotsize == 0 ? 64 : c->kslotsize * 2;
+        int *slots = (int*)malloc(size * sizeof(int));
+        if (slots == NULL) {
+            printf("no enough memory\n");
+            c->nomem = 1;
+            lpv_free(v);
+            return 0;
+        }
+        memset(slots, -1, size * sizeof(int));
+        for (i = 0; i < f->kcount; i++) {
+            unsigned h = khash(f->k[i]) & (size - 1);
+            while (slots[h] != -1)
+                h = (h + 1) & (size - 1);
+            slots[h] = i;
+        }
+        free(c->kslots);
+        c->kslots = slots;
+        c->kslotsize = size;
+    }
+    mask = c->kslotsize - 1;
+    for (i = khash(v) & mask; c->kslots[i] != -1; i = (i + 1) & mask) {
+        if (same_k(f->k[c->kslots[i]], v)) {
+            if (f->k[c->kslots[i]] != v)
+                lpv_free(v);
+            return c->kslots[i];
+        }
+    }
+    if (f->kcount > 0xffff) {
+        compile_error(c, c->row, "too many constants");
+        lpv_free(v);
+        return 0;
+    }
+    if (!grow((void**)&f->k, &f->ksize, f->kcount, sizeof(lp_value))) {
+        c->nomem = 1;
+        lpv_free(v);
+        return 0;
+    }
+    f->k[f->kcount] = v;
+    c->kslots[i] = f->kcount;
+    return f->kcount++;
+}
+
+// index of the inline cache of a GETFIELD
+static int add_field(Compiler *c, unsigned name) {
+    lp_proto *f = c->f;
+    if (!grow((void**)&f->fields, &f->fieldsize, f->fieldcount, sizeof(vm_field))) {
+        c->nomem = 1;
+        return 0;
+    }
+    f->fields[f->fieldcount].name = name;
+    f->fields[f->fieldcount].cache = 0;
+    return f->fieldcount++;
+}
+
+// index of a new match of no arms
+static int add_match(Compiler *c) {
+    lp_proto *f = c->f;
+    vm_match *m;
+    if (!grow((void**)&f->matches, &f->matchsize, f->matchcount, sizeof(vm_match*))) {
+        c->nomem = 1;
+        return 0;
+    }
+    if ((m = (vm_match*)calloc(1, sizeof(vm_match))) == NULL) {
+        printf("no enough memory\n");
+        c->nomem = 1;
+        return 0;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+    f->matches[f->matchcount] = m;
+    return f->matchcount++;
+}
+
+// add the pattern as the next arm of the match, its index
+static int add_pattern(Compiler *c, int k, const char *pattern, int len) {
+    vm_match *m;
+    char **patterns;
+    int *lens;
+    char *p;
+    if (c->nomem)
+        return 0;
+    m = c->f->matches[k];
+    patterns = (char**)realloc(m->patterns, (m->count + 1) * sizeof(char*));
+    lens = patterns == NULL ? NULL : (int*)realloc(m->lens, (m->count + 1) * sizeof(int));
+    p = lens == NULL ? NULL : (char*)malloc(len + 1);
+    if (patterns != NULL)
+        m->patterns = patterns;
+    if (lens != NULL)
+        m->lens = lens;
+    if (p == NULL) {
+        printf("no enough memory\n");
+        c->nomem = 1;
+        return 0;
+    }
+    memcpy(p, pattern, len);
+    p[len] = 0;
+    m->patterns[m->count] = p;
+    m->lens[m->count] = len;
+    return m->count++;
+}
+
+//2 -------------------- jumps ---------------------------------------
+// a jump not patched yet keeps the next one of its list in Bx, 0xffff
+// ends the list. VM_MAX_CODE keeps every pc below it
+static int emit_jump(Compiler *c, int op, int a) {
+    return emit(c, vm_abx(op, a, 0xffff));
+}
+
+static void jump_to(Compiler *c, int *list, int pc) {
+    unsigned *code = c->f->code;
+    if (pc < 0)
+        return;
+    code[pc] = (code[pc] & 0xffff) | (unsigned)(*list == NO_JUMP ? 0xffff : *list) << 16;
+    *list = pc;
+}
+
+static void patch(Compiler *c, int list, int target) {
+    unsigned *code = c->f->code;
+    while (list != NO_JUMP && list < c->f->codecount) {
+        int next = VM_BX(code[list]);
+        code[list] = (code[list] & 0xffff) | (unsigned)(target - (list + 1) + VM_BIAS) << 16;
+        list = next == 0xffff ? NO_JUMP : next;
+    }
+}
+
+#define patch_here(c, list) patch(c, list, here(c))
+
+static void emit_back(Compiler *c, int op, int a, int target) {
+    emit(c, vm_abx(op, a, target - (here(c) + 1) + VM_BIAS));
+}
+
+//2 -------------------- expressions ---------------------------------
+static void expr(Compiler *c, unsigned n, int dst);
+static void call(Compiler *c, unsigned n, int dst);
+static void block(Compiler *c, unsigned list);
+
+static const char *unsupported(int kind) {
+    switch (kind) {
+        case AST_TUPLE:   return "tuples";
+        case AST_LIST:    return "lists";
+        case AST_COMP:    return "list comprehensions";
+        case AST_REGEX:   return "regex values";
+        case AST_FUNDEF:  return "functions as values";
+        case AST_IMPORT:  return "imports";
+        case AST_BINARYDEF: return "binaries";
+        default:          return "these expressions";
+    }
+}
+
+static int find_fun(Compiler *c, unsigned name) {
+    int i;
+    for (i = 1; i < c->prog->funcount; i++) {
+        if (c->prog->funs[i]->name == name)
+            return i;
+    }
+    return -1;
+}
+
+static int find_type(Compiler *c, unsigned name) {
+    int i;
+    for (i = 0; i < c->prog->typecount; i++) {
+        if (c->prog->types[i]->name == name)
+            return i;
+    }
+    return -1;
+}
+
+// the register of a local read as an operand, or a new temporary with
+// the value of the expression
+static int expr_any(Compiler *c, unsigned n) {
+    ast_node *node = ast_at(c->ast, n);
+    int reg;
+    if (node->kind == AST_NAME && (reg = find_local(c, node->a)) != NO_REG)
+        return reg;
+    reg = alloc_reg(c);
+    expr(c, n, reg);
+    return reg;
+}
+
+// a constant of a literal, -1 if it's not one
+static int literal_k(Compiler *c, unsigned n) {
+    ast_node *node = ast_at(c->ast, n);
+    switch (node->kind) {
+        case AST_INT:
+            return add_k(c, lpv_int(ast_intval(c->ast, n)));
+        case AST_FLOAT:
+            return add_k(c, lpv_float(ast_floatval(c->ast, n)));
+        case AST_STRING:
+            if (node->flags & AST_TEMPLATE)
+                return -1;
+            return add_k(c, lpv_str(ast_str(c->ast, node->a), node->b));
+        case AST_ATOM:
+            return add_k(c, lpv_atom(node->a));
+        default:
+            return -1;
+    }
+}
+
+static void load_int(Compiler *c, long i, int dst) {
+    if (i >= -VM_BIAS && i <= 0xffff - VM_BIAS)
+        emit_abx(c, LOADI, dst, i + VM_BIAS);
+    else
+        emit_abx(c, LOADK, dst, add_k(c, lpv_int(i)));
+}
+
+// a name, "a.b.c" is the field b.c of the local a
+static void name_expr(Compiler *c, unsigned id, int dst) {
+    const char *s = namestr(c, id);
+    const char *dot = strchr(s, '.');
+    int reg;
+    if (dot == NULL) {
+        reg = find_local(c, id);
+        if (reg != NO_REG) {
+            if (reg != dst)
+                emit_abc(c, MOVE, dst, reg, 0);
+        } else if (find_fun(c, id) >= 0) {
+            compile_error(c, c->row, "functions as values are not supported yet");
+        } else {
+            compile_error(c, c->row, "unknown name %s", s);
+        }
+        return;
+    }
+    reg = find_local(c, ast_name(c->ast, s, dot - s));
+    if (reg == NO_REG) {
+        compile_error(c, c->row, "unknown name %.*s", (int)(dot - s), s);
+        return;
+    }
+    while (dot != NULL) {
+        const char *field = dot + 1;
+        dot = strchr(field, '.');
+        emit_abc(c, GETFIELD, dst, reg, 0);
+        emit(c, add_field(c, ast_name(c->ast, field,
+                                      dot != NULL ? (int)(dot - field) : (int)strlen(field))));
+        reg = dst;
+    }
+}
+
+// the name in hole k of the template, NULL if it's not a name
+static const char *hole_name(StrTemplate *tpl, int k, int *len) {
+    StrHole *h = &tpl->holes[k];
+    const char *s = tpl->text + h->expr;
+    int n = h->exprlen;
+    while (n > 0 && (*s == ' ' || *s == '\t')) {
+        s++;
+        n--;
+    }
+    while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t'))
+        n--;
+    *len = n;
+    // ${name} is taken as $name
+    if (h->kind == HOLE_EXPR &&
+        strspn(s, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.") < (size_t)n)
+        return NULL;
+    return s;
+}
+
+// "...$a...${b}..." into R(dst), the values of the holes are put in the
+// registers after it
+static void template_expr(Compiler *c, unsigned n, int dst) {
+    ast_node *node = ast_at(c->ast, n);
+    StrTemplate *tpl = compile_template(ast_str(c->ast, node->a), node->b);
+    lp_proto *f = c->f;
+    int top = c->freereg;
+    int k, a;
+    if (tpl == NULL) {
+        compile_error(c, c->row, "bad string template");
+        return;
+    }
+    if (!grow((void**)&f->tpls, &f->tplsize, f->tplcount, sizeof(StrTemplate*))) {
+        c->nomem = 1;
+        free(tpl);
+        return;
+    }
+    f->tpls[f->tplcount++] = tpl;
+    if (f->tplcount > 0xffff)
+        compile_error(c, c->row, "too many string templates");
+    // the holes go in the registers right after the result
+    a = c->freereg == dst + 1 ? dst : alloc_reg(c);
+    for (k = 0; k < tpl->holecount; k++) {
+        int reg = alloc_reg(c);
+        int len;
+        const char *s = hole_name(tpl, k, &len);
+        if (s == NULL) {
+            compile_error(c, c->row, "expressions in string templates are not supported yet");
+            continue;
+        }
+        name_expr(c, ast_name(c->ast, s, len), reg);
+    }
+    emit_abx(c, TPL, a, f->tplcount - 1);
+    if (a != dst)
+        emit_abc(c, MOVE, dst, a, 0);
+    c->freereg = top;
+}
+
+// the arguments of a call or new in the order of the parameters or
+// fields in 'params'(a list of VARDEFs), named ones put by their names.
+// the missing ones are the default values, or nil for a struct
+static void arguments(Compiler *c, unsigned params, unsigned args, int base, int isfun) {
+    unsigned np = ast_count(c->ast, params);
+    unsigned na = ast_count(c->ast, args);
+    unsigned given[VM_MAX_REGS];
+    unsigned i, j;
+    if (np > VM_MAX_REGS) {
+        compile_error(c, c->row, "too many parameters");
+        return;
+    }
+    memset(given, 0, np * sizeof(unsigned));
+    for (i = 0; i < na; i++) {
+        unsigned a = ast_items(c->ast, args)[i];
+        ast_node *node = ast_at(c->ast, a);
+        if (node->kind != AST_NAMEDARG) {
+            if (i >= np)
+                compile_error(c, c->row, "too many arguments");
+            else
+                given[i] = a;
+            continue;
+        }
+        for (j = 0; j < np; j++) {
+            if (ast_at(c->ast, ast_items(c->ast, params)[j])->a == node->a)
+                break;
+        }
+        if (j == np)
+            compile_error(c, c->row, "no %s named %s", isfun ? "parameter" : "field",
+                          namestr(c, node->a));
+        else if (given[j] != 0)
+            compile_error(c, c->row, "%s given twice", namestr(c, node->a));
+        else
+            given[j] = node->b;
+    }
+    for (j = 0; j < np; j++) {
+        unsigned p = ast_items(c->ast, params)[j];
+        unsigned value = given[j] != 0 ? given[j] : c->ast->extra[ast_at(c->ast, p)->b + 1];
+        if (value != 0)
+            expr(c, value, base + j);
+        else if (isfun)
+            compile_error(c, c->row, "no argument of %s", namestr(c, ast_at(c->ast, p)->a));
+        else
+            emit_abc(c, LOADNIL, base + j, 0, 0);
+    }
+}
+
+// a call into R(dst), the result is dropped if dst is NO_REG
+static void call(Compiler *c, unsigned n, int dst) {
+    ast_node *node = ast_at(c->ast, n);
+    ast_node *fn = ast_at(c->ast, node->a);
+    unsigned args = node->b;
+    int top = c->freereg;
+    int base = c->freereg;
+    int fi, i, count;
+
+    if (fn->kind != AST_NAME || strchr(namestr(c, fn->a), '.') != NULL) {
+        compile_error(c, c->row, "only functions called by name are supported yet");
+        return;
+    }
+    fi = find_fun(c, fn->a);
+    if (fi < 0 && (fn->a == c->id_puts || fn->a == c->id_print)) {
+        count = ast_count(c->ast, args);
+        for (i = 0; i < count; i++) {
+            unsigned a = ast_items(c->ast, args)[i];
+            if (ast_at(c->ast, a)->kind == AST_NAMEDARG)
+                compile_error(c, c->row, "no named arguments of %s", namestr(c, fn->a));
+            expr(c, a, alloc_reg(c));
+        }
+        emit_abc(c, PRINT, base, count, 0);
+        if (dst != NO_REG)
+            emit_abc(c, LOADNIL, dst, 0, 0);
+        c->freereg = top;
+        return;
+    }
+    if (fi < 0) {
+        compile_error(c, c->row, "unknown function %s", namestr(c, fn->a));
+        return;
+    }
+    // the registers of the callee begin with its arguments, it may use
+    // one for its result even if it has no parameters
+    count = c->prog->funs[fi]->nparams;
+    for (i = 0; i < count || i == 0; i++)
+        alloc_reg(c);
+    arguments(c, ast_ops(c->ast, c->fundefs[fi])[1], args, base, 1);
+    emit_abx(c, CALL, base, fi);
+    if (dst != NO_REG && dst != base)
+        emit_abc(c, MOVE, dst, base, 0);
+    c->freereg = top;
+}
+
+static void new_expr(Compiler *c, unsigned n, int dst) {
+    ast_node *node = ast_at(c->ast, n);
+    ast_node *type = ast_at(c->ast, node->a);
+    int top = c->freereg;
+    int base = c->freereg;
+    int ti, i, count;
+    if (type->kind != AST_NAME || (ti = find_type(c, type->a)) < 0) {
+        compile_error(c, c->row, "unknown struct %s",
+                      type->kind == AST_NAME ? namestr(c, type->a) : "");
+        return;
+    }
+    count = c->prog->types[ti]->field_count;
+    for (i = 0; i < count; i++)
+        alloc_reg(c);
+    arguments(c, ast_at(c->ast, c->structdefs[ti])->b, node->b, base, 0);
+    emit_abc(c, NEW, dst, ti, base);
+    c->freereg = top;
+}
+
+static int is_local_reg(Compiler *c, int reg) {
+    int i;
+    for (i = 0; i < c->nlocals; i++) {
+        if (c->locals[i].reg == reg)
+            return 1;
+    }
+    return 0;
+}
+
+static void begin_fun(Compiler *c, lp_proto *f);
+static int add_proto(lp_program *prog, lp_proto *f, int *size);
+
+// the locals visible read in an lp block, the parameters of its function
+typedef struct {
+    Compiler *c;
+    unsigned names[VM_MAX_REGS];
+    int regs[VM_MAX_REGS];
+    int count;
+} Captures;
+
+// the local of "a" or "a.b.c"
+static void capture(Captures *cap, const char *s, int len) {
+    const char *dot = (const char*)memchr(s, '.', len);
+    unsigned name = ast_name(cap->c->ast, s, dot != NULL ? (int)(dot - s) : len);
+    int reg = find_local(cap->c, name);
+    int i;
+    if (reg == NO_REG)
+        return;
+    for (i = 0; i < cap->count; i++) {
+        if (cap->names[i] == name)
+            return;
+    }
+    // no more than the locals, each one is captured once
+    cap->names[cap->count] = name;
+    cap->regs[cap->count] = reg;
+    cap->count++;
+}
+
+static void find_captures(void *arg, unsigned n) {
+    Captures *cap = (Captures*)arg;
+    lp_ast *ast = cap->c->ast;
+    ast_node *node = ast_at(ast, n);
+    if (node->kind == AST_NAME) {
+        const char *s = ast_namestr(ast, node->a);
+        capture(cap, s, strlen(s));
+    } else if (node->kind == AST_STRING && (node->flags & AST_TEMPLATE)) {
+        StrTemplate *tpl = compile_template(ast_str(ast, node->a), node->b);
+        const char *s;
+        int k, len;
+        if (tpl == NULL)
+            return;
+        for (k = 0; k < tpl->holecount; k++) {
+            if ((s = hole_name(tpl, k, &len)) != NULL)
+                capture(cap, s, len);
+        }
+        free(tpl);
+    }
+}
+
+// lp ... end: the block is a function of its own, by a compiler sharing
+// all but the state of the function. the locals it reads are its
+// parameters, SPAWN copies their values into the new lp
+static void lp_expr(Compiler *c, unsigned n, int dst) {
+    Captures cap;
+    Compiler *sub;
+    int top = c->freereg;
+    int base, fi, i;
+
+    cap.c = c;
+    cap.count = 0;
+    ast_walk(c->ast, n, find_captures, &cap);
+    fi = c->prog->funcount;
+    if (fi > 0xffff) {
+        compile_error(c, c->row, "too many functions");
+        return;
+    }
+    sub = (Compiler*)malloc(sizeof(Compiler));
+    if (sub == NULL) {
+        printf("no enough memory\n");
+        c->nomem = 1;
+        return;
+    }
+    if (!add_proto(c->prog, proto_new(c->id_lp, cap.count), &c->funsize)) {
+        free(sub);
+        c->nomem = 1;
+        return;
+    }
+    *sub = *c;
+    sub->kslots = NULL;
+    begin_fun(sub, c->prog->funs[fi]);
+    for (i = 0; i < cap.count; i++)
+        add_local(sub, cap.names[i], alloc_reg(sub));
+    block(sub, ast_at(c->ast, n)->a);
+    emit_abc(sub, RETURN, 0, 0, 0);
+    c->funsize = sub->funsize;
+    c->nomem = sub->nomem;
+    free(sub->kslots);
+    free(sub);
+
+    // the arguments begin at dst if it's the last temporary taken, one
+    // register at least for the id
+    base = c->freereg == dst + 1 && !is_local_reg(c, dst) ? dst : alloc_reg(c);
+    for (i = 1; i < cap.count; i++)
+        alloc_reg(c);
+    for (i = 0; i < cap.count; i++)
+        emit_abc(c, MOVE, base + i, cap.regs[i], 0);
+    emit_abx(c, SPAWN, base, fi);
+    if (dst != base)
+        emit_abc(c, MOVE, dst, base, 0);
+    c->freereg = top;
+}
+
+static void binop(Compiler *c, unsigned n, int dst) {
+    ast_node *node = ast_at(c->ast, n);
+    ast_node *right = ast_at(c->ast, node->b);
+    int op = node->aux;
+    int top = c->freereg;
+    int b, r;
+
+    if (op == TOKEN_KW_AND || op == TOKEN_KW_OR) {
+        // the right side may read the local dst, so it's not written early
+        int t = is_local_reg(c, dst) ? alloc_reg(c) : dst;
+        int j;
+        expr(c, node->a, t);
+        j = emit_jump(c, op == TOKEN_KW_AND ? OP_JF : OP_JT, t);
+        expr(c, node->b, t);
+        patch(c, j < 0 ? NO_JUMP : j, here(c));
+        if (t != dst)
+            emit_abc(c, MOVE, dst, t, 0);
+        c->freereg = top;
+        return;
+    }
+    if (op == TOKEN_RANGE) {
+        compile_error(c, c->row, "a range is only iterated by for");
+        return;
+    }
+    // x + 1, x - 1
+    if ((op == '+' || op == '-') && right->kind == AST_INT) {
+        long i = ast_intval(c->ast, node->b);
+        if (op == '-')
+            i = -i;
+        if (i >= -128 && i <= 127) {
+            b = expr_any(c, node->a);
+            emit_abc(c, ADDI, dst, b, (unsigned char)(signed char)i);
+            c->freereg = top;
+            return;
+        }
+    }
+    b = expr_any(c, node->a);
+    r = expr_any(c, node->b);
+    switch (op) {
+        case '+':          emit_abc(c, ADD, dst, b, r); break;
+        case '-':          emit_abc(c, SUB, dst, b, r); break;
+        case '*':          emit_abc(c, MUL, dst, b, r); break;
+        case '/':          emit_abc(c, DIV, dst, b, r); break;
+        case '%':          emit_abc(c, MOD, dst, b, r); break;
+        case TOKEN_EXPONENT: emit_abc(c, POW, dst, b, r); break;
+        case TOKEN_EQ:     emit_abc(c, EQ, dst, b, r); break;
+        case TOKEN_NEQ:    emit_abc(c, NE, dst, b, r); break;
+        case '<':          emit_abc(c, LT, dst, b, r); break;
+        case TOKEN_LE:     emit_abc(c, LE, dst, b, r); break;
+        case '>':          emit_abc(c, LT, dst, r, b); break;
+        case TOKEN_GE:     emit_abc(c, LE, dst, r, b); break;
+        default:
+            compile_error(c, c->row, "unknown operator");
+            break;
+    }
+    c->freereg = top;
+}
+
+// the value of the expression into R(dst)
+static void expr(Compiler *c, unsigned n, int dst) {
+    ast_node *node = ast_at(c->ast, n);
+    int top = c->freereg;
+    int b;
+    switch (node->kind) {
+        case AST_INT:
+            load_int(c, ast_intval(c->ast, n), dst);
+            break;
+        case AST_FLOAT:
+        case AST_ATOM:
+            emit_abx(c, LOADK, dst, literal_k(c, n));
+            break;
+        case AST_STRING:
+            if (node->flags & AST_TEMPLATE)
+                template_expr(c, n, dst);
+            else
+                emit_abx(c, LOADK, dst, literal_k(c, n));
+            break;
+        case AST_BOOL:
+            emit_abc(c, LOADBOOL, dst, node->aux, 0);
+            break;
+        case AST_NIL:
+            emit_abc(c, LOADNIL, dst, 0, 0);
+            break;
+        case AST_NAME:
+            name_expr(c, node->a, dst);
+            break;
+        case AST_UNARY:
+            b = expr_any(c, node->a);
+            if (node->aux == '-')
+                emit_abc(c, UNM, dst, b, 0);
+            else
+                emit_abc(c, NOT, dst, b, 0);
+            break;
+        case AST_BINOP:
+            binop(c, n, dst);
+            break;
+        case AST_FIELD:
+            b = expr_any(c, node->a);
+            emit_abc(c, GETFIELD, dst, b, 0);
+            emit(c, add_field(c, node->b));
+            break;
+        case AST_CALL:
+            call(c, n, dst);
+            break;
+        case AST_NEW:
+            new_expr(c, n, dst);
+            break;
+        case AST_TYPED:
+            expr(c, node->a, dst);
+            break;
+        case AST_LP:
+            lp_expr(c, n, dst);
+            break;
+        default:
+            compile_error(c, node->row, "%s are not supported yet", unsupported(node->kind));
+            break;
+    }
+    c->freereg = top;
+}
+
+//2 -------------------- conditions ----------------------------------
+// jump to 'list' if the truth of the expression is 'jumpif', go on with
+// the next instruction otherwise
+static void cond(Compiler *c, unsigned n, int jumpif, int *list) {
+    ast_node *node = ast_at(c->ast, n);
+    int top = c->freereg;
+    int op = node->kind == AST_BINOP ? node->aux : 0;
+    int skip = NO_JUMP;
+    int a, b, k;
+
+    if (node->kind == AST_BOOL) {
+        if (node->aux == jumpif)
+            jump_to(c, list, emit_jump(c, OP_JMP, 0));
+        return;
+    }
+    if (node->kind == AST_UNARY && node->aux == '!') {
+        cond(c, node->a, !jumpif, list);
+        return;
+    }
+    if (op == TOKEN_KW_AND || op == TOKEN_KW_OR) {
+        // a and b: jump if false when a is, a or b: jump if true when a is
+        int first = op == TOKEN_KW_OR;
+        if (jumpif == first) {
+            cond(c, node->a, jumpif, list);
+        } else {
+            cond(c, node->a, first, &skip);
+        }
+        cond(c, node->b, jumpif, list);
+        patch_here(c, skip);
+        return;
+    }
+    if (op == TOKEN_EQ || op == TOKEN_NEQ || op == '<' || op == '>' ||
+        op == TOKEN_LE || op == TOKEN_GE) {
+        // compared with a constant: the ops with K
+        k = literal_k(c, node->b);
+        a = expr_any(c, node->a);
+        if (op == TOKEN_NEQ)
+            jumpif = !jumpif;
+        if (k >= 0 && k <= 0xff) {
+            switch (op) {
+                case TOKEN_EQ:
+                case TOKEN_NEQ: emit_abc(c, EQKJ, a, k, jumpif); break;
+                case '<':       emit_abc(c, LTKJ, a, k, jumpif); break;
+                case TOKEN_LE:  emit_abc(c, LEKJ, a, k, jumpif); break;
+                case '>':       emit_abc(c, GTKJ, a, k, jumpif); break;
+                case TOKEN_GE:  emit_abc(c, GEKJ, a, k, jumpif); break;
+            }
+        } else {
+            b = expr_any(c, node->b);
+            switch (op) {
+                case TOKEN_EQ:
+                case TOKEN_NEQ: emit_abc(c, EQJ, a, b, jumpif); break;
+                case '<':       emit_abc(c, LTJ, a, b, jumpif); break;
+                case TOKEN_LE:  emit_abc(c, LEJ, a, b, jumpif); break;
+                case '>':       emit_abc(c, LTJ, b, a, jumpif); break;
+                case TOKEN_GE:  emit_abc(c, LEJ, b, a, jumpif); break;
+            }
+        }
+        jump_to(c, list, emit_jump(c, OP_JMP, 0));
+        c->freereg = top;
+        return;
+    }
+    a = expr_any(c, n);
+    jump_to(c, list, emit_jump(c, jumpif ? OP_JT : OP_JF, a));
+    c->freereg = top;
+}
+
+//2 -------------------- statements ----------------------------------
+// a new local of the name with the value
+static void define(Compiler *c, unsigned name, unsigned value) {
+    int reg = alloc_reg(c);
+    if (value != 0)
+        expr(c, value, reg);
+    else
+        emit_abc(c, LOADNIL, reg, 0, 0);
+    add_local(c, name, reg);
+}
+
+// targets = values. 'fresh' defines new locals even for the names
+// visible already, as the clauses of if/while/for do
+static void assign(Compiler *c, unsigned n, int fresh) {
+    ast_node *node = ast_at(c->ast, n);
+    unsigned count = ast_count(c->ast, node->a);
+    unsigned *targets = ast_items(c->ast, node->a);
+    unsigned *values = ast_items(c->ast, node->b);
+    unsigned i;
+    int base;
+
+    if (count != ast_count(c->ast, node->b)) {
+        compile_error(c, c->row, "%u names assigned %u values", count, ast_count(c->ast, node->b));
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        ast_node *t = ast_at(c->ast, targets[i]);
+        if (t->kind != AST_NAME || strchr(namestr(c, t->a), '.') != NULL) {
+            compile_error(c, c->row, "only names can be assigned, values are immutable");
+            return;
+        }
+    }
+    if (count == 1) {
+        unsigned name = ast_at(c->ast, targets[0])->a;
+        int reg = fresh ? NO_REG : find_local(c, name);
+        if (reg == NO_REG)
+            define(c, name, values[0]);
+        else
+            expr(c, values[0], reg);
+        return;
+    }
+    // a, b = b, a: all values first
+    base = c->freereg;
+    for (i = 0; i < count; i++)
+        expr(c, values[i], alloc_reg(c));
+    for (i = 0; i < count; i++) {
+        unsigned name = ast_at(c->ast, targets[i])->a;
+        int reg = fresh ? NO_REG : find_local(c, name);
+        if (reg == NO_REG)
+            add_local(c, name, base + i);
+        else
+            emit_abc(c, MOVE, reg, base + i, 0);
+    }
+}
+
+// give the values of the locals defined since 'from' to the locals of
+// the same names before it
+static void give_back(Compiler *c, int from, int to) {
+    int i, j;
+    for (i = from; i < to; i++) {
+        for (j = from - 1; j >= 0; j--) {
+            if (c->locals[j].name == c->locals[i].name) {
+                emit_abc(c, MOVE, c->locals[j].reg, c->locals[i].reg, 0);
+                break;
+            }
+        }
+    }
+}
+
+static void if_stmt(Compiler *c, unsigned n) {
+    unsigned branches = ast_at(c->ast, n)->a;
+    unsigned count = ast_count(c->ast, branches);
+    int end = NO_JUMP;
+    unsigned i, j;
+    for (i = 0; i < count; i++) {
+        ast_node *br = ast_at(c->ast, ast_items(c->ast, branches)[i]);
+        unsigned nclause = ast_count(c->ast, br->a);
+        int nlocals = c->nlocals;
+        int freereg = c->freereg;
+        int next = NO_JUMP;
+        int defined;
+        for (j = 0; j < nclause; j++) {
+            unsigned cl = ast_items(c->ast, br->a)[j];
+            c->row = ast_at(c->ast, cl)->row;
+            if (ast_at(c->ast, cl)->kind == AST_ASSIGN)
+                assign(c, cl, 1);
+            else if (ast_at(c->ast, cl)->kind == AST_IN)
+                compile_error(c, c->row, "'in' is a clause of for");
+            else
+                cond(c, cl, 0, &next);
+        }
+        defined = c->nlocals;
+        block(c, br->b);
+        give_back(c, nlocals, defined);
+        c->nlocals = nlocals;
+        c->freereg = freereg;
+        if (i + 1 < count)
+            jump_to(c, &end, emit_jump(c, OP_JMP, 0));
+        patch_here(c, next);
+    }
+    patch_here(c, end);
+}
+
+// while clauses do body end: the assignments of the clauses are done
+// once, the conditions are tested before each round, at the bottom
+static void while_stmt(Compiler *c, unsigned n) {
+    ast_node *node = ast_at(c->ast, n);
+    unsigned nclause = ast_count(c->ast, node->a);
+    int nlocals = c->nlocals;
+    int freereg = c->freereg;
+    int defined, top, last = -1, exit = NO_JUMP, j0;
+    Loop loop;
+    unsigned j;
+
+    for (j = 0; j < nclause; j++) {
+        unsigned cl = ast_items(c->ast, node->a)[j];
+        c->row = ast_at(c->ast, cl)->row;
+        if (ast_at(c->ast, cl)->kind == AST_ASSIGN)
+            assign(c, cl, 1);
+        else if (ast_at(c->ast, cl)->kind == AST_IN)
+            compile_error(c, c->row, "'in' of while is not supported yet");
+        else
+            last = j;
+    }
+    defined = c->nlocals;
+    j0 = emit_jump(c, OP_JMP, 0);
+    top = here(c);
+    loop.outer = c->loop;
+    loop.breaks = NO_JUMP;
+    loop.conts = NO_JUMP;
+    c->loop = &loop;
+    block(c, node->b);
+    c->loop = loop.outer;
+    patch_here(c, loop.conts);
+    if (j0 >= 0)
+        patch_here(c, j0);
+    for (j = 0; j < nclause; j++) {
+        unsigned cl = ast_items(c->ast, node->a)[j];
+        int kind = ast_at(c->ast, cl)->kind;
+        int body = NO_JUMP;
+        if (kind == AST_ASSIGN || kind == AST_IN)
+            continue;
+        c->row = ast_at(c->ast, cl)->row;
+        if ((int)j == last) {
+            cond(c, cl, 1, &body);
+            patch(c, body, top);
+        } else {
+            cond(c, cl, 0, &exit);
+        }
+    }
+    if (last < 0)
+        emit_back(c, OP_JMP, 0, top);
+    patch_here(c, exit);
+    patch_here(c, loop.breaks);
+    give_back(c, nlocals, defined);
+    c->nlocals = nlocals;
+    c->freereg = freereg;
+}
+
+// for clauses do body end: each "name in a..b[..step]" is a loop in the
+// one before it, the conditions filter the rounds of the innermost one,
+// the assignments are done once before the loops
+static void for_stmt(Compiler *c, unsigned n) {
+    ast_node *node = ast_at(c->ast, n);
+    unsigned nclause = ast_count(c->ast, node->a);
+    unsigned *clauses = ast_items(c->ast, node->a);
+    int nlocals = c->nlocals;
+    int freereg = c->freereg;
+    int preps[VM_MAX_REGS / 4];
+    int regs[VM_MAX_REGS / 4];
+    int nloop = 0;
+    int defined, i;
+    Loop loop;
+    unsigned j;
+
+    for (j = 0; j < nclause; j++) {
+        if (ast_at(c->ast, clauses[j])->kind == AST_ASSIGN) {
+            c->row = ast_at(c->ast, clauses[j])->row;
+            assign(c, clauses[j], 1);
+        }
+    }
+    defined = c->nlocals;
+    loop.outer = c->loop;
+    loop.breaks = NO_JUMP;
+    loop.conts = NO_JUMP;
+    for (j = 0; j < nclause; j++) {
+        ast_node *in = ast_at(c->ast, clauses[j]);
+        ast_node *range;
+        unsigned from, to, step = 0;
+        int a;
+        if (in->kind != AST_IN)
+            continue;
+        c->row = in->row;
+        range = ast_at(c->ast, in->b);
+        if (range->kind != AST_BINOP || range->aux != TOKEN_RANGE) {
+            compile_error(c, c->row, "only ranges are iterated by for yet");
+            continue;
+        }
+        from = range->a;
+        to = range->b;
+        if (ast_at(c->ast, from)->kind == AST_BINOP && ast_at(c->ast, from)->aux == TOKEN_RANGE) {
+            // a..b..step
+            step = to;
+            to = ast_at(c->ast, from)->b;
+            from = ast_at(c->ast, from)->a;
+        }
+        if (nloop == VM_MAX_REGS / 4) {
+            compile_error(c, c->row, "too many loops");
+            break;
+        }
+        a = alloc_reg(c);
+        alloc_reg(c);
+        alloc_reg(c);
+        alloc_reg(c);
+        expr(c, from, a);
+        expr(c, to, a + 1);
+        if (step != 0)
+            expr(c, step, a + 2);
+        else
+            emit_abx(c, LOADI, a + 2, 1 + VM_BIAS);
+        preps[nloop] = emit_jump(c, OP_FORPREP, a);
+        regs[nloop] = a;
+        nloop++;
+        add_local(c, in->a, a + 3);
+    }
+    // the filters jump to the next round of the innermost loop
+    for (j = 0; j < nclause; j++) {
+        int kind = ast_at(c->ast, clauses[j])->kind;
+        if (kind != AST_IN && kind != AST_ASSIGN) {
+            c->row = ast_at(c->ast, clauses[j])->row;
+            cond(c, clauses[j], 0, &loop.conts);
+        }
+    }
+    c->loop = &loop;
+    block(c, node->b);
+    c->loop = loop.outer;
+    patch_here(c, loop.conts);
+    for (i = nloop - 1; i >= 0; i--) {
+        emit_back(c, OP_FORLOOP, regs[i], preps[i] + 1);
+        patch_here(c, preps[i]);
+    }
+    if (nloop == 0) {
+        // no range, one round
+        compile_error(c, node->row, "for has no 'in' clause");
+    }
+    patch_here(c, loop.breaks);
+    give_back(c, nlocals, defined);
+    c->nlocals = nlocals;
+    c->freereg = freereg;
+}
+
+// case subject of arms end: an arm matches by a value equal to the
+// subject, a local name as its value, a new name bound to the subject, a
+// regex found in the subject, or _. the regex arms are matched together
+// by a MATCH at the first of them, and each one tests the index matched.
+// a guarded regex arm is the last of its MATCH, as the arms after it are
+// tried when the guard fails
+static void case_stmt(Compiler *c, unsigned n) {
+    ast_node *node = ast_at(c->ast, n);
+    unsigned count = ast_count(c->ast, node->b);
+    int nlocals = c->nlocals;
+    int freereg = c->freereg;
+    int end = NO_JUMP;
+    int s = expr_any(c, node->a);
+    int m = NO_REG;        // index of the arm matched by the last MATCH
+    int match = -1;        // of the regex arms being compiled
+    unsigned i;
+
+    for (i = 0; i < count && m == NO_REG; i++) {
+        ast_node *arm = ast_at(c->ast, ast_items(c->ast, node->b)[i]);
+        if (ast_at(c->ast, c->ast->extra[arm->a])->kind == AST_REGEX)
+            m = alloc_reg(c);
+    }
+    for (i = 0; i < count; i++) {
+        ast_node *arm = ast_at(c->ast, ast_items(c->ast, node->b)[i]);
+        unsigned pattern = c->ast->extra[arm->a];
+        unsigned guard = c->ast->extra[arm->a + 1];
+        ast_node *pn = ast_at(c->ast, pattern);
+        int armlocals = c->nlocals;
+        int armfree = c->freereg;
+        int next = NO_JUMP;
+        int k;
+        c->row = arm->row;
+        if (pn->kind == AST_NAME && pn->a == c->id_any) {
+            // matches anything
+        } else if (pn->kind == AST_NAME && strchr(namestr(c, pn->a), '.') == NULL &&
+                   find_local(c, pn->a) == NO_REG) {
+            int reg = alloc_reg(c);
+            emit_abc(c, MOVE, reg, s, 0);
+            add_local(c, pn->a, reg);
+        } else if (pn->kind == AST_REGEX) {
+            if (match < 0) {
+                match = add_match(c);
+                emit_abc(c, MATCH, m, s, 0);
+                emit(c, match);
+            }
+            k = add_k(c, lpv_small(add_pattern(c, match, ast_str(c->ast, pn->a), pn->b)));
+            if (k <= 0xff) {
+                emit_abc(c, EQKJ, m, k, 0);
+            } else {
+                int top = c->freereg;
+                int reg = alloc_reg(c);
+                emit_abx(c, LOADK, reg, k);
+                emit_abc(c, EQJ, m, reg, 0);
+                c->freereg = top;
+            }
+            jump_to(c, &next, emit_jump(c, OP_JMP, 0));
+            if (guard != 0)
+                match = -1;
+        } else if ((k = literal_k(c, pattern)) >= 0 && k <= 0xff) {
+            emit_abc(c, EQKJ, s, k, 0);
+            jump_to(c, &next, emit_jump(c, OP_JMP, 0));
+        } else {
+            int top = c->freereg;
+            emit_abc(c, EQJ, s, expr_any(c, pattern), 0);
+            jump_to(c, &next, emit_jump(c, OP_JMP, 0));
+            c->freereg = top;
+        }
+        if (guard != 0)
+            cond(c, guard, 0, &next);
+        block(c, arm->b);
+        c->nlocals = armlocals;
+        c->freereg = armfree;
+        if (i + 1 < count)
+            jump_to(c, &end, emit_jump(c, OP_JMP, 0));
+        patch_here(c, next);
+    }
+    patch_here(c, end);
+    c->nlocals = nlocals;
+    c->freereg = freereg;
+}
+
+static void statement(Compiler *c, unsigned n, int toplevel) {
+    ast_node *node = ast_at(c->ast, n);
+    int top = c->freereg;
+    int reg;
+    c->row = node->row;
+    switch (node->kind) {
+        case AST_VARDEF:
+            define(c, node->a, c->ast->extra[node->b + 1]);
+            return;
+        case AST_ASSIGN:
+            assign(c, n, 0);
+            return;
+        case AST_EXPR:
+            if (ast_at(c->ast, node->a)->kind == AST_CALL)
+                call(c, node->a, NO_REG);
+            else
+                expr(c, node->a, alloc_reg(c));
+            break;
+        case AST_IF:
+            if_stmt(c, n);
+            break;
+        case AST_WHILE:
+            while_stmt(c, n);
+            break;
+        case AST_FOR:
+            for_stmt(c, n);
+            break;
+        case AST_CASE:
+            case_stmt(c, n);
+            break;
+        case AST_DO:
+            block(c, node->a);
+            break;
+        case AST_RETURN:
+            if (ast_count(c->ast, node->a) == 0) {
+                emit_abc(c, RETURN, 0, 0, 0);
+            } else if (ast_count(c->ast, node->a) == 1) {
+                reg = expr_any(c, ast_items(c->ast, node->a)[0]);
+                emit_abc(c, RETURN, reg, 1, 0);
+            } else {
+                compile_error(c, c->row, "returning several values is not supported yet");
+            }
+            break;
+        case AST_BREAK:
+        case AST_CONTINUE:
+            if (c->loop == NULL)
+                compile_error(c, c->row, "%s out of a loop",
+                              node->kind == AST_BREAK ? "break" : "continue");
+            else
+                jump_to(c, node->kind == AST_BREAK ? &c->loop->breaks : &c->loop->conts,
+                        emit_jump(c, OP_JMP, 0));
+            break;
+        case AST_FUNDEF:
+        case AST_STRUCTDEF:
+            // the top-level ones are taken before
+            if (!toplevel)
+                compile_error(c, c->row, "%s in a block are not supported yet",
+                              node->kind == AST_FUNDEF ? "functions" : "structs");
+            break;
+        case AST_ERROR:
+            break;
+        default:
+            compile_error(c, c->row, "%s are not supported yet", unsupported(node->kind));
+            break;
+    }
+    c->freereg = top;
+}
+
+// the statements of a block, the locals defined in it end with it
+static void block(Compiler *c, unsigned list) {
+    unsigned count = ast_count(c->ast, list);
+    int nlocals = c->nlocals;
+    int freereg = c->freereg;
+    unsigned i;
+    for (i = 0; i < count; i++)
+        statement(c, ast_items(c->ast, list)[i], 0);
+    c->nlocals = nlocals;
+    c->freereg = freereg;
+}
+
+//2 -------------------- module --------------------------------------
+static int add_proto(lp_program *prog, lp_proto *f, int *size) {
+    if (f == NULL || !grow((void**)&prog->funs, size, prog->funcount, sizeof(lp_proto*))) {
+        proto_free(f);
+        return 0;
+    }
+    prog->funs[prog->funcount++] = f;
+    return 1;
+}
+
+static int add_struct(Compiler *c, unsigned n, int *size, int *defsize) {
+    lp_program *prog = c->prog;
+    ast_node *node = ast_at(c->ast, n);
+    unsigned count = ast_count(c->ast, node->b);
+    lpt_struct *t;
+    unsigned i;
+    if (!grow((void**)&prog->types, size, prog->typecount, sizeof(lpt_struct*)) ||
+        !grow((void**)&c->structdefs, defsize, prog->typecount, sizeof(unsigned)))
+        return 0;
+    t = (lpt_struct*)malloc(sizeof(lpt_struct));
+    if (t == NULL || (t->fields = (unsigned*)malloc((count + 1) * sizeof(unsigned))) == NULL) {
+        printf("no enough memory\n");
+        free(t);
+        return 0;
+    }
+    t->name = node->a;
+    t->field_count = count;
+    for (i = 0; i < count; i++) {
+        ast_node *m = ast_at(c->ast, ast_items(c->ast, node->b)[i]);
+        if (m->kind != AST_VARDEF) {
+            compile_error(c, m->row, "embedded structs are not supported yet");
+            t->fields[i] = 0;
+        } else {
+            t->fields[i] = m->a;
+        }
+    }
+    if (find_type(c, node->a) >= 0)
+        compile_error(c, node->row, "struct %s defined twice", namestr(c, node->a));
+    if (prog->typecount >= 256)
+        compile_error(c, node->row, "too many structs");
+    c->structdefs[prog->typecount] = n;
+    prog->types[prog->typecount++] = t;
+    return 1;
+}
+
+// the top-level statements of all sections, in order
+static void each_toplevel(lp_ast *ast, void (*fn)(void *arg, unsigned n), void *arg) {
+    unsigned sections = ast_at(ast, ast->root)->a;
+    unsigned i, j;
+    for (i = 0; i < ast_count(ast, sections); i++) {
+        unsigned sec = ast_items(ast, sections)[i];
+        unsigned stmts = ast_ops(ast, sec)[2];
+        for (j = 0; j < ast_count(ast, stmts); j++)
+            fn(arg, ast_items(ast, stmts)[j]);
+    }
+}
+
+typedef struct {
+    Compiler *c;
+    int typesize;
+    int defsize;
+    int structsize;
+    int ok;
+} Collect;
+
+// the functions and structs of the module, before any code, so they can
+// be used before they're defined
+static void collect(void *arg, unsigned n) {
+    Collect *col = (Collect*)arg;
+    Compiler *c = col->c;
+    ast_node *node = ast_at(c->ast, n);
+    if (!col->ok)
+        return;
+    if (node->kind == AST_STRUCTDEF) {
+        col->ok = add_struct(c, n, &col->typesize, &col->structsize);
+    } else if (node->kind == AST_FUNDEF) {
+        unsigned *ops = ast_ops(c->ast, n);
+        if (ops[0] == 0)
+            return;
+        if (find_fun(c, ops[0]) >= 0)
+            compile_error(c, node->row, "function %s defined twice", namestr(c, ops[0]));
+        if (!grow((void**)&c->fundefs, &col->defsize, c->prog->funcount, sizeof(unsigned))) {
+            col->ok = 0;
+            return;
+        }
+        c->fundefs[c->prog->funcount] = n;
+        col->ok = add_proto(c->prog, proto_new(ops[0], ast_count(c->ast, ops[1])), &c->funsize);
+    }
+}
+
+static void toplevel(void *arg, unsigned n) {
+    statement((Compiler*)arg, n, 1);
+}
+
+static void begin_fun(Compiler *c, lp_proto *f) {
+    c->f = f;
+    c->nlocals = 0;
+    c->freereg = 0;
+    c->loop = NULL;
+    c->toolong = 0;
+    free(c->kslots);
+    c->kslots = NULL;
+    c->kslotsize = 0;
+}
+
+lp_program *vm_compile(lp_ast *ast) {
+    lp_program *prog = (lp_program*)calloc(1, sizeof(lp_program));
+    Compiler *c = (Compiler*)calloc(1, sizeof(Compiler));
+    Collect col;
+    int i, nfun;
+
+    if (prog == NULL || c == NULL) {
+        printf("no enough memory\n");
+        free(prog);
+        free(c);
+        return NULL;
+    }
+    prog->names = ast->names;
+    prog->shared = ast->shared;
+    c->prog = prog;
+    c->ast = ast;
+    c->id_any = ast_name(ast, "_", 1);
+    c->id_puts = ast_name(ast, "puts", 4);
+    c->id_print = ast_name(ast, "print", 5);
+    c->id_lp = ast_name(ast, "lp", 2);
+
+    col.c = c;
+    col.typesize = 0;
+    col.defsize = 0;
+    col.structsize = 0;
+    col.ok = add_proto(prog, proto_new(ast_name(ast, "main", 4), 0), &c->funsize) &&
+             grow((void**)&c->fundefs, &col.defsize, 0, sizeof(unsigned));
+    if (col.ok) {
+        c->fundefs[0] = 0;
+        each_toplevel(ast, collect, &col);
+    }
+    if (!col.ok || c->nomem) {
+        free(c->fundefs);
+        free(c->structdefs);
+        free(c);
+        vm_free_program(prog);
+        return NULL;
+    }
+
+    // the functions of lp blocks are added after them
+    nfun = prog->funcount;
+    for (i = 1; i < nfun; i++) {
+        unsigned *ops = ast_ops(ast, c->fundefs[i]);
+        unsigned j;
+        begin_fun(c, prog->funs[i]);
+        c->row = ast_at(ast, c->fundefs[i])->row;
+        for (j = 0; j < ast_count(ast, ops[1]); j++)
+            add_local(c, ast_at(ast, ast_items(ast, ops[1])[j])->a, alloc_reg(c));
+        block(c, ops[4]);
+        emit_abc(c, RETURN, 0, 0, 0);
+    }
+    begin_fun(c, prog->funs[0]);
+    c->row = 1;
+    each_toplevel(ast, toplevel, c);
+    emit_abc(c, RETURN, 0, 0, 0);
+    // a function uses one register at least, for its result
+    for (i = 0; i < prog->funcount; i++) {
+        if (prog->funs[i]->nregs == 0)
+            prog->funs[i]->nregs = 1;
+    }
+
+    i = c->nomem;
+    free(c->kslots);
+    free(c->fundefs);
+    free(c->structdefs);
+    free(c);
+    if (i) {
+        vm_free_program(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+//1 --------------------- values -------------------------------------
+typedef struct {
+    char *s;
+    int len;
+    int size;
+} Buf;
+
+static void buf_add(Buf *b, const char *s, int len) {
+    if (b->len + len + 1 > b->size) {
+        int size = b->size == 0 ? 64 : b->size;
+        char *p;
+        while (size < b->len + len + 1)
+            size *= 2;
+        p = (char*)realloc(b->s, size);
+        if (p == NULL) {
+            printf("no enough memory\n");
+            return;
+        }
+        b->s = p;
+        b->size = size;
+    }
+    memcpy(b->s + b->len, s, len);
+    b->len += len;
+    b->s[b->len] = 0;
+}
+
+// the shortest of %.15g and %.17g reading back the same, with ".0" if it
+// looks like an integer
+static int format_float(char *buf, double d) {
+    int n = sprintf(buf, "%.15g", d);
+    if (strtod(buf, NULL) != d)
+        n = sprintf(buf, "%.17g", d);
+    if (strspn(buf, "-0123456789") == (size_t)n) {
+        strcpy(buf + n, ".0");
+        n += 2;
+    }
+    return n;
+}
+
+// a value as text, the strings in quotes if 'quoted'
+static void buf_value(lp_program *prog, Buf *b, lp_value v, int quoted) {
+    char tmp[64];
+    const char *s;
+    int len, i;
+    switch (lpv_type(v)) {
+        case LPV_NIL:
+            buf_add(b, "nil", 3);
+            break;
+        case LPV_BOOLEAN:
+            buf_add(b, v == LPV_TRUEV ? "true" : "false", v == LPV_TRUEV ? 4 : 5);
+            break;
+        case LPV_INTEGER:
+            buf_add(b, tmp, sprintf(tmp, "%ld", lpv_intof(v)));
+            break;
+        case LPV_FLOAT:
+            buf_add(b, tmp, format_float(tmp, lpv_floatof(v)));
+            break;
+        case LPV_LP:
+            buf_add(b, tmp, sprintf(tmp, "<lp %ld>", lpv_lpidof(v)));
+            break;
+        case LPV_ATOM:
+            s = vm_namestr(prog, lpv_atomof(v));
+            buf_add(b, ".", 1);
+            if (s != NULL)
+                buf_add(b, s, strlen(s));
+            break;
+        case LPV_STRING:
+            s = lpv_strof(v, tmp, &len);
+            if (quoted)
+                buf_add(b, "'", 1);
+            buf_add(b, s, len);
+            if (quoted)
+                buf_add(b, "'", 1);
+            break;
+        case LPV_OBJECT: {
+            lpv_object *o = lpv_objectof(v);
+            if (o->type != NULL) {
+                s = vm_namestr(prog, o->type->name);
+                buf_add(b, s, strlen(s));
+            }
+            buf_add(b, "{", 1);
+            for (i = 0; i < o->item_count; i++) {
+                if (i > 0)
+                    buf_add(b, ", ", 2);
+                if (o->type != NULL && o->type->fields[i] != 0) {
+                    s = vm_namestr(prog, o->type->fields[i]);
+                    buf_add(b, s, strlen(s));
+                    buf_add(b, "=", 1);
+                }
+                buf_value(prog, b, o->items[i], 1);
+            }
+            buf_add(b, "}", 1);
+            break;
+        }
+        default:
+            buf_add(b, tmp, sprintf(tmp, "<%d %p>", lpv_type(v), lpv_ptr(v)));
+            break;
+    }
+}
+
+void vm_print_value(lp_vm *vm, lp_value v) {
+    Buf b = {NULL, 0, 0};
+    buf_value(vm->prog, &b, v, 0);
+    if (b.s != NULL)
+        fwrite(b.s, 1, b.len, stdout);
+    free(b.s);
+}
+
+// keep the heap value made by the run, 0 if it's not made or can't be
+// kept(no enough memory)
+static int keep(lp_vm *vm, lp_value v) {
+    if (v == LPV_NILV)
+        return 0;
+    if (!grow((void**)&vm->heap, &vm->heapsize, vm->heapcount, sizeof(lp_value))) {
+        lpv_free(v);
+        return 0;
+    }
+    vm->heap[vm->heapcount++] = v;
+    return 1;
+}
+
+// a copy of the value in the heap of the vm, with the values it refers
+// to, so the vm owns all it reads. 0 if no enough memory
+static int copy_value(lp_vm *vm, lp_value v, lp_value *copy) {
+    lpv_object *o, *from;
+    int k;
+    *copy = v;
+    if (lpv_isfloat(v) || !lpv_isptr(v))
+        return 1;
+    if (lpv_isheapstr(v)) {
+        lpv_string *str = (lpv_string*)lpv_ptr(v);
+        return keep(vm, *copy = lpv_str(str->chars, str->len));
+    }
+    if (lpv_isint(v))
+        return keep(vm, *copy = lpv_int(lpv_intof(v)));
+    if (!lpv_isobject(v))
+        return 1;
+    from = lpv_objectof(v);
+    if (!keep(vm, *copy = lpv_object_new(from->type, from->item_count)))
+        return 0;
+    o = lpv_objectof(*copy);
+    for (k = 0; k < from->item_count; k++) {
+        if (!copy_value(vm, from->items[k], &o->items[k]))
+            return 0;
+    }
+    return 1;
+}
+
+// a number as an integer(1) or a float(2), 0 if it's not a number
+static int number(lp_value v, long *i, double *d) {
+    if (lpv_isfloat(v)) {
+        *d = lpv_floatof(v);
+        return 2;
+    }
+    if (lpv_isint(v)) {
+        *i = lpv_intof(v);
+        *d = (double)*i;
+        return 1;
+    }
+    return 0;
+}
+
+static long ipow(long b, long e) {
+    unsigned long r = 1, x = (unsigned long)b;
+    while (e > 0) {
+        if (e & 1)
+            r *= x;
+        x *= x;
+        e >>= 1;
+    }
+    return (long)r;
+}
+
+// the slow way of the arithmetic ops: the integers not immediate or
+// overflowing 48 bits, floats, and the errors. NULL or the error
+static const char *arith(lp_vm *vm, int op, lp_value b, lp_value c, lp_value *r) {
+    long x = 0, y = 0, z;
+    double dx, dy, dz;
+    int tb = number(b, &x, &dx);
+    int tc = number(c, &y, &dy);
+    if (tb == 0 || tc == 0) {
+        switch (op) {
+            case OP_ADD: return "bad operands of +";
+            case OP_SUB: return "bad operands of -";
+            case OP_MUL: return "bad operands of *";
+            case OP_DIV: return "bad operands of /";
+            case OP_MOD: return "bad operands of %";
+            case OP_UNM: return "bad operand of -";
+            default:     return "bad operands of **";
+        }
+    }
+    if (tb == 1 && tc == 1 && (op != OP_POW || y >= 0)) {
+        // wrapping around in 64 bits
+        switch (op) {
+            case OP_ADD: z = (long)((unsigned long)x + (unsigned long)y); break;
+            case OP_SUB: z = (long)((unsigned long)x - (unsigned long)y); break;
+            case OP_MUL: z = (long)((unsigned long)x * (unsigned long)y); break;
+            case OP_UNM: z = (long)(0 - (unsigned long)x); break;
+            case OP_POW: z = ipow(x, y); break;
+            default:
+                if (y == 0)
+                    return "divided by 0";
+                if (y == -1)
+                    z = op == OP_DIV ? (long)(0 - (unsigned long)x) : 0;
+                else
+                    z = op == OP_DIV ? x / y : x % y;
+                break;
+        }
+        if (lpv_fits(z))
+            *r = lpv_small(z);
+        else if (!keep(vm, *r = lpv_int(z)))
+            return "no enough memory";
+        return NULL;
+    }
+    switch (op) {
+        case OP_ADD: dz = dx + dy; break;
+        case OP_SUB: dz = dx - dy; break;
+        case OP_MUL: dz = dx * dy; break;
+        case OP_DIV: dz = dx / dy; break;
+        case OP_MOD: dz = fmod(dx, dy); break;
+        case OP_UNM: dz = -dx; break;
+        default:     dz = pow(dx, dy); break;
+    }
+    *r = lpv_float(dz);
+    return NULL;
+}
+
+static int equal(lp_value a, lp_value b) {
+    if (a == b)
+        return a != LPV_NAN;
+    // different immediates but numbers
+    if (!lpv_isfloat(a) && !lpv_isfloat(b) && !lpv_isptr(a) && !lpv_isptr(b))
+        return 0;
+    return lpv_equal(a, b);
+}
+
+// a < b, or a <= b with 'orequal'. numbers and strings are compared,
+// the others are an error put in 'err'
+static int less(lp_value a, lp_value b, int orequal, const char **err) {
+    long x, y;
+    double dx, dy;
+    int ta = number(a, &x, &dx);
+    int tb = number(b, &y, &dy);
+    if (ta == 1 && tb == 1)
+        return orequal ? x <= y : x < y;
+    if (ta != 0 && tb != 0)
+        return orequal ? dx <= dy : dx < dy;
+    if (lpv_isstr(a) && lpv_isstr(b)) {
+        char ba[LPV_SSTRMAX + 1], bb[LPV_SSTRMAX + 1];
+        int la, lb, r;
+        const char *sa = lpv_strof(a, ba, &la);
+        const char *sb = lpv_strof(b, bb, &lb);
+        r = memcmp(sa, sb, la < lb ? la : lb);
+        if (r == 0)
+            r = la - lb;
+        return orequal ? r <= 0 : r < 0;
+    }
+    *err = "compared values not both numbers or strings";
+    return 0;
+}
+
+// the first arm of the match found in the subject, -1 if none, -2 if no
+// enough memory. the matcher taken from the free list, or made, is put
+// back for the next MATCH on any thread
+static int match_arms(vm_match *m, const char *subject, int len) {
+    vm_matcher *mt;
+    const char *err;
+    int i, k;
+    pthread_mutex_lock(&m->lock);
+    if ((mt = m->free) != NULL)
+        m->free = mt->next;
+    pthread_mutex_unlock(&m->lock);
+    if (mt == NULL) {
+        if ((mt = (vm_matcher*)calloc(1, sizeof(vm_matcher))) == NULL ||
+            (mt->arms = (lp_regex**)calloc(m->count, sizeof(lp_regex*))) == NULL) {
+            printf("no enough memory\n");
+            free(mt);
+            return -2;
+        }
+        // the patterns are valid, the lexer has compiled them already
+        for (i = 0; i < m->count; i++) {
+            if ((mt->arms[i] = regex_compile(m->patterns[i], m->lens[i], &err)) == NULL)
+                break;
+        }
+        if (i < m->count || (mt->set = regexset_new(mt->arms, m->count)) == NULL) {
+            matcher_free(mt, m->count);
+            return -2;
+        }
+    }
+    k = regexset_match(mt->set, subject, len);
+    pthread_mutex_lock(&m->lock);
+    mt->next = m->free;
+    m->free = mt;
+    pthread_mutex_unlock(&m->lock);
+    return k;
+}
+
+// the index of the field in the objects of the type, put in the cache,
+// -1 if they have no such field
+static int find_field(vm_field *fc, lpt_struct *type) {
+    int i;
+    if (type == NULL)
+        return -1;
+    for (i = 0; i < type->field_count; i++) {
+        if (type->fields[i] == fc->name) {
+            __atomic_store_n(&fc->cache, (uint64_t)(uintptr_t)type | (uint64_t)i << 48, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// render the template into regs[0], with the values of the holes in
+// the registers after it
+static int render(lp_vm *vm, StrTemplate *t, lp_value *regs) {
+    HoleValue values[VM_MAX_REGS];
+    int offsets[VM_MAX_REGS];
+    char sstrs[VM_MAX_REGS][LPV_SSTRMAX + 1];
+    Buf b = {NULL, 0, 0};
+    lp_value v;
+    char *s;
+    int k, len;
+    for (k = 0; k < t->holecount; k++) {
+        lp_value h = regs[k + 1];
+        offsets[k] = -1;
+        if (lpv_isfloat(h)) {
+            values[k].type = TOKEN_FLOAT;
+            values[k].v.f = lpv_floatof(h);
+        } else if (lpv_isint(h)) {
+            values[k].type = TOKEN_INTEGER;
+            values[k].v.i = lpv_intof(h);
+        } else if (lpv_isstr(h)) {
+            values[k].type = TOKEN_STRING;
+            values[k].v.s.str = lpv_strof(h, sstrs[k], &values[k].v.s.len);
+        } else {
+            // the others as puts prints them, the buffer may move
+            values[k].type = TOKEN_STRING;
+            offsets[k] = b.len;
+            buf_value(vm->prog, &b, h, 0);
+            values[k].v.s.len = b.len - offsets[k];
+        }
+    }
+    for (k = 0; k < t->holecount; k++) {
+        if (offsets[k] >= 0)
+            values[k].v.s.str = b.s + offsets[k];
+    }
+    s = render_template(t, values, &len);
+    free(b.s);
+    if (s == NULL)
+        return 0;
+    v = lpv_str(s, len);
+    free(s);
+    if (lpv_isheapstr(v) && !keep(vm, v))
+        return 0;
+    regs[0] = v;
+    return 1;
+}
+
+static void print_values(lp_vm *vm, lp_value *regs, int count) {
+    Buf b = {NULL, 0, 0};
+    int k;
+    for (k = 0; k < count; k++) {
+        if (k > 0)
+            buf_add(&b, " ", 1);
+        buf_value(vm->prog, &b, regs[k], 0);
+    }
+    buf_add(&b, "\n", 1);
+    if (b.s != NULL)
+        fwrite(b.s, 1, b.len, stdout);
+    free(b.s);
+}
+
+//1 --------------------- interpreter --------------------------------
+lp_vm *vm_new(lp_program *prog) {
+    lp_vm *vm = (lp_vm*)calloc(1, sizeof(lp_vm));
+    if (vm == NULL) {
+        printf("no enough memory\n");
+        return NULL;
+    }
+    vm->prog = prog;
+    vm->stacksize = INIT_STACK;
+    vm->stack = (lp_value*)malloc(INIT_STACK * sizeof(lp_value));
+    vm->framesize = INIT_FRAMES;
+    vm->frames = (vm_frame*)malloc(INIT_FRAMES * sizeof(vm_frame));
+    vm->result = LPV_NILV;
+    if (vm->stack == NULL || vm->frames == NULL) {
+        printf("no enough memory\n");
+        vm_free(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+void vm_free(lp_vm *vm) {
+    int i;
+    if (vm == NULL)
+        return;
+    for (i = 0; i < vm->heapcount; i++)
+        lpv_free(vm->heap[i]);
+    free(vm->heap);
+    free(vm->stack);
+    free(vm->frames);
+    free(vm);
+}
+
+void vm_clear(lp_vm *vm) {
+    int i;
+    for (i = 0; i < vm->heapcount; i++)
+        lpv_free(vm->heap[i]);
+    vm->heapcount = 0;
+    vm->result = LPV_NILV;
+}
+
+// room for 'size' values in the stack
+static int grow_stack(lp_vm *vm, int size) {
+    int newsize = vm->stacksize;
+    lp_value *stack;
+    while (newsize < size)
+        newsize *= 2;
+    if (newsize > VM_MAX_STACK)
+        return 0;
+    stack = (lp_value*)realloc(vm->stack, newsize * sizeof(lp_value));
+    if (stack == NULL)
+        return 0;
+    vm->stack = stack;
+    vm->stacksize = newsize;
+    return 1;
+}
+
+static void vm_error(lp_vm *vm, lp_proto *f, unsigned *pc, const char *fmt, ...) {
+    va_list ap;
+    vm->errorrow = f->rows[pc - 1 - f->code];
+    va_start(ap, fmt);
+    vsnprintf(vm->error, PARSE_MSGMAX, fmt, ap);
+    va_end(ap);
+}
+
+// computed goto where the compiler has it, LPVM_SWITCH takes the switch
+// anyway, to compare them
+#if defined(__GNUC__) && !defined(LPVM_SWITCH)
+#define VM_GOTO
+#endif
+
+#ifdef LPVM_STATS
+#define count_step() (vm->steps++)
+#else
+#define count_step() ((void)0)
+#endif
+
+#ifdef VM_GOTO
+#define VM_LABEL(name) &&L_##name,
+#define vmcase(name)   L_##name:
+#define vmbreak        do { i = *pc++; count_step(); goto *labels[VM_OP(i)]; } while (0)
+#else
+#define vmcase(name)   case OP_##name:
+#define vmbreak        break
+#endif
+
+// a call or a jump backward is a reduction, the vm yields when the
+// budget of them is used up
+#define reduce()   do { if (--budget <= 0) goto yield; } while (0)
+
+#define RA (R[VM_A(i)])
+#define RB (R[VM_B(i)])
+#define RC (R[VM_C(i)])
+#define KB (K[VM_B(i)])
+
+// the jump in the next word is taken if the test is C, else it's skipped
+#define jump_if(test) \
+    do { \
+        if ((test) == (int)VM_C(i)) { \
+            int o = VM_SBX(*pc); \
+            pc += o + 1; \
+            if (o < 0) \
+                reduce(); \
+        } else { \
+            pc++; \
+        } \
+    } while (0)
+
+#define arith_op(name, cop) \
+    vmcase(name) { \
+        lp_value b = RB, c = RC; \
+        if (lpv_issmall(b) && lpv_issmall(c)) { \
+            long r = lpv_smallof(b) cop lpv_smallof(c); \
+            if (lpv_fits(r)) { \
+                RA = lpv_small(r); \
+                vmbreak; \
+            } \
+        } \
+        if ((err = arith(vm, OP_##name, b, c, &RA)) != NULL) \
+            goto fail; \
+        vmbreak; \
+    }
+
+#define compare_op(name, test, orequal) \
+    vmcase(name) { \
+        lp_value a = RB, b = RC; \
+        int t; \
+        if (lpv_issmall(a) && lpv_issmall(b)) \
+            t = lpv_smallof(a) test lpv_smallof(b); \
+        else if (t = less(a, b, orequal, &err), err != NULL) \
+            goto fail; \
+        RA = lpv_bool(t); \
+        vmbreak; \
+    }
+
+// R(A) op x, x is R(B) or K(B), jumping by the next word
+#define compare_jump(name, a, b, test, orequal) \
+    vmcase(name) { \
+        lp_value x = a, y = b; \
+        if (lpv_issmall(x) && lpv_issmall(y)) { \
+            jump_if(lpv_smallof(x) test lpv_smallof(y)); \
+        } else { \
+            int t = less(x, y, orequal, &err); \
+            if (err != NULL) \
+                goto fail; \
+            jump_if(t); \
+        } \
+        vmbreak; \
+    }
+
+static int execute(lp_vm *vm, int budget) {
+#ifdef VM_GOTO
+    static void *labels[] = { VM_OPS(VM_LABEL) };
+#endif
+    lp_program *prog = vm->prog;
+    vm_frame *fr = &vm->frames[vm->framecount - 1];
+    lp_proto *f = fr->f;
+    unsigned *pc = fr->pc;
+    lp_value *R = vm->stack + fr->base;
+    lp_value *K = f->k;
+    const char *err = NULL;
+    unsigned i;
+
+#ifdef VM_GOTO
+    vmbreak;
+#else
+    for (;;) {
+        i = *pc++;
+        count_step();
+        switch (VM_OP(i)) {
+#endif
+    vmcase(MOVE)
+        RA = RB;
+        vmbreak;
+    vmcase(LOADK)
+        RA = K[VM_BX(i)];
+        vmbreak;
+    vmcase(LOADI)
+        RA = lpv_small((long)VM_SBX(i));
+        vmbreak;
+    vmcase(LOADNIL)
+        RA = LPV_NILV;
+        vmbreak;
+    vmcase(LOADBOOL)
+        RA = lpv_bool(VM_B(i));
+        vmbreak;
+    arith_op(ADD, +)
+    arith_op(SUB, -)
+    vmcase(MUL) {
+        lp_value b = RB, c = RC;
+        long r;
+        if (lpv_issmall(b) && lpv_issmall(c) &&
+            !__builtin_mul_overflow(lpv_smallof(b), lpv_smallof(c), &r) && lpv_fits(r)) {
+            RA = lpv_small(r);
+            vmbreak;
+        }
+        if ((err = arith(vm, OP_MUL, b, c, &RA)) != NULL)
+            goto fail;
+        vmbreak;
+    }
+    vmcase(DIV)
+    vmcase(MOD) {
+        lp_value b = RB, c = RC;
+        if (lpv_issmall(b) && lpv_issmall(c) && lpv_smallof(c) > 0) {
+            long x = lpv_smallof(b), y = lpv_smallof(c);
+            RA = lpv_small(VM_OP(i) == OP_DIV ? x / y : x % y);
+            vmbreak;
+        }
+        if ((err = arith(vm, VM_OP(i), b, c, &RA)) != NULL)
+            goto fail;
+        vmbreak;
+    }
+    vmcase(POW)
+        if ((err = arith(vm, OP_POW, RB, RC, &RA)) != NULL)
+            goto fail;
+        vmbreak;
+    vmcase(ADDI) {
+        lp_value b = RB;
+        if (lpv_issmall(b)) {
+            long r = lpv_smallof(b) + VM_SC(i);
+            if (lpv_fits(r)) {
+                RA = lpv_small(r);
+                vmbreak;
+            }
+        }
+        if ((err = arith(vm, OP_ADD, b, lpv_small((long)VM_SC(i)), &RA)) != NULL)
+            goto fail;
+        vmbreak;
+    }
+    vmcase(UNM)
+        if ((err = arith(vm, OP_UNM, RB, RB, &RA)) != NULL)
+            goto fail;
+        vmbreak;
+    vmcase(NOT)
+        RA = lpv_bool(!lpv_istrue(RB));
+        vmbreak;
+    vmcase(EQ)
+        RA = lpv_bool(equal(RB, RC));
+        vmbreak;
+    vmcase(NE)
+        RA = lpv_bool(!equal(RB, RC));
+        vmbreak;
+    compare_op(LT, <, 0)
+    compare_op(LE, <=, 1)
+    vmcase(JMP)
+        pc += VM_SBX(i);
+        if (VM_SBX(i) < 0)
+            reduce();
+        vmbreak;
+    vmcase(JF)
+        if (!lpv_istrue(RA)) {
+            pc += VM_SBX(i);
+            if (VM_SBX(i) < 0)
+                reduce();
+        }
+        vmbreak;
+    vmcase(JT)
+        if (lpv_istrue(RA)) {
+            pc += VM_SBX(i);
+            if (VM_SBX(i) < 0)
+                reduce();
+        }
+        vmbreak;
+    vmcase(EQJ)
+        jump_if(equal(RA, RB));
+        vmbreak;
+    vmcase(EQKJ)
+        jump_if(equal(RA, KB));
+        vmbreak;
+    compare_jump(LTJ, RA, RB, <, 0)
+    compare_jump(LEJ, RA, RB, <=, 1)
+    compare_jump(LTKJ, RA, KB, <, 0)
+    compare_jump(LEKJ, RA, KB, <=, 1)
+    compare_jump(GTKJ, KB, RA, <, 0)
+    compare_jump(GEKJ, KB, RA, <=, 1)
+    vmcase(FORPREP) {
+        // the loop keeps raw words: the integer, the count of the rounds
+        // left, and the step
+        lp_value *ra = &RA;
+        lp_value v = ra[0];
+        long start, limit, step;
+        if (!lpv_isint(ra[0]) || !lpv_isint(ra[1]) || !lpv_isint(ra[2])) {
+            err = "range of values not integers";
+            goto fail;
+        }
+        start = lpv_intof(ra[0]);
+        limit = lpv_intof(ra[1]);
+        step = lpv_intof(ra[2]);
+        if (step == 0) {
+            err = "range by step 0";
+            goto fail;
+        }
+        if (step > 0 ? start > limit : start < limit) {
+            pc += VM_SBX(i);
+            vmbreak;
+        }
+        ra[1] = step > 0 ? ((unsigned long)limit - (unsigned long)start) / (unsigned long)step
+                         : ((unsigned long)start - (unsigned long)limit) / (0 - (unsigned long)step);
+        ra[0] = (lp_value)start;
+        ra[2] = (lp_value)step;
+        ra[3] = v;
+        vmbreak;
+    }
+    vmcase(FORLOOP) {
+        lp_value *ra = &RA;
+        if (ra[1] != 0) {
+            long n = (long)(ra[0] + ra[2]);
+            ra[0] = (lp_value)n;
+            ra[1]--;
+            if (lpv_fits(n))
+                ra[3] = lpv_small(n);
+            else if (!keep(vm, ra[3] = lpv_int(n)))
+                goto nomem;
+            pc += VM_SBX(i);
+            reduce();
+        }
+        vmbreak;
+    }
+    vmcase(GETFIELD) {
+        lp_value b = RB;
+        vm_field *fc = &f->fields[*pc++];
+        uint64_t cache = __atomic_load_n(&fc->cache, __ATOMIC_RELAXED);
+        lpv_object *o;
+        int k;
+        if (!lpv_isobject(b)) {
+            vm_error(vm, f, pc, "field %s of a value not a struct", vm_namestr(prog, fc->name));
+            goto error;
+        }
+        o = lpv_objectof(b);
+        if (o->type == vm_cachetype(cache)) {
+            k = vm_cacheindex(cache);
+        } else if ((k = find_field(fc, o->type)) < 0) {
+            vm_error(vm, f, pc, "no field %s", vm_namestr(prog, fc->name));
+            goto error;
+        }
+        RA = o->items[k];
+        vmbreak;
+    }
+    vmcase(MATCH) {
+        lp_value b = RB;
+        vm_match *m = f->matches[*pc++];
+        // only a string matches a regex
+        if (lpv_isstr(b)) {
+            char buf[LPV_SSTRMAX + 1];
+            int len, k;
+            const char *subject = lpv_strof(b, buf, &len);
+            if ((k = match_arms(m, subject, len)) < -1)
+                goto nomem;
+            RA = lpv_small(k);
+        } else {
+            RA = lpv_small(-1);
+        }
+        vmbreak;
+    }
+    vmcase(NEW) {
+        lpt_struct *t = prog->types[VM_B(i)];
+        lp_value v = lpv_object_new(t, t->field_count);
+        if (!keep(vm, v))
+            goto nomem;
+        memcpy(lpv_objectof(v)->items, &RC, t->field_count * sizeof(lp_value));
+        RA = v;
+        vmbreak;
+    }
+    vmcase(CALL) {
+        lp_proto *g = prog->funs[VM_BX(i)];
+        int base = (int)(R - vm->stack) + VM_A(i);
+        if (base + g->nregs > vm->stacksize && !grow_stack(vm, base + g->nregs)) {
+            err = "stack overflow";
+            goto fail;
+        }
+        if (vm->framecount == vm->framesize) {
+            vm_frame *frames = NULL;
+            if (vm->framesize < VM_MAX_CALLS)
+                frames = (vm_frame*)realloc(vm->frames, vm->framesize * 2 * sizeof(vm_frame));
+            if (frames == NULL) {
+                err = "stack overflow";
+                goto fail;
+            }
+            vm->frames = frames;
+            vm->framesize *= 2;
+        }
+        vm->frames[vm->framecount - 1].pc = pc;
+        fr = &vm->frames[vm->framecount++];
+        fr->f = f = g;
+        fr->base = base;
+        pc = g->code;
+        R = vm->stack + base;
+        K = g->k;
+        reduce();
+        vmbreak;
+    }
+    vmcase(SPAWN) {
+        long id;
+        if (vm->spawn == NULL) {
+            err = "no scheduler to run lps";
+            goto fail;
+        }
+        if ((id = vm->spawn(vm, VM_BX(i), &RA)) < 0)
+            goto nomem;
+        RA = lpv_lpid(id);
+        vmbreak;
+    }
+    vmcase(RETURN) {
+        // the result goes where the first argument was, R(A) of the caller
+        lp_value v = VM_B(i) ? RA : LPV_NILV;
+        R[0] = v;
+        if (--vm->framecount == 0) {
+            vm->result = v;
+            return VM_OK;
+        }
+        fr = &vm->frames[vm->framecount - 1];
+        f = fr->f;
+        pc = fr->pc;
+        R = vm->stack + fr->base;
+        K = f->k;
+        vmbreak;
+    }
+    vmcase(PRINT)
+        print_values(vm, &RA, VM_B(i));
+        vmbreak;
+    vmcase(TPL)
+        if (!render(vm, f->tpls[VM_BX(i)], &RA))
+            goto nomem;
+        vmbreak;
+#ifndef VM_GOTO
+        }
+    }
+#endif
+yield:
+    vm->frames[vm->framecount - 1].pc = pc;
+    return VM_YIELD;
+nomem:
+    err = "no enough memory";
+fail:
+    vm_error(vm, f, pc, "%s", err);
+error:
+    vm->frames[vm->framecount - 1].pc = pc;
+    return VM_ERROR;
+}
+
+int vm_start(lp_vm *vm, int fun, const lp_value *args) {
+    lp_proto *f = vm->prog->funs[fun];
+    int k;
+    vm->result = LPV_NILV;
+    vm->errorrow = 0;
+    vm->error[0] = 0;
+    vm->framecount = 0;
+    if (f->nregs > vm->stacksize && !grow_stack(vm, f->nregs)) {
+        strcpy(vm->error, "no enough memory");
+        return VM_ERROR;
+    }
+    for (k = 0; k < f->nparams; k++) {
+        if (!copy_value(vm, args[k], &vm->stack[k])) {
+            strcpy(vm->error, "no enough memory");
+            return VM_ERROR;
+        }
+    }
+    vm->frames[0].f = f;
+    vm->frames[0].pc = f->code;
+    vm->frames[0].base = 0;
+    vm->framecount = 1;
+    return VM_OK;
+}
+
+int vm_resume(lp_vm *vm, int budget) {
+    return execute(vm, budget);
+}
+
+int vm_run(lp_vm *vm) {
+    int r;
+    if (vm_start(vm, 0, NULL) != VM_OK)
+        return VM_ERROR;
+    while ((r = vm_resume(vm, INT_MAX)) == VM_YIELD)
+        ;
+    return r;
+}
+
+//1 --------------------- print --------------------------------------
+void vm_print(lp_program *prog) {
+    Buf b = {NULL, 0, 0};
+    int n, pc;
+    for (n = 0; n < prog->funcount; n++) {
+        lp_proto *f = prog->funs[n];
+        printf("fun %s: %d params, %d registers, %d constants\n",
+               vm_namestr(prog, f->name), f->nparams, f->nregs, f->kcount);
+        for (pc = 0; pc < f->codecount; pc++) {
+            unsigned i = f->code[pc];
+            int op = VM_OP(i);
+            printf("%5d  [%u]\t%-9s", pc, f->rows[pc], op < VM_OPCOUNT ? opnames[op] : "?");
+            b.len = 0;
+            switch (op) {
+                case OP_LOADK:
+                    buf_value(prog, &b, f->k[VM_BX(i)], 1);
+                    printf("%d %d\t; %s", VM_A(i), VM_BX(i), b.s);
+                    break;
+                case OP_LOADI:
+                    printf("%d %d", VM_A(i), VM_SBX(i));
+                    break;
+                case OP_JMP:
+                case OP_JF:
+                case OP_JT:
+                case OP_FORPREP:
+                case OP_FORLOOP:
+                    printf("%d %d\t; to %d", VM_A(i), VM_SBX(i), pc + 1 + VM_SBX(i));
+                    break;
+                case OP_ADDI:
+                    printf("%d %d %d", VM_A(i), VM_B(i), VM_SC(i));
+                    break;
+                case OP_EQKJ:
+                case OP_LTKJ:
+                case OP_LEKJ:
+                case OP_GTKJ:
+                case OP_GEKJ:
+                    buf_value(prog, &b, f->k[VM_B(i)], 1);
+                    printf("%d %d %d\t; %s", VM_A(i), VM_B(i), VM_C(i), b.s);
+                    break;
+                case OP_GETFIELD:
+                    pc++;
+                    printf("%d %d\t; .%s", VM_A(i), VM_B(i),
+                           vm_namestr(prog, f->fields[f->code[pc]].name));
+                    break;
+                case OP_MATCH:
+                    pc++;
+                    printf("%d %d\t; %d arms", VM_A(i), VM_B(i), f->matches[f->code[pc]]->count);
+                    break;
+                case OP_NEW:
+                    printf("%d %d %d\t; %s", VM_A(i), VM_B(i), VM_C(i),
+                           vm_namestr(prog, prog->types[VM_B(i)]->name));
+                    break;
+                case OP_CALL:
+                case OP_SPAWN:
+                    printf("%d %d\t; %s", VM_A(i), VM_BX(i),
+                           vm_namestr(prog, prog->funs[VM_BX(i)]->name));
+                    break;
+                case OP_TPL:
+                    printf("%d %d", VM_A(i), VM_BX(i));
+                    break;
+                default:
+                    printf("%d %d %d", VM_A(i), VM_B(i), VM_C(i));
+                    break;
+            }
+            printf("\n");
+        }
+    }
+    free(b.s);
+}
+
+//1 --------------------- test ---------------------------------------
+#ifdef VM_TEST
+#include <assert.h>
+#include <time.h>
+
+typedef struct {
+    const char *src;
+    const char *result; // of the top-level return, or the error
+} Case;
+
+static Case cases[] = {
+    {"return 1 + 2 * 3", "7"},
+    {"return 7 / 2, 0", "returning several values is not supported yet"},
+    {"return -7 / 2 + -7 % 3", "-4"},
+    {"return 1 / 4.0", "0.25"},
+    {"return 2 ** 10", "1024"},
+    {"return 2 ** -1", "0.5"},
+    {"return 140737488355327 + 1", "140737488355328"},
+    {"return -140737488355328 - 1 + 1", "-140737488355328"},
+    {"return 3000000000 * 3000000000", "9000000000000000000"},
+    {"return 1 / 0", "divided by 0"},
+    {"return 1 + nil", "bad operands of +"},
+    {"return 0.1 + 0.2", "0.30000000000000004"},
+    {"return 2.0 == 2", "true"},
+    {"return 'abc' < 'abd'", "true"},
+    {"a = nil\nreturn a or 3", "3"},
+    {"a = 5\nreturn a and a + 1", "6"},
+    {"return !nil", "true"},
+    {"return x", "unknown name x"},
+    {"a = 0\nfor i in 1..100 do a = a + i end\nreturn a", "5050"},
+    {"s = 0\nfor i in 10..1..-3 do s = s + i end\nreturn s", "22"},
+    {"s = 0\nfor i in 5..1 do s = s + i end\nreturn s", "0"},
+    {"for i in 1..3..0 do end", "range by step 0"},
+    {"s = 100\nfor i in 1..10; s = 0; i % 3 == 0 do s = s + i end\nreturn s", "18"},
+    {"c = 0\nfor i in 1..10; j in 1..i do\nif j > 3 then break end\nc = c + 1\nend\nreturn c", "9"},
+    {"i = 0\ns = 0\nwhile i < 10 do\ni = i + 1\nif i % 2 == 0 then continue end\ns = s + i\nend\nreturn s", "25"},
+    {"n = 0\nwhile n = 1; n < 100 do n = n * 2 end\nreturn n", "128"},
+    {"x = 5\nif x > 3 then r = 1 elseif x > 1 then r = 2 else r = 3 end\nreturn r", "unknown name r"},
+    {"r = 0\nx = 2\nif x > 3 then r = 1 elseif x > 1 then r = 2 else r = 3 end\nreturn r", "2"},
+    {"fun fib(n)\nif n < 2 then return n end\nreturn fib(n - 1) + fib(n - 2)\nend\nreturn fib(20)", "6765"},
+    {"fun f(a, b = 10) return a - b end\nreturn f(b = 1, a = 5) + f(100)", "94"},
+    {"fun f(a) return a end\nreturn f()", "no argument of a"},
+    {"fun f() return g() end\nfun g() return .ok end\nreturn f()", ".ok"},
+    {"fun f(n) return f(n + 1) end\nreturn f(0)", "stack overflow"},
+    {"struct Point { x, y = 5 }\np = Point{1}\nq = Point{y = 2, x = 3}\nreturn p.x + p.y + q.x * q.y", "12"},
+    {"struct P { x, y }\nstruct Q { y }\nfun gety(o) return o.y end\nreturn gety(P{1, 2}) + gety(Q{3}) + gety(P{4, 5})", "10"},
+    {"struct P { x }\np = P{1}\nreturn p.z", "no field z"},
+    {"struct P { x, name }\nreturn P{1, 'a'}", "P{x=1, name='a'}"},
+    {"x = .b\nr = 0\ncase x of\n.a: r = 1\n.b: r = 2\n_: r = 3\nend\nreturn r", "2"},
+    {"r = 0\ncase 7 of\n1: r = 1\nn when n > 5: r = n * 2\nend\nreturn r", "14"},
+    // the first regex arm found in the subject is taken
+    {"fun route(s)\ncase s of\nr'err': return 1\nr'error \\d+': return 2\nr'^GET ': return 3\n_: return 0\nend\nend\n"
+     "return route('error 42') * 100 + route('GET /') * 10 + route('ok')", "130"},
+    {"r = 0\ncase 5 of\nr'5': r = 1\n_: r = 2\nend\nreturn r", "2"},
+    {"r = 0\ncase 'abc' of\nr'x': r = 1\nend\nreturn r", "0"},
+    // the arms after a guard failing are still tried
+    {"fun f(s, n)\ncase s of\nr'a' when n > 0: return 1\n'abc': return 2\nr'b': return 3\nr'\\bz+\\b': return 4\nx: return 5\nend\nend\n"
+     "return f('abc', 1) * 10000 + f('abc', 0) * 1000 + f('xbx', 0) * 100 + f('zz', 0) * 10 + f('yzy', 0)", "12345"},
+    {"n = 5\nf = 1.5\nreturn \"n=$n f=${f} s=$s\"", "unknown name s"},
+    {"n = 5\nf = 1.5\nb = true\nreturn \"n=$n f=${f} b=$b\"", "'n=5 f=1.5 b=true'"},
+    {"a, b = 1, 2\na, b = b, a\nreturn a * 10 + b", "21"},
+    {"do x = 1 end\nreturn x", "unknown name x"},
+    {"lp puts 1 end", "no scheduler to run lps"},
+    {NULL, NULL}
+};
+
+static void run_case(Case *t) {
+    void *src = string_source(t->src);
+    lp_ast *ast = parse_module(src, NULL);
+    lp_program *prog;
+    lp_vm *vm;
+    Buf b = {NULL, 0, 0};
+    assert(ast != NULL && ast->errorcount == 0);
+    prog = vm_compile(ast);
+    assert(prog != NULL);
+    if (prog->errorcount > 0) {
+        buf_add(&b, prog->errors[0].msg, strlen(prog->errors[0].msg));
+    } else {
+        vm = vm_new(prog);
+        if (vm_run(vm) == VM_OK)
+            buf_value(prog, &b, vm->result, 1);
+        else
+            buf_add(&b, vm->error, strlen(vm->error));
+        vm_free(vm);
+    }
+    if (strcmp(b.s, t->result) != 0) {
+        printf("%s\n=> %s, not %s\n", t->src, b.s, t->result);
+        vm_print(prog);
+        assert(0);
+    }
+    free(b.s);
+    vm_free_program(prog);
+    ast_free(ast);
+    close_source(src);
+}
+
+// lp blocks, each lp is run at once to its end by the spawn of the test,
+// with a small budget so it yields often. the result is what each lp
+// returns or its error, in the order they end, then the result of the
+// top-level code
+static Case lpcases[] = {
+    {"a = 1\nb = 2\nc = 3\nlp return a * 10 + c end", "13, nil"},
+    {"a = 1\nlp a = 2\nreturn a end\nreturn a", "2, 1"},
+    {"n = 7\nlp return \"n=$n\" end", "'n=7', nil"},
+    {"struct P { x }\np = P{4}\nlp return p.x + 1 end", "5, nil"},
+    {"a = 5\nlp b = a + 1\nlp return b * 2 end\nreturn b end", "12, 6, nil"},
+    {"p = lp end\nq = lp end\nreturn q", "nil, nil, <lp 2>"},
+    {"lp return 1 + nil end\nreturn 1", "bad operands of +, 1"},
+    {"for i in 1..3 do lp return i * i end end", "1, 4, 9, nil"},
+    {"fun f(n) return lp return n end end\nreturn f(3)", "3, <lp 1>"},
+    {"s = 0\nfor i in 1..1000 do s = s + i end\nlp while s > 0 do s = s - 1 end\nreturn s end\nreturn s", "0, 500500"},
+    {NULL, NULL}
+};
+
+static Buf lpresults;
+static long lpcount;
+static long yields;
+
+static void add_result(lp_vm *vm, int r) {
+    if (r == VM_OK)
+        buf_value(vm->prog, &lpresults, vm->result, 1);
+    else
+        buf_add(&lpresults, vm->error, strlen(vm->error));
+}
+
+static int run_slices(lp_vm *vm) {
+    int r;
+    while ((r = vm_resume(vm, 10)) == VM_YIELD)
+        yields++;
+    return r;
+}
+
+static long run_at_once(lp_vm *vm, int fun, lp_value *args) {
+    lp_vm *lp = vm_new(vm->prog);
+    int r;
+    assert(lp != NULL);
+    r = vm_start(lp, fun, args);
+    assert(r == VM_OK);
+    lp->spawn = run_at_once;
+    add_result(lp, run_slices(lp));
+    buf_add(&lpresults, ", ", 2);
+    vm_free(lp);
+    return ++lpcount;
+}
+
+static void run_lpcase(Case *t) {
+    void *src = string_source(t->src);
+    lp_ast *ast = parse_module(src, NULL);
+    lp_program *prog = vm_compile(ast);
+    lp_vm *vm = vm_new(prog);
+    int r;
+    assert(prog->errorcount == 0);
+    lpresults.len = 0;
+    lpcount = 0;
+    vm->spawn = run_at_once;
+    r = vm_start(vm, 0, NULL);
+    assert(r == VM_OK);
+    add_result(vm, run_slices(vm));
+    if (strcmp(lpresults.s, t->result) != 0) {
+        printf("%s\n=> %s, not %s\n", t->src, lpresults.s, t->result);
+        vm_print(prog);
+        assert(0);
+    }
+    vm_free(vm);
+    vm_free_program(prog);
+    ast_free(ast);
+    close_source(src);
+}
+
+// a case of 300 regex arms, their indexes out of the range of EQKJ
+static void test_match() {
+    Buf b = {NULL, 0, 0};
+    const char *head = "fun f(s)\ncase s of\n";
+    const char *tail = "_: return -1\nend\nend\nreturn f('w299') * 1000 + f('w7') + f('w300')";
+    char arm[64];
+    int k;
+    Case t;
+    buf_add(&b, head, strlen(head));
+    for (k = 0; k < 300; k++) {
+        snprintf(arm, sizeof(arm), "r'^w%d$': return %d\n", k, k);
+        buf_add(&b, arm, strlen(arm));
+    }
+    buf_add(&b, tail, strlen(tail));
+    t.src = b.s;
+    t.result = "299006";
+    run_case(&t);
+    free(b.s);
+}
+
+static void test_lp() {
+    void *src = string_source("a = 1\nb = 2\nc = 3\nlp return a * 10 + c end\nlp break end");
+    lp_ast *ast = parse_module(src, NULL);
+    lp_program *prog = vm_compile(ast);
+    int k;
+    // only the locals read are copied
+    assert(prog->funcount == 3 && prog->funs[1]->nparams == 2);
+    assert(prog->errorcount == 1 && strcmp(prog->errors[0].msg, "break out of a loop") == 0);
+    vm_free_program(prog);
+    ast_free(ast);
+    close_source(src);
+    for (k = 0; lpcases[k].src != NULL; k++)
+        run_lpcase(&lpcases[k]);
+    // the loops of 1000 rounds yield by the budget of 10
+    assert(yields >= 200);
+    free(lpresults.s);
+}
+
+// loops for the speed of the interpreter
+static const char *benches[][2] = {
+    {"range", "s = 0\nfor i in 1..16000000 do s = s + i end\nreturn s"},
+    {"while", "i = 0\ns = 0\nwhile i < 50000000 do\ni = i + 1\ns = s + i % 7\nend\nreturn s"},
+    {"fib", "fun fib(n)\nif n < 2 then return n end\nreturn fib(n - 1) + fib(n - 2)\nend\nreturn fib(30)"},
+    {"field", "struct P { x, y }\np = P{1, 2}\ns = 0\nfor i in 1..20000000 do s = s + p.x + p.y end\nreturn s"},
+    {NULL, NULL}
+};
+
+static void bench() {
+    int k;
+    for (k = 0; benches[k][0] != NULL; k++) {
+        void *src = string_source(benches[k][1]);
+        lp_ast *ast = parse_module(src, NULL);
+        lp_program *prog = vm_compile(ast);
+        lp_vm *vm = vm_new(prog);
+        struct timespec t0, t1;
+        double secs;
+        int r;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        r = vm_run(vm);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(r == VM_OK);
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%-6s %7.3fs ", benches[k][0], secs);
+#ifdef LPVM_STATS
+        printf("%12lu insts %8.1fM insts/s ", vm->steps, vm->steps / secs / 1e6);
+#endif
+        vm_print_value(vm, vm->result);
+        printf("\n");
+        vm_free(vm);
+        vm_free_program(prog);
+        ast_free(ast);
+        close_source(src);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int k;
+    assert(sizeof(lp_value) == 8 && VM_OPCOUNT <= 256);
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        bench();
+        return 0;
+    }
+    for (k = 0; cases[k].src != NULL; k++)
+        run_case(&cases[k]);
+    test_match();
+    test_lp();
+    printf("%d cases ok\n", k);
+    return 0;
+}
+#endif //VM_TEST
@@ -0,0 +1,247 @@
+#ifndef LPVM_H
+#define LPVM_H
+#include <pthread.h>
+#include "lpvalue.h"
+#include "lpparse.h"
+#include "lplex.h"
+
+/*
+ * virtual machine of lp: a register machine in the way of lua 5.
+ * 1. a function is compiled into a proto: an array of 32-bit
+ *    instructions, its constants, and the count of registers it uses.
+ *    the registers of a call are a window of the stack of lp_values,
+ *    beginning at its first argument; the locals live in registers,
+ *    so most instructions take their operands from the registers and
+ *    put the result into one, without moving anything.
+ * 2. an instruction is three-address: the op in bits 0-7, A in bits
+ *    8-15, B in 16-23 and C in 24-31. Bx is B and C as one 16-bit
+ *    operand, sBx is Bx - VM_BIAS, a signed jump offset or integer.
+ * 3. the interpreter dispatches by computed goto(the address of the
+ *    code of the next op is taken from a table at the end of the code of
+ *    each op), where the compiler has it, by a switch otherwise.
+ * 4. the common patterns of lp code have instructions of their own:
+ *    a compare followed by a jump is one instruction(LTJ ... with the
+ *    offset in the next word), "for i in a..b" is FORPREP/FORLOOP
+ *    counting the rounds left, the field of a struct is read by GETFIELD
+ *    with an inline cache of the struct type last seen, x + 1 is ADDI,
+ *    and the regex arms of a case are matched together by one MATCH(see
+ *    lpregex.h for the regex set), which the arms then test for their
+ *    index.
+ * 5. integers are taken fast when both operands are immediate, they
+ *    wrap around in 64 bits. / and % of integers truncate toward 0 as C.
+ * 6. there's no garbage collector yet: the heap values made by a run are
+ *    kept by the vm, and freed with it, or by vm_clear. a vm owns all the
+ *    values it reads: the arguments it starts with are copied into its
+ *    heap, so it's freed with no care of the others.
+ * 7. an lp_vm is the state of one lp(lightweight process), the program is
+ *    shared by all of them. a run is resumable: vm_resume stops after a
+ *    budget of reductions(a call or a jump backward is one), so a
+ *    scheduler can take turns among the lps, see lpsched.h. "lp ... end"
+ *    is compiled into a function of its own, whose parameters are the
+ *    locals of the block around it read in it, and SPAWN hands the new lp
+ *    to the scheduler with their values.
+ *
+ * what the compiler takes of the language: top-level functions called by
+ * name(with named and default arguments), structs, locals, the
+ * arithmetic and comparing operators, and/or/!, if, while, for over
+ * ranges, case on values and regexes, do, break, continue, return, string templates
+ * with $name holes, lp blocks, and the builtin puts/print. the others are
+ * reported as not supported yet.
+ */
+
+#define VM_BIAS      0x7fff
+#define VM_MAX_REGS  250     // registers of a function
+#define VM_MAX_CODE  32767   // instructions of a function, so every jump fits in sBx
+#define VM_MAX_CALLS 100000  // depth of calls
+
+#define VM_OP(i)   ((i) & 0xff)
+#define VM_A(i)    (((i) >> 8) & 0xff)
+#define VM_B(i)    (((i) >> 16) & 0xff)
+#define VM_C(i)    ((i) >> 24)
+#define VM_SC(i)   ((int)(signed char)VM_C(i))
+#define VM_BX(i)   ((i) >> 16)
+#define VM_SBX(i)  ((int)VM_BX(i) - VM_BIAS)
+
+#define vm_abc(op, a, b, c) ((unsigned)(op) | (unsigned)(a) << 8 | (unsigned)(b) << 16 | (unsigned)(c) << 24)
+#define vm_abx(op, a, bx)   ((unsigned)(op) | (unsigned)(a) << 8 | (unsigned)(bx) << 16)
+
+/*
+ * the ops, R(x) is register x, K(x) is constant x. an op ending with J
+ * tests R(A) against R(B) or K(B), and is followed by a JMP word: the
+ * jump is taken if the result of the test is C, else the word is
+ * skipped. so != is EQJ with C 0, and a condition can jump either when
+ * it's true or when it's false.
+ */
+#define VM_OPS(_) \
+    _(MOVE)     /* A B     R(A) = R(B) */ \
+    _(LOADK)    /* A Bx    R(A) = K(Bx) */ \
+    _(LOADI)    /* A sBx   R(A) = sBx */ \
+    _(LOADNIL)  /* A       R(A) = nil */ \
+    _(LOADBOOL) /* A B     R(A) = B != 0 */ \
+    _(ADD)      /* A B C   R(A) = R(B) + R(C) */ \
+    _(SUB)      /* A B C   R(A) = R(B) - R(C) */ \
+    _(MUL)      /* A B C   R(A) = R(B) * R(C) */ \
+    _(DIV)      /* A B C   R(A) = R(B) / R(C) */ \
+    _(MOD)      /* A B C   R(A) = R(B) % R(C) */ \
+    _(POW)      /* A B C   R(A) = R(B) ** R(C) */ \
+    _(ADDI)     /* A B sC  R(A) = R(B) + sC */ \
+    _(UNM)      /* A B     R(A) = -R(B) */ \
+    _(NOT)      /* A B     R(A) = !R(B) */ \
+    _(EQ)       /* A B C   R(A) = R(B) == R(C) */ \
+    _(NE)       /* A B C   R(A) = R(B) != R(C) */ \
+    _(LT)       /* A B C   R(A) = R(B) < R(C) */ \
+    _(LE)       /* A B C   R(A) = R(B) <= R(C) */ \
+    _(JMP)      /* sBx     pc += sBx */ \
+    _(JF)       /* A sBx   if R(A) is nil or false, pc += sBx */ \
+    _(JT)       /* A sBx   if R(A) is not nil or false, pc += sBx */ \
+    _(EQJ)      /* A B C   R(A) == R(B) */ \
+    _(LTJ)      /* A B C   R(A) < R(B) */ \
+    _(LEJ)      /* A B C   R(A) <= R(B) */ \
+    _(EQKJ)     /* A B C   R(A) == K(B) */ \
+    _(LTKJ)     /* A B C   R(A) < K(B) */ \
+    _(LEKJ)     /* A B C   R(A) <= K(B) */ \
+    _(GTKJ)     /* A B C   R(A) > K(B) */ \
+    _(GEKJ)     /* A B C   R(A) >= K(B) */ \
+    _(FORPREP)  /* A sBx   R(A)..R(A+1) by R(A+2): if empty pc += sBx, else R(A+3) = R(A) */ \
+    _(FORLOOP)  /* A sBx   if rounds are left: R(A+3) = R(A) += step, pc += sBx */ \
+    _(GETFIELD) /* A B     R(A) = R(B).name, the next word is the field of the proto */ \
+    _(MATCH)    /* A B     R(A) = index of the first arm matching R(B), or -1, the next word is the match of the proto */ \
+    _(NEW)      /* A B C   R(A) = struct B{R(C), R(C+1)...} */ \
+    _(CALL)     /* A Bx    R(A) = function Bx(R(A), R(A+1)...) */ \
+    _(SPAWN)    /* A Bx    R(A) = id of a new lp running function Bx(R(A), R(A+1)...) */ \
+    _(RETURN)   /* A B     return R(A) if B, else nil */ \
+    _(PRINT)    /* A B     print R(A)...R(A+B-1) */ \
+    _(TPL)      /* A Bx    R(A) = template Bx with R(A+1)... in its holes */
+
+#define VM_OPENUM(name) OP_##name,
+enum { VM_OPS(VM_OPENUM) VM_OPCOUNT };
+
+// inline cache of GETFIELD: the field of 'name' is item 'index' of the
+// objects of 'type'. both are one word(type | index << 48), read and
+// written at once, as the lps on other threads run the same code
+typedef struct {
+    unsigned name;
+    uint64_t cache;
+} vm_field;
+
+// the regex arms of a case, from the first one or after a guarded one up
+// to the next guarded one, matched by MATCH. a regex set is used by one
+// thread at a time, so a MATCH takes a matcher from 'free', or makes a
+// new one from the patterns, and puts it back after
+typedef struct vm_matcher_ vm_matcher;
+
+typedef struct {
+    char **patterns;       // NUL ended
+    int *lens;
+    int count;
+    pthread_mutex_t lock;  // of free
+    vm_matcher *free;
+} vm_match;
+
+#define vm_cachetype(w)  ((lpt_struct*)(uintptr_t)((w) & LPV_PAYLOAD))
+#define vm_cacheindex(w) ((int)((w) >> 48))
+
+typedef struct {
+    unsigned name;         // string pool id
+    int nparams;
+    int nregs;             // registers used, including the parameters
+    unsigned *code;
+    unsigned *rows;        // row of the source of each instruction
+    int codecount;
+    int codesize;
+    lp_value *k;           // constants
+    int kcount;
+    int ksize;
+    vm_field *fields;
+    int fieldcount;
+    int fieldsize;
+    vm_match **matches;
+    int matchcount;
+    int matchsize;
+    StrTemplate **tpls;
+    int tplcount;
+    int tplsize;
+} lp_proto;
+
+// a compiled module, shared by the runs of it
+typedef struct {
+    lp_proto **funs;       // funs[0] is the top-level code
+    int funcount;
+    lpt_struct **types;
+    int typecount;
+    lp_strpool *names;     // the pool of the ast, kept by the caller
+    lp_sharedpool *shared; // or the shared pool of the ast
+    int errorcount;        // errors of compiling, the first PARSE_MAX_ERRORS are kept
+    ast_error errors[PARSE_MAX_ERRORS];
+} lp_program;
+
+#define vm_namestr(prog, id) ((prog)->shared != NULL ? sharedpool_get((prog)->shared, (id)) \
+                                                     : strpool_get((prog)->names, (id)))
+
+typedef struct {
+    lp_proto *f;
+    unsigned *pc;
+    int base;              // where the registers begin in the stack
+} vm_frame;
+
+#define VM_OK    0
+#define VM_ERROR 1
+#define VM_YIELD 2         // the budget is used up, vm_resume goes on
+
+// state of a run, of one lp
+typedef struct lp_vm_ {
+    lp_program *prog;
+    lp_value *stack;
+    int stacksize;
+    vm_frame *frames;
+    int framecount;
+    int framesize;
+    lp_value *heap;        // heap values made by the run, freed with the vm
+    int heapcount;
+    int heapsize;
+    lp_value result;       // of the function run
+    int errorrow;
+    char error[PARSE_MSGMAX];
+    long id;               // of the lp
+    // make an lp running function 'fun' of the program with the arguments
+    // from 'args', its id, or -1 if no enough memory. SPAWN fails if it's
+    // NULL
+    long (*spawn)(struct lp_vm_ *vm, int fun, lp_value *args);
+    void *owner;           // of the vm, for spawn
+#ifdef LPVM_STATS
+    unsigned long steps;   // instructions run
+#endif
+} lp_vm;
+
+// compile the ast, which has no syntax errors. the program is returned
+// even if there are errors of compiling, see prog->errorcount. NULL if no
+// enough memory
+lp_program *vm_compile(lp_ast *ast);
+void vm_free_program(lp_program *prog);
+void print_compile_errors(lp_program *prog, const char *name);
+
+// print the code of the program, for test
+void vm_print(lp_program *prog);
+
+lp_vm *vm_new(lp_program *prog);
+void vm_free(lp_vm *vm);
+// free the heap values made by the runs of the vm, which is kept for
+// another run
+void vm_clear(lp_vm *vm);
+
+// get the vm ready to run function 'fun' of the program with copies of
+// the arguments from 'args', VM_OK, or VM_ERROR if no enough memory
+int vm_start(lp_vm *vm, int fun, const lp_value *args);
+
+// run the vm started, or yielded, for about 'budget' reductions. VM_OK when the
+// function returns, its result in vm->result, VM_YIELD if it's not done
+// yet, or VM_ERROR with the message in vm->error
+int vm_resume(lp_vm *vm, int budget);
+
+// run the top-level code of the program to its end, VM_OK or VM_ERROR
+int vm_run(lp_vm *vm);
+
+// print the value as puts does
+void vm_print_value(lp_vm *vm, lp_value v);
+
+#endif //LPVM_H
@@ -1,156 +1,577 @@
-#include "strpool.h"
-#include <stdio.h>
-#include <assert.h>
-#include <string.h>
-#include <stdlib.h>
-
-#define INIT_POOL_SIZE 4096
-#define INIT_IDX_SIZE  256
-
-lp_strpool *strpool_init() {
-    char *pool;
-    int *indexes;
-    lp_strpool *sp;
-
-    pool = (char*)malloc(INIT_POOL_SIZE);
-    if (pool == NULL) {
-        fprintf(stderr, "no enough memory");
-        return NULL;
-    }
-    indexes = (int*)malloc(INIT_IDX_SIZE * sizeof(int));
-    if (indexes == NULL) {
-        free(pool);
-        fprintf(stderr, "no enough memory");
-        return NULL;
-    }
-
-    sp = (lp_strpool*)malloc(sizeof(lp_strpool));
-    if (sp == NULL) {
-        free(pool);
-        free(indexes);
-        fprintf(stderr, "no enough memory");
-        return NULL;
-    }
-
-    sp->charcount = 0;
-    sp->charsize  = INIT_POOL_SIZE;
-    sp->pool      = pool;
-    sp->idxcount  = 0;
-    sp->idxsize   = INIT_IDX_SIZE;
-    sp->indexes   = indexes;
-
-    return sp;
-}
-
-void strpool_destroy(lp_strpool* sp) {
-    if (sp == NULL)
-        return;
-    free(sp->indexes);
-    free(sp->pool);
-    free(sp);
-}
-
-// if the result >= 0, then it's the position of 'str' in pool
-// if the result < 0, then -(result+1) is the order of 'str' in
-// the index list
-static int search(lp_strpool *sp, const char* str) {
-    int i = 0;
-    int j = sp->idxcount - 1;
-    char *pool = sp->pool;
-    int *indexes = sp->indexes;
-    while (i <= j) {
-        int m = (i + j) / 2;
-        char *b = &pool[indexes[m]];
-        int r = strcmp(b, str);
-        if (r == 0) {
-            return indexes[m];
-        } else if (r < 0) {
-            i = m + 1;
-        } else {
-            j = m - 1;
-        }
-    }
-    // (i+j+1)/2 is the position for the string,
-    // -1 is used to differenciate with the found position 0
-    return -((i+j+1)/2)  - 1;
-}
-
-int strpool_add(lp_strpool *sp, const char* str) {
-    int len;
-    int pos;
-    int idxpos;
-    int newcharcount;
-    int newidxcount;
-    assert(sp != NULL);
-    assert(str != NULL);
-
-    pos = search(sp, str);
-
-    if (pos >= 0) {
-        return pos;
-    }
-
-    idxpos = -(pos + 1);
-
-    len = strlen(str);
-    pos = sp->charcount;
-
-    newcharcount = pos + len + 1;
-    if (newcharcount >= sp->charsize) {
-        int newsize = newcharcount * 2;
-        char *pool = (char*)realloc(sp->pool, newsize);
-        if (pool == NULL) {
-            fprintf(stderr, "no enough memory");
-            return NOT_SP_ID;
-        }
-        sp->pool = pool;
-        sp->charsize = newsize;
-    }
-
-    newidxcount = sp->idxcount + 1;
-    if (newidxcount >= sp->idxsize) {
-        int newsize = newidxcount * 2;
-        int *indexes = (int*)realloc(sp->indexes, newsize*sizeof(int));
-        if (indexes == NULL) {
-            fprintf(stderr, "no enough memory");
-            return NOT_SP_ID;
-        }
-        sp->indexes = indexes;
-        sp->idxsize = newsize;
-    }
-
-    strcpy(sp->pool + sp->charcount, str);
-    sp->charcount = newcharcount;
-
-    if (idxpos < sp->idxcount) {
-        memmove((void*)(sp->indexes+idxpos+1), (void*)(sp->indexes+idxpos), sizeof(int));
-    }
-    sp->indexes[idxpos] = pos;
-    sp->idxcount = newidxcount;
-    return pos;
-}
-
-void strpool_print(lp_strpool *sp) {
-    int i;
-    for (i=0; i<sp->idxcount; i++) {
-        printf("%s\n", sp->pool + sp->indexes[i]);
-    }
-}
-
-int main(int argc, char*argv[]) {
-    lp_strpool *sp = strpool_init();
-
-    strpool_add(sp, "cadsfeasfd");
-    strpool_add(sp, "afsadf");
-    strpool_add(sp, "f1111");
-    strpool_add(sp, "dr222");
-    strpool_add(sp, "iddd");
-    strpool_add(sp, "eaa");
-
-
-    printf("%d\n", search(sp, argv[1]));
-    strpool_print(sp);
-    strpool_destroy(sp);
-    return 0;
-}
-
+#include "strpool.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define INIT_POOL_SIZE 4096
+#define INIT_ID_SIZE   256
+#define INIT_SLOT_SIZE 512
+
+// FNV-1a
+static unsigned hash(const char *str, int len) {
+    unsigned h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+lp_strpool *strpool_init() {
+    char *pool;
+    int *offsets;
+    lp_spslot *slots;
+    lp_strpool *sp;
+    int i;
+
+    pool = (char*)malloc(INIT_POOL_SIZE);
+    offsets = (int*)malloc(INIT_ID_SIZE * sizeof(int));
+    slots = (lp_spslot*)malloc(INIT_SLOT_SIZE * sizeof(lp_spslot));
+    sp = (lp_strpool*)malloc(sizeof(lp_strpool));
+    if (pool == NULL || offsets == NULL || slots == NULL || sp == NULL) {
+        free(pool);
+        free(offsets);
+        free(slots);
+        free(sp);
+        fprintf(stderr, "no enough memory");
+        return NULL;
+    }
+
+    for (i = 0; i < INIT_SLOT_SIZE; i++) {
+        slots[i].id = NOT_SP_ID;
+    }
+
+    sp->charcount = 0;
+    sp->charsize  = INIT_POOL_SIZE;
+    sp->pool      = pool;
+    sp->count     = 0;
+    sp->idsize    = INIT_ID_SIZE;
+    sp->offsets   = offsets;
+    sp->slotsize  = INIT_SLOT_SIZE;
+    sp->slots     = slots;
+    sp->sorted    = NULL;
+
+    return sp;
+}
+
+void strpool_destroy(lp_strpool* sp) {
+    if (sp == NULL)
+        return;
+    free(sp->sorted);
+    free(sp->slots);
+    free(sp->offsets);
+    free(sp->pool);
+    free(sp);
+}
+
+const char* strpool_get(lp_strpool* sp, int id) {
+    assert(sp != NULL);
+    if (id < 0 || id >= sp->count)
+        return NULL;
+    return sp->pool + sp->offsets[id];
+}
+
+int strpool_len(lp_strpool* sp, int id) {
+    int len;
+    assert(sp != NULL);
+    if (id < 0 || id >= sp->count)
+        return 0;
+    memcpy(&len, sp->pool + sp->offsets[id] - sizeof(int), sizeof(int));
+    return len;
+}
+
+// return the slot holding 'str', or the empty slot where it should be
+static lp_spslot *search(lp_strpool *sp, const char *str, int len, unsigned h) {
+    unsigned mask = sp->slotsize - 1;
+    unsigned i = h & mask;
+    while (1) {
+        lp_spslot *slot = &sp->slots[i];
+        if (slot->id == NOT_SP_ID)
+            return slot;
+        if (slot->hash == h && strpool_len(sp, slot->id) == len &&
+            memcmp(sp->pool + sp->offsets[slot->id], str, len) == 0)
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+// double the hash table, the cached hashes are reused
+static int grow_slots(lp_strpool *sp) {
+    int newsize = sp->slotsize * 2;
+    unsigned mask = newsize - 1;
+    lp_spslot *slots = (lp_spslot*)malloc(newsize * sizeof(lp_spslot));
+    int i;
+    if (slots == NULL) {
+        fprintf(stderr, "no enough memory");
+        return 0;
+    }
+    for (i = 0; i < newsize; i++) {
+        slots[i].id = NOT_SP_ID;
+    }
+    for (i = 0; i < sp->slotsize; i++) {
+        lp_spslot *slot = &sp->slots[i];
+        unsigned j;
+        if (slot->id == NOT_SP_ID)
+            continue;
+        j = slot->hash & mask;
+        while (slots[j].id != NOT_SP_ID)
+            j = (j + 1) & mask;
+        slots[j] = *slot;
+    }
+    free(sp->slots);
+    sp->slots = slots;
+    sp->slotsize = newsize;
+    return 1;
+}
+
+int strpool_addn(lp_strpool *sp, const char* str, int len) {
+    unsigned h;
+    int pos;
+    int newcharcount;
+    lp_spslot *slot;
+    assert(sp != NULL);
+    assert(str != NULL);
+
+    h = hash(str, len);
+    slot = search(sp, str, len, h);
+    if (slot->id != NOT_SP_ID) {
+        return slot->id;
+    }
+
+    // keep the table at most half full
+    if ((sp->count + 1) * 2 > sp->slotsize) {
+        if (!grow_slots(sp))
+            return NOT_SP_ID;
+        slot = search(sp, str, len, h);
+    }
+
+    // the string is stored after its length
+    pos = sp->charcount + sizeof(int);
+    newcharcount = pos + len + 1;
+    if (newcharcount >= sp->charsize) {
+        int newsize = newcharcount * 2;
+        char *pool = (char*)realloc(sp->pool, newsize);
+        if (pool == NULL) {
+            fprintf(stderr, "no enough memory");
+            return NOT_SP_ID;
+        }
+        sp->pool = pool;
+        sp->charsize = newsize;
+    }
+
+    if (sp->count == sp->idsize) {
+        int newsize = sp->idsize * 2;
+        int *offsets = (int*)realloc(sp->offsets, newsize*sizeof(int));
+        if (offsets == NULL) {
+            fprintf(stderr, "no enough memory");
+            return NOT_SP_ID;
+        }
+        sp->offsets = offsets;
+        sp->idsize = newsize;
+    }
+
+    memcpy(sp->pool + sp->charcount, &len, sizeof(int));
+    memcpy(sp->pool + pos, str, len);
+    sp->pool[pos + len] = 0;
+    sp->charcount = newcharcount;
+    sp->offsets[sp->count] = pos;
+
+    slot->hash = h;
+    slot->id = sp->count++;
+
+    free(sp->sorted);
+    sp->sorted = NULL;
+
+    return sp->count - 1;
+}
+
+int strpool_add(lp_strpool *sp, const char* str) {
+    assert(str != NULL);
+    return strpool_addn(sp, str, strlen(str));
+}
+
+static lp_strpool *sorting_pool;
+static int compare_id(const void *a, const void *b) {
+    return strcmp(strpool_get(sorting_pool, *(const int*)a),
+                  strpool_get(sorting_pool, *(const int*)b));
+}
+
+const int *strpool_sorted(lp_strpool *sp) {
+    int i;
+    if (sp->sorted != NULL)
+        return sp->sorted;
+
+    sp->sorted = (int*)malloc((sp->count + 1) * sizeof(int));
+    if (sp->sorted == NULL) {
+        fprintf(stderr, "no enough memory");
+        return NULL;
+    }
+    for (i = 0; i < sp->count; i++) {
+        sp->sorted[i] = i;
+    }
+    sorting_pool = sp;
+    qsort(sp->sorted, sp->count, sizeof(int), compare_id);
+    sorting_pool = NULL;
+    return sp->sorted;
+}
+
+void strpool_print(lp_strpool *sp) {
+    const int *sorted = strpool_sorted(sp);
+    int i;
+    if (sorted == NULL)
+        return;
+    for (i=0; i<sp->count; i++) {
+        printf("%d: %s\n", sorted[i], strpool_get(sp, sorted[i]));
+    }
+}
+
+//1 ---------------------- shared string pool ---------------------------
+// the global id of a string is its id in the shard and the shard index,
+// plus 1: id 0 is the empty string, which is not stored in the shards
+#define shard_of(id) (((id) - 1) & (SP_SHARDS - 1))
+#define local_of(id) (((id) - 1) >> SP_SHARD_BITS)
+#define global_id(shard, local) ((((local) << SP_SHARD_BITS) | (shard)) + 1)
+
+lp_sharedpool *sharedpool_init() {
+    lp_sharedpool *sp = (lp_sharedpool*)calloc(1, sizeof(lp_sharedpool));
+    int i, j;
+    if (sp == NULL) {
+        fprintf(stderr, "no enough memory");
+        return NULL;
+    }
+
+    for (i = 0; i < SP_SHARDS; i++) {
+        lp_spshard *shard = &sp->shards[i];
+        shard->slotsize = INIT_SLOT_SIZE / SP_SHARDS;
+        shard->slots = (lp_spslot*)malloc(shard->slotsize * sizeof(lp_spslot));
+        if (shard->slots == NULL) {
+            fprintf(stderr, "no enough memory");
+            sharedpool_destroy(sp);
+            return NULL;
+        }
+        for (j = 0; j < shard->slotsize; j++) {
+            shard->slots[j].id = NOT_SP_ID;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return sp;
+}
+
+void sharedpool_destroy(lp_sharedpool *sp) {
+    int i, j;
+    if (sp == NULL)
+        return;
+    for (i = 0; i < SP_SHARDS; i++) {
+        lp_spshard *shard = &sp->shards[i];
+        lp_spchunk *chunk = shard->chunks;
+        if (shard->slots == NULL)
+            continue;
+        while (chunk != NULL) {
+            lp_spchunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        for (j = 0; j < SP_DIR_SIZE && shard->dir[j] != NULL; j++) {
+            free(shard->dir[j]);
+        }
+        free(shard->slots);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(sp);
+}
+
+static const char *shard_get(lp_spshard *shard, int local) {
+    const char **block;
+    if (local < 0 || (local >> SP_BLOCK_BITS) >= SP_DIR_SIZE)
+        return NULL;
+    // pairs with the release stores in shard_add
+    block = __atomic_load_n(&shard->dir[local >> SP_BLOCK_BITS], __ATOMIC_ACQUIRE);
+    if (block == NULL)
+        return NULL;
+    return __atomic_load_n(&block[local & (SP_BLOCK_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+const char *sharedpool_get(lp_sharedpool *sp, int id) {
+    assert(sp != NULL);
+    if (id < 0)
+        return NULL;
+    if (id == 0)
+        return "";
+    return shard_get(&sp->shards[shard_of(id)], local_of(id));
+}
+
+int sharedpool_len(lp_sharedpool *sp, int id) {
+    const char *str = sharedpool_get(sp, id);
+    int len;
+    if (str == NULL || id == 0)
+        return 0;
+    memcpy(&len, str - sizeof(int), sizeof(int));
+    return len;
+}
+
+int sharedpool_count(lp_sharedpool *sp) {
+    int count = 0;
+    int i;
+    for (i = 0; i < SP_SHARDS; i++) {
+        pthread_mutex_lock(&sp->shards[i].lock);
+        count += sp->shards[i].count;
+        pthread_mutex_unlock(&sp->shards[i].lock);
+    }
+    return count;
+}
+
+// the following functions are called with the shard locked
+
+// return the slot holding 'str', or the empty slot where it should be
+static lp_spslot *shard_search(lp_spshard *shard, const char *str, int len, unsigned h) {
+    unsigned mask = shard->slotsize - 1;
+    unsigned i = h & mask;
+    while (1) {
+        lp_spslot *slot = &shard->slots[i];
+        const char *s;
+        int l;
+        if (slot->id == NOT_SP_ID)
+            return slot;
+        if (slot->hash == h) {
+            s = shard_get(shard, slot->id);
+            memcpy(&l, s - sizeof(int), sizeof(int));
+            if (l == len && memcmp(s, str, len) == 0)
+                return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int shard_grow_slots(lp_spshard *shard) {
+    int newsize = shard->slotsize * 2;
+    unsigned mask = newsize - 1;
+    lp_spslot *slots = (lp_spslot*)malloc(newsize * sizeof(lp_spslot));
+    int i;
+    if (slots == NULL) {
+        fprintf(stderr, "no enough memory");
+        return 0;
+    }
+    for (i = 0; i < newsize; i++) {
+        slots[i].id = NOT_SP_ID;
+    }
+    for (i = 0; i < shard->slotsize; i++) {
+        unsigned j;
+        if (shard->slots[i].id == NOT_SP_ID)
+            continue;
+        j = shard->slots[i].hash & mask;
+        while (slots[j].id != NOT_SP_ID)
+            j = (j + 1) & mask;
+        slots[j] = shard->slots[i];
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->slotsize = newsize;
+    return 1;
+}
+
+// copy the string into the chunks, it's never moved after that
+static char *shard_store(lp_spshard *shard, const char *str, int len) {
+    lp_spchunk *chunk = shard->chunks;
+    int need = sizeof(int) + len + 1;
+    char *entry;
+
+    // keep the entries aligned for the length prefix
+    need = (need + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+    if (chunk == NULL || chunk->used + need > chunk->size) {
+        int size = need > SP_CHUNK_SIZE ? need : SP_CHUNK_SIZE;
+        chunk = (lp_spchunk*)malloc(sizeof(lp_spchunk) + size);
+        if (chunk == NULL) {
+            fprintf(stderr, "no enough memory");
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->size = size;
+        if (shard->chunks != NULL && size == need) {
+            // a big string gets its own chunk, keep filling the current one
+            chunk->next = shard->chunks->next;
+            shard->chunks->next = chunk;
+        } else {
+            chunk->next = shard->chunks;
+            shard->chunks = chunk;
+        }
+    }
+
+    entry = chunk->data + chunk->used;
+    chunk->used += need;
+    memcpy(entry, &len, sizeof(int));
+    memcpy(entry + sizeof(int), str, len);
+    entry[sizeof(int) + len] = 0;
+    return entry + sizeof(int);
+}
+
+static int shard_add(lp_spshard *shard, const char *str, int len, unsigned h) {
+    lp_spslot *slot = shard_search(shard, str, len, h);
+    int local = shard->count;
+    const char **block;
+    char *entry;
+
+    if (slot->id != NOT_SP_ID)
+        return slot->id;
+
+    if ((local >> SP_BLOCK_BITS) >= SP_DIR_SIZE) {
+        fprintf(stderr, "too many strings");
+        return NOT_SP_ID;
+    }
+
+    // keep the table at most half full
+    if ((shard->count + 1) * 2 > shard->slotsize) {
+        if (!shard_grow_slots(shard))
+            return NOT_SP_ID;
+        slot = shard_search(shard, str, len, h);
+    }
+
+    block = shard->dir[local >> SP_BLOCK_BITS];
+    if (block == NULL) {
+        block = (const char**)calloc(SP_BLOCK_SIZE, sizeof(const char*));
+        if (block == NULL) {
+            fprintf(stderr, "no enough memory");
+            return NOT_SP_ID;
+        }
+        __atomic_store_n(&shard->dir[local >> SP_BLOCK_BITS], block, __ATOMIC_RELEASE);
+    }
+
+    entry = shard_store(shard, str, len);
+    if (entry == NULL)
+        return NOT_SP_ID;
+    // the string is complete before its address can be seen by shard_get
+    __atomic_store_n(&block[local & (SP_BLOCK_SIZE - 1)], entry, __ATOMIC_RELEASE);
+
+    slot->hash = h;
+    slot->id = local;
+    shard->count++;
+    return local;
+}
+
+int sharedpool_addn(lp_sharedpool *sp, const char *str, int len) {
+    unsigned h;
+    int s;
+    int local;
+    assert(sp != NULL);
+    assert(str != NULL);
+
+    if (len == 0)
+        return 0;
+    h = hash(str, len);
+    // the table index takes the low bits of the hash, the shard the high
+    s = h >> (32 - SP_SHARD_BITS);
+    pthread_mutex_lock(&sp->shards[s].lock);
+    local = shard_add(&sp->shards[s], str, len, h);
+    pthread_mutex_unlock(&sp->shards[s].lock);
+
+    if (local == NOT_SP_ID)
+        return NOT_SP_ID;
+    return global_id(s, local);
+}
+
+int sharedpool_add(lp_sharedpool *sp, const char *str) {
+    assert(str != NULL);
+    return sharedpool_addn(sp, str, strlen(str));
+}
+
+#ifdef STRPOOL_TEST
+#define TEST_THREADS 4
+#define TEST_STRINGS 50000
+
+static lp_sharedpool *test_pool;
+static int test_ids[TEST_THREADS][TEST_STRINGS];
+static int test_steps[TEST_THREADS] = {7919, 7927, 7933, 7937};
+
+// every thread adds the same strings in a different order
+static void *test_adder(void *arg) {
+    int t = (int)(long)arg;
+    char buf[32];
+    int i;
+    for (i = 0; i < TEST_STRINGS; i++) {
+        int n = (i * test_steps[t]) % TEST_STRINGS;
+        sprintf(buf, "s%d", n);
+        test_ids[t][n] = sharedpool_add(test_pool, buf);
+        assert(test_ids[t][n] > 0);
+        assert(strcmp(sharedpool_get(test_pool, test_ids[t][n]), buf) == 0);
+    }
+    return NULL;
+}
+
+static void test_sharedpool() {
+    pthread_t threads[TEST_THREADS];
+    char big[SP_CHUNK_SIZE * 2];
+    int i, t;
+
+    test_pool = sharedpool_init();
+    for (t = 0; t < TEST_THREADS; t++) {
+        pthread_create(&threads[t], NULL, test_adder, (void*)(long)t);
+    }
+    for (t = 0; t < TEST_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (i = 0; i < TEST_STRINGS; i++) {
+        for (t = 1; t < TEST_THREADS; t++) {
+            assert(test_ids[t][i] == test_ids[0][i]);
+        }
+    }
+
+    assert(sharedpool_count(test_pool) == TEST_STRINGS);
+
+    memset(big, 'b', sizeof(big) - 1);
+    big[sizeof(big) - 1] = 0;
+    i = sharedpool_add(test_pool, big);
+    assert(sharedpool_len(test_pool, i) == (int)sizeof(big) - 1);
+    i = sharedpool_add(test_pool, "s1");
+    assert(i == test_ids[0][1]);
+
+    // the empty string is 0, as in the pool of an ast
+    i = sharedpool_add(test_pool, "");
+    assert(i == 0 && sharedpool_len(test_pool, 0) == 0);
+    assert(strcmp(sharedpool_get(test_pool, 0), "") == 0);
+    assert(sharedpool_count(test_pool) == TEST_STRINGS + 1);
+    printf("shared pool ok\n");
+    sharedpool_destroy(test_pool);
+}
+
+int main(int argc, char*argv[]) {
+    lp_strpool *sp = strpool_init();
+    char buf[32];
+    int i, id;
+
+    strpool_add(sp, "cadsfeasfd");
+    strpool_add(sp, "afsadf");
+    strpool_add(sp, "f1111");
+    strpool_add(sp, "dr222");
+    strpool_add(sp, "iddd");
+    strpool_add(sp, "eaa");
+    id = strpool_add(sp, "f1111");
+    assert(id == 2);
+    id = strpool_addn(sp, "eaaxx", 3);
+    assert(id == 5);
+
+    // enough strings to grow the pool and the table several times
+    for (i = 0; i < 100000; i++) {
+        sprintf(buf, "s%d", i);
+        id = strpool_add(sp, buf);
+        assert(id == i + 6);
+    }
+    for (i = 0; i < 100000; i++) {
+        sprintf(buf, "s%d", i);
+        id = strpool_add(sp, buf);
+        assert(id == i + 6);
+        assert(strcmp(strpool_get(sp, i + 6), buf) == 0);
+        assert(strpool_len(sp, i + 6) == (int)strlen(buf));
+    }
+
+    if (argc > 1)
+        printf("%d\n", strpool_add(sp, argv[1]));
+    for (i = 0; i < 7 && i < sp->count; i++) {
+        printf("%d: %s\n", strpool_sorted(sp)[i], strpool_get(sp, strpool_sorted(sp)[i]));
+    }
+    strpool_destroy(sp);
+
+    test_sharedpool();
+    return 0;
+}
+#endif
@@ -1,44 +1,127 @@
-#ifndef STRPOOL_H
-#define STRPOOL_H
-
-/*
- * simple string pool.
- * 1. can add string, query string by id
- * 2. cannot remove string, so no need to manage the storage
- *
- */
-#define NOT_SP_ID -1
-
-typedef struct {
-    int charcount; // current used count in the pool
-    int charsize;  // size of the pool
-    char *pool;    // the pool to store the strings
-    int idxcount;  // string count
-    int idxsize;   // index size
-    int *indexes;  // string position list in the pool, in order
-} lp_strpool;
-
-// create a string pool
-lp_strpool *strpool_init();
-
-// destroy a string pool
-void strpool_destroy(lp_strpool* sp);
-
-// add a string into the string pool, return the id of the string
-// if the string is already in the pool, just return the id of it
-int strpool_add(lp_strpool* sp, const char* str);
-#define strpool_getid(sp, str) strpool_add((sp), (str))
-
-// do not implement remove-string in this simple version
-// remove a string from the pool, if it exists in the pool
-//void strpool_remove(lp_strpool* sp, const char* str);
-// remove a string by its id, if it exists in the pool
-//void strpool_removeid(lp_strpool* sp, int id);
-
-// get a string from the pool, according to its id
-const char* strpool_get(lp_strpool* sp, int id);
-
-// for test
-void strpool_print(lp_strpool *sp);
-
-#endif //STRPOOL_H
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+/*
+ * simple string pool.
+ * 1. can add string, query string by id
+ * 2. cannot remove string, so no need to manage the storage
+ * 3. ids are given in order of adding: 0, 1, 2...
+ * 4. strings are found by an open addressing hash table, adding and
+ *    querying are O(1) in average.
+ *
+ */
+#define NOT_SP_ID -1
+
+typedef struct {
+    unsigned hash; // cached hash of the string
+    int id;        // NOT_SP_ID if the slot is empty
+} lp_spslot;
+
+typedef struct {
+    int charcount;    // current used count in the pool
+    int charsize;     // size of the pool
+    char *pool;       // the pool to store the strings, each one is
+                      // prefixed by its length and ended by NUL
+    int count;        // string count
+    int idsize;       // size of offsets
+    int *offsets;     // position of each string in the pool, by id
+    int slotsize;     // size of the hash table, power of 2
+    lp_spslot *slots; // the hash table
+    int *sorted;      // ids in order of the strings, NULL if not built
+} lp_strpool;
+
+// create a string pool
+lp_strpool *strpool_init();
+
+// destroy a string pool
+void strpool_destroy(lp_strpool* sp);
+
+// add a string into the string pool, return the id of the string
+// if the string is already in the pool, just return the id of it
+int strpool_add(lp_strpool* sp, const char* str);
+#define strpool_getid(sp, str) strpool_add((sp), (str))
+
+// the same as strpool_add, but the string is given by its length,
+// it needs not be ended by NUL
+int strpool_addn(lp_strpool* sp, const char* str, int len);
+
+// do not implement remove-string in this simple version
+// remove a string from the pool, if it exists in the pool
+//void strpool_remove(lp_strpool* sp, const char* str);
+// remove a string by its id, if it exists in the pool
+//void strpool_removeid(lp_strpool* sp, int id);
+
+// get a string from the pool, according to its id
+const char* strpool_get(lp_strpool* sp, int id);
+
+// get the length of a string in the pool, according to its id
+int strpool_len(lp_strpool* sp, int id);
+
+// get the ids of all strings in order of the strings. the result is
+// kept by the pool until a new string is added, don't free it.
+const int *strpool_sorted(lp_strpool* sp);
+
+// for test
+void strpool_print(lp_strpool *sp);
+
+/*
+ * shared string pool, for several lexer/parser threads sharing one
+ * symbol table.
+ * 1. strings are spread over shards by hash, each shard has its own lock,
+ *    so threads adding different strings seldom wait for each other.
+ * 2. strings are stored in chunks which are never moved, so a string
+ *    got by id stays valid until the pool is destroyed.
+ * 3. getting a string by id takes no lock, the id can be passed to and
+ *    used by any thread.
+ * 4. id 0 is the empty string, the same as in the pool of an ast, so the
+ *    asts parsed by several threads can share the pool, see ast_new_shared.
+ *
+ */
+#include <pthread.h>
+
+#define SP_SHARD_BITS 4
+#define SP_SHARDS     (1 << SP_SHARD_BITS)
+#define SP_BLOCK_BITS 10
+#define SP_BLOCK_SIZE (1 << SP_BLOCK_BITS) // string addresses in a block
+#define SP_DIR_SIZE   4096                 // blocks of a shard
+#define SP_CHUNK_SIZE 65536
+
+typedef struct lp_spchunk_ {
+    struct lp_spchunk_ *next;
+    int used;
+    int size;
+    char data[];
+} lp_spchunk;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int count;                     // string count of the shard
+    int slotsize;                  // size of the hash table, power of 2
+    lp_spslot *slots;              // the hash table, holding the local ids
+    lp_spchunk *chunks;            // storage of the strings, current one first
+    const char **dir[SP_DIR_SIZE]; // address of each string, by local id
+} lp_spshard;
+
+typedef struct {
+    lp_spshard shards[SP_SHARDS];
+} lp_sharedpool;
+
+// create a shared string pool
+lp_sharedpool *sharedpool_init();
+
+// destroy a shared string pool, no thread may use it any more
+void sharedpool_destroy(lp_sharedpool *sp);
+
+// add a string into the pool, return its id. if the string is already
+// in the pool(added by any thread), just return the id of it
+int sharedpool_add(lp_sharedpool *sp, const char *str);
+int sharedpool_addn(lp_sharedpool *sp, const char *str, int len);
+
+// get a string from the pool, according to its id
+const char *sharedpool_get(lp_sharedpool *sp, int id);
+int sharedpool_len(lp_sharedpool *sp, int id);
+
+// count of the strings in the pool, the empty string not counted
+int sharedpool_count(lp_sharedpool *sp);
+
+#endif //STRPOOL_H